@@ -1,103 +1,145 @@
 #include "agent.h"
 
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <inttypes.h>
-#include <ifaddrs.h>
-#include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include "aggregate.h"
+#include "cgroup.h"
 #include "event.h"
 #include "error_handling.h"
+#include "fanout.h"
+#include "heap.h"
 #include "influxdb.h"
+#include "irq.h"
+#include "netlink.h"
+#include "options.h"
+#include "process.h"
+#include "series.h"
+#include "sink.h"
+#include "source.h"
+#include "state.h"
+#include "telemetry.h"
+#include "uring.h"
+#include "worker.h"
 
-#define MAX_MESSAGE_SIZE 65535
+#define TICK_BUFFER_SIZE 65536
+#define TICK_BUFFER_LIMIT (16 * 1024 * 1024)
 
-int create_sink(const char *remote, const char *service) {
-    assert(remote != NULL);
-    assert(service != NULL);
-
-    int s = -1;
-    struct addrinfo hint;
-    struct addrinfo *result = NULL;
-
-    memset(&hint, 0, sizeof(hint));
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_socktype = SOCK_DGRAM;
-    hint.ai_flags = AI_NUMERICSERV;
-
-    int ec = getaddrinfo(remote, service, &hint, &result);
-    HANDLE_RESULT(ec != 0, return -1, "getaddrinfo: %s", gai_strerror(ec));
-
-    for(struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
-        HANDLE_POSIX_RESULT(s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol),
-                            goto NEXT_ADDRESS, "socket");
-        HANDLE_POSIX_RESULT(connect(s, ai->ai_addr, ai->ai_addrlen),
-                            goto NEXT_ADDRESS, "fd=%d: connect", s);
-        syslog(LOG_DEBUG, "fd=%d: sink created", s);
-        break;
-NEXT_ADDRESS:
-        HANDLE_POSIX_RESULT(close(s), (void)s, "fd=%d: close", s);
-    }
-    freeaddrinfo(result);
-    return s;
-}
-
-int read_file(const char *filename,
-              char *content,
-              size_t *contentlen) {
-    assert(filename != NULL);
-    assert(content != NULL);
-    assert(contentlen != NULL);
-
-    int fd = -1;
-    HANDLE_POSIX_RESULT(fd = open(filename, O_CLOEXEC | O_NONBLOCK, O_RDONLY),
-                        return -1, "read_file(%s): open", filename);
-
-    int r = read(fd, content, *contentlen);
-    HANDLE_POSIX_RESULT(r, goto CLEANUP, "read_file(%s): read", filename);
-    HANDLE_RESULT((size_t) r >= *contentlen,
-                  goto CLEANUP, "read_file(%s): buffer too small", filename);
-    content[*contentlen - 1] = 0;
-    *contentlen = r;
+#define MAX_COLLECTOR_SOURCES 2
+/* completions carry the collector with the index of the source in its low bits */
+#define SOURCE_INDEX_MASK 7
 
-CLEANUP:
-    HANDLE_POSIX_RESULT(close(fd), (void)fd, "read_file(%s): close", filename);
-    return *contentlen;
+struct collector;
+
+typedef int(*serializer)(struct collector *collector,
+                         const char *hostname,
+                         const struct timespec *ts,
+                         struct lp_writer *w);
+typedef int(*opener)(struct collector *collector, const struct agent_config *config);
+typedef void(*closer)(struct collector *collector);
+
+struct collector {
+    const char *name;
+    serializer serializer;
+    const char *paths[MAX_COLLECTOR_SOURCES + 1];
+    struct source sources[MAX_COLLECTOR_SOURCES];
+    opener open;        /* optional, for state other than sources */
+    closer close;
+    opener reconfigure; /* optional, takes a reloaded configuration in place; 1 to be opened again */
+    int opened;
+    int closed;         /* turned off, or could not be opened again on a reload */
+    void *data;
+    int live;           /* needs the live /proc or measures the agent itself, not replayed */
+    struct event_handler watch;     /* optional, set up by open() and polled with the timers */
+
+    unsigned interval;  /* milliseconds */
+    int offset;         /* milliseconds into the interval, -1 to stagger */
+    struct event_handler timer;
+    struct agent_context *context;
+    uint64_t ticks;
+    struct telemetry telemetry;
+    struct aggregate aggregate;     /* capacity 0 when the collector is not aggregated */
+    unsigned pending;           /* batched reads not completed yet */
+    struct timespec sampled;    /* time of the tick they were submitted for */
+    int64_t woken;              /* monotonic ns the timer of the tick fired */
+    uint64_t settled;           /* first tick expected not to allocate, see heap.h */
+};
+
+struct agent_context {
+    const struct agent_config *config;  /* in effect, replaced on a reload */
+    struct agent_options *loaded;       /* options of the last reload, NULL before the first one */
+    struct fanout fanout;
+    struct sink *retired;   /* removed on a reload, closed once they delivered their queue */
+    size_t retirements;
+    char *buf;      /* output of a collection, grows to the largest one seen */
+    size_t bufsize;
+    const char *hostname;
+    struct collector *collectors;
+    struct state_table *state;  /* rate mode or suppression, NULL otherwise */
+    struct state_table states;  /* storage of state */
+    struct series_registry series;  /* series keys, with the global tags */
+    int rate;
+    unsigned keyframe;
+    struct uring uring;
+    struct uring *ring;     /* &uring when reads are batched, NULL to read synchronously */
+    struct worker_queue *queue;     /* ticks to the sending thread in worker mode, NULL otherwise */
+    const struct worker_sched *sched;
+    int ev_loop;            /* event loop of the sinks */
+    int collect_loop;       /* event loop of the collectors, the only one without a worker */
+    pthread_t thread;       /* collecting thread in worker mode */
+    int worker;             /* it runs */
+    struct event_handler stop;  /* of the collecting thread */
+};
+
+/* NULL terminated lists of strings, NULL is the same as an empty one */
+int same_strings(const char **a, const char **b) {
+    for(; a != NULL && *a != NULL; ++a, ++b) {
+        if(b == NULL || *b == NULL || strcmp(*a, *b) != 0) return 0;
+    }
+    return b == NULL || *b == NULL;
 }
 
-int serialize_softnet_stat(const char *hostname,
+int serialize_softnet_stat(struct collector *collector,
+                           const char *hostname,
                            const struct timespec *ts,
-                           char *message, size_t *messagelen) {
+                           struct lp_writer *w) {
+    assert(collector != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(message != NULL);
-    assert(messagelen != NULL);
-
-    char stat[65535];
-    size_t statlen = sizeof(stat);
-    HANDLE_RESULT(read_file("/proc/net/softnet_stat", stat, &statlen) < 0,
-                  return -1, "serialize_softnet_stat: read_file");
-    stat[statlen] = 0;
-    HANDLE_RESULT(influxdb_serialize_softnet_stat(stat, hostname, ts, message, messagelen) < 0,
+    assert(w != NULL);
+
+    struct source *stat = &collector->sources[0];
+    HANDLE_RESULT(source_read(stat) == -1,
+                  return -1, "serialize_softnet_stat: source_read");
+    HANDLE_RESULT(influxdb_serialize_softnet_stat(stat->buf, stat->len, hostname, ts, w) < 0,
                   return -1, "serialize_softnet_stat: influxdb_serialize_softnet_stat");
     return 0;
 }
 
-int serialize_net_stat(const char *hostname,
+int serialize_net_stat(struct collector *collector,
+                       const char *hostname,
                        const struct timespec *ts,
-                       char *message, size_t *messagelen) {
+                       struct lp_writer *w) {
+    assert(collector != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(message != NULL);
-    assert(messagelen != NULL);
+    assert(w != NULL);
 
     static const char *tags[] = {
         "Ip", "Icmp", "IcmpMsg", "Tcp", "Udp", /* SNMP tags */
@@ -105,160 +147,1801 @@ int serialize_net_stat(const char *hostname,
         NULL
     };
 
-    char stat[65535];
-    size_t snmplen = sizeof(stat);
-    size_t netstatlen = sizeof(stat);
-
-    HANDLE_RESULT(read_file("/proc/net/snmp", stat, &snmplen) < 0,
-                  return -1, "serialize_net_stat[/proc/net/snmp]: read_file");
-
-    netstatlen -= snmplen;
-    HANDLE_RESULT(read_file("/proc/net/netstat", stat + snmplen, &netstatlen) < 0,
-                  return -1, "serialize_net_stat[/proc/net/netstat]: read_file");
-    stat[snmplen + netstatlen] = 0;
-    HANDLE_RESULT(influxdb_serialize_net_stat(stat, tags, hostname, ts, message, messagelen) < 0,
-                  return -1, "serialize_net_stat: influxdb_serialize_net_stat");
+    for(struct source *stat = collector->sources;
+        stat < collector->sources + MAX_COLLECTOR_SOURCES && stat->path != NULL;
+        ++stat) {
+        HANDLE_RESULT(source_read(stat) == -1,
+                      return -1, "serialize_net_stat[%s]: source_read", stat->path);
+        HANDLE_RESULT(influxdb_serialize_net_stat(stat->buf, stat->len, tags, hostname, ts, w) < 0,
+                      return -1, "serialize_net_stat[%s]: influxdb_serialize_net_stat",
+                      stat->path);
+    }
     return 0;
 }
 
-int serialize_proc_stat(const char *hostname,
+int serialize_proc_stat(struct collector *collector,
+                        const char *hostname,
                         const struct timespec *ts,
-                        char *message, size_t *messagelen) {
+                        struct lp_writer *w) {
+    assert(collector != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(message != NULL);
-    assert(messagelen != NULL);
-
-    char proc[65535];
-    size_t proclen = sizeof(proc);
-    HANDLE_RESULT(read_file("/proc/stat", proc, &proclen) < 0,
-                  return -1, "serialize_proc_stat: read_file");
-    proc[proclen] = 0;
-    HANDLE_RESULT(influxdb_serialize_proc_stat(proc, hostname, ts, message, messagelen) < 0,
+    assert(w != NULL);
+
+    struct source *proc = &collector->sources[0];
+    HANDLE_RESULT(source_read(proc) == -1,
+                  return -1, "serialize_proc_stat: source_read");
+    HANDLE_RESULT(influxdb_serialize_proc_stat(proc->buf, proc->len, hostname, ts, w) < 0,
                   return -1, "serialize_proc_stat: influxdb_serialize_proc_stat");
     return 0;
 }
 
-int serialize_nic_stat(const char *hostname,
+int open_nic_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    if(config->proc_root == NULL) {
+        return netlink_open(collector->data, config->nic_include, config->nic_exclude);
+    }
+    /* links of a snapshot come from its net/dev */
+    HANDLE_RESULT(netlink_init(collector->data, config->nic_include, config->nic_exclude) == -1,
+                  return -1, "open_nic_stat: netlink_init");
+    HANDLE_RESULT(source_open(&collector->sources[0], config->proc_root, "net/dev") == -1,
+                  goto FAIL, "open_nic_stat: source_open");
+    return 0;
+
+FAIL:
+    netlink_close(collector->data);
+    return -1;
+}
+
+void close_nic_stat(struct collector *collector) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+
+    netlink_close(collector->data);
+}
+
+/* links are selected again on the next refresh */
+int reconfigure_nic_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    struct netlink *nl = collector->data;
+    if(!same_strings(nl->include, config->nic_include) ||
+       !same_strings(nl->exclude, config->nic_exclude)) {
+        nl->stale = 1;
+    }
+    nl->include = config->nic_include;
+    nl->exclude = config->nic_exclude;
+    return 0;
+}
+
+int serialize_nic_stat(struct collector *collector,
+                       const char *hostname,
                        const struct timespec *ts,
-                       char *message, size_t *messagelen) {
+                       struct lp_writer *w) {
+    assert(collector != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(message != NULL);
-    assert(messagelen != NULL);
+    assert(w != NULL);
 
-    return influxdb_serialize_nic_stat(hostname, ts, message, messagelen);
+    struct netlink *nl = collector->data;
+    struct source *dev = &collector->sources[0];
+    if(dev->path != NULL) {
+        HANDLE_RESULT(source_read(dev) == -1,
+                      return -1, "serialize_nic_stat: source_read");
+        HANDLE_RESULT(netlink_parse_dev(nl, dev->buf, dev->len) == -1,
+                      return -1, "serialize_nic_stat: netlink_parse_dev");
+    } else {
+        HANDLE_RESULT(netlink_read(nl) == -1,
+                      return -1, "serialize_nic_stat: netlink_read");
+    }
+    HANDLE_RESULT(influxdb_serialize_nic_stat(nl->links, nl->count, hostname, ts, w) < 0,
+                  return -1, "serialize_nic_stat: influxdb_serialize_nic_stat");
+    HANDLE_RESULT(influxdb_serialize_nic_queue_stat(nl->queues, nl->queue_count, hostname, ts, w) < 0,
+                  return -1, "serialize_nic_stat: influxdb_serialize_nic_queue_stat");
+    return 0;
 }
 
-int serialize_memory_stat(const char *hostname,
-                          const struct timespec *ts,
-                          char *message, size_t *messagelen) {
+struct disk_patterns {
+    const char **include;
+    const char **exclude;
+};
+
+/* partitions, loop, RAM, floppy and optical devices */
+static const char *disk_exclude[] = {
+    "loop*", "ram*", "zram*", "fd*", "sr*",
+    "sd*[0-9]", "hd*[0-9]", "vd*[0-9]", "xvd*[0-9]", "nvme*p*", "mmcblk*p*",
+    NULL
+};
+
+int open_disk_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    struct disk_patterns *patterns = collector->data;
+    patterns->include = config->disk_include;
+    patterns->exclude = config->disk_exclude;
+    if(patterns->exclude == NULL || *patterns->exclude == NULL) patterns->exclude = disk_exclude;
+    return 0;
+}
+
+void close_disk_stat(struct collector *collector) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+
+    memset(collector->data, 0, sizeof(struct disk_patterns));
+}
+
+int serialize_disk_stat(struct collector *collector,
+                        const char *hostname,
+                        const struct timespec *ts,
+                        struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(message != NULL);
-    assert(messagelen != NULL);
+    assert(w != NULL);
 
-    return influxdb_serialize_memory_stat(hostname, ts, message, messagelen);
+    const struct disk_patterns *patterns = collector->data;
+    struct source *diskstats = &collector->sources[0];
+    HANDLE_RESULT(source_read(diskstats) == -1,
+                  return -1, "serialize_disk_stat: source_read");
+    HANDLE_RESULT(influxdb_serialize_disk_stat(diskstats->buf, diskstats->len,
+                                               patterns->include, patterns->exclude,
+                                               hostname, ts, w) < 0,
+                  return -1, "serialize_disk_stat: influxdb_serialize_disk_stat");
+    return 0;
 }
 
+int open_process_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
 
-typedef int(*serializer)(const char *hostname,
-                         const struct timespec *ts,
-                         char *message, size_t *messagelen);
-
-static const serializer serializers[] = {
-    &serialize_proc_stat,
-    &serialize_net_stat,
-    &serialize_softnet_stat,
-    &serialize_nic_stat,
-    &serialize_memory_stat,
+    return process_open(collector->data, config->proc_root, PROCESS_CAPACITY,
+                        config->process_top, config->process_cgroup);
+}
+
+void close_process_stat(struct collector *collector) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+
+    process_close(collector->data);
+}
+
+int reconfigure_process_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    const struct process_table *table = collector->data;
+    return table->top_capacity != config->process_top || table->by_cgroup != config->process_cgroup;
+}
+
+int serialize_process_stat(struct collector *collector,
+                           const char *hostname,
+                           const struct timespec *ts,
+                           struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    struct process_table *table = collector->data;
+    HANDLE_RESULT(process_read(table, ts) == -1,
+                  return -1, "serialize_process_stat: process_read");
+    HANDLE_RESULT(influxdb_serialize_process_stat(table, hostname, ts, w) < 0,
+                  return -1, "serialize_process_stat: influxdb_serialize_process_stat");
+    return 0;
+}
+
+int watch_cgroups(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    HANDLE_RESULT(cgroup_update(data) == -1, return -1, "watch_cgroups: cgroup_update");
+    return 0;
+}
+
+int open_cgroup_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    struct cgroup_tree *tree = collector->data;
+    HANDLE_RESULT(cgroup_open(tree, config->cgroup_depth,
+                              config->cgroup_include, config->cgroup_exclude) == -1,
+                  return -1, "open_cgroup_stat: cgroup_open");
+    collector->watch.fd = tree->inotify;
+    collector->watch.handler = &watch_cgroups;
+    collector->watch.data = tree;
+    return 0;
+}
+
+void close_cgroup_stat(struct collector *collector) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+
+    cgroup_close(collector->data);
+    collector->watch.fd = -1;
+}
+
+/* groups are selected as they are found, other patterns need a new scan */
+int reconfigure_cgroup_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    struct cgroup_tree *tree = collector->data;
+    if(tree->depth != config->cgroup_depth ||
+       !same_strings(tree->include, config->cgroup_include) ||
+       !same_strings(tree->exclude, config->cgroup_exclude)) {
+        return 1;
+    }
+    tree->include = config->cgroup_include;
+    tree->exclude = config->cgroup_exclude;
+    return 0;
+}
+
+int serialize_cgroup_stat(struct collector *collector,
+                          const char *hostname,
+                          const struct timespec *ts,
+                          struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    struct cgroup_tree *tree = collector->data;
+    for(struct cgroup *cgroup = tree->cgroups; cgroup < tree->cgroups + tree->count; ++cgroup) {
+        if(!cgroup->selected) continue;
+        cgroup_read(tree, cgroup, collector->ticks);
+        HANDLE_RESULT(influxdb_serialize_cgroup_stat(tree, cgroup, hostname, ts, w) < 0,
+                      return -1, "serialize_cgroup_stat: influxdb_serialize_cgroup_stat(%s)",
+                      cgroup->path);
+    }
+    return 0;
+}
+
+/* paging, swapping, reclaim and compaction; 200+ counters otherwise */
+static const char *vmstat_include[] = {
+    "pgpgin", "pgpgout", "pswpin", "pswpout", "pgfault", "pgmajfault",
+    "pgscan_kswapd", "pgscan_direct", "pgsteal_kswapd", "pgsteal_direct", "allocstall_*",
+    "workingset_refault_*", "compact_stall", "compact_fail", "compact_success",
+    "thp_fault_alloc", "thp_fault_fallback", "oom_kill",
     NULL
 };
 
+int open_memory_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
 
-struct agent_context {
-    int sink;
-    const char *hostname;
+    struct influxdb_field_map *map = collector->data;
+    map->include = config->memory_include;
+    map->count = 0;
+    return 0;
+}
+
+int open_vmstat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    struct influxdb_field_map *map = collector->data;
+    map->include = config->vmstat_include;
+    if(map->include == NULL || *map->include == NULL) map->include = vmstat_include;
+    map->count = 0;
+    return 0;
+}
+
+/* fields are looked up again when the patterns changed */
+int reconfigure_field_map(struct influxdb_field_map *map, const char **include) {
+    if(!same_strings(map->include, include)) map->count = 0;
+    map->include = include;
+    return 0;
+}
+
+int reconfigure_memory_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    return reconfigure_field_map(collector->data, config->memory_include);
+}
+
+int reconfigure_vmstat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    const char **include = config->vmstat_include;
+    if(include == NULL || *include == NULL) include = vmstat_include;
+    return reconfigure_field_map(collector->data, include);
+}
+
+void close_field_map(struct collector *collector) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+
+    struct influxdb_field_map *map = collector->data;
+    map->include = NULL;
+    map->count = 0;
+}
+
+int serialize_memory_stat(struct collector *collector,
+                          const char *hostname,
+                          const struct timespec *ts,
+                          struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    struct source *meminfo = &collector->sources[0];
+    HANDLE_RESULT(source_read(meminfo) == -1,
+                  return -1, "serialize_memory_stat: source_read");
+    HANDLE_RESULT(influxdb_serialize_memory_stat(collector->data, meminfo->buf, meminfo->len,
+                                                 hostname, ts, w) < 0,
+                  return -1, "serialize_memory_stat: influxdb_serialize_memory_stat");
+    return 0;
+}
+
+int serialize_vmstat(struct collector *collector,
+                     const char *hostname,
+                     const struct timespec *ts,
+                     struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    struct source *vmstat = &collector->sources[0];
+    HANDLE_RESULT(source_read(vmstat) == -1,
+                  return -1, "serialize_vmstat: source_read");
+    HANDLE_RESULT(influxdb_serialize_vmstat(collector->data, vmstat->buf, vmstat->len,
+                                            hostname, ts, w) < 0,
+                  return -1, "serialize_vmstat: influxdb_serialize_vmstat");
+    return 0;
+}
+
+int open_irq_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    struct irq_matrix *matrix = collector->data;
+    matrix->cells = config->irq_cells;
+    return 0;
+}
+
+void close_irq_stat(struct collector *collector) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+
+    irq_close(collector->data);
+}
+
+int reconfigure_irq_stat(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(config != NULL);
+
+    const struct irq_matrix *matrix = collector->data;
+    return matrix->cells != config->irq_cells;
+}
+
+/* the label of a row of /proc/interrupts is an irq, of /proc/softirqs a softirq */
+int serialize_irq_stat(struct collector *collector,
+                       const char *hostname,
+                       const struct timespec *ts,
+                       struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(collector->data != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    struct irq_matrix *matrix = collector->data;
+    struct source *source = &collector->sources[0];
+    const char *tag = strcmp(collector->name, "softirqs") == 0 ? "softirq" : "irq";
+    HANDLE_RESULT(source_read(source) == -1,
+                  return -1, "serialize_irq_stat[%s]: source_read", collector->name);
+    HANDLE_RESULT(irq_read(matrix, source->buf, source->len, ts) == -1,
+                  return -1, "serialize_irq_stat[%s]: irq_read", collector->name);
+    HANDLE_RESULT(influxdb_serialize_irq_matrix(matrix, collector->name, tag, hostname, ts, w) < 0,
+                  return -1, "serialize_irq_stat[%s]: influxdb_serialize_irq_matrix", collector->name);
+    return 0;
+}
+
+int serialize_agent_stat(struct collector *collector,
+                         const char *hostname,
+                         const struct timespec *ts,
+                         struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(collector->context != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    for(struct collector *c = collector->context->collectors; c->serializer != NULL; ++c) {
+        HANDLE_RESULT(influxdb_serialize_collector_stat(c->name, &c->telemetry, hostname, ts, w) < 0,
+                      return -1, "serialize_agent_stat: influxdb_serialize_collector_stat(%s)",
+                      c->name);
+        c->telemetry.latency_max = 0;
+        __atomic_store_n(&c->telemetry.send_delay_max, 0, __ATOMIC_RELAXED);
+    }
+    struct source *statm = &collector->sources[0];
+    HANDLE_RESULT(source_read(statm) == -1,
+                  return -1, "serialize_agent_stat: source_read");
+    struct fanout *fanout = &collector->context->fanout;
+    /* the sinks belong to the sending thread, only their published counters are read */
+    HANDLE_RESULT(influxdb_serialize_agent_stat(statm->buf, statm->len, fanout->sinks, fanout->stats, fanout->count,
+                                                hostname, ts, w) < 0,
+                  return -1, "serialize_agent_stat: influxdb_serialize_agent_stat");
+    return 0;
+}
+
+
+static struct netlink nic_links;
+static struct process_table process_table;
+static struct disk_patterns disk_patterns;
+static struct cgroup_tree cgroup_tree;
+static struct influxdb_field_map meminfo_fields;
+static struct influxdb_field_map vmstat_fields;
+static struct irq_matrix interrupts;
+static struct irq_matrix softirqs;
+
+static struct collector collectors[] = {
+    {
+        .name = "stat",
+        .serializer = &serialize_proc_stat,
+        .paths = { "stat", NULL }
+    },
+    {
+        .name = "snmp",
+        .serializer = &serialize_net_stat,
+        .paths = { "net/snmp", NULL }
+    },
+    {
+        .name = "netstat",
+        .serializer = &serialize_net_stat,
+        .paths = { "net/netstat", NULL }
+    },
+    {
+        .name = "softnet",
+        .serializer = &serialize_softnet_stat,
+        .paths = { "net/softnet_stat", NULL }
+    },
+    {
+        .name = "interrupts",
+        .serializer = &serialize_irq_stat,
+        .paths = { "interrupts", NULL },
+        .open = &open_irq_stat,
+        .close = &close_irq_stat,
+        .reconfigure = &reconfigure_irq_stat,
+        .data = &interrupts
+    },
+    {
+        .name = "softirqs",
+        .serializer = &serialize_irq_stat,
+        .paths = { "softirqs", NULL },
+        .open = &open_irq_stat,
+        .close = &close_irq_stat,
+        .reconfigure = &reconfigure_irq_stat,
+        .data = &softirqs
+    },
+    {
+        .name = "nic",
+        .serializer = &serialize_nic_stat,
+        .paths = { NULL },
+        .open = &open_nic_stat,
+        .close = &close_nic_stat,
+        .reconfigure = &reconfigure_nic_stat,
+        .data = &nic_links
+    },
+    {
+        .name = "memory",
+        .serializer = &serialize_memory_stat,
+        .paths = { "meminfo", NULL },
+        .open = &open_memory_stat,
+        .close = &close_field_map,
+        .reconfigure = &reconfigure_memory_stat,
+        .data = &meminfo_fields
+    },
+    {
+        .name = "vmstat",
+        .serializer = &serialize_vmstat,
+        .paths = { "vmstat", NULL },
+        .open = &open_vmstat,
+        .close = &close_field_map,
+        .reconfigure = &reconfigure_vmstat,
+        .data = &vmstat_fields
+    },
+    {
+        .name = "diskstats",
+        .serializer = &serialize_disk_stat,
+        .paths = { "diskstats", NULL },
+        .open = &open_disk_stat,
+        .close = &close_disk_stat,
+        .reconfigure = &open_disk_stat,
+        .data = &disk_patterns
+    },
+    {
+        /* per-process directories are not part of snapshots */
+        .name = "process",
+        .serializer = &serialize_process_stat,
+        .paths = { NULL },
+        .open = &open_process_stat,
+        .close = &close_process_stat,
+        .reconfigure = &reconfigure_process_stat,
+        .data = &process_table,
+        .live = 1
+    },
+    {
+        /* cgroups are not part of snapshots */
+        .name = "cgroup",
+        .serializer = &serialize_cgroup_stat,
+        .paths = { NULL },
+        .open = &open_cgroup_stat,
+        .close = &close_cgroup_stat,
+        .reconfigure = &reconfigure_cgroup_stat,
+        .data = &cgroup_tree,
+        .live = 1
+    },
+    {
+        .name = "agent",
+        .serializer = &serialize_agent_stat,
+        .paths = { "/proc/self/statm", NULL },
+        .live = 1
+    },
+    {
+        .serializer = NULL
+    }
 };
 
+/* with the terminating one */
+#define COLLECTOR_COUNT (sizeof(collectors) / sizeof(*collectors))
 
-int collect_stats(int fd, void *data) {
+void close_collector(struct collector *collector) {
+    assert(collector != NULL);
+
+    for(size_t i = 0; i < MAX_COLLECTOR_SOURCES; ++i) {
+        if(collector->sources[i].path != NULL) {
+            source_close(&collector->sources[i]);
+        }
+    }
+    if(collector->opened) {
+        collector->close(collector);
+        collector->opened = 0;
+    }
+    if(collector->aggregate.capacity != 0) {
+        aggregate_destroy(&collector->aggregate);
+    }
+    collector->closed = 1;
+}
+
+void close_collectors(struct collector *collectors) {
+    assert(collectors != NULL);
+
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        close_collector(collector);
+    }
+}
+
+/* collectors sampling faster than the flush interval are aggregated */
+int open_aggregate(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(collector->aggregate.capacity == 0);
+    assert(config != NULL);
+
+    size_t window = collector->interval != 0 ? config->flush / collector->interval : 0;
+    if(window <= 1) return 0;
+    return aggregate_init(&collector->aggregate, config->aggregate_capacity,
+                          window, config->percentile);
+}
+
+int open_collector(struct collector *collector, const struct agent_config *config) {
+    assert(collector != NULL);
+    assert(config != NULL);
+
+    for(size_t i = 0; i < MAX_COLLECTOR_SOURCES && collector->paths[i] != NULL; ++i) {
+        struct source *source = &collector->sources[i];
+        if(source_open(source, config->proc_root, collector->paths[i]) == -1) {
+            /* older snapshots lack some files, reads fail until one has it */
+            HANDLE_RESULT(config->snapshots == NULL || source->path == NULL || source->buf == NULL,
+                          goto FAIL, "open_collector: source_open(%s)", collector->paths[i]);
+            syslog(LOG_WARNING, "%s is missing, %s fails while it is", source->path,
+                   collector->name);
+        }
+    }
+    if(collector->open != NULL) {
+        HANDLE_RESULT(collector->open(collector, config) == -1,
+                      goto FAIL, "open_collector: open(%s)", collector->name);
+        collector->opened = 1;
+    }
+    HANDLE_RESULT(open_aggregate(collector, config) == -1,
+                  goto FAIL, "open_collector: aggregate_init(%s)", collector->name);
+    collector->closed = 0;
+    collector->settled = collector->ticks + HEAP_WARMUP;
+    return 0;
+
+FAIL:
+    close_collector(collector);
+    return -1;
+}
+
+/* the collectors that are not turned off */
+int open_collectors(struct collector *collectors, const struct agent_config *config) {
+    assert(collectors != NULL);
+    assert(config != NULL);
+
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        collector->closed = 1;
+        if(collector->interval == 0) continue;
+        /* snapshots hold no processes, cgroups or agent of their own */
+        if(collector->live && config->snapshots != NULL) continue;
+        HANDLE_RESULT(open_collector(collector, config) == -1,
+                      goto FAIL, "open_collectors: open_collector(%s)", collector->name);
+    }
+    return 0;
+
+FAIL:
+    close_collectors(collectors);
+    return -1;
+}
+
+
+/* closes the retired sinks that delivered their queue or gave up on it */
+void reap_sinks(struct agent_context *context) {
+    assert(context != NULL);
+
+    size_t kept = 0;
+    for(size_t i = 0; i < context->retirements; ++i) {
+        struct sink *sink = &context->retired[i];
+        if(!sink_retired(sink)) {
+            context->retired[kept++] = *sink;
+            continue;
+        }
+        syslog(LOG_INFO, "sink %s closed", sink->name);
+        sink_close(sink);
+    }
+    context->retirements = kept;
+}
+
+/* hands the output of a tick to the sinks, on the thread that owns them */
+void send_tick(struct agent_context *context, struct collector *collector,
+               const char *buf, size_t len, int64_t woken) {
+    assert(context != NULL);
+    assert(collector != NULL);
+    assert(buf != NULL);
+
+    int failed = fanout_send(&context->fanout, buf, len) == -1;
+    HANDLE_RESULT(failed, (void)context, "send_tick[%s]: fanout_send", collector->name);
+    fanout_publish(&context->fanout);
+    telemetry_sent(&collector->telemetry, telemetry_now() - woken, failed);
+    if(context->retirements != 0) reap_sinks(context);
+}
+
+/* one sample of the collector taken at ts, serialized and sent */
+void collect(struct collector *collector, const struct timespec *ts) {
+    assert(collector != NULL);
+    assert(ts != NULL);
+
+    struct agent_context *context = collector->context;
+    struct telemetry *telemetry = &collector->telemetry;
+    assert(context != NULL);
+    assert(context->fanout.sinks != NULL);
+    assert(context->hostname != NULL);
+
+    struct aggregate *aggregate = collector->aggregate.capacity != 0 ? &collector->aggregate : NULL;
+    struct lp_writer w;
+    lp_writer_init(&w, context->buf, context->bufsize);
+    lp_writer_growable(&w, TICK_BUFFER_LIMIT);
+    lp_writer_registry(&w, &context->series);
+    if(context->state != NULL) {
+        lp_writer_state(&w, context->state, ts);
+        /* aggregates of cumulative counters are only meaningful as rates */
+        w.rate = context->rate || aggregate != NULL;
+        w.keyframe = context->keyframe;
+        w.tick = collector->ticks;
+    }
+    if(aggregate != NULL) {
+        w.aggregate = aggregate;
+        w.flush = (collector->ticks + 1) % aggregate->window == 0;
+    }
+    uint64_t allocations = heap_allocations;
+    uint64_t growths = heap_growths;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = collector->serializer(collector, context->hostname, ts, &w);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    telemetry_latency(telemetry, telemetry_elapsed(&start, &end));
+    HANDLE_RESULT(result < 0, ++telemetry->errors; w.len = w.lines = 0; lp_line_abort(&w),
+                  "collect[%s]: serializer failed", collector->name);
+    if(aggregate != NULL) {
+        if(result < 0) {
+            aggregate->count = 0;
+        } else if(w.flush) {
+            aggregate_reset(aggregate);
+        } else {
+            aggregate_fold(aggregate);
+        }
+    }
+    context->buf = w.buf;
+    context->bufsize = w.size;
+    telemetry->bytes += w.len;
+    telemetry->lines += w.lines;
+
+    /* empty on the first sample in rate mode or when nothing changed */
+    assert(w.buf[w.len] == 0);
+    int dropped = result < 0;
+    if(w.len != 0 && context->queue != NULL) {
+        dropped = worker_push(context->queue, &context->buf, &context->bufsize, w.len,
+                              collector, collector->woken) == -1;
+        HANDLE_RESULT(dropped, ++telemetry->dropped,
+                      "collect[%s]: send queue full, tick dropped", collector->name);
+    } else if(w.len != 0) {
+        send_tick(context, collector, w.buf, w.len, collector->woken);
+    }
+    /* values that are not sent are neither the last sent nor the base of the next rate */
+    if(context->state != NULL && dropped) {
+        state_table_rollback(context->state, 0);
+    } else if(context->state != NULL) {
+        state_table_commit(context->state);
+    }
+    allocations = heap_allocations - allocations;
+    telemetry->allocations += allocations;
+    telemetry->growths += heap_growths - growths;
+#ifdef HEAP_CHECK
+    HANDLE_RESULT(allocations != 0 && collector->ticks >= collector->settled, assert(allocations == 0),
+                  "collect[%s]: %" PRIu64 " heap allocations in tick %" PRIu64,
+                  collector->name, allocations, collector->ticks);
+#endif
+    ++collector->ticks;
+}
+
+/* stops batching reads, the ones in flight are waited for as they write into the sources */
+void disable_uring(struct agent_context *context) {
+    assert(context != NULL);
+    assert(context->ring != NULL);
+
+    struct uring *ring = context->ring;
+    syslog(LOG_WARNING, "io_uring failed, reading synchronously");
+    context->ring = NULL;
+    HANDLE_RESULT(ring->inflight != 0 && uring_wait(ring, ring->inflight) == -1, (void)ring,
+                  "disable_uring: uring_wait");
+    uint64_t token;
+    int32_t res;
+    while(uring_reap(ring, &token, &res)) { }
+    for(struct collector *collector = context->collectors; collector->serializer != NULL; ++collector) {
+        collector->pending = 0;
+    }
+}
+
+/* queues the reads of all sources of the collector, collect() runs when they completed */
+int submit_sources(struct collector *collector, const struct timespec *ts) {
+    assert(collector != NULL);
+    assert(collector->context != NULL);
+    assert(collector->context->ring != NULL);
+    assert(((uintptr_t)collector & SOURCE_INDEX_MASK) == 0);
+    assert(ts != NULL);
+
+    struct agent_context *context = collector->context;
+    unsigned count = 0;
+    /* a source that can't be queued is read by its serializer */
+    for(size_t i = 0; i < MAX_COLLECTOR_SOURCES && collector->sources[i].path != NULL; ++i) {
+        count += source_submit(&collector->sources[i], context->ring, (uintptr_t)collector | i) == 0;
+    }
+    if(count == 0) return -1;
+    collector->pending = count;
+    collector->sampled = *ts;
+    HANDLE_RESULT(uring_submit(context->ring) == -1, disable_uring(context); return -1,
+                  "submit_sources[%s]: uring_submit", collector->name);
+    return 0;
+}
+
+/* collects the ticks whose reads all completed */
+void reap_sources(struct agent_context *context) {
+    assert(context != NULL);
+    assert(context->ring != NULL);
+
+    uint64_t token;
+    int32_t res;
+    while(uring_reap(context->ring, &token, &res)) {
+        struct collector *collector = (struct collector *)(uintptr_t)(token & ~(uint64_t)SOURCE_INDEX_MASK);
+        source_complete(&collector->sources[token & SOURCE_INDEX_MASK], res);
+        assert(collector->pending > 0);
+        if(--collector->pending == 0) {
+            collect(collector, &collector->sampled);
+        }
+    }
+}
+
+int complete_sources(int fd, void *data) {
     assert(fd != -1);
     assert(data != NULL);
 
     struct agent_context *context = (struct agent_context *)data;
-    assert(context->sink != -1);
-    assert(context->hostname != NULL);
+    uint64_t v = 0;
+    ssize_t r = read(fd, &v, sizeof(v));
+    HANDLE_POSIX_RESULT(r, return -1, "complete_sources: read fd=%d", fd);
+    if(context->ring == NULL) return 0;
+
+    reap_sources(context);
+    return 0;
+}
 
+/* waits for the reads in flight and collects their ticks */
+void drain_sources(struct agent_context *context) {
+    assert(context != NULL);
+
+    if(context->ring == NULL || context->ring->inflight == 0) return;
+    HANDLE_RESULT(uring_wait(context->ring, context->ring->inflight) == -1,
+                  disable_uring(context); return, "drain_sources: uring_wait");
+    reap_sources(context);
+}
+
+int collect_stats(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    struct collector *collector = (struct collector *)data;
+    collector->woken = telemetry_now();
     uint64_t v = 0;
     ssize_t r = read(fd, &v, sizeof(v));
-    HANDLE_POSIX_RESULT(r, return -1, "collect_stats: read fd=%d", fd);
+    HANDLE_POSIX_RESULT(r, return -1, "collect_stats[%s]: read fd=%d", collector->name, fd);
     HANDLE_RESULT(r != sizeof(v), return -1,
-                  "collect_stats: read %zd bytes expected %zu", r, sizeof(v));
-    HANDLE_RESULT(v != 1, (void)v,
-                  "collect_stats: detected slow processing, "
-                  "timer overrun %" PRIu64 " times", v);
+                  "collect_stats[%s]: read %zd bytes expected %zu", collector->name, r, sizeof(v));
+    struct telemetry *telemetry = &collector->telemetry;
+    HANDLE_RESULT(v != 1, telemetry->overruns += v - 1,
+                  "collect_stats[%s]: detected slow processing, "
+                  "timer overrun %" PRIu64 " times, %" PRIu64 " in total",
+                  collector->name, v - 1, telemetry->overruns + v - 1);
 
+    HANDLE_RESULT(collector->pending != 0, ++telemetry->overruns; return 0,
+                  "collect_stats[%s]: reads of the previous tick did not complete", collector->name);
 
     struct timespec ts;
     HANDLE_POSIX_RESULT(clock_gettime(CLOCK_REALTIME, &ts),
                         return -1, "collect_stats: clock_gettime");
+    if(collector->context->ring != NULL && submit_sources(collector, &ts) == 0) return 0;
+    collect(collector, &ts);
+    return 0;
+}
 
-    char message[MAX_MESSAGE_SIZE];
-    for(const serializer *serializer = serializers;
-        *serializer != NULL;
-        ++serializer) {
-        size_t messagelen = sizeof(message);
-        HANDLE_RESULT((*serializer)(context->hostname, &ts, message, &messagelen) < 0,
-                      goto NEXT_SERIALIZER, "collect_stats: serializer %p failed",
-                      *serializer);
-        assert(message[messagelen] == 0);
-        HANDLE_POSIX_RESULT(send(context->sink, message, messagelen, 0),
-                            (void)context->sink, "collect_stats: send");
-NEXT_SERIALIZER:
-        ;
+/* sends the ticks the collecting thread queued */
+void flush_ticks(struct agent_context *context) {
+    assert(context != NULL);
+    assert(context->queue != NULL);
+
+    struct worker_slot *slot;
+    while((slot = worker_peek(context->queue)) != NULL) {
+        send_tick(context, slot->data, slot->buf, slot->len, slot->woken);
+        worker_pop(context->queue);
     }
+}
+
+/* sending thread in worker mode */
+int send_ticks(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    struct agent_context *context = (struct agent_context *)data;
+    uint64_t v = 0;
+    ssize_t r = read(fd, &v, sizeof(v));
+    HANDLE_RESULT(r == -1 && errno != EAGAIN, return -1, "send_ticks: read fd=%d: %s", fd, strerror(errno));
+    flush_ticks(context);
+    HANDLE_RESULT(__atomic_load_n(&context->queue->stopped, __ATOMIC_ACQUIRE), return -1,
+                  "send_ticks: the collecting thread stopped");
     return 0;
 }
 
+int stop_worker(int fd, void *data) {
+    assert(fd != -1);
+    (void)data;
 
-int run_agent(const char *hostname, const char *remote, const char *service) {
-    assert(hostname != NULL);
+    /* read, the loop runs again when the thread is started again */
+    uint64_t v = 0;
+    HANDLE_POSIX_RESULT(read(fd, &v, sizeof(v)), (void)v, "stop_worker: read fd=%d", fd);
+    return -1;
+}
+
+/* collecting thread in worker mode, runs the collectors until stopped */
+void *run_worker(void *data) {
+    assert(data != NULL);
+
+    struct agent_context *context = (struct agent_context *)data;
+    /* the loop is left through the stop event, or on an error it logged */
+    if(worker_settle(context->sched) == 0) run_event_loop(context->collect_loop);
+    syslog(LOG_DEBUG, "collecting thread done");
+    worker_stop(context->queue);
+    return NULL;
+}
+
+int start_worker(struct agent_context *context) {
+    assert(context != NULL);
+    assert(context->queue != NULL);
+    assert(!context->worker);
+
+    worker_resume(context->queue);
+    int error = pthread_create(&context->thread, NULL, &run_worker, context);
+    HANDLE_RESULT(error != 0, return -1, "can't start collecting thread: %s", strerror(error));
+    context->worker = 1;
+    return 0;
+}
+
+/* stops the collecting thread between two ticks */
+void join_worker(struct agent_context *context) {
+    assert(context != NULL);
+
+    if(!context->worker) return;
+    uint64_t one = 1;
+    HANDLE_POSIX_RESULT(write(context->stop.fd, &one, sizeof(one)), (void)context,
+                        "fd=%d: write: stop", context->stop.fd);
+    pthread_join(context->thread, NULL);
+    context->worker = 0;
+}
+
+int replay_spool(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    struct agent_context *context = (struct agent_context *)data;
+    uint64_t v = 0;
+    ssize_t r = read(fd, &v, sizeof(v));
+    HANDLE_POSIX_RESULT(r, return -1, "replay_spool: read fd=%d", fd);
+    for(size_t i = 0; i < context->fanout.count; ++i) {
+        HANDLE_RESULT(sink_replay(&context->fanout.sinks[i]) == -1,
+                      (void)context, "replay_spool: sink_replay(%s)", context->fanout.sinks[i].name);
+    }
+    fanout_publish(&context->fanout);
+    return 0;
+}
+
+int configure_collectors(struct collector *collectors, const struct agent_config *config) {
+    assert(collectors != NULL);
+    assert(config != NULL);
+
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        collector->interval = AGENT_INTERVAL;
+        collector->offset = -1;
+    }
+    for(const struct agent_schedule *schedule = config->schedules;
+        schedule != NULL && schedule->collector != NULL;
+        ++schedule) {
+        struct collector *collector = collectors;
+        while(collector->serializer != NULL && strcmp(collector->name, schedule->collector) != 0) {
+            ++collector;
+        }
+        HANDLE_RESULT(collector->serializer == NULL, return -1,
+                      "configure_collectors: unknown collector %s", schedule->collector);
+        HANDLE_RESULT(schedule->offset >= 0 && (unsigned)schedule->offset >= schedule->interval,
+                      return -1, "configure_collectors: invalid schedule of %s", schedule->collector);
+        collector->interval = schedule->interval;
+        collector->offset = schedule->offset;
+    }
+
+    /* collectors sharing an interval are spread evenly across it, slack brings them together */
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        if(collector->interval == 0) collector->offset = 0;
+        if(collector->offset != -1) continue;
+        unsigned count = 0;
+        for(struct collector *c = collector; c->serializer != NULL; ++c) {
+            count += c->interval == collector->interval && c->offset == -1;
+        }
+        unsigned index = 0;
+        for(struct collector *c = collector; c->serializer != NULL; ++c) {
+            if(c->interval == collector->interval && c->offset == -1) {
+                c->offset = (uint64_t)c->interval * index++ / count;
+            }
+        }
+    }
+    for(struct collector *collector = collectors;
+        config->slack > 1 && collector->serializer != NULL;
+        ++collector) {
+        collector->offset -= collector->offset % config->slack;
+    }
+    return 0;
+}
+
+/* ns after which a field without a sample is stale: two intervals of the slowest collector */
+int64_t field_ttl(const struct collector *collectors) {
+    assert(collectors != NULL);
+
+    unsigned longest = 0;
+    for(const struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        if(collector->interval > longest) longest = collector->interval;
+    }
+    return (int64_t)longest * 2 * 1000000;
+}
+
+void unschedule_collectors(struct collector *collectors) {
+    assert(collectors != NULL);
+
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        if(collector->timer.fd != -1) {
+            HANDLE_POSIX_RESULT(close(collector->timer.fd), (void)collector,
+                                "fd=%d: close: timer[%s]", collector->timer.fd, collector->name);
+            collector->timer.fd = -1;
+        }
+    }
+}
+
+/* the timer of a collector that is closed is disarmed */
+void collector_timeout(const struct collector *collector, struct itimerspec *timeout) {
+    assert(collector != NULL);
+    assert(timeout != NULL);
+
+    memset(timeout, 0, sizeof(*timeout));
+    if(collector->closed) return;
+    timeout->it_interval.tv_sec = collector->interval / 1000;
+    timeout->it_interval.tv_nsec = collector->interval % 1000 * 1000000L;
+    timeout->it_value.tv_sec = collector->offset / 1000;
+    timeout->it_value.tv_nsec = collector->offset % 1000 * 1000000L;
+    if(collector->offset == 0) timeout->it_value.tv_nsec = 1;
+}
+
+/* timers are set back to back, relative offsets keep their phases */
+int reschedule_collectors(struct collector *collectors) {
+    assert(collectors != NULL);
+
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        struct itimerspec timeout;
+        collector_timeout(collector, &timeout);
+        HANDLE_POSIX_RESULT(timerfd_settime(collector->timer.fd, 0, &timeout, NULL), return -1,
+                            "fd=%d: timerfd_settime: timer[%s]", collector->timer.fd, collector->name);
+        syslog(LOG_DEBUG, "fd=%d: %s every %ums at +%dms%s", collector->timer.fd,
+               collector->name, collector->interval, collector->offset,
+               collector->closed ? ", off" : "");
+    }
+    return 0;
+}
+
+int schedule_collectors(struct collector *collectors, struct agent_context *context, int ev_loop) {
+    assert(collectors != NULL);
+    assert(context != NULL);
+    assert(ev_loop != -1);
+
+    for(struct collector *collector = collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        collector->context = context;
+        collector->ticks = 0;
+        collector->settled = HEAP_WARMUP;
+        collector->pending = 0;
+        memset(&collector->telemetry, 0, sizeof(collector->telemetry));
+        collector->timer.handler = &collect_stats;
+        collector->timer.data = collector;
+
+        /* timers are created back to back, relative offsets keep their phases */
+        struct itimerspec timeout;
+        collector_timeout(collector, &timeout);
+        HANDLE_RESULT(create_timer(ev_loop, &timeout, &collector->timer) == -1,
+                      goto FAIL, "can't create timer to query %s", collector->name);
+        syslog(LOG_DEBUG, "fd=%d: %s every %ums at +%dms%s", collector->timer.fd,
+               collector->name, collector->interval, collector->offset,
+               collector->closed ? ", off" : "");
+        /* closed with the collector, which takes it out of the loop */
+        if(collector->watch.fd != -1) {
+            HANDLE_RESULT(register_event(ev_loop, EPOLLIN, &collector->watch) == -1,
+                          goto FAIL, "can't watch %s", collector->name);
+        }
+    }
+    return 0;
+
+FAIL:
+    unschedule_collectors(collectors);
+    return -1;
+}
+
+/* snapshots are directories named by their time, seconds[.fraction] since the epoch */
+int snapshot_time(const char *name, struct timespec *ts) {
+    assert(name != NULL);
+    assert(ts != NULL);
+
+    char *end = NULL;
+    if(*name < '0' || *name > '9') return -1;
+    ts->tv_sec = strtoul(name, &end, 10);
+    ts->tv_nsec = 0;
+    if(*end == '.') {
+        long scale = 100000000;
+        for(++end; *end >= '0' && *end <= '9'; ++end, scale /= 10) {
+            if(scale == 0) return -1;   /* finer than nanoseconds */
+            ts->tv_nsec += (*end - '0') * scale;
+        }
+        if(end[-1] == '.') return -1;
+    }
+    return *end == 0 ? 0 : -1;
+}
+
+int snapshot_filter(const struct dirent *entry) {
+    struct timespec ts;
+    return (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) &&
+           snapshot_time(entry->d_name, &ts) == 0;
+}
+
+int snapshot_compare(const struct dirent **a, const struct dirent **b) {
+    struct timespec ta = { 0, 0 }, tb = { 0, 0 };
+    snapshot_time((*a)->d_name, &ta);
+    snapshot_time((*b)->d_name, &tb);
+    if(ta.tv_sec != tb.tv_sec) return (ta.tv_sec > tb.tv_sec) - (ta.tv_sec < tb.tv_sec);
+    return (ta.tv_nsec > tb.tv_nsec) - (ta.tv_nsec < tb.tv_nsec);
+}
+
+/*
+ * Runs every collector once per snapshot, in the order of their times and
+ * as fast as possible; schedules do not apply. Collectors that measure the
+ * agent itself are skipped.
+ */
+int replay_snapshots(struct agent_context *context, const struct agent_config *config) {
+    assert(context != NULL);
+    assert(config != NULL);
+    assert(config->snapshots != NULL);
+
+    int result = -1;
+    char *root = NULL;
+    struct dirent **entries = NULL;
+    int count = scandir(config->snapshots, &entries, &snapshot_filter, &snapshot_compare);
+    HANDLE_POSIX_RESULT(count, return -1, "replay_snapshots: scandir(%s)", config->snapshots);
+    HANDLE_RESULT(count == 0, goto CLEANUP,
+                  "replay_snapshots: no snapshots in %s", config->snapshots);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < count; ++i) {
+        free(root);
+        HANDLE_RESULT(asprintf(&root, "%s/%s", config->snapshots, entries[i]->d_name) == -1,
+                      root = NULL; goto CLEANUP, "replay_snapshots: can't allocate path");
+        struct timespec ts;
+        snapshot_time(entries[i]->d_name, &ts);
+        if(i == 0) {
+            /* sources are opened in the first snapshot and moved along */
+            struct agent_config first = *config;
+            first.proc_root = root;
+            HANDLE_RESULT(open_collectors(context->collectors, &first) == -1,
+                          goto CLEANUP, "replay_snapshots: can't open collector sources in %s", root);
+        }
+        for(struct collector *collector = context->collectors;
+            collector->serializer != NULL;
+            ++collector) {
+            if(collector->closed) continue;
+            collector->context = context;
+            collector->woken = telemetry_now();
+            /* a missing file fails the read and counts as an error of the collector */
+            for(size_t j = 0; i > 0 && j < MAX_COLLECTOR_SOURCES; ++j) {
+                if(collector->sources[j].path != NULL) {
+                    source_reroot(&collector->sources[j], root);
+                }
+            }
+            collect(collector, &ts);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    syslog(LOG_INFO, "%d snapshots of %s replayed in %.3fs", count, config->snapshots,
+           telemetry_elapsed(&start, &end) / 1e9);
+    result = 0;
+
+CLEANUP:
+    free(root);
+    for(int i = 0; i < count; ++i) free(entries[i]);
+    free(entries);
+    return result;
+}
+
+
+/* "host", "host:port" or "[v6 address]:port", the port defaults to service */
+int open_sink(struct sink *sink, const char *remote, const struct agent_config *config) {
+    assert(sink != NULL);
     assert(remote != NULL);
-    assert(service != NULL);
+    assert(config != NULL);
+
+    char host[NI_MAXHOST];
+    const char *service = config->service;
+    const char *colon = strrchr(remote, ':');
+    size_t len = strlen(remote);
+    if(remote[0] == '[') {
+        const char *bracket = strchr(remote, ']');
+        HANDLE_RESULT(bracket == NULL, return -1, "open_sink: bad address %s", remote);
+        if(bracket[1] == ':') service = bracket + 2;
+        remote += 1;
+        len = bracket - remote;
+    } else if(colon != NULL && strchr(remote, ':') == colon) {
+        service = colon + 1;
+        len = colon - remote;
+    }
+    HANDLE_RESULT(len >= sizeof(host), return -1, "open_sink: host of %s is too long", remote);
+    memcpy(host, remote, len);
+    host[len] = 0;
+    HANDLE_RESULT(service == NULL && strcmp(host, SINK_STDOUT) != 0, return -1,
+                  "open_sink: no port for %s", host);
+
+    if(config->database != NULL) {
+        HANDLE_RESULT(sink_http(sink, host, service, config->database, config->gzip) == -1,
+                      return -1, "can't open HTTP sink to %s:%s", host, service);
+    } else {
+        HANDLE_RESULT(sink_open(sink, host, service, config->payload, config->gso) == -1,
+                      return -1, "can't connect to %s:%s", host, service != NULL ? service : "");
+    }
+    return 0;
+}
+
+/* a spool per sink, the path of the first one is used as it is */
+int open_spool(struct sink *sink, size_t index, const struct agent_config *config) {
+    assert(sink != NULL);
+    assert(config != NULL);
+    assert(config->spool != NULL);
+
+    char *path = NULL;
+    HANDLE_RESULT(asprintf(&path, index == 0 ? "%s" : "%s.%zu", config->spool, index) == -1,
+                  return -1, "open_spool: asprintf");
+    int result = sink_spool(sink, path, config->spool_size, config->replay_rate);
+    HANDLE_RESULT(result == -1, (void)sink, "can't open spool %s", path);
+    free(path);
+    return result;
+}
+
+static inline int same_string(const char *a, const char *b) {
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/* options of the sinks themselves, a change reopens all of them */
+int same_transport(const struct agent_config *a, const struct agent_config *b) {
+    return same_string(a->service, b->service) && same_string(a->database, b->database) &&
+           a->http_flush == b->http_flush && a->gzip == b->gzip &&
+           a->payload == b->payload && a->gso == b->gso;
+}
+
+/* options that only apply on startup keep their values, along with the sinks of a spool */
+void keep_fixed(struct agent_config *next, const struct agent_config *config) {
+    assert(next != NULL);
+    assert(config != NULL);
+
+    if(!same_string(next->proc_root, config->proc_root) || next->uring != config->uring ||
+       next->worker != config->worker || next->lock != config->lock ||
+       memcmp(&next->sched, &config->sched, sizeof(next->sched)) != 0 ||
+       !same_string(next->spool, config->spool) || next->spool_size != config->spool_size ||
+       next->replay_rate != config->replay_rate) {
+        syslog(LOG_WARNING, "-d, -u, -w, -L, -C, -Q, -s and -R only change with a restart");
+    }
+    next->hostname = config->hostname;
+    next->proc_root = config->proc_root;
+    next->snapshots = config->snapshots;
+    next->uring = config->uring;
+    next->worker = config->worker;
+    next->lock = config->lock;
+    next->sched = config->sched;
+    next->spool = config->spool;
+    next->spool_size = config->spool_size;
+    next->replay_rate = config->replay_rate;
+    if(config->spool == NULL) return;
+    /* spools belong to the sinks by their position */
+    if(!same_strings(next->remotes, config->remotes) || !same_transport(next, config) ||
+       next->shard != config->shard) {
+        syslog(LOG_WARNING, "sinks with a spool only change with a restart");
+    }
+    next->remotes = config->remotes;
+    next->service = config->service;
+    next->database = config->database;
+    next->http_flush = config->http_flush;
+    next->gzip = config->gzip;
+    next->payload = config->payload;
+    next->gso = config->gso;
+    next->shard = config->shard;
+}
+
+/* opens the sinks that are new, the ones that stay are moved over with their connections */
+int reload_sinks(struct agent_context *context, const struct agent_config *next) {
+    assert(context != NULL);
+    assert(next != NULL);
+
+    const struct agent_config *config = context->config;
+    int transport = same_transport(next, config);
+    if(transport && next->shard == config->shard && same_strings(next->remotes, config->remotes)) return 0;
+
+    int result = -1;
+    struct fanout fanout = { .sinks = NULL };
+    size_t remotes = 0;
+    while(next->remotes[remotes] != NULL) ++remotes;
+    size_t *kept = calloc(remotes, sizeof(*kept));
+    HANDLE_RESULT(kept == NULL, return -1, "reload_sinks: can't allocate %zu sinks", remotes);
+    HANDLE_RESULT(fanout_open(&fanout, remotes, next->shard && remotes > 1) == -1,
+                  goto CLEANUP, "reload_sinks: can't allocate sinks");
+    for(size_t i = 0; i < remotes; ++i) {
+        kept[i] = SIZE_MAX;
+        for(size_t j = 0; transport && j < context->fanout.count && kept[i] == SIZE_MAX; ++j) {
+            if(strcmp(next->remotes[i], config->remotes[j]) != 0) continue;
+            size_t k = 0;
+            while(k < i && kept[k] != j) ++k;
+            if(k == i) kept[i] = j;
+        }
+        if(kept[i] != SIZE_MAX) {
+            /* the ring is placed by name before the sink moves */
+            memcpy(fanout.sinks[i].name, context->fanout.sinks[kept[i]].name, sizeof(fanout.sinks[i].name));
+            continue;
+        }
+        HANDLE_RESULT(open_sink(&fanout.sinks[i], next->remotes[i], next) == -1,
+                      goto CLEANUP, "reload_sinks: can't open sink %s", next->remotes[i]);
+        HANDLE_RESULT(sink_schedule(&fanout.sinks[i], context->ev_loop, next->http_flush) == -1,
+                      goto CLEANUP, "reload_sinks: can't schedule HTTP batches of %s", next->remotes[i]);
+        syslog(LOG_INFO, "sink %s opened", fanout.sinks[i].name);
+    }
+    HANDLE_RESULT(fanout_ring(&fanout) == -1, goto CLEANUP, "reload_sinks: can't shard the sinks");
+    /* room for all of the sinks in effect, the ones removed go on delivering */
+    struct sink *retired = realloc(context->retired,
+                                   (context->retirements + context->fanout.count) * sizeof(*retired));
+    HANDLE_RESULT(retired == NULL, goto CLEANUP, "reload_sinks: can't allocate retired sinks");
+    context->retired = retired;
+
+    for(size_t i = 0; i < remotes; ++i) {
+        if(kept[i] == SIZE_MAX) continue;
+        struct sink *sink = &context->fanout.sinks[kept[i]];
+        fanout.sinks[i] = *sink;
+        memset(sink, 0, sizeof(*sink));
+        sink->fd = -1;
+    }
+    for(size_t j = 0; j < context->fanout.count; ++j) {
+        struct sink *sink = &context->fanout.sinks[j];
+        if(sink->name[0] == 0) continue;
+        sink_retire(sink);
+        if(sink_retired(sink)) {
+            syslog(LOG_INFO, "sink %s closed", sink->name);
+            continue;
+        }
+        syslog(LOG_INFO, "sink %s removed, closed once its queue is delivered", sink->name);
+        context->retired[context->retirements++] = *sink;
+        memset(sink, 0, sizeof(*sink));
+        sink->fd = -1;
+    }
+    fanout.failovers = context->fanout.failovers;
+    fanout_close(&context->fanout);
+    context->fanout = fanout;
+    fanout_publish(&context->fanout);
+    result = 0;
+
+CLEANUP:
+    if(result == -1) fanout_close(&fanout);
+    free(kept);
+    return result;
+}
+
+/* the aggregate of the collector is not the one the configuration asks for */
+int aggregate_changed(const struct collector *collector, const struct agent_config *config) {
+    size_t window = config->flush / collector->interval;
+    if(window <= 1) window = 0;
+    const struct aggregate *aggregate = &collector->aggregate;
+    if(aggregate->capacity == 0) return window != 0;
+    return window != aggregate->window || (aggregate->history != NULL) != (config->percentile != 0);
+}
+
+/* collectors that changed are opened again, the others take the configuration in place */
+void reload_collectors(struct agent_context *context, const struct agent_config *next) {
+    assert(context != NULL);
+    assert(next != NULL);
+
+    for(struct collector *collector = context->collectors;
+        collector->serializer != NULL;
+        ++collector) {
+        int reopen = 0;
+        if(collector->interval == 0) {
+            if(!collector->closed) {
+                close_collector(collector);
+                syslog(LOG_INFO, "%s turned off", collector->name);
+            }
+            continue;
+        } else if(collector->closed) {
+            reopen = 1;
+        } else if(collector->reconfigure != NULL && collector->reconfigure(collector, next) == 1) {
+            close_collector(collector);
+            reopen = 1;
+        } else if(aggregate_changed(collector, next)) {
+            if(collector->aggregate.capacity != 0) aggregate_destroy(&collector->aggregate);
+            HANDLE_RESULT(open_aggregate(collector, next) == -1, close_collector(collector),
+                          "reload_collectors: aggregate_init(%s)", collector->name);
+        }
+        if(!reopen) continue;
+        /* a collector that can't be opened is off until a reload opens it */
+        HANDLE_RESULT(open_collector(collector, next) == -1, continue,
+                      "reload_collectors: can't open %s, it is off", collector->name);
+        HANDLE_RESULT(collector->watch.fd != -1 &&
+                      register_event(context->collect_loop, EPOLLIN, &collector->watch) == -1,
+                      close_collector(collector); continue, "reload_collectors: can't watch %s", collector->name);
+        syslog(LOG_INFO, "%s opened", collector->name);
+    }
+}
+
+/*
+ * Loads the options again, the command line followed by the file, and
+ * applies them between two ticks: the collecting thread is stopped and the
+ * reads in flight are waited for meanwhile. The whole reload is dropped
+ * when the options are not valid or a new sink can't be opened; after that
+ * a collector that can't be opened again is turned off. Collectors and
+ * sinks that did not change keep their state and descriptors.
+ */
+int reload_agent(struct agent_context *context) {
+    assert(context != NULL);
+    assert(context->config->file != NULL);
+
+    const struct agent_config *config = context->config;
+    struct collector *list = context->collectors;
+    unsigned intervals[COLLECTOR_COUNT];
+    int offsets[COLLECTOR_COUNT];
+    int closed[COLLECTOR_COUNT];
+    struct state_table states = { .capacity = 0 };
+    struct agent_options *loaded = malloc(sizeof(*loaded));
+    HANDLE_RESULT(loaded == NULL, return 0, "reload_agent: can't allocate options");
+    if(options_load(loaded, config->argc, config->argv) == -1) {
+        syslog(LOG_WARNING, "options of %s are not valid, the ones in effect are kept", config->file);
+        free(loaded);
+        return 0;
+    }
+    struct agent_config *next = &loaded->config;
+    keep_fixed(next, config);
+
+    join_worker(context);
+    drain_sources(context);
+    if(context->queue != NULL) flush_ticks(context);
+
+    for(size_t i = 0; list[i].serializer != NULL; ++i) {
+        intervals[i] = list[i].interval;
+        offsets[i] = list[i].offset;
+        closed[i] = list[i].closed;
+    }
+    int stateful = next->rate || next->keyframe != 0 || next->flush != 0;
+    HANDLE_RESULT(configure_collectors(list, next) == -1,
+                  goto FAIL, "reload_agent: can't configure collectors");
+    /* a table of another size starts over, rates resume with the second sample */
+    int resized = stateful && (context->states.capacity == 0 ||
+                               next->state_capacity != config->state_capacity);
+    HANDLE_RESULT(resized && state_table_init(&states, next->state_capacity) == -1,
+                  goto FAIL, "reload_agent: can't allocate per-series state");
+    HANDLE_RESULT(series_registry_tags(&context->series, next->tags) == -1,
+                  goto FAIL, "reload_agent: invalid tags");
+    HANDLE_RESULT(reload_sinks(context, next) == -1,
+                  series_registry_tags(&context->series, config->tags); goto FAIL,
+                  "reload_agent: can't open the sinks");
+
+    reload_collectors(context, next);
+    int rescheduled = 0;
+    for(size_t i = 0; list[i].serializer != NULL; ++i) {
+        rescheduled |= list[i].interval != intervals[i] || list[i].offset != offsets[i] ||
+                       list[i].closed != closed[i];
+    }
+    HANDLE_RESULT(rescheduled && reschedule_collectors(list) == -1,
+                  (void)list, "reload_agent: reschedule_collectors");
+    context->rate = next->rate;
+    context->keyframe = next->keyframe;
+    if(resized || !stateful) {
+        if(context->states.capacity != 0) state_table_destroy(&context->states);
+        context->states = states;
+    }
+    context->states.ttl = field_ttl(list);
+    context->state = stateful ? &context->states : NULL;
+
+    if(context->loaded != NULL) {
+        options_free(context->loaded);
+        free(context->loaded);
+    }
+    context->loaded = loaded;
+    context->config = next;
+    syslog(LOG_INFO, "options of %s reloaded", next->file);
+    return context->queue != NULL ? start_worker(context) : 0;
+
+FAIL:
+    for(size_t i = 0; list[i].serializer != NULL; ++i) {
+        list[i].interval = intervals[i];
+        list[i].offset = offsets[i];
+    }
+    if(states.capacity != 0) state_table_destroy(&states);
+    options_free(loaded);
+    free(loaded);
+    syslog(LOG_WARNING, "options of %s not reloaded, the ones in effect are kept", config->file);
+    return context->queue != NULL ? start_worker(context) : 0;
+}
+
+int reload_signal(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    struct signalfd_siginfo info;
+    ssize_t r = read(fd, &info, sizeof(info));
+    HANDLE_POSIX_RESULT(r, return -1, "reload_signal: read fd=%d", fd);
+    syslog(LOG_INFO, "SIGHUP from pid %u, reloading", info.ssi_pid);
+    return reload_agent(data);
+}
+
+/* editors write the file in place or rename a new one over it */
+int reload_watch(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    struct agent_context *context = (struct agent_context *)data;
+    const char *name = strrchr(context->config->file, '/');
+    name = name != NULL ? name + 1 : context->config->file;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    for(;;) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len == -1 && errno == EAGAIN) break;
+        HANDLE_POSIX_RESULT(len, return -1, "reload_watch: read fd=%d", fd);
+        for(char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            changed |= event->len != 0 && strcmp(event->name, name) == 0;
+            p += sizeof(*event) + event->len;
+        }
+    }
+    if(!changed) return 0;
+    syslog(LOG_INFO, "%s changed, reloading", context->config->file);
+    return reload_agent(context);
+}
+
+/* SIGHUP and changes of the file reload the options */
+int watch_options(struct agent_context *context, struct event_handler *signal,
+                  struct event_handler *watch) {
+    assert(context != NULL);
+    assert(context->config->file != NULL);
+    assert(signal != NULL);
+    assert(watch != NULL);
+
+    const char *file = context->config->file;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    /* blocked before the collecting thread starts, it inherits the mask */
+    int error = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    HANDLE_RESULT(error != 0, return -1, "watch_options: pthread_sigmask: %s", strerror(error));
+    HANDLE_POSIX_RESULT(signal->fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC),
+                        return -1, "watch_options: signalfd");
+    HANDLE_RESULT(register_event(context->ev_loop, EPOLLIN, signal) == -1,
+                  return -1, "watch_options: register_event(signalfd)");
+
+    /* the directory is watched, a file renamed over the options is another inode */
+    char dir[PATH_MAX];
+    const char *slash = strrchr(file, '/');
+    size_t len = slash == NULL ? 1 : slash == file ? 1 : (size_t)(slash - file);
+    HANDLE_RESULT(len >= sizeof(dir), return -1, "watch_options: path of %s is too long", file);
+    memcpy(dir, slash == NULL ? "." : file, len);
+    dir[len] = 0;
+    HANDLE_POSIX_RESULT(watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+                        return -1, "watch_options: inotify_init1");
+    HANDLE_POSIX_RESULT(inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO),
+                        return -1, "watch_options: inotify_add_watch(%s)", dir);
+    HANDLE_RESULT(register_event(context->ev_loop, EPOLLIN, watch) == -1,
+                  return -1, "watch_options: register_event(inotify)");
+    syslog(LOG_DEBUG, "fd=%d, fd=%d: reloading %s on SIGHUP or when it changes",
+           signal->fd, watch->fd, file);
+    return 0;
+}
+
+int run_agent(const struct agent_config *config) {
+    assert(config != NULL);
+    assert(config->hostname != NULL);
+    assert(config->remotes != NULL && config->remotes[0] != NULL);
 
     int result = -1;
     int ev_loop = -1;
+    struct worker_queue queue = { .fd = -1 };
     struct agent_context context = {
-        .sink = create_sink(remote, service),
-        .hostname = hostname
+        .config = config,
+        .loaded = NULL,
+        .fanout = { .sinks = NULL },
+        .retired = NULL,
+        .retirements = 0,
+        .buf = malloc(TICK_BUFFER_SIZE),
+        .bufsize = TICK_BUFFER_SIZE,
+        .hostname = config->hostname,
+        .collectors = collectors,
+        .state = NULL,
+        .states = { .capacity = 0 },
+        .series = { .entries = NULL },
+        .rate = config->rate,
+        .keyframe = config->keyframe,
+        .uring = { .fd = -1 },
+        .ring = NULL,
+        .queue = NULL,
+        .sched = &config->sched,
+        .ev_loop = -1,
+        .collect_loop = -1,
+        .worker = 0,
+        .stop = {
+            .fd = -1,
+            .handler = &stop_worker,
+            .data = &context
+        }
     };
-    HANDLE_RESULT(context.sink == -1,
-                  goto CLEANUP, "can't connect to %s:%s", remote, service);
-
-    struct event_handler timer = {
+    struct event_handler replay = {
         .fd = -1,
-        .handler = &collect_stats,
+        .handler = &replay_spool,
         .data = &context
     };
+    struct event_handler completions = {
+        .fd = -1,
+        .handler = &complete_sources,
+        .data = &context
+    };
+    struct event_handler ticks = {
+        .fd = -1,
+        .handler = &send_ticks,
+        .data = &context
+    };
+    struct event_handler hangup = {
+        .fd = -1,
+        .handler = &reload_signal,
+        .data = &context,
+        .last = 1
+    };
+    struct event_handler watch = {
+        .fd = -1,
+        .handler = &reload_watch,
+        .data = &context,
+        .last = 1
+    };
+    for(struct collector *collector = collectors; collector->serializer != NULL; ++collector) {
+        collector->timer.fd = -1;
+        collector->watch.fd = -1;
+    }
+
+    HANDLE_RESULT(context.buf == NULL,
+                  goto CLEANUP, "can't allocate tick buffer");
+    size_t remotes = 0;
+    while(config->remotes[remotes] != NULL) ++remotes;
+    HANDLE_RESULT(fanout_open(&context.fanout, remotes, config->shard && remotes > 1) == -1,
+                  goto CLEANUP, "can't allocate sinks");
+    for(size_t i = 0; i < remotes; ++i) {
+        HANDLE_RESULT(open_sink(&context.fanout.sinks[i], config->remotes[i], config) == -1,
+                      goto CLEANUP, "can't open sink %s", config->remotes[i]);
+        HANDLE_RESULT(config->spool != NULL && open_spool(&context.fanout.sinks[i], i, config) == -1,
+                      goto CLEANUP, "can't open spool of sink %s", config->remotes[i]);
+    }
+    HANDLE_RESULT(fanout_ring(&context.fanout) == -1,
+                  goto CLEANUP, "can't shard the sinks");
+    HANDLE_RESULT(series_registry_init(&context.series, SERIES_CAPACITY, SERIES_ARENA_SIZE,
+                                       config->tags) == -1,
+                  goto CLEANUP, "can't allocate series registry");
+    if(config->rate || config->keyframe != 0 || config->flush != 0) {
+        HANDLE_RESULT(state_table_init(&context.states, config->state_capacity) == -1,
+                      goto CLEANUP, "can't allocate per-series state");
+        context.state = &context.states;
+    }
+    HANDLE_RESULT(configure_collectors(context.collectors, config) == -1,
+                  goto CLEANUP, "can't configure collectors");
+    context.states.ttl = field_ttl(context.collectors);
+    if(config->lock) {
+        /* pages are locked as they are touched, a spool is not read in as a whole */
+        HANDLE_POSIX_RESULT(mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT),
+                            goto CLEANUP, "can't lock memory: mlockall");
+    }
+    if(config->snapshots != NULL) {
+        result = replay_snapshots(&context, config);
+        goto CLEANUP;
+    }
+    HANDLE_RESULT(open_collectors(context.collectors, config) == -1,
+                  goto CLEANUP, "can't open collector sources");
 
     HANDLE_RESULT((ev_loop = create_event_loop()) == -1,
                   goto CLEANUP, "can't initialize event loop");
+    context.ev_loop = context.collect_loop = ev_loop;
+    if(config->worker) {
+        /* the collectors get a loop and a thread of their own, sinks stay on this one */
+        HANDLE_RESULT((context.collect_loop = create_event_loop()) == -1,
+                      goto CLEANUP, "can't initialize event loop of the collectors");
+        HANDLE_RESULT(worker_queue_init(&queue) == -1,
+                      goto CLEANUP, "can't allocate the queue of ticks");
+        context.queue = &queue;
+        ticks.fd = queue.fd;
+        HANDLE_RESULT(register_event(ev_loop, EPOLLIN, &ticks) == -1,
+                      goto CLEANUP, "can't wait for ticks");
+        HANDLE_RESULT(create_event(context.collect_loop, 0, &context.stop) == -1,
+                      goto CLEANUP, "can't create event to stop collecting");
+    }
+
+    if(config->uring) {
+        if(uring_open(&context.uring, AGENT_URING_ENTRIES) == -1) {
+            syslog(LOG_WARNING, "io_uring not available, reading synchronously");
+        } else {
+            HANDLE_RESULT(create_event(context.collect_loop, 0, &completions) == -1,
+                          goto CLEANUP, "can't create event for io_uring completions");
+            HANDLE_RESULT(uring_register_eventfd(&context.uring, completions.fd) == -1,
+                          goto CLEANUP, "can't signal io_uring completions");
+            context.ring = &context.uring;
+        }
+    }
+    HANDLE_RESULT(schedule_collectors(context.collectors, &context, context.collect_loop) == -1,
+                  goto CLEANUP, "can't schedule collectors");
+    for(size_t i = 0; i < context.fanout.count; ++i) {
+        HANDLE_RESULT(sink_schedule(&context.fanout.sinks[i], ev_loop, config->http_flush) == -1,
+                      goto CLEANUP, "can't schedule HTTP batches of %s", context.fanout.sinks[i].name);
+    }
+    if(config->spool != NULL) {
+        struct itimerspec timeout;
+        timeout.it_interval.tv_sec = 0;
+        timeout.it_interval.tv_nsec = SINK_REPLAY_INTERVAL * 1000000L;
+        timeout.it_value = timeout.it_interval;
+        HANDLE_RESULT(create_timer(ev_loop, &timeout, &replay) == -1,
+                      goto CLEANUP, "can't create timer to replay the spool");
+    }
 
-    struct itimerspec timeout;
-    timeout.it_interval.tv_sec = 1;
-    timeout.it_interval.tv_nsec = 0;
-    timeout.it_value.tv_sec = 0;
-    timeout.it_value.tv_nsec = 1;
-    HANDLE_RESULT(create_timer(ev_loop, &timeout, &timer) == -1,
-                  goto CLEANUP, "can't create timer to query stats");
+    if(config->file != NULL) {
+        HANDLE_RESULT(watch_options(&context, &hangup, &watch) == -1,
+                      goto CLEANUP, "can't watch options file %s", config->file);
+    }
+
+    if(config->worker) {
+        HANDLE_RESULT(start_worker(&context) == -1, goto CLEANUP, NULL);
+    } else {
+        HANDLE_RESULT(worker_settle(&config->sched) == -1,
+                      goto CLEANUP, "can't move collection to its CPUs and priority");
+    }
 
     result = run_event_loop(ev_loop);
 
 CLEANUP:
-    HANDLE_POSIX_RESULT(close(timer.fd), (void)timer, "fd=%d: close: timer", timer.fd);
-    HANDLE_POSIX_RESULT(close(ev_loop), (void)ev_loop, "fd=%d: close: ev_loop", ev_loop);
-    HANDLE_POSIX_RESULT(close(context.sink), (void)context.sink, "fd=%d: close: sink", context.sink);
+    join_worker(&context);
+    if(context.stop.fd != -1) {
+        HANDLE_POSIX_RESULT(close(context.stop.fd), (void)context, "fd=%d: close: stop", context.stop.fd);
+    }
+    if(hangup.fd != -1) {
+        HANDLE_POSIX_RESULT(close(hangup.fd), (void)hangup, "fd=%d: close: signalfd", hangup.fd);
+    }
+    if(watch.fd != -1) {
+        HANDLE_POSIX_RESULT(close(watch.fd), (void)watch, "fd=%d: close: inotify", watch.fd);
+    }
+    if(context.collect_loop != -1 && context.collect_loop != ev_loop) {
+        HANDLE_POSIX_RESULT(close(context.collect_loop), (void)context,
+                            "fd=%d: close: collect_loop", context.collect_loop);
+    }
+    unschedule_collectors(context.collectors);
+    if(replay.fd != -1) {
+        HANDLE_POSIX_RESULT(close(replay.fd), (void)replay, "fd=%d: close: replay", replay.fd);
+    }
+    if(completions.fd != -1) {
+        HANDLE_POSIX_RESULT(close(completions.fd), (void)completions,
+                            "fd=%d: close: completions", completions.fd);
+    }
+    /* reads still in flight are cancelled before their sources go away */
+    uring_close(&context.uring);
+    /* the blocking drain of the HTTP queues left, with the event loop still open */
+    fanout_close(&context.fanout);
+    for(size_t i = 0; i < context.retirements; ++i) {
+        sink_close(&context.retired[i]);
+    }
+    free(context.retired);
+    if(ev_loop != -1) {
+        HANDLE_POSIX_RESULT(close(ev_loop), (void)ev_loop, "fd=%d: close: ev_loop", ev_loop);
+    }
+    worker_queue_destroy(&queue);
+    free(context.buf);
+    close_collectors(context.collectors);
+    series_registry_destroy(&context.series);
+    if(context.states.capacity != 0) {
+        state_table_destroy(&context.states);
+    }
+    if(context.loaded != NULL) {
+        options_free(context.loaded);
+        free(context.loaded);
+    }
 
     return result;
 }
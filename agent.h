@@ -1,6 +1,67 @@
 #ifndef AGENT_H_
 #define AGENT_H_
 
-int run_agent(const char *hostname, const char *remote, const char *service);
+#include <sys/types.h>
+
+#include "worker.h"
+
+struct agent_schedule {
+    const char *collector;
+    unsigned interval;      /* milliseconds, 0 turns the collector off */
+    int offset;             /* milliseconds into the interval, -1 to stagger automatically */
+};
+
+struct agent_config {
+    const char *hostname;
+    const char **remotes;   /* NULL terminated "host[:port]" sinks */
+    int shard;              /* split the series over the sinks instead of sending all to each */
+    const char *service;
+    int rate;               /* emit per-second rates instead of counters */
+    unsigned keyframe;      /* send only changed fields, everything every N ticks */
+    size_t state_capacity;  /* fields tracked across ticks by -r, -k and -a */
+    size_t payload;         /* maximum datagram payload */
+    int gso;                /* send datagrams with UDP GSO when supported */
+    const char **nic_include;   /* NULL terminated fnmatch(3) patterns, all links if empty */
+    const char **nic_exclude;
+    const char **disk_include;  /* NULL terminated fnmatch(3) patterns, all devices if empty */
+    const char **disk_exclude;  /* partitions, loop and RAM devices if empty */
+    const struct agent_schedule *schedules;    /* terminated by a NULL collector */
+    unsigned flush;         /* milliseconds, faster collectors are aggregated; 0 disables */
+    int percentile;         /* add p99 to the aggregates */
+    size_t aggregate_capacity;  /* fields per sample of an aggregated collector */
+    const char *spool;      /* ring file for batches the sink did not take, NULL disables */
+    size_t spool_size;      /* bytes */
+    size_t replay_rate;     /* bytes per second */
+    const char *proc_root;  /* collect from this copy of /proc, NULL for the live one */
+    const char *snapshots;  /* replay the snapshots in this directory, NULL to run live */
+    int uring;              /* batch the reads of a tick on an io_uring when available */
+    size_t process_top;     /* process groups reported */
+    int process_cgroup;     /* group processes by cgroup instead of name */
+    unsigned cgroup_depth;  /* levels of cgroups reported below the root */
+    const char **cgroup_include;    /* NULL terminated fnmatch(3) patterns of cgroup paths */
+    const char **cgroup_exclude;
+    const char **memory_include;    /* NULL terminated fnmatch(3) patterns, all meminfo fields if empty */
+    const char **vmstat_include;    /* paging and reclaim counters if empty */
+    const char *database;   /* send over HTTP /write into this database, NULL for UDP */
+    unsigned http_flush;    /* milliseconds between HTTP batches */
+    int gzip;               /* compress HTTP batches */
+    int irq_cells;          /* interrupts per CPU and interrupt rather than per interrupt */
+    const char **tags;      /* NULL terminated "key=value" added to every line */
+    int lock;               /* keep the memory of the agent locked in RAM */
+    struct worker_sched sched;  /* CPUs and priority of collection */
+    unsigned slack;         /* milliseconds, timers closer than this fire together */
+    int worker;             /* collect on a thread of its own, send from the main one */
+    const char *file;       /* options file reloaded on SIGHUP or when it changes, NULL without */
+    int argc;               /* command line the file is loaded with */
+    char **argv;
+};
+
+#define AGENT_STATE_CAPACITY 16384
+#define AGENT_STATE_LIMIT (1 << 26)     /* fields, 3 GiB of state */
+#define AGENT_INTERVAL 1000     /* milliseconds */
+#define AGENT_AGGREGATE_CAPACITY 4096
+#define AGENT_URING_ENTRIES 64
+
+int run_agent(const struct agent_config *config);
 
 #endif /* AGENT_H_ */
@@ -0,0 +1,159 @@
+#include "aggregate.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "error_handling.h"
+
+int aggregate_init(struct aggregate *agg, size_t capacity, size_t window, int percentile) {
+    assert(agg != NULL);
+    assert(capacity > 0);
+    assert(window > 1);
+
+    memset(agg, 0, sizeof(*agg));
+    agg->capacity = capacity;
+    agg->window = window;
+    agg->sample_keys = calloc(capacity, sizeof(*agg->sample_keys));
+    agg->sample = calloc(capacity, sizeof(*agg->sample));
+    agg->keys = calloc(capacity, sizeof(*agg->keys));
+    agg->min = calloc(capacity, sizeof(*agg->min));
+    agg->max = calloc(capacity, sizeof(*agg->max));
+    agg->sum = calloc(capacity, sizeof(*agg->sum));
+    agg->last = calloc(capacity, sizeof(*agg->last));
+    agg->n = calloc(capacity, sizeof(*agg->n));
+    HANDLE_RESULT(agg->sample_keys == NULL || agg->sample == NULL || agg->keys == NULL ||
+                  agg->min == NULL || agg->max == NULL || agg->sum == NULL ||
+                  agg->last == NULL || agg->n == NULL,
+                  goto FAIL, "aggregate_init: can't allocate %zu slots", capacity);
+    if(percentile) {
+        agg->history = calloc(window * capacity, sizeof(*agg->history));
+        agg->scratch = calloc(window + 1, sizeof(*agg->scratch));
+        HANDLE_RESULT(agg->history == NULL || agg->scratch == NULL,
+                      goto FAIL, "aggregate_init: can't allocate %zu x %zu history",
+                      window, capacity);
+    }
+    syslog(LOG_DEBUG, "aggregate with %zu slots over %zu samples allocated", capacity, window);
+    return 0;
+
+FAIL:
+    aggregate_destroy(agg);
+    return -1;
+}
+
+void aggregate_destroy(struct aggregate *agg) {
+    assert(agg != NULL);
+
+    free(agg->sample_keys);
+    free(agg->sample);
+    free(agg->keys);
+    free(agg->min);
+    free(agg->max);
+    free(agg->sum);
+    free(agg->last);
+    free(agg->n);
+    free(agg->history);
+    free(agg->scratch);
+    memset(agg, 0, sizeof(*agg));
+}
+
+/* slot of the value in the current sample, -1 when the sample is full */
+ssize_t aggregate_record(struct aggregate *agg, uint64_t key, double value) {
+    assert(agg != NULL);
+    assert(key != 0);
+
+    if(agg->count == agg->capacity) {
+        if(!agg->full) {
+            syslog(LOG_WARNING, "aggregate is full (%zu fields), the rest is sent unaggregated",
+                   agg->capacity);
+            agg->full = 1;
+        }
+        return -1;
+    }
+    agg->sample_keys[agg->count] = key;
+    agg->sample[agg->count] = value;
+    return agg->count++;
+}
+
+/* statistics of the slot including the current sample, which is not folded yet */
+void aggregate_stats(struct aggregate *agg, size_t slot, struct aggregate_stats *stats) {
+    assert(agg != NULL);
+    assert(slot < agg->count);
+    assert(stats != NULL);
+
+    double v = agg->sample[slot];
+    size_t n = 0;
+    stats->min = stats->max = stats->last = stats->p99 = v;
+    stats->mean = v;
+    if(agg->keys[slot] == agg->sample_keys[slot]) {
+        n = agg->n[slot];
+        stats->min = agg->min[slot] < v ? agg->min[slot] : v;
+        stats->max = agg->max[slot] > v ? agg->max[slot] : v;
+        stats->mean = (agg->sum[slot] + v) / (n + 1);
+    }
+    if(agg->history == NULL) return;
+
+    /* nearest rank over the last n rows and the current value */
+    if(n > agg->window) n = agg->window;
+    double *values = agg->scratch;
+    size_t count = 0;
+    for(size_t i = agg->samples - n; i < agg->samples; ++i) {
+        values[count++] = agg->history[(i % agg->window) * agg->capacity + slot];
+    }
+    values[count++] = v;
+    for(size_t i = 1; i < count; ++i) {
+        double x = values[i];
+        size_t j = i;
+        for(; j > 0 && values[j - 1] > x; --j) values[j] = values[j - 1];
+        values[j] = x;
+    }
+    stats->p99 = values[(99 * count + 99) / 100 - 1];
+}
+
+/* same fields as last time: branch free over parallel arrays, vectorized */
+void aggregate_fold_dense(size_t count, const double *restrict sample,
+                          double *restrict min, double *restrict max,
+                          double *restrict sum, double *restrict last,
+                          double *restrict n) {
+    for(size_t i = 0; i < count; ++i) {
+        double v = sample[i];
+        min[i] = v < min[i] ? v : min[i];
+        max[i] = v > max[i] ? v : max[i];
+        sum[i] += v;
+        last[i] = v;
+        n[i] += 1;
+    }
+}
+
+void aggregate_fold(struct aggregate *agg) {
+    assert(agg != NULL);
+
+    size_t count = agg->count;
+    if(memcmp(agg->keys, agg->sample_keys, count * sizeof(*agg->keys)) != 0) {
+        /* slots whose field changed start over */
+        for(size_t i = 0; i < count; ++i) {
+            if(agg->keys[i] != agg->sample_keys[i]) {
+                agg->keys[i] = agg->sample_keys[i];
+                agg->min[i] = agg->max[i] = agg->sample[i];
+                agg->sum[i] = agg->n[i] = 0;
+            }
+        }
+    }
+    aggregate_fold_dense(count, agg->sample, agg->min, agg->max, agg->sum, agg->last, agg->n);
+    if(agg->history != NULL) {
+        memcpy(&agg->history[(agg->samples % agg->window) * agg->capacity],
+               agg->sample, count * sizeof(*agg->sample));
+    }
+    ++agg->samples;
+    agg->count = 0;
+}
+
+/* starts a new window, every slot starts over with its next sample */
+void aggregate_reset(struct aggregate *agg) {
+    assert(agg != NULL);
+
+    memset(agg->keys, 0, agg->capacity * sizeof(*agg->keys));
+    agg->samples = 0;
+    agg->count = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Local aggregation of high frequency samples. A collector that samples
+ * faster than it flushes records the numeric fields of a sample into a dense
+ * vector, slot i holding the i-th field of the collection. After the sample
+ * the vector is folded into per-slot min/max/sum/last arrays; as long as the
+ * fields come in the same order as last time (the key vector is unchanged)
+ * the fold is a branch free loop over parallel arrays. A slot whose key
+ * changed starts over with the new field.
+ *
+ * With percentiles enabled every folded sample is also kept as a row of a
+ * window x capacity history matrix.
+ *
+ * All arrays are allocated once; fields beyond capacity are not aggregated.
+ */
+struct aggregate {
+    size_t capacity;        /* fields per sample */
+    size_t window;          /* samples per flush */
+    size_t count;           /* fields recorded in the current sample */
+    size_t samples;         /* samples folded since the last flush */
+    int full;               /* set once a sample did not fit */
+
+    uint64_t *sample_keys;  /* current sample */
+    double *sample;
+    uint64_t *keys;         /* folded samples, 0 marks an empty slot */
+    double *min;
+    double *max;
+    double *sum;
+    double *last;
+    double *n;
+    double *history;        /* window rows of capacity values, NULL without percentiles */
+    double *scratch;
+};
+
+struct aggregate_stats {
+    double min;
+    double max;
+    double mean;
+    double last;
+    double p99;
+};
+
+int aggregate_init(struct aggregate *agg, size_t capacity, size_t window, int percentile);
+void aggregate_destroy(struct aggregate *agg);
+ssize_t aggregate_record(struct aggregate *agg, uint64_t key, double value);
+void aggregate_stats(struct aggregate *agg, size_t slot, struct aggregate_stats *stats);
+void aggregate_fold(struct aggregate *agg);
+void aggregate_reset(struct aggregate *agg);
+
+#endif /* AGGREGATE_H_ */
@@ -0,0 +1,417 @@
+/*
+ * Benchmark of the influxdb_serialize_* functions against /proc fixtures.
+ *
+ *     bench OUTPUT FIXTURES...
+ *
+ * Every serializer runs over the files of every fixture directory, plain and
+ * in rate mode, with a writer, series registry and state table reused across
+ * calls like the agent does. A case is repeated in doubling batches until a batch takes
+ * BENCH_BATCH_NS; the last batch is reported as ns per call, input bytes per
+ * second, heap allocations and syscalls per call (malloc, calloc, realloc,
+ * pread and syscall are wrapped with -Wl,--wrap). A table goes to stdout and
+ * tab separated values to OUTPUT, one case per line, to be compared between
+ * commits.
+ *
+ * The read_sources case reads the files of all cases through the source
+ * layer, one after another with pread() (sync) and as one batch on an
+ * io_uring (uring); the latter is skipped when io_uring is not available.
+ *
+ * Rate mode serializes the same snapshot every second, so all deltas are
+ * zero: it measures the state table lookups, and /proc/stat CPU lines whose
+ * elapsed jiffies are zero are skipped as they would be by the agent.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "error_handling.h"
+#include "influxdb.h"
+#include "irq.h"
+#include "line_protocol.h"
+#include "netlink.h"
+#include "series.h"
+#include "source.h"
+#include "state.h"
+#include "uring.h"
+
+#define BENCH_BATCH_NS 200000000ULL
+#define BENCH_BUFFER_SIZE 65536
+#define BENCH_BUFFER_LIMIT (16 * 1024 * 1024)
+#define BENCH_STATE_CAPACITY 65536
+#define BENCH_HOSTNAME "bench-host.example.com"
+#define BENCH_URING_ENTRIES 64
+
+static uint64_t allocations;
+static uint64_t syscalls;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    ++allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    ++allocations;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    ++allocations;
+    return __real_realloc(ptr, size);
+}
+
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+long __real_syscall(long number, ...);
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    ++syscalls;
+    return __real_pread(fd, buf, count, offset);
+}
+
+/* io_uring has no libc wrappers, it is entered through syscall(2) */
+long __wrap_syscall(long number, ...) {
+    long args[6];
+    va_list ap;
+    va_start(ap, number);
+    for(int i = 0; i < 6; ++i) args[i] = va_arg(ap, long);
+    va_end(ap);
+    ++syscalls;
+    return __real_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+struct input {
+    char *buf;      /* content of the fixture */
+    size_t len;
+    struct netlink nl;      /* links parsed from the fixture */
+};
+
+struct bench_case {
+    const char *name;
+    const char *path;   /* relative to the fixture directory */
+    int (*parse)(struct input *input);
+    int (*run)(const struct input *input, const struct timespec *ts, struct lp_writer *w);
+};
+
+static const char *net_tags[] = {
+    "Ip", "Icmp", "IcmpMsg", "Tcp", "Udp", "TcpExt", "IpExt", NULL
+};
+
+int run_proc_stat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_proc_stat(input->buf, input->len, BENCH_HOSTNAME, ts, w);
+}
+
+int run_net_stat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_net_stat(input->buf, input->len, net_tags, BENCH_HOSTNAME, ts, w);
+}
+
+int run_softnet_stat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_softnet_stat(input->buf, input->len, BENCH_HOSTNAME, ts, w);
+}
+
+/* looked up on the first call, like in the agent */
+static struct influxdb_field_map meminfo_fields;
+static struct influxdb_field_map vmstat_fields;
+
+int run_memory_stat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_memory_stat(&meminfo_fields, input->buf, input->len,
+                                          BENCH_HOSTNAME, ts, w);
+}
+
+int run_vmstat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_vmstat(&vmstat_fields, input->buf, input->len, BENCH_HOSTNAME, ts, w);
+}
+
+static struct irq_matrix interrupts;
+static struct irq_matrix softirqs;
+
+/* the fixture does not change, the matrix is parsed but only the first call has deltas */
+int run_interrupts(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    if(irq_read(&interrupts, input->buf, input->len, ts) == -1) return -1;
+    return influxdb_serialize_irq_matrix(&interrupts, "interrupts", "irq", BENCH_HOSTNAME, ts, w);
+}
+
+int run_softirqs(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    if(irq_read(&softirqs, input->buf, input->len, ts) == -1) return -1;
+    return influxdb_serialize_irq_matrix(&softirqs, "softirqs", "softirq", BENCH_HOSTNAME, ts, w);
+}
+
+int run_disk_stat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_disk_stat(input->buf, input->len, NULL, NULL, BENCH_HOSTNAME, ts, w);
+}
+
+int run_nic_stat(const struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_nic_stat(input->nl.links, input->nl.count, BENCH_HOSTNAME, ts, w);
+}
+
+/* /proc/net/dev stands in for the RTM_GETSTATS replies */
+int parse_net_dev(struct input *input) {
+    assert(input != NULL);
+    assert(input->buf != NULL);
+
+    HANDLE_RESULT(netlink_parse_dev(&input->nl, input->buf, input->len) == -1, return -1,
+                  "parse_net_dev: netlink_parse_dev");
+    return 0;
+}
+
+static const struct bench_case cases[] = {
+    { "proc_stat", "stat", NULL, &run_proc_stat },
+    { "net_stat_snmp", "net/snmp", NULL, &run_net_stat },
+    { "net_stat_netstat", "net/netstat", NULL, &run_net_stat },
+    { "softnet_stat", "net/softnet_stat", NULL, &run_softnet_stat },
+    { "memory_stat", "meminfo", NULL, &run_memory_stat },
+    { "vmstat", "vmstat", NULL, &run_vmstat },
+    { "nic_stat", "net/dev", &parse_net_dev, &run_nic_stat },
+    { "disk_stat", "diskstats", NULL, &run_disk_stat },
+    { "interrupts", "interrupts", NULL, &run_interrupts },
+    { "softirqs", "softirqs", NULL, &run_softirqs },
+    { NULL, NULL, NULL, NULL }
+};
+
+int read_fixture(const char *path, struct input *input) {
+    assert(path != NULL);
+    assert(input != NULL);
+
+    FILE *f = fopen(path, "r");
+    HANDLE_RESULT(f == NULL, return -1, "read_fixture: can't open %s", path);
+    HANDLE_POSIX_RESULT(fseek(f, 0, SEEK_END), goto FAIL, "read_fixture: fseek(%s)", path);
+    long size = ftell(f);
+    HANDLE_POSIX_RESULT(size, goto FAIL, "read_fixture: ftell(%s)", path);
+    rewind(f);
+    input->buf = malloc(size + 1);
+    HANDLE_RESULT(input->buf == NULL, goto FAIL, "read_fixture: can't allocate %ld bytes", size);
+    input->len = fread(input->buf, 1, size, f);
+    input->buf[input->len] = 0;
+    fclose(f);
+    return 0;
+
+FAIL:
+    fclose(f);
+    return -1;
+}
+
+static inline uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+struct result {
+    uint64_t calls;
+    double ns;          /* per call */
+    double allocs;      /* per call */
+    double syscalls;    /* per call */
+    size_t output;      /* bytes per call */
+};
+
+int bench(const struct bench_case *c, const struct input *input, int rate,
+          char **buf, size_t *bufsize, struct result *result) {
+    assert(c != NULL);
+    assert(input != NULL);
+    assert(result != NULL);
+
+    struct series_registry series;
+    HANDLE_RESULT(series_registry_init(&series, SERIES_CAPACITY, SERIES_ARENA_SIZE, NULL) == -1,
+                  return -1, "bench: series_registry_init");
+    struct state_table state = { .capacity = 0 };
+    if(rate) {
+        HANDLE_RESULT(state_table_init(&state, BENCH_STATE_CAPACITY) == -1,
+                      series_registry_destroy(&series); return -1, "bench: state_table_init");
+    }
+
+    /* every call is a new sample a second after the previous one */
+    struct timespec ts = { .tv_sec = 1792196808, .tv_nsec = 123456789 };
+    int ok = 1;
+    for(uint64_t calls = 1;; calls *= 2) {
+        struct lp_writer w;
+        struct timespec start, end;
+        uint64_t before = allocations;
+        uint64_t entered = syscalls;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(uint64_t i = 0; i < calls; ++i) {
+            lp_writer_init(&w, *buf, *bufsize);
+            lp_writer_growable(&w, BENCH_BUFFER_LIMIT);
+            lp_writer_registry(&w, &series);
+            if(rate) {
+                lp_writer_state(&w, &state, &ts);
+                w.rate = 1;
+            }
+            ok &= c->run(input, &ts, &w) == 0;
+            if(rate) state_table_commit(&state);
+            *buf = w.buf;
+            *bufsize = w.size;
+            ++ts.tv_sec;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t ns = elapsed_ns(&start, &end);
+        if(ns >= BENCH_BATCH_NS) {
+            result->calls = calls;
+            result->ns = (double)ns / calls;
+            result->allocs = (double)(allocations - before) / calls;
+            result->syscalls = (double)(syscalls - entered) / calls;
+            result->output = w.len;
+            break;
+        }
+    }
+    if(rate) state_table_destroy(&state);
+    series_registry_destroy(&series);
+    HANDLE_RESULT(!ok, return -1, "bench: %s failed", c->name);
+    return 0;
+}
+
+/* one read of every source, synchronously or as a batch on the ring */
+int read_sources(struct source *sources, size_t count, struct uring *ring) {
+    assert(sources != NULL);
+
+    if(ring != NULL) {
+        for(size_t i = 0; i < count; ++i) {
+            HANDLE_RESULT(source_submit(&sources[i], ring, i) == -1, return -1,
+                          "read_sources(%s): source_submit", sources[i].path);
+        }
+        HANDLE_RESULT(uring_wait(ring, count) == -1, return -1, "read_sources: uring_wait");
+        uint64_t data;
+        int32_t res;
+        while(uring_reap(ring, &data, &res)) {
+            source_complete(&sources[data], res);
+        }
+    }
+    /* takes the completed reads, or reads what did not complete */
+    for(size_t i = 0; i < count; ++i) {
+        HANDLE_RESULT(source_read(&sources[i]) == -1, return -1,
+                      "read_sources(%s): source_read", sources[i].path);
+    }
+    return 0;
+}
+
+int bench_read(const char *dir, struct uring *ring, size_t *input, struct result *result) {
+    assert(dir != NULL);
+    assert(input != NULL);
+    assert(result != NULL);
+
+    int ok = 0;
+    size_t count = 0;
+    struct source sources[sizeof(cases) / sizeof(cases[0])];
+    for(const struct bench_case *c = cases; c->name != NULL; ++c) {
+        int opened = source_open(&sources[count++], dir, c->path);
+        HANDLE_RESULT(opened == -1, goto CLEANUP, "bench_read: source_open(%s/%s)", dir, c->path);
+    }
+    /* buffers grow to the size of the files first */
+    HANDLE_RESULT(read_sources(sources, count, NULL) == -1, goto CLEANUP, "bench_read: read_sources");
+    *input = 0;
+    for(size_t i = 0; i < count; ++i) *input += sources[i].len;
+
+    for(uint64_t calls = 1;; calls *= 2) {
+        struct timespec start, end;
+        uint64_t before = allocations;
+        uint64_t entered = syscalls;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(uint64_t i = 0; i < calls; ++i) {
+            HANDLE_RESULT(read_sources(sources, count, ring) == -1, goto CLEANUP,
+                          "bench_read: read_sources");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t ns = elapsed_ns(&start, &end);
+        if(ns >= BENCH_BATCH_NS) {
+            result->calls = calls;
+            result->ns = (double)ns / calls;
+            result->allocs = (double)(allocations - before) / calls;
+            result->syscalls = (double)(syscalls - entered) / calls;
+            result->output = 0;
+            break;
+        }
+    }
+    ok = 1;
+
+CLEANUP:
+    for(size_t i = 0; i < count; ++i) source_close(&sources[i]);
+    return ok ? 0 : -1;
+}
+
+void report(FILE *out, const char *fixture, const char *name, const char *mode,
+            size_t input, const struct result *r) {
+    double throughput = input * 1e9 / r->ns;
+    printf("%-8s %-18s %-5s %12.0f %12.1f %10zu %10zu %8.2f %8.2f\n",
+           fixture, name, mode, r->ns, throughput / (1024 * 1024), input, r->output,
+           r->allocs, r->syscalls);
+    fprintf(out, "%s\t%s\t%s\t%" PRIu64 "\t%.1f\t%zu\t%zu\t%.0f\t%.3f\t%.3f\n",
+            fixture, name, mode, r->calls, r->ns, input, r->output, throughput,
+            r->allocs, r->syscalls);
+}
+
+int main(int argc, char **argv) {
+    openlog(basename(argv[0]), LOG_NDELAY | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_INFO));
+    if(argc < 3) {
+        fprintf(stderr, "usage: %s OUTPUT FIXTURES...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_FAILURE;
+    size_t bufsize = BENCH_BUFFER_SIZE;
+    char *buf = malloc(bufsize);
+    FILE *out = fopen(argv[1], "w");
+    struct uring ring = { .fd = -1 };
+    HANDLE_RESULT(buf == NULL, goto CLEANUP, "can't allocate output buffer");
+    HANDLE_RESULT(out == NULL, goto CLEANUP, "can't open %s", argv[1]);
+    if(uring_open(&ring, BENCH_URING_ENTRIES) == -1) {
+        syslog(LOG_WARNING, "io_uring not available, read_sources runs synchronously only");
+    }
+
+    fprintf(out, "fixture\tcase\tmode\tcalls\tns_per_call\tinput_bytes\toutput_bytes"
+                 "\tbytes_per_second\tallocs_per_call\tsyscalls_per_call\n");
+    printf("%-8s %-18s %-5s %12s %12s %10s %10s %8s %8s\n",
+           "fixture", "case", "mode", "ns/call", "MB/s", "in", "out", "allocs", "syscalls");
+    for(int i = 2; i < argc; ++i) {
+        char *dir = argv[i];
+        const char *fixture = basename(strdupa(dir));
+        for(const struct bench_case *c = cases; c->name != NULL; ++c) {
+            struct input input = { .buf = NULL, .len = 0 };
+            HANDLE_RESULT(netlink_init(&input.nl, NULL, NULL) == -1, goto CLEANUP,
+                          "can't allocate links");
+            if(c->path != NULL) {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s/%s", dir, c->path);
+                HANDLE_RESULT(read_fixture(path, &input) == -1, goto CLEANUP,
+                              "can't read fixture %s", path);
+            }
+            if(c->parse != NULL) {
+                HANDLE_RESULT(c->parse(&input) == -1, goto NEXT_CASE,
+                              "can't parse fixture %s/%s", dir, c->path);
+            }
+            for(int rate = 0; rate <= 1; ++rate) {
+                struct result r;
+                HANDLE_RESULT(bench(c, &input, rate, &buf, &bufsize, &r) == -1, goto NEXT_CASE,
+                              "%s/%s failed", fixture, c->name);
+                report(out, fixture, c->name, rate ? "rate" : "plain", input.len, &r);
+            }
+NEXT_CASE:
+            free(input.buf);
+            netlink_close(&input.nl);
+        }
+        for(int batched = 0; batched <= 1; ++batched) {
+            if(batched && ring.fd == -1) continue;
+            struct result r;
+            size_t input = 0;
+            HANDLE_RESULT(bench_read(dir, batched ? &ring : NULL, &input, &r) == -1, goto NEXT_READ,
+                          "%s/read_sources failed", fixture);
+            report(out, fixture, "read_sources", batched ? "uring" : "sync", input, &r);
+NEXT_READ:
+            ;
+        }
+    }
+    result = EXIT_SUCCESS;
+
+CLEANUP:
+    uring_close(&ring);
+    if(out != NULL) fclose(out);
+    free(buf);
+    return result;
+}
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""Synthetic /proc snapshots shaped like a small (4 CPUs, 64 IRQs) and a
+large (256 CPUs, 600 IRQs) host, used by `make bench`. The output is
+deterministic, every run writes the same files."""
+import os, random, sys
+
+def write(root, name, text):
+    path = os.path.join(root, name)
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "w") as f:
+        f.write(text)
+
+def gen(root, ncpu, nirq, seed):
+    rnd = random.Random(seed)
+    big = lambda: rnd.randrange(0, 1 << 40)
+    small = lambda: rnd.choice([0, 0, 0, rnd.randrange(0, 1 << 20)])
+    # /proc/stat
+    lines = []
+    cols = lambda: " ".join(str(rnd.randrange(0, 1 << 32)) for _ in range(10))
+    lines.append("cpu  " + cols())
+    for c in range(ncpu):
+        lines.append("cpu%d %s" % (c, cols()))
+    irqs = [small() for _ in range(nirq)]
+    lines.append("intr %d %s" % (sum(irqs), " ".join(map(str, irqs))))
+    lines.append("ctxt %d" % big())
+    lines.append("btime 1792196808")
+    lines.append("processes %d" % rnd.randrange(1 << 20))
+    lines.append("procs_running 2")
+    lines.append("procs_blocked 0")
+    sirq = [big() for _ in range(10)]
+    lines.append("softirq %d %s" % (sum(sirq), " ".join(map(str, sirq))))
+    write(root, "stat", "\n".join(lines) + "\n")
+    # /proc/net/snmp and /proc/net/netstat
+    def kv(groups):
+        out = []
+        for tag, n in groups:
+            names = ["%s%d" % (tag.lower(), i) for i in range(n)]
+            out.append("%s: %s" % (tag, " ".join(names)))
+            out.append("%s: %s" % (tag, " ".join(str(small()) for _ in names)))
+        return "\n".join(out) + "\n"
+    write(root, "net/snmp", kv([("Ip", 20), ("Icmp", 29), ("IcmpMsg", 4),
+                                ("Tcp", 15), ("Udp", 9), ("UdpLite", 9)]))
+    write(root, "net/netstat", kv([("TcpExt", 120), ("IpExt", 18), ("MPTcpExt", 40)]))
+    # /proc/net/softnet_stat
+    write(root, "net/softnet_stat", "".join(
+        " ".join("%08x" % (rnd.randrange(1 << 32) if i < 3 else 0) for i in range(11))
+        + " %08x %08x\n" % (0, c) for c in range(ncpu)))
+    # /proc/net/dev
+    dev = ["Inter-|   Receive                                                |  Transmit",
+           " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed"]
+    for name in ["lo", "eth0", "eth1"] + ["veth%d" % i for i in range(ncpu // 4)]:
+        dev.append("%6s: %s" % (name, " ".join(str(big()) for _ in range(16))))
+    write(root, "net/dev", "\n".join(dev) + "\n")
+    # /proc/interrupts and /proc/softirqs
+    hdr = " " * 11 + "".join("CPU%-8d" % c for c in range(ncpu))
+    body = [hdr]
+    for i in range(nirq):
+        body.append("%4d: %s  PCI-MSIX-0000:00:01.0 %d-edge      dev%d" % (
+            i, " ".join("%10d" % small() for _ in range(ncpu)), i, i))
+    for name in ["NMI", "LOC", "RES", "CAL", "TLB"]:
+        body.append("%4s: %s   %s" % (name, " ".join("%10d" % small() for _ in range(ncpu)), name))
+    body.append(" ERR:          0")
+    body.append(" MIS:          0")
+    write(root, "interrupts", "\n".join(body) + "\n")
+    sirqs = ["HI", "TIMER", "NET_TX", "NET_RX", "BLOCK", "IRQ_POLL", "TASKLET", "SCHED", "HRTIMER", "RCU"]
+    write(root, "softirqs", "\n".join(["       " + "".join("CPU%-8d" % c for c in range(ncpu))] +
+        ["%12s: %s" % (n + "", " ".join("%10d" % small() for _ in range(ncpu))) for n in sirqs]) + "\n")
+    # /proc/diskstats
+    disks = []
+    for i in range(8):
+        disks.append((7, i, "loop%d" % i))
+    for n in range(max(1, ncpu // 16)):
+        disks.append((259, n * 2, "nvme%dn1" % n))
+        disks.append((259, n * 2 + 1, "nvme%dn1p1" % n))
+    disks.append((8, 0, "sda"))
+    disks.append((8, 1, "sda1"))
+    write(root, "diskstats", "".join("%4d %7d %s %s\n" % (ma, mi, name, " ".join(str(small()) for _ in range(17)))
+                                     for ma, mi, name in disks))
+    # /proc/meminfo and /proc/vmstat
+    mem = ["MemTotal", "MemFree", "MemAvailable", "Buffers", "Cached", "SwapCached", "Active",
+           "Inactive", "Active(anon)", "Inactive(anon)", "Active(file)", "Inactive(file)",
+           "Unevictable", "Mlocked", "SwapTotal", "SwapFree", "Zswap", "Zswapped", "Dirty",
+           "Writeback", "AnonPages", "Mapped", "Shmem", "KReclaimable", "Slab", "SReclaimable",
+           "SUnreclaim", "KernelStack", "PageTables", "SecPageTables", "NFS_Unstable", "Bounce",
+           "WritebackTmp", "CommitLimit", "Committed_AS", "VmallocTotal", "VmallocUsed",
+           "VmallocChunk", "Percpu", "HardwareCorrupted", "AnonHugePages", "ShmemHugePages",
+           "ShmemPmdMapped", "FileHugePages", "FilePmdMapped", "Unaccepted"]
+    out = ["%-16s%8d kB" % (m + ":", rnd.randrange(1 << 30)) for m in mem]
+    out += ["HugePages_Total:       0", "HugePages_Free:        0", "HugePages_Rsvd:        0",
+            "HugePages_Surp:        0", "Hugepagesize:       2048 kB", "Hugetlb:               0 kB",
+            "DirectMap4k:      %8d kB" % rnd.randrange(1 << 20), "DirectMap2M:    %8d kB" % rnd.randrange(1 << 24)]
+    write(root, "meminfo", "\n".join(out) + "\n")
+    vm = ["nr_free_pages", "nr_zone_inactive_anon", "nr_zone_active_anon", "nr_zone_inactive_file",
+          "nr_zone_active_file", "nr_dirty", "nr_writeback", "pgpgin", "pgpgout", "pswpin", "pswpout",
+          "pgalloc_normal", "pgfree", "pgfault", "pgmajfault", "pgsteal_kswapd", "pgsteal_direct",
+          "pgscan_kswapd", "pgscan_direct", "oom_kill", "allocstall_normal", "compact_stall"]
+    vm += ["nr_vmstat_counter_%d" % i for i in range(200)]
+    write(root, "vmstat", "".join("%s %d\n" % (v, big()) for v in vm))
+
+if __name__ == "__main__":
+    out = sys.argv[1] if len(sys.argv) > 1 else "fixtures"
+    gen(os.path.join(out, "small"), 4, 64, 4)
+    gen(os.path.join(out, "large"), 256, 600, 256)
@@ -0,0 +1,314 @@
+#include "cgroup.h"
+
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+
+#define CGROUP_EVENTS_SIZE 4096
+#define CGROUP_DIRENTS_SIZE 4096
+#define CGROUP_WATCH (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const char *cgroup_files[CGROUP_FILES] = {
+    "cpu.stat", "memory.stat", "memory.pressure", "io.stat"
+};
+
+int cgroup_select(const struct cgroup_tree *tree, const char *path) {
+    assert(tree != NULL);
+    assert(path != NULL);
+
+    if(tree->include != NULL && *tree->include != NULL) {
+        const char **pattern = tree->include;
+        while(*pattern != NULL && fnmatch(*pattern, path, 0) != 0) ++pattern;
+        if(*pattern == NULL) return 0;
+    }
+    for(const char **pattern = tree->exclude; pattern != NULL && *pattern != NULL; ++pattern) {
+        if(fnmatch(*pattern, path, 0) == 0) return 0;
+    }
+    return 1;
+}
+
+/* path of a file of the group relative to the root, "" for the group itself */
+void cgroup_path(char *buf, size_t size, const char *path, const char *name) {
+    assert(buf != NULL);
+    assert(path != NULL);
+    assert(name != NULL);
+
+    const char *relative = path[1] != 0 ? path + 1 : ".";
+    if(*name == 0) {
+        snprintf(buf, size, "%s", relative);
+    } else {
+        snprintf(buf, size, "%s/%s", relative, name);
+    }
+}
+
+void cgroup_release(struct cgroup_tree *tree, struct cgroup *cgroup) {
+    assert(tree != NULL);
+    assert(cgroup != NULL);
+
+    for(int i = 0; i < CGROUP_FILES; ++i) {
+        if(cgroup->fds[i] == -1) continue;
+        HANDLE_POSIX_RESULT(close(cgroup->fds[i]), (void)cgroup,
+                            "fd=%d: close: cgroup %s", cgroup->fds[i], cgroup->path);
+        cgroup->fds[i] = -1;
+    }
+    /* the watch of a removed directory is gone already */
+    if(cgroup->wd != -1) inotify_rm_watch(tree->inotify, cgroup->wd);
+    cgroup->wd = -1;
+}
+
+/* drops the group at path and the groups below it */
+void cgroup_remove(struct cgroup_tree *tree, const char *path) {
+    assert(tree != NULL);
+    assert(path != NULL);
+
+    size_t len = strlen(path);
+    for(size_t i = 0; i < tree->count;) {
+        struct cgroup *cgroup = &tree->cgroups[i];
+        if(strncmp(cgroup->path, path, len) != 0 ||
+           (cgroup->path[len] != 0 && cgroup->path[len] != '/')) {
+            ++i;
+            continue;
+        }
+        syslog(LOG_DEBUG, "cgroup %s removed", cgroup->path);
+        cgroup_release(tree, cgroup);
+        *cgroup = tree->cgroups[--tree->count];
+    }
+}
+
+struct cgroup *cgroup_find(struct cgroup_tree *tree, const char *path) {
+    assert(tree != NULL);
+    assert(path != NULL);
+
+    for(struct cgroup *cgroup = tree->cgroups; cgroup < tree->cgroups + tree->count; ++cgroup) {
+        if(strcmp(cgroup->path, path) == 0) return cgroup;
+    }
+    return NULL;
+}
+
+/* tracks the group at path and the groups below it down to the depth limit */
+int cgroup_walk(struct cgroup_tree *tree, const char *path, unsigned depth) {
+    assert(tree != NULL);
+    assert(path != NULL);
+
+    /* a group created while its parent is listed is also reported by inotify */
+    if(cgroup_find(tree, path) != NULL) return 0;
+    if(tree->count == CGROUP_CAPACITY) {
+        if(!tree->full) syslog(LOG_WARNING, "more than %d cgroups, %s and others are ignored",
+                               CGROUP_CAPACITY, path);
+        tree->full = 1;
+        return 0;
+    }
+    size_t len = strlen(path);
+    if(len >= CGROUP_PATH_SIZE) {
+        syslog(LOG_WARNING, "cgroup %s ignored, its path is longer than %d bytes",
+               path, CGROUP_PATH_SIZE - 1);
+        return 0;
+    }
+
+    struct cgroup *cgroup = &tree->cgroups[tree->count];
+    memset(cgroup, 0, sizeof(*cgroup));
+    cgroup->wd = -1;
+    for(int i = 0; i < CGROUP_FILES; ++i) cgroup->fds[i] = -1;
+    cgroup->depth = depth;
+    memcpy(cgroup->path, path, len + 1);
+    cgroup->selected = cgroup_select(tree, path);
+    ++tree->count;
+    if(depth >= tree->depth) return 0;
+
+    /* watched before it is listed, so that no group created meanwhile is missed */
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s%s", tree->root, path);
+    cgroup->wd = inotify_add_watch(tree->inotify, buf, CGROUP_WATCH);
+    if(cgroup->wd == -1) {
+        /* removed since it was reported */
+        HANDLE_RESULT(errno != ENOENT, (void)cgroup, "cgroup_walk: inotify_add_watch(%s)", buf);
+        return 0;
+    }
+    cgroup_path(buf, sizeof(buf), path, "");
+    int fd = openat(tree->dir, buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) return 0;
+    /* getdents64(2) rather than readdir(3), whose DIR is allocated */
+    char dirents[CGROUP_DIRENTS_SIZE] __attribute__((aligned(__alignof__(struct linux_dirent64))));
+    int result = 0;
+    while(result == 0) {
+        /* fails when the group was removed since it was opened */
+        long r = syscall(SYS_getdents64, fd, dirents, sizeof(dirents));
+        if(r <= 0) break;
+        for(long offset = 0; result == 0 && offset < r;) {
+            const struct linux_dirent64 *entry = (const struct linux_dirent64 *)(dirents + offset);
+            offset += entry->d_reclen;
+            if(entry->d_type != DT_DIR || strcmp(entry->d_name, ".") == 0 ||
+               strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            snprintf(buf, sizeof(buf), "%s/%s", len > 1 ? path : "", entry->d_name);
+            result = cgroup_walk(tree, buf, depth + 1);
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/* forgets all groups and walks the hierarchy again */
+int cgroup_rescan(struct cgroup_tree *tree) {
+    assert(tree != NULL);
+
+    for(size_t i = 0; i < tree->count; ++i) cgroup_release(tree, &tree->cgroups[i]);
+    tree->count = 0;
+    tree->full = 0;
+    HANDLE_RESULT(cgroup_walk(tree, "/", 0) == -1, return -1, "cgroup_rescan: cgroup_walk");
+    syslog(LOG_DEBUG, "%zu cgroups under %s", tree->count, tree->root);
+    return 0;
+}
+
+/* applies the pending inotify events */
+int cgroup_update(struct cgroup_tree *tree) {
+    assert(tree != NULL);
+    assert(tree->inotify != -1);
+
+    char buf[CGROUP_EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        ssize_t r = read(tree->inotify, buf, sizeof(buf));
+        if(r == -1 && errno == EAGAIN) return 0;
+        HANDLE_POSIX_RESULT(r, return -1, "fd=%d: cgroup_update: read", tree->inotify);
+
+        const struct inotify_event *event;
+        for(char *p = buf; p < buf + r; p += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if(event->mask & IN_Q_OVERFLOW) {
+                syslog(LOG_WARNING, "cgroup events overflowed, walking %s again", tree->root);
+                HANDLE_RESULT(cgroup_rescan(tree) == -1, return -1, "cgroup_update: cgroup_rescan");
+                continue;
+            }
+            if(!(event->mask & IN_ISDIR) || event->len == 0) continue;
+            struct cgroup *parent = tree->cgroups;
+            while(parent < tree->cgroups + tree->count && parent->wd != event->wd) ++parent;
+            if(parent == tree->cgroups + tree->count) continue;
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", parent->path[1] != 0 ? parent->path : "",
+                     event->name);
+            if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                cgroup_remove(tree, path);
+            } else if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                syslog(LOG_DEBUG, "cgroup %s created", path);
+                HANDLE_RESULT(cgroup_walk(tree, path, parent->depth + 1) == -1,
+                              return -1, "cgroup_update: cgroup_walk(%s)", path);
+            }
+        }
+    }
+}
+
+/* reads the stat files of the group into the files of the tree */
+void cgroup_read(struct cgroup_tree *tree, struct cgroup *cgroup, uint64_t tick) {
+    assert(tree != NULL);
+    assert(cgroup != NULL);
+
+    int retry = tick >= cgroup->retry;
+    int missing = 0;
+    for(int i = 0; i < CGROUP_FILES; ++i) {
+        tree->lens[i] = 0;
+        if(cgroup->fds[i] == -1) {
+            if(!retry) continue;
+            char path[PATH_MAX];
+            cgroup_path(path, sizeof(path), cgroup->path, cgroup_files[i]);
+            cgroup->fds[i] = openat(tree->dir, path, O_RDONLY | O_CLOEXEC);
+            if(cgroup->fds[i] == -1) {
+                missing = 1;
+                continue;
+            }
+        }
+        /* fails once the group is removed, until its event is handled */
+        ssize_t r = pread(cgroup->fds[i], tree->files[i], sizeof(tree->files[i]) - 1, 0);
+        if(r == -1) {
+            close(cgroup->fds[i]);
+            cgroup->fds[i] = -1;
+            missing = 1;
+            continue;
+        }
+        tree->files[i][r] = 0;
+        tree->lens[i] = r;
+    }
+    if(missing && retry) cgroup->retry = tick + CGROUP_RETRY;
+}
+
+int cgroup_open(struct cgroup_tree *tree, unsigned depth,
+                const char **include, const char **exclude) {
+    assert(tree != NULL);
+
+    memset(tree, 0, sizeof(*tree));
+    tree->dir = tree->inotify = -1;
+    tree->depth = depth;
+    tree->include = include;
+    tree->exclude = exclude;
+
+    /* cgroup.controllers only exists in a v2 hierarchy */
+    static const char *roots[] = { CGROUP_ROOT, CGROUP_ROOT "/unified", NULL };
+    const char **root = roots;
+    char path[PATH_MAX];
+    for(; *root != NULL; ++root) {
+        snprintf(path, sizeof(path), "%s/cgroup.controllers", *root);
+        if(access(path, F_OK) == 0) break;
+    }
+    if(*root == NULL) {
+        syslog(LOG_WARNING, "no cgroup v2 hierarchy under %s, cgroups are not reported", CGROUP_ROOT);
+        return 0;
+    }
+    tree->root = strdup(*root);
+    tree->cgroups = calloc(CGROUP_CAPACITY, sizeof(*tree->cgroups));
+    HANDLE_RESULT(tree->root == NULL || tree->cgroups == NULL, goto FAIL,
+                  "cgroup_open: can't allocate %d groups", CGROUP_CAPACITY);
+    HANDLE_POSIX_RESULT(tree->dir = open(tree->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                        goto FAIL, "cgroup_open: open(%s)", tree->root);
+    HANDLE_POSIX_RESULT(tree->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+                        goto FAIL, "cgroup_open: inotify_init1");
+    HANDLE_RESULT(cgroup_rescan(tree) == -1, goto FAIL, "cgroup_open: cgroup_rescan");
+    syslog(LOG_DEBUG, "fd=%d: watching cgroups under %s down to depth %u",
+           tree->inotify, tree->root, depth);
+    return 0;
+
+FAIL:
+    cgroup_close(tree);
+    return -1;
+}
+
+void cgroup_close(struct cgroup_tree *tree) {
+    assert(tree != NULL);
+
+    for(size_t i = 0; i < tree->count; ++i) cgroup_release(tree, &tree->cgroups[i]);
+    if(tree->inotify != -1) {
+        HANDLE_POSIX_RESULT(close(tree->inotify), (void)tree,
+                            "fd=%d: close: cgroup inotify", tree->inotify);
+    }
+    if(tree->dir != -1) {
+        HANDLE_POSIX_RESULT(close(tree->dir), (void)tree, "fd=%d: close: cgroup", tree->dir);
+    }
+    free(tree->cgroups);
+    free(tree->root);
+    tree->cgroups = NULL;
+    tree->root = NULL;
+    tree->count = 0;
+    tree->dir = tree->inotify = -1;
+}
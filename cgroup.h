@@ -0,0 +1,71 @@
+#ifndef CGROUP_H_
+#define CGROUP_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Statistics of cgroup v2 groups: cpu.stat, memory.stat, memory.pressure
+ * and io.stat of every group down to a depth below the root.
+ *
+ * The hierarchy is walked once when opened; after that groups are found
+ * through inotify watches on the directories above the depth limit, which
+ * report the mkdir(2), rmdir(2) and rename(2) of groups. The inotify
+ * descriptor is polled by the event loop, so a tick only reads the stat
+ * files, which are kept open. A file is missing when its controller is not
+ * enabled for the group; opening it again is tried every CGROUP_RETRY
+ * ticks since enabling a controller is not reported by inotify. When the
+ * event queue overflows the hierarchy is walked again.
+ *
+ * Groups are tracked whether or not they pass the patterns, only the ones
+ * that do are reported. The table of groups, paths included, is allocated
+ * when the tree is opened, so groups coming and going don't allocate.
+ */
+#define CGROUP_ROOT "/sys/fs/cgroup"    /* or its unified/ on hybrid hosts */
+#define CGROUP_DEPTH 2
+#define CGROUP_CAPACITY 4096    /* groups tracked, more are ignored */
+#define CGROUP_PATH_SIZE 256    /* groups with longer paths are ignored */
+#define CGROUP_RETRY 60         /* ticks */
+#define CGROUP_FILE_SIZE 8192
+
+enum cgroup_file {
+    CGROUP_CPU,         /* cpu.stat */
+    CGROUP_MEMORY,      /* memory.stat */
+    CGROUP_PRESSURE,    /* memory.pressure */
+    CGROUP_IO,          /* io.stat */
+    CGROUP_FILES
+};
+
+struct cgroup {
+    char path[CGROUP_PATH_SIZE];    /* relative to the root, "/" for the root itself */
+    unsigned depth;
+    int wd;                 /* inotify watch, -1 below the depth limit */
+    int selected;           /* passes the patterns */
+    int fds[CGROUP_FILES];  /* -1 when missing */
+    uint64_t retry;         /* tick to open missing files again */
+};
+
+struct cgroup_tree {
+    char *root;             /* mount point of the v2 hierarchy, NULL when there is none */
+    int dir;
+    int inotify;
+    unsigned depth;
+    const char **include;   /* NULL terminated fnmatch(3) patterns of the paths */
+    const char **exclude;
+
+    struct cgroup *cgroups; /* CGROUP_CAPACITY */
+    size_t count;
+    int full;               /* warned about untracked groups */
+
+    char files[CGROUP_FILES][CGROUP_FILE_SIZE];   /* content of the last group read */
+    size_t lens[CGROUP_FILES];                    /* 0 when missing */
+};
+
+int cgroup_open(struct cgroup_tree *tree, unsigned depth,
+                const char **include, const char **exclude);
+int cgroup_update(struct cgroup_tree *tree);
+void cgroup_read(struct cgroup_tree *tree, struct cgroup *cgroup, uint64_t tick);
+void cgroup_close(struct cgroup_tree *tree);
+
+#endif /* CGROUP_H_ */
@@ -75,15 +75,28 @@ FAIL:
 }
 
 
+static inline int handle_one(struct event_handler *ev) {
+    //        syslog(LOG_DEBUG, "fd=%d: handling event", ev->fd);
+    int r = (*ev->handler)(ev->fd, ev->data);
+    syslog(LOG_DEBUG, "fd=%d: event handled, result=%d", ev->fd, r);
+    return r;
+}
+
 int handle_event(struct epoll_event *events, int eventslen) {
     assert(events != NULL);
     int result = 0;
+    int last = 0;
     for(int i = 0; i < eventslen; ++i) {
         struct event_handler *ev = (struct event_handler*)events[i].data.ptr;
-        //        syslog(LOG_DEBUG, "fd=%d: handling event", ev->fd);
-        int r = (*ev->handler)(ev->fd, ev->data);
-        syslog(LOG_DEBUG, "fd=%d: event handled, result=%d", ev->fd, r);
-        if(r == -1) result = r;
+        if(ev->last) {
+            /* moved ahead into the slots already handled */
+            events[last++] = events[i];
+            continue;
+        }
+        if(handle_one(ev) == -1) result = -1;
+    }
+    for(int i = 0; i < last; ++i) {
+        if(handle_one((struct event_handler*)events[i].data.ptr) == -1) result = -1;
     }
     return result;
 }
@@ -8,11 +8,13 @@ struct event_handler {
     int fd;
     void *data;
     int (*handler)(int fd, void *data);
+    int last;   /* handled after the other events of its batch, as it may close them */
 };
 
 int run_event_loop(int ev_loop);
 
 int create_event_loop();
+int register_event(int ev_loop, int events, struct event_handler *ev);
 int create_event(int ev_loop, uint64_t value, struct event_handler *ev);
 int create_timer(int ev_loop, const struct itimerspec *timeout, struct event_handler *ev);
 
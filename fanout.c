@@ -0,0 +1,225 @@
+#include "fanout.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "error_handling.h"
+#include "scanner.h"
+#include "state.h"
+
+/* FNV-1a spreads names that only differ at the end poorly, the hash is mixed further */
+static inline uint64_t fanout_hash(const char *buf, size_t len) {
+    uint64_t h = state_hash(STATE_HASH_SEED, buf, len);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+int fanout_compare(const void *a, const void *b) {
+    const struct fanout_node *x = a;
+    const struct fanout_node *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+int fanout_open(struct fanout *fanout, size_t count, int shard) {
+    assert(fanout != NULL);
+    assert(count > 0);
+
+    memset(fanout, 0, sizeof(*fanout));
+    fanout->count = count;
+    fanout->shard = shard;
+    fanout->sinks = calloc(count, sizeof(*fanout->sinks));
+    fanout->shards = calloc(count, sizeof(*fanout->shards));
+    fanout->available = calloc(count, sizeof(*fanout->available));
+    fanout->stats = calloc(count, sizeof(*fanout->stats));
+    HANDLE_RESULT(fanout->sinks == NULL || fanout->shards == NULL || fanout->available == NULL ||
+                  fanout->stats == NULL,
+                  goto FAIL, "fanout_open: can't allocate %zu sinks", count);
+    for(size_t i = 0; i < count; ++i) {
+        fanout->sinks[i].fd = -1;
+        fanout->available[i] = 1;
+        fanout->stats[i].available = 1;
+    }
+    return 0;
+
+FAIL:
+    fanout_close(fanout);
+    return -1;
+}
+
+/* places the sinks on the ring by their names, once they are open */
+int fanout_ring(struct fanout *fanout) {
+    assert(fanout != NULL);
+    assert(fanout->ring == NULL);
+
+    if(!fanout->shard) return 0;
+    fanout->ring = malloc(fanout->count * FANOUT_REPLICAS * sizeof(*fanout->ring));
+    HANDLE_RESULT(fanout->ring == NULL, return -1, "fanout_ring: can't allocate hash ring");
+    for(size_t i = 0; i < fanout->count; ++i) {
+        for(size_t r = 0; r < FANOUT_REPLICAS; ++r) {
+            char point[sizeof(fanout->sinks[i].name) + 8];
+            int len = snprintf(point, sizeof(point), "%s#%zu", fanout->sinks[i].name, r);
+            struct fanout_node *node = &fanout->ring[fanout->nodes++];
+            node->hash = fanout_hash(point, len);
+            node->sink = i;
+        }
+    }
+    qsort(fanout->ring, fanout->nodes, sizeof(*fanout->ring), &fanout_compare);
+    syslog(LOG_DEBUG, "%zu sinks sharded on %zu points", fanout->count, fanout->nodes);
+    return 0;
+}
+
+void fanout_close(struct fanout *fanout) {
+    assert(fanout != NULL);
+
+    for(size_t i = 0; fanout->sinks != NULL && i < fanout->count; ++i) {
+        sink_close(&fanout->sinks[i]);
+    }
+    for(size_t i = 0; fanout->shards != NULL && i < fanout->count; ++i) {
+        free(fanout->shards[i].buf);
+    }
+    free(fanout->failed.buf);
+    free(fanout->sinks);
+    free(fanout->shards);
+    free(fanout->available);
+    free(fanout->stats);
+    free(fanout->ring);
+    memset(fanout, 0, sizeof(*fanout));
+}
+
+/* the sink of the first point at or after the hash that is available */
+static inline size_t fanout_owner(struct fanout *fanout, uint64_t hash) {
+    size_t lo = 0;
+    size_t hi = fanout->nodes;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(fanout->ring[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t owner = fanout->ring[lo % fanout->nodes].sink;
+    if(fanout->available[owner]) return owner;
+    for(size_t k = 1; k < fanout->nodes; ++k) {
+        size_t sink = fanout->ring[(lo + k) % fanout->nodes].sink;
+        if(fanout->available[sink]) {
+            ++fanout->failovers;
+            return sink;
+        }
+    }
+    /* none is available, the series stays with its own */
+    return owner;
+}
+
+int fanout_append(struct fanout_buffer *buffer, const char *buf, size_t len) {
+    assert(buffer != NULL);
+    assert(buf != NULL);
+
+    if(buffer->len + len > buffer->size) {
+        size_t size = buffer->size == 0 ? 4096 : buffer->size;
+        while(size < buffer->len + len) size *= 2;
+        char *grown = realloc(buffer->buf, size);
+        HANDLE_RESULT(grown == NULL, return -1, "fanout_append: can't grow to %zu bytes", size);
+        buffer->buf = grown;
+        buffer->size = size;
+    }
+    memcpy(buffer->buf + buffer->len, buf, len);
+    buffer->len += len;
+    return 0;
+}
+
+/* appends every line to the shard of its series key, the line up to the first unescaped space */
+int fanout_split(struct fanout *fanout, const char *buf, size_t len) {
+    assert(fanout != NULL);
+    assert(buf != NULL);
+
+    const char *end = buf + len;
+    for(const char *line = buf; line < end;) {
+        const char *eol = scan_find(line, end, '\n');
+        eol = eol < end ? eol + 1 : eol;
+        const char *key = line;
+        while(key < eol && *key != ' ' && *key != '\n') key += *key == '\\' ? 2 : 1;
+        if(key > eol) key = eol;
+        size_t sink = fanout_owner(fanout, fanout_hash(line, key - line));
+        HANDLE_RESULT(fanout_append(&fanout->shards[sink], line, eol - line) == -1, return -1,
+                      "fanout_split: fanout_append");
+        line = eol;
+    }
+    return 0;
+}
+
+/* notes the sinks that went away or came back since the last send */
+void fanout_check(struct fanout *fanout) {
+    assert(fanout != NULL);
+
+    for(size_t i = 0; i < fanout->count; ++i) {
+        int available = sink_available(&fanout->sinks[i]);
+        if(available && !fanout->available[i]) {
+            syslog(LOG_INFO, "sink %s is available again", fanout->sinks[i].name);
+        } else if(!available && fanout->available[i]) {
+            syslog(LOG_WARNING, "sink %s is not available", fanout->sinks[i].name);
+        }
+        fanout->available[i] = available;
+    }
+}
+
+int fanout_send(struct fanout *fanout, const char *buf, size_t len) {
+    assert(fanout != NULL);
+    assert(buf != NULL);
+
+    if(len == 0) return 0;
+    if(fanout->count > 1) fanout_check(fanout);
+    if(!fanout->shard) {
+        int result = 0;
+        for(size_t i = 0; i < fanout->count; ++i) {
+            if(sink_send(&fanout->sinks[i], buf, len) == -1) result = -1;
+        }
+        return result;
+    }
+
+    HANDLE_RESULT(fanout_split(fanout, buf, len) == -1, goto DROP, "fanout_send: fanout_split");
+    /* every round a failed sink drops out, the last round has none left to fail over to */
+    for(size_t round = 0; round <= fanout->count; ++round) {
+        int failed = 0;
+        for(size_t i = 0; i < fanout->count; ++i) {
+            struct fanout_buffer *shard = &fanout->shards[i];
+            if(shard->len == 0) continue;
+            if(sink_send(&fanout->sinks[i], shard->buf, shard->len) == 0) {
+                shard->len = 0;
+                continue;
+            }
+            if(fanout->available[i] && fanout->count > 1) {
+                syslog(LOG_WARNING, "sink %s failed, its series fail over", fanout->sinks[i].name);
+            }
+            fanout->available[i] = 0;
+            struct fanout_buffer lines = fanout->failed;
+            fanout->failed = *shard;
+            *shard = lines;
+            shard->len = 0;
+            HANDLE_RESULT(fanout_split(fanout, fanout->failed.buf, fanout->failed.len) == -1,
+                          goto DROP, "fanout_send: fanout_split");
+            fanout->failed.len = 0;
+            failed = 1;
+        }
+        if(!failed) return 0;
+    }
+
+DROP:
+    for(size_t i = 0; i < fanout->count; ++i) fanout->shards[i].len = 0;
+    fanout->failed.len = 0;
+    return -1;
+}
+
+/* counters of the sinks for the agent collector, on the thread that sends */
+void fanout_publish(struct fanout *fanout) {
+    assert(fanout != NULL);
+
+    for(size_t i = 0; i < fanout->count; ++i) {
+        sink_publish(&fanout->sinks[i], &fanout->stats[i]);
+        __atomic_store_n(&fanout->stats[i].available, fanout->available[i], __ATOMIC_RELAXED);
+    }
+}
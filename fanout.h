@@ -0,0 +1,61 @@
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "sink.h"
+
+#define FANOUT_REPLICAS 64  /* points of a sink on the hash ring */
+
+/*
+ * Output of the agent to one or more sinks. Broadcast sends every tick to
+ * every sink. Sharded, every line goes to one sink picked by a consistent
+ * hash of its series key (measurement and tags): each sink has
+ * FANOUT_REPLICAS points on a ring hashed from its "host:port", and a
+ * series belongs to the first point at or after its hash. Every agent
+ * with the same sinks sends a series to the same relay, and adding or
+ * removing a relay only moves the series of its points.
+ *
+ * Lines of a sink that is not available (see sink_available()) go to the
+ * next available sink on the ring; when a send fails its lines are split
+ * again over the sinks still available, so the tick is not lost with the
+ * relay. A sink with a spool is never failed over, it keeps its series and
+ * spools them. All sends are non-blocking, the HTTP sink only queues.
+ *
+ * The sinks belong to the thread that sends; fanout_publish() copies their
+ * counters to `stats`, which the agent collector reads from the collecting
+ * thread in worker mode.
+ */
+struct fanout_node {
+    uint64_t hash;
+    size_t sink;
+};
+
+struct fanout_buffer {
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+struct fanout {
+    struct sink *sinks;
+    size_t count;
+    int shard;                      /* split lines by series rather than broadcast */
+    struct fanout_node *ring;       /* sorted by hash */
+    size_t nodes;
+    struct fanout_buffer *shards;   /* lines of a tick per sink */
+    struct fanout_buffer failed;    /* lines of a failed send, split again */
+    int *available;                 /* per sink, as of the last send */
+    struct sink_stat *stats;        /* per sink, as of the last publish */
+    uint64_t failovers;             /* lines sent to another sink than their own */
+};
+
+int fanout_open(struct fanout *fanout, size_t count, int shard);
+int fanout_ring(struct fanout *fanout);
+int fanout_send(struct fanout *fanout, const char *buf, size_t len);
+void fanout_publish(struct fanout *fanout);
+void fanout_close(struct fanout *fanout);
+
+#endif /* FANOUT_H_ */
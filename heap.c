@@ -0,0 +1,60 @@
+#include "heap.h"
+
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread uint64_t heap_allocations;
+__thread uint64_t heap_growths;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+DIR *__real_fdopendir(int fd);
+
+void *__wrap_malloc(size_t size) {
+    ++heap_allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    ++heap_allocations;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if(ptr == NULL) {
+        ++heap_allocations;
+    } else {
+        ++heap_growths;
+    }
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    ++heap_allocations;
+    return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n) {
+    ++heap_allocations;
+    return __real_strndup(s, n);
+}
+
+int __wrap_asprintf(char **strp, const char *format, ...) {
+    ++heap_allocations;
+    va_list args;
+    va_start(args, format);
+    int result = vasprintf(strp, format, args);
+    va_end(args);
+    return result;
+}
+
+DIR *__wrap_fdopendir(int fd) {
+    ++heap_allocations;
+    return __real_fdopendir(fd);
+}
@@ -0,0 +1,25 @@
+#ifndef HEAP_H_
+#define HEAP_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Heap allocations of the agent, to check that collecting does not
+ * allocate once it runs. The binary is linked with -Wl,--wrap of malloc,
+ * calloc, strdup, strndup, asprintf and fdopendir (which allocates its
+ * DIR): the wrappers count and call the real function. realloc() is
+ * counted apart, as growths: buffers grow to the largest payload seen so
+ * far, which takes a bounded number of them. Allocations libc makes on its
+ * own, e.g. in getaddrinfo(), are not seen. The counts are per thread.
+ *
+ * Built with -DHEAP_CHECK, collect() asserts that a collection makes no
+ * allocation after its first HEAP_WARMUP ticks.
+ */
+#define HEAP_WARMUP 2   /* ticks that open and fill the state of a collector */
+
+extern __thread uint64_t heap_allocations;
+extern __thread uint64_t heap_growths;
+
+#endif /* HEAP_H_ */
@@ -0,0 +1,571 @@
+#include "http.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+
+#define HTTP_GZIP_LEVEL 1   /* line protocol compresses well even at the fastest level */
+
+static inline time_t http_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* database names go into the query string as they are, unless they have to be escaped */
+size_t http_escape(char *buf, size_t size, const char *s) {
+    assert(buf != NULL);
+    assert(s != NULL);
+
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = 0;
+    for(; *s != 0; ++s) {
+        unsigned char c = *s;
+        int plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                    c == '-' || c == '_' || c == '.' || c == '~';
+        if(len + 4 > size) return size;
+        if(plain) {
+            buf[len++] = c;
+        } else {
+            buf[len++] = '%';
+            buf[len++] = hex[c >> 4];
+            buf[len++] = hex[c & 15];
+        }
+    }
+    buf[len] = 0;
+    return len;
+}
+
+int http_open(struct http *http, const char *remote, const char *service,
+              const char *database, int gzip) {
+    assert(http != NULL);
+    assert(remote != NULL);
+    assert(service != NULL);
+    assert(database != NULL);
+
+    memset(http, 0, sizeof(*http));
+    http->ev_loop = -1;
+    http->conn.fd = -1;
+    http->conn.data = http;
+    http->conn.handler = &http_handle;
+    http->timer.fd = -1;
+    http->state = HTTP_CLOSED;
+    http->capacity = HTTP_QUEUE_SIZE;
+    snprintf(http->host, sizeof(http->host), "%s:%s", remote, service);
+
+    struct addrinfo hint;
+    struct addrinfo *result = NULL;
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_flags = AI_NUMERICSERV;
+    int ec = getaddrinfo(remote, service, &hint, &result);
+    HANDLE_RESULT(ec != 0, return -1, "http_open: getaddrinfo: %s", gai_strerror(ec));
+    memcpy(&http->addr, result->ai_addr, result->ai_addrlen);
+    http->addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    char db[HTTP_PREFIX_SIZE / 2];
+    HANDLE_RESULT(http_escape(db, sizeof(db), database) == sizeof(db), return -1,
+                  "http_open: database name %s is too long", database);
+    int len = snprintf(http->prefix, sizeof(http->prefix),
+                       "POST /write?db=%s&precision=ns HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Content-Type: text/plain; charset=utf-8\r\n"
+                       "%s",
+                       db, http->host, gzip ? "Content-Encoding: gzip\r\n" : "");
+    HANDLE_RESULT(len < 0 || (size_t)len >= sizeof(http->prefix), return -1,
+                  "http_open: request header for %s is too long", http->host);
+
+    http->queue = malloc(http->capacity);
+    HANDLE_RESULT(http->queue == NULL, goto FAIL, "http_open: can't allocate queue");
+    if(gzip) {
+        HANDLE_RESULT(deflateInit2(&http->z, HTTP_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                                   Z_DEFAULT_STRATEGY) != Z_OK,
+                      goto FAIL, "http_open: deflateInit2");
+        http->gzip = 1;
+        http->zsize = deflateBound(&http->z, HTTP_BATCH_SIZE);
+        http->zbuf = malloc(http->zsize);
+        HANDLE_RESULT(http->zbuf == NULL, goto FAIL, "http_open: can't allocate gzip buffer");
+    }
+    syslog(LOG_DEBUG, "http sink to %s opened", http->host);
+    return 0;
+
+FAIL:
+    http_close(http);
+    return -1;
+}
+
+/* the server closed the connection or a request failed; the batch stays queued */
+void http_disconnect(struct http *http, int failed) {
+    assert(http != NULL);
+
+    if(http->conn.fd != -1) {
+        HANDLE_POSIX_RESULT(close(http->conn.fd), (void)http, "fd=%d: close: http", http->conn.fd);
+        syslog(LOG_DEBUG, "fd=%d: http connection closed", http->conn.fd);
+    }
+    http->conn.fd = -1;
+    http->state = HTTP_CLOSED;
+    http->batch = 0;
+    http->iovcnt = 0;
+    http->responselen = 0;
+    if(failed) {
+        ++http->failures;
+        http->retry = http_now() + (http->backoff != 0 ? http->backoff : 1);
+        http->backoff = http->backoff == 0 ? 1 :
+                        http->backoff < HTTP_BACKOFF_MAX ? 2 * http->backoff : HTTP_BACKOFF_MAX;
+    }
+}
+
+int http_connect(struct http *http) {
+    assert(http != NULL);
+    assert(http->state == HTTP_CLOSED);
+
+    int fd = -1;
+    HANDLE_POSIX_RESULT(fd = socket(http->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                        return -1, "http_connect: socket");
+    http->conn.fd = fd;
+    http->state = HTTP_CONNECTING;
+    http->started = http_now();
+    if(connect(fd, (struct sockaddr *)&http->addr, http->addrlen) == -1 && errno != EINPROGRESS) {
+        /* warned once per outage, the backoff is 0 until the first failure */
+        syslog(http->backoff == 0 ? LOG_WARNING : LOG_DEBUG, "fd=%d: can't connect to %s: %m",
+               fd, http->host);
+        http_disconnect(http, 1);
+        return -1;
+    }
+    /* edge triggered, a write or read goes on until it would block */
+    HANDLE_RESULT(http->ev_loop != -1 &&
+                  register_event(http->ev_loop, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &http->conn) == -1,
+                  http_disconnect(http, 1); return -1, "fd=%d: http_connect: register_event", fd);
+    syslog(LOG_DEBUG, "fd=%d: connecting to %s", fd, http->host);
+    return 0;
+}
+
+/* bytes of the next request, whole lines up to a batch */
+size_t http_batch(const struct http *http) {
+    assert(http != NULL);
+
+    size_t queued = http_queued(http);
+    if(queued <= HTTP_BATCH_SIZE) return queued;
+    /* the last newline within the batch, searched in the ring from the end of the batch */
+    uint64_t end = http->tail + HTTP_BATCH_SIZE;
+    while(end > http->tail) {
+        size_t offset = (end - 1) % http->capacity;
+        size_t len = end - http->tail < offset + 1 ? end - http->tail : offset + 1;
+        const char *start = http->queue + offset + 1 - len;
+        const char *eol = memrchr(start, '\n', len);
+        if(eol != NULL) return end - len + (eol - start) + 1 - http->tail;
+        end -= len;
+    }
+    /* a line longer than a batch goes out whole */
+    for(end = http->tail + HTTP_BATCH_SIZE; end < http->head; ++end) {
+        if(http->queue[end % http->capacity] == '\n') return end + 1 - http->tail;
+    }
+    return queued;
+}
+
+int http_send(struct http *http) {
+    assert(http != NULL);
+    assert(http->state == HTTP_SENDING);
+
+    while(http->iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &http->iov[http->iovfirst];
+        msg.msg_iovlen = http->iovcnt;
+        ssize_t r = sendmsg(http->conn.fd, &msg, MSG_NOSIGNAL);
+        if(r == -1 && errno == EINTR) continue;
+        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if(r == -1) {
+            syslog(LOG_WARNING, "fd=%d: can't send to %s: %m", http->conn.fd, http->host);
+            http_disconnect(http, 1);
+            return -1;
+        }
+        while(http->iovcnt > 0 && (size_t)r >= http->iov[http->iovfirst].iov_len) {
+            r -= http->iov[http->iovfirst].iov_len;
+            ++http->iovfirst;
+            --http->iovcnt;
+        }
+        if(http->iovcnt > 0) {
+            http->iov[http->iovfirst].iov_base = (char *)http->iov[http->iovfirst].iov_base + r;
+            http->iov[http->iovfirst].iov_len -= r;
+        }
+    }
+    http->state = HTTP_RECEIVING;
+    http->responselen = 0;
+    http->bodystart = 0;
+    return 0;
+}
+
+/* compresses the pieces of the batch into zbuf, 0 when it does not fit */
+size_t http_deflate(struct http *http, const struct iovec *pieces, size_t count) {
+    assert(http != NULL);
+    assert(http->gzip);
+
+    HANDLE_RESULT(deflateReset(&http->z) != Z_OK, return 0, "http_deflate: deflateReset");
+    http->z.next_out = (Bytef *)http->zbuf;
+    http->z.avail_out = http->zsize;
+    for(size_t i = 0; i < count; ++i) {
+        http->z.next_in = (Bytef *)pieces[i].iov_base;
+        http->z.avail_in = pieces[i].iov_len;
+        int r = deflate(&http->z, i + 1 == count ? Z_FINISH : Z_NO_FLUSH);
+        if(i + 1 == count && r != Z_STREAM_END) return 0;
+        if(r != Z_OK && r != Z_STREAM_END) return 0;
+    }
+    return http->zsize - http->z.avail_out;
+}
+
+/* starts a request of the next batch */
+int http_start(struct http *http) {
+    assert(http != NULL);
+    assert(http->state == HTTP_IDLE);
+
+    size_t batch = http_batch(http);
+    if(batch == 0) return 0;
+    size_t offset = http->tail % http->capacity;
+    size_t first = http->capacity - offset < batch ? http->capacity - offset : batch;
+    http->iov[1].iov_base = http->queue + offset;
+    http->iov[1].iov_len = first;
+    http->iov[2].iov_base = http->queue;
+    http->iov[2].iov_len = batch - first;
+    http->iovcnt = batch > first ? 3 : 2;
+    size_t body = batch;
+    if(http->gzip) {
+        /* a batch past the bound of the buffer is a single line longer than a batch */
+        size_t len = batch <= HTTP_BATCH_SIZE ? http_deflate(http, &http->iov[1], http->iovcnt - 1) : 0;
+        HANDLE_RESULT(len == 0, http->tail += batch; http->dropped += batch; return -1,
+                      "http_start: can't compress batch of %zu bytes, dropped", batch);
+        http->iov[1].iov_base = http->zbuf;
+        http->iov[1].iov_len = body = len;
+        http->iovcnt = 2;
+    }
+    int len = snprintf(http->header, sizeof(http->header), "%sContent-Length: %zu\r\n\r\n",
+                       http->prefix, body);
+    http->iov[0].iov_base = http->header;
+    http->iov[0].iov_len = len;
+    http->iovfirst = 0;
+    http->batch = batch;
+    http->state = HTTP_SENDING;
+    http->started = http_now();
+    return http_send(http);
+}
+
+/* status line and the headers that matter; the body is only kept for the log */
+int http_parse_headers(struct http *http, const char *end) {
+    assert(http != NULL);
+    assert(end != NULL);
+
+    const char *p = http->response;
+    int minor = 0;
+    HANDLE_RESULT(sscanf(p, "HTTP/1.%d %d", &minor, &http->status) != 2, return -1,
+                  "%s: bad response %.*s", http->host, (int)(end - p), p);
+    http->keepalive = minor >= 1;
+    int length = 0;
+    for(p = strstr(p, "\r\n") + 2; p < end; p = strstr(p, "\r\n") + 2) {
+        if(strncasecmp(p, "Content-Length:", sizeof("Content-Length:") - 1) == 0) {
+            http->remaining = strtoull(p + sizeof("Content-Length:") - 1, NULL, 10);
+            length = 1;
+        } else if(strncasecmp(p, "Connection:", sizeof("Connection:") - 1) == 0) {
+            const char *eol = strstr(p, "\r\n");
+            if(memmem(p, eol - p, "close", sizeof("close") - 1) != NULL) http->keepalive = 0;
+        }
+    }
+    if(!length) {
+        /* a chunked body or one up to the close, the connection is not reused */
+        http->remaining = 0;
+        if(http->status != 204 && http->status != 304) http->keepalive = 0;
+    }
+    return 0;
+}
+
+/* the response of the batch is complete */
+void http_complete(struct http *http) {
+    assert(http != NULL);
+
+    const char *body = http->response + http->bodystart;
+    int bodylen = http->responselen - http->bodystart;
+    int status = http->status;
+    if(status / 100 == 2) {
+        http->tail += http->batch;
+        ++http->requests;
+        if(http->backoff != 0) {
+            syslog(LOG_INFO, "%s: back, %zu bytes queued", http->host, http_queued(http));
+        }
+        http->backoff = 0;
+        http->retry = 0;
+    } else if(status / 100 == 4 && status != 408 && status != 429) {
+        syslog(LOG_ERR, "%s: batch of %zu bytes rejected with %d, dropped: %.*s",
+               http->host, http->batch, status, bodylen, body);
+        http->tail += http->batch;
+        http->dropped += http->batch;
+        ++http->failures;
+    } else {
+        syslog(http->backoff == 0 ? LOG_WARNING : LOG_DEBUG,
+               "%s: batch of %zu bytes failed with %d, retrying: %.*s",
+               http->host, http->batch, status, bodylen, body);
+        ++http->failures;
+        http->retry = http_now() + (http->backoff != 0 ? http->backoff : 1);
+        http->backoff = http->backoff == 0 ? 1 :
+                        http->backoff < HTTP_BACKOFF_MAX ? 2 * http->backoff : HTTP_BACKOFF_MAX;
+    }
+    http->batch = 0;
+    http->responselen = 0;
+    http->state = HTTP_IDLE;
+    if(!http->keepalive) {
+        http_disconnect(http, 0);
+        return;
+    }
+    /* a backlog is sent back to back, smaller batches wait for the flush */
+    if(http_queued(http) >= HTTP_BATCH_SIZE && http->retry <= http_now()) http_start(http);
+}
+
+int http_receive(struct http *http) {
+    assert(http != NULL);
+    assert(http->state == HTTP_RECEIVING);
+
+    for(;;) {
+        char discard[4096];
+        char *p = http->response + http->responselen;
+        size_t room = sizeof(http->response) - 1 - http->responselen;
+        if(room == 0) {
+            if(http->bodystart == 0) {
+                syslog(LOG_WARNING, "fd=%d: response headers of %s are too long", http->conn.fd, http->host);
+                http_disconnect(http, 1);
+                return -1;
+            }
+            p = discard;
+            room = sizeof(discard);
+        }
+        ssize_t r = recv(http->conn.fd, p, room, 0);
+        if(r == -1 && errno == EINTR) continue;
+        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if(r <= 0) {
+            if(r == 0) {
+                syslog(LOG_WARNING, "fd=%d: %s closed the connection", http->conn.fd, http->host);
+            } else {
+                syslog(LOG_WARNING, "fd=%d: can't receive from %s: %m", http->conn.fd, http->host);
+            }
+            http_disconnect(http, 1);
+            return -1;
+        }
+        if(p != discard) {
+            http->responselen += r;
+            http->response[http->responselen] = 0;
+        }
+        if(http->bodystart == 0) {
+            const char *end = memmem(http->response, http->responselen, "\r\n\r\n", 4);
+            if(end == NULL) continue;
+            http->bodystart = end + 4 - http->response;
+            if(http_parse_headers(http, end + 2) == -1) {
+                http_disconnect(http, 1);
+                return -1;
+            }
+            r = http->responselen - http->bodystart;
+        }
+        http->remaining -= (size_t)r < http->remaining ? (size_t)r : http->remaining;
+        if(http->remaining == 0) {
+            http_complete(http);
+            return 0;
+        }
+    }
+}
+
+int http_handle(int fd, void *data) {
+    assert(data != NULL);
+
+    struct http *http = (struct http *)data;
+    /* an event of a connection closed earlier in the same round */
+    if(fd == -1 || fd != http->conn.fd) return 0;
+
+    if(http->state == HTTP_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        HANDLE_POSIX_RESULT(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len),
+                            error = errno, "fd=%d: http_handle: getsockopt(SO_ERROR)", fd);
+        if(error == EINPROGRESS) return 0;
+        if(error != 0) {
+            syslog(http->backoff == 0 ? LOG_WARNING : LOG_DEBUG, "fd=%d: can't connect to %s: %s",
+                   fd, http->host, strerror(error));
+            http_disconnect(http, 1);
+            return 0;
+        }
+        syslog(LOG_DEBUG, "fd=%d: connected to %s", fd, http->host);
+        http->state = HTTP_IDLE;
+        if(http->retry <= http_now()) http_start(http);
+    }
+    if(http->state == HTTP_SENDING) http_send(http);
+    if(http->state == HTTP_RECEIVING) http_receive(http);
+    if(http->state == HTTP_IDLE && http->conn.fd == fd) {
+        /* nothing is expected on an idle connection but its close */
+        char c;
+        ssize_t r = recv(fd, &c, sizeof(c), MSG_DONTWAIT);
+        if(r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            syslog(LOG_DEBUG, "fd=%d: %s closed the idle connection", fd, http->host);
+            http_disconnect(http, 0);
+        }
+    }
+    return 0;
+}
+
+/* runs on the flush timer: connects when needed, starts a request or gives up on a stuck one */
+int http_flush(struct http *http) {
+    assert(http != NULL);
+
+    time_t now = http_now();
+    switch(http->state) {
+        case HTTP_CONNECTING:
+        case HTTP_SENDING:
+        case HTTP_RECEIVING:
+            if(now - http->started >= HTTP_TIMEOUT) {
+                syslog(LOG_WARNING, "fd=%d: %s timed out", http->conn.fd, http->host);
+                http_disconnect(http, 1);
+            }
+            return 0;
+        case HTTP_CLOSED:
+            if(http_queued(http) == 0 || now < http->retry) return 0;
+            http_connect(http);
+            return 0;
+        case HTTP_IDLE:
+            if(http_queued(http) == 0 || now < http->retry) return 0;
+            http_start(http);
+            return 0;
+    }
+    return 0;
+}
+
+int http_timer(int fd, void *data) {
+    assert(fd != -1);
+    assert(data != NULL);
+
+    uint64_t v = 0;
+    ssize_t r = read(fd, &v, sizeof(v));
+    HANDLE_POSIX_RESULT(r, return -1, "http_timer: read fd=%d", fd);
+    http_flush((struct http *)data);
+    return 0;
+}
+
+int http_schedule(struct http *http, int ev_loop, unsigned flush) {
+    assert(http != NULL);
+    assert(ev_loop != -1);
+    assert(flush > 0);
+
+    struct itimerspec timeout;
+    timeout.it_interval.tv_sec = flush / 1000;
+    timeout.it_interval.tv_nsec = (flush % 1000) * 1000000L;
+    timeout.it_value = timeout.it_interval;
+    http->timer.data = http;
+    http->timer.handler = &http_timer;
+    HANDLE_RESULT(create_timer(ev_loop, &timeout, &http->timer) == -1, return -1,
+                  "http_schedule: create_timer");
+    http->ev_loop = ev_loop;
+    return 0;
+}
+
+/* blocking: delivers the queue or gives up after HTTP_TIMEOUT seconds */
+int http_drain(struct http *http) {
+    assert(http != NULL);
+
+    time_t now = http_now();
+    time_t deadline = now + HTTP_TIMEOUT;
+    for(; http_queued(http) > 0 && now < deadline; now = http_now()) {
+        if(http->retry > now) {
+            if(http->retry >= deadline) break;
+            sleep(http->retry - now);
+            continue;
+        }
+        if(http->state == HTTP_CLOSED && http_connect(http) == -1) continue;
+        if(http->state == HTTP_IDLE) {
+            http_start(http);
+            continue;
+        }
+        struct pollfd pfd = {
+            .fd = http->conn.fd,
+            .events = POLLIN | (http->state == HTTP_CONNECTING || http->state == HTTP_SENDING ? POLLOUT : 0)
+        };
+        HANDLE_POSIX_RESULT(poll(&pfd, 1, 100), break, "fd=%d: http_drain: poll", pfd.fd);
+        if(pfd.revents != 0) http_handle(pfd.fd, http);
+    }
+    if(http_queued(http) == 0) return 0;
+    syslog(LOG_WARNING, "%s: %zu queued bytes not delivered", http->host, http_queued(http));
+    return -1;
+}
+
+/* removed from the sinks, the queue is delivered from the event loop until the deadline */
+void http_retire(struct http *http) {
+    assert(http != NULL);
+
+    http->deadline = http_now() + HTTP_TIMEOUT;
+    if(http->ev_loop != -1) http_flush(http);
+}
+
+/* the retired sink can be closed without blocking; a queue it could not deliver is dropped */
+int http_retired(struct http *http) {
+    assert(http != NULL);
+    assert(http->deadline != 0);
+
+    /* without an event loop http_close() drains it */
+    if(http_queued(http) == 0 || http->ev_loop == -1) return 1;
+    if(http_now() < http->deadline) return 0;
+    syslog(LOG_WARNING, "%s: removed, %zu queued bytes dropped", http->host, http_queued(http));
+    http->dropped += http_queued(http);
+    http->tail = http->head;
+    http_disconnect(http, 0);
+    return 1;
+}
+
+int http_queue(struct http *http, const char *buf, size_t len) {
+    assert(http != NULL);
+    assert(http->queue != NULL);
+    assert(buf != NULL);
+
+    if(len > http->capacity - http_queued(http)) return -1;
+    size_t offset = http->head % http->capacity;
+    size_t first = http->capacity - offset < len ? http->capacity - offset : len;
+    memcpy(http->queue + offset, buf, first);
+    memcpy(http->queue, buf + first, len - first);
+    http->head += len;
+    if(http_queued(http) < HTTP_BATCH_SIZE) return 0;
+    /* without an event loop full batches are delivered right away */
+    if(http->ev_loop == -1) {
+        HANDLE_RESULT(http_drain(http) == -1, (void)http, "http_queue: http_drain");
+    } else if(http->state == HTTP_IDLE && http->retry <= http_now()) {
+        http_start(http);
+    }
+    return 0;
+}
+
+void http_close(struct http *http) {
+    assert(http != NULL);
+
+    if(http->queue != NULL && http_queued(http) > 0) {
+        HANDLE_RESULT(http_drain(http) == -1, (void)http, "http_close: http_drain");
+    }
+    http_disconnect(http, 0);
+    if(http->timer.fd != -1) {
+        HANDLE_POSIX_RESULT(close(http->timer.fd), (void)http, "fd=%d: close: http timer", http->timer.fd);
+    }
+    if(http->gzip) deflateEnd(&http->z);
+    free(http->zbuf);
+    free(http->queue);
+    memset(http, 0, sizeof(*http));
+    http->conn.fd = -1;
+    http->timer.fd = -1;
+    http->ev_loop = -1;
+}
@@ -0,0 +1,117 @@
+#ifndef HTTP_H_
+#define HTTP_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netdb.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "event.h"
+
+#define HTTP_QUEUE_SIZE (16 * 1024 * 1024)
+#define HTTP_BATCH_SIZE (1024 * 1024)   /* body of a request, cut on a line boundary */
+#define HTTP_FLUSH 5000                 /* milliseconds */
+#define HTTP_TIMEOUT 10                 /* seconds a connect or a request may take */
+#define HTTP_BACKOFF_MAX 32             /* seconds */
+#define HTTP_PREFIX_SIZE 512
+#define HTTP_RESPONSE_SIZE 1024
+
+/*
+ * InfluxDB /write client. Output of the ticks is copied into a bounded
+ * ring and sent in batches as `POST /write?db=<database>&precision=ns`
+ * over one keep-alive connection, with at most one request in flight.
+ *
+ * A request is started when the flush timer fires or as soon as a full
+ * batch is queued. The body is sent straight from the ring with a
+ * scatter/gather send of the header and the one or two pieces of the
+ * ring, or from a buffer of its gzip when compression is on. The
+ * connection is non-blocking and driven by the event loop; without one,
+ * e.g. when replaying snapshots, a full batch and the queue left on close
+ * are delivered with a blocking drain instead.
+ *
+ * A batch leaves the ring on a 2xx, and on a 4xx other than 408 and 429
+ * since sending it again would not help. Otherwise it is kept and sent
+ * again after a backoff that doubles up to HTTP_BACKOFF_MAX seconds, so
+ * delivery is at-least-once; InfluxDB overwrites a point written twice.
+ * When the ring is full new output is refused, which is the backpressure
+ * the sink turns into spooling.
+ *
+ * A sink removed on a reload is retired rather than closed: it goes on
+ * delivering its queue from the event loop, and what is left after
+ * HTTP_TIMEOUT seconds is dropped, so the reload never waits on it.
+ */
+enum http_state {
+    HTTP_CLOSED,
+    HTTP_CONNECTING,
+    HTTP_IDLE,          /* connected, no request in flight */
+    HTTP_SENDING,
+    HTTP_RECEIVING
+};
+
+struct http {
+    char host[NI_MAXHOST + NI_MAXSERV];     /* "host:port" */
+    struct sockaddr_storage addr;   /* resolved once, reconnects go to the same address */
+    socklen_t addrlen;
+    char prefix[HTTP_PREFIX_SIZE];  /* request line and headers up to Content-Length */
+    int gzip;
+    z_stream z;
+    char *zbuf;
+    size_t zsize;
+
+    int ev_loop;                    /* -1 to drain synchronously */
+    struct event_handler conn;
+    struct event_handler timer;
+    enum http_state state;
+    time_t started;                 /* monotonic second of the connect or request */
+    time_t retry;                   /* no request before this second */
+    unsigned backoff;               /* seconds, 0 after a successful request */
+    time_t deadline;                /* retired: the queue left is dropped at this second, 0 in use */
+
+    char *queue;                    /* ring of line protocol, positions only grow */
+    size_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    size_t batch;                   /* bytes of the queue in the request */
+
+    char header[HTTP_PREFIX_SIZE + 64];
+    struct iovec iov[3];
+    size_t iovfirst;
+    size_t iovcnt;
+
+    char response[HTTP_RESPONSE_SIZE];
+    size_t responselen;
+    size_t bodystart;               /* 0 until the headers are complete */
+    size_t remaining;               /* bytes of the body not received yet */
+    int status;
+    int keepalive;
+
+    uint64_t requests;              /* batches delivered */
+    uint64_t failures;              /* failed connects and requests */
+    uint64_t dropped;               /* bytes of rejected batches */
+};
+
+int http_open(struct http *http, const char *remote, const char *service,
+              const char *database, int gzip);
+int http_schedule(struct http *http, int ev_loop, unsigned flush);
+int http_queue(struct http *http, const char *buf, size_t len);
+int http_flush(struct http *http);
+int http_drain(struct http *http);
+void http_retire(struct http *http);
+int http_retired(struct http *http);
+int http_handle(int fd, void *data);
+void http_close(struct http *http);
+
+static inline size_t http_queued(const struct http *http) {
+    return http->head - http->tail;
+}
+
+/* connected and the last request went through */
+static inline int http_healthy(const struct http *http) {
+    return http->state != HTTP_CLOSED && http->state != HTTP_CONNECTING && http->backoff == 0;
+}
+
+#endif /* HTTP_H_ */
@@ -2,190 +2,526 @@
 
 #include <linux/if_link.h>
 #include <net/if.h>
-#include <sys/sysinfo.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 
 #include <assert.h>
+#include <fnmatch.h>
 #include <inttypes.h>
-#include <ifaddrs.h>
-#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include "cgroup.h"
 #include "error_handling.h"
+#include "irq.h"
+#include "line_protocol.h"
+#include "netlink.h"
+#include "process.h"
+#include "scanner.h"
+#include "sink.h"
+#include "telemetry.h"
 
-int format(char **buf, size_t *buflen, const char *format, ...) {
+/* MemTotal -> mem_total, Active(anon) -> active_anon, DirectMap2M -> direct_map2m */
+void influxdb_snake_case(char *name, size_t size, const struct span *key) {
+    assert(name != NULL);
+    assert(size > 0);
+    assert(key != NULL);
+
+    size_t len = 0;
+    for(size_t i = 0; i < key->len && len + 2 < size; ++i) {
+        char c = key->ptr[i];
+        char previous = i > 0 ? key->ptr[i - 1] : 0;
+        if(c >= 'A' && c <= 'Z') {
+            if(len > 0 && name[len - 1] != '_' &&
+               previous >= 'a' && previous <= 'z') {
+                name[len++] = '_';
+            }
+            name[len++] = c - 'A' + 'a';
+        } else if((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+            name[len++] = c;
+        } else if(len > 0 && name[len - 1] != '_') {
+            name[len++] = '_';
+        }
+    }
+    while(len > 0 && name[len - 1] == '_') --len;
+    name[len] = 0;
+}
+
+/* vmstat nr_* are current numbers of pages, the rest count events */
+int influxdb_vmstat_is_counter(const struct span *key) {
+    assert(key != NULL);
+
+    static const char *counters[] = {
+        "nr_dirtied", "nr_written", "nr_foll_pin_acquired", "nr_foll_pin_released", NULL
+    };
+    if(span_equals(key, "workingset_nodes", sizeof("workingset_nodes") - 1)) return 0;
+    if(!span_has_prefix(key, "nr_", 3)) return 1;
+    for(const char **counter = counters; *counter != NULL; ++counter) {
+        if(span_equals(key, *counter, strlen(*counter))) return 1;
+    }
+    return 0;
+}
+
+/* looks up the field of every line of meminfo (separator ':') or vmstat (' ') */
+void influxdb_resolve_fields(struct influxdb_field_map *map, const char *buf, size_t len, char separator) {
+    assert(map != NULL);
+    assert(buf != NULL);
+
+    struct scanner sc;
+    struct span line;
+    size_t selected = 0;
+    map->count = 0;
+    map->reserve = 0;
+    scanner_init(&sc, buf, len);
+    while(map->count < INFLUXDB_FIELDS && scan_line(&sc, &line)) {
+        struct influxdb_field *field = &map->fields[map->count++];
+        const char *end = memchr(line.ptr, separator, line.len);
+        struct span key = { line.ptr, end != NULL ? (size_t)(end - line.ptr) : 0 };
+        memset(field, 0, sizeof(*field));
+        if(key.len == 0 || key.len > UINT8_MAX) continue;
+        field->keylen = key.len;
+        field->first = key.ptr[0];
+        field->scale = 1;
+        if(separator == ':') {
+            /* sizes are in kB, the HugePages_ counts have no unit */
+            influxdb_snake_case(field->name, sizeof(field->name), &key);
+            if(line.len > 3 && memcmp(line.ptr + line.len - 3, " kB", 3) == 0) field->scale = 1024;
+        } else if(key.len < sizeof(field->name)) {
+            memcpy(field->name, key.ptr, key.len);
+            field->name[key.len] = 0;
+            field->counter = influxdb_vmstat_is_counter(&key);
+        }
+        if(field->name[0] != 0 && map->include != NULL && *map->include != NULL) {
+            const char **pattern = map->include;
+            while(*pattern != NULL && fnmatch(*pattern, field->name, 0) != 0) ++pattern;
+            if(*pattern == NULL) field->name[0] = 0;
+        }
+        if(field->name[0] != 0) {
+            map->reserve += LP_FIELD_SIZE(field->name);
+            ++selected;
+        }
+    }
+    syslog(LOG_DEBUG, "%zu of %zu fields selected", selected, map->count);
+}
+
+/* one line of the selected fields of meminfo or vmstat */
+int influxdb_serialize_fields(struct influxdb_field_map *map, const char *measurement,
+                              const char *buf, size_t len, char separator,
+                              const char *hostname,
+                              const struct timespec *ts,
+                              struct lp_writer *w) {
+    assert(map != NULL);
+    assert(measurement != NULL);
     assert(buf != NULL);
-    assert(*buf != NULL);
-    assert(buflen != NULL);
-    assert(format != NULL);
-
-    va_list vl;
-    va_start(vl, format);
-    ssize_t result = vsnprintf(*buf, *buflen, format, vl);
-    va_end(vl);
-
-    HANDLE_POSIX_RESULT(result, return -1, "format: snprintf");
-    HANDLE_RESULT((size_t)result >= *buflen, return -1,
-                  "format: buffer too small: "
-                  "has %zu need %zd bytes\n", *buflen, result);
-    *buflen -= result;
-    *buf += result;
-    assert(**buf == 0);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    int resolved = 0;
+    if(map->count == 0) {
+        influxdb_resolve_fields(map, buf, len, separator);
+        resolved = 1;
+    }
+AGAIN:
+    HANDLE_RESULT(lp_line_begin(w, strlen(measurement) + 1 +
+                                LP_TAG_SIZE("hostname", hostname) + map->reserve) == -1,
+                  return -1, "influxdb_serialize_fields[%s]: lp_line_begin", measurement);
+    lp_measurement(w, measurement);
+    lp_tag(w, "hostname", hostname);
+
+    struct scanner sc;
+    struct span line;
+    size_t i = 0;
+    scanner_init(&sc, buf, len);
+    for(; scan_line(&sc, &line); ++i) {
+        if(i == INFLUXDB_FIELDS) break;
+        if(i == map->count) goto CHANGED;
+        /* the layout is checked with the position of the separator and the first letter */
+        const struct influxdb_field *field = &map->fields[i];
+        if(field->keylen == 0) continue;
+        if(line.len <= field->keylen || line.ptr[field->keylen] != separator ||
+           line.ptr[0] != field->first) {
+            goto CHANGED;
+        }
+        if(field->name[0] == 0) continue;
+
+        struct scanner fs;
+        struct span value;
+        uint64_t v;
+        scanner_init(&fs, line.ptr + field->keylen + 1, line.len - field->keylen - 1);
+        if(!scan_field(&fs, &value) || span_parse_u64(&value, &v) == -1) continue;
+        if(field->counter) {
+            lp_counter_int(w, field->name, v, 64);
+        } else {
+            lp_field_int(w, field->name, v * field->scale);
+        }
+    }
+    if(i != map->count) goto CHANGED;
+    lp_timestamp(w, ts);
+    return 0;
+
+CHANGED:
+    /* e.g. snapshots of another kernel */
+    lp_line_abort(w);
+    HANDLE_RESULT(resolved, return -1,
+                  "influxdb_serialize_fields[%s]: unexpected layout", measurement);
+    syslog(LOG_INFO, "layout of %s changed, looking up its fields again", measurement);
+    influxdb_resolve_fields(map, buf, len, separator);
+    resolved = 1;
+    goto AGAIN;
+}
+
+int influxdb_serialize_memory_stat(struct influxdb_field_map *map,
+                                   const char *meminfo, size_t meminfolen,
+                                   const char *hostname,
+                                   const struct timespec *ts,
+                                   struct lp_writer *w) {
+    return influxdb_serialize_fields(map, "memory", meminfo, meminfolen, ':', hostname, ts, w);
+}
+
+int influxdb_serialize_vmstat(struct influxdb_field_map *map,
+                              const char *vmstat, size_t vmstatlen,
+                              const char *hostname,
+                              const struct timespec *ts,
+                              struct lp_writer *w) {
+    return influxdb_serialize_fields(map, "vmstat", vmstat, vmstatlen, ' ', hostname, ts, w);
+}
+
+int influxdb_serialize_nic_stat(const struct netlink_link *links, size_t count,
+                                const char *hostname,
+                                const struct timespec *ts,
+                                struct lp_writer *w) {
+    assert(links != NULL || count == 0);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    for(const struct netlink_link *link = links; link < links + count; ++link) {
+        if(!link->selected || !link->has_stats) continue;
+        const struct rtnl_link_stats64 *stats = &link->stats;
+
+        HANDLE_RESULT(lp_line_begin(w, sizeof("nic") +
+                                    LP_TAG_SIZE("hostname", hostname) +
+                                    LP_TAG_SIZE("if", link->name) +
+                                    24 * LP_FIELD_SIZE("tx_heartbeat_errors")) == -1,
+                      return -1, "influxdb_serialize_nic_stat: lp_line_begin");
+        lp_measurement(w, "nic");
+        lp_tag(w, "hostname", hostname);
+        lp_tag(w, "if", link->name);
+        lp_counter_int(w, "rx_packets", stats->rx_packets, 64);
+        lp_counter_int(w, "tx_packets", stats->tx_packets, 64);
+        lp_counter_int(w, "rx_bytes", stats->rx_bytes, 64);
+        lp_counter_int(w, "tx_bytes", stats->tx_bytes, 64);
+        lp_counter_int(w, "rx_errors", stats->rx_errors, 64);
+        lp_counter_int(w, "tx_errors", stats->tx_errors, 64);
+        lp_counter_int(w, "rx_dropped", stats->rx_dropped, 64);
+        lp_counter_int(w, "tx_dropped", stats->tx_dropped, 64);
+        lp_counter_int(w, "multicast", stats->multicast, 64);
+        lp_counter_int(w, "collisions", stats->collisions, 64);
+        lp_counter_int(w, "rx_length_errors", stats->rx_length_errors, 64);
+        lp_counter_int(w, "rx_over_errors", stats->rx_over_errors, 64);
+        lp_counter_int(w, "rx_crc_errors", stats->rx_crc_errors, 64);
+        lp_counter_int(w, "rx_frame_errors", stats->rx_frame_errors, 64);
+        lp_counter_int(w, "rx_fifo_errors", stats->rx_fifo_errors, 64);
+        lp_counter_int(w, "rx_missed_errors", stats->rx_missed_errors, 64);
+        lp_counter_int(w, "tx_aborted_errors", stats->tx_aborted_errors, 64);
+        lp_counter_int(w, "tx_carrier_errors", stats->tx_carrier_errors, 64);
+        lp_counter_int(w, "tx_fifo_errors", stats->tx_fifo_errors, 64);
+        lp_counter_int(w, "tx_heartbeat_errors", stats->tx_heartbeat_errors, 64);
+        lp_counter_int(w, "tx_window_errors", stats->tx_window_errors, 64);
+        lp_counter_int(w, "rx_compressed", stats->rx_compressed, 64);
+        lp_counter_int(w, "tx_compressed", stats->tx_compressed, 64);
+        lp_counter_int(w, "rx_nohandler", stats->rx_nohandler, 64);
+        lp_timestamp(w, ts);
+    }
+    return 0;
+}
+
+int influxdb_serialize_process_stat(const struct process_table *table,
+                                    const char *hostname,
+                                    const struct timespec *ts,
+                                    struct lp_writer *w) {
+    assert(table != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    /* the counters of the groups are deltas, they are always sent as rates */
+    if(table->seconds == 0) return 0;
+    const char *tag = table->by_cgroup ? "cgroup" : "name";
+    double ticks = table->hz * table->seconds;
+    for(size_t i = 0; i < table->top_count; ++i) {
+        const struct process_group *group = table->top[i];
+        if(group->len == 0) continue;
+
+        HANDLE_RESULT(lp_line_begin(w, sizeof("process") +
+                                    LP_TAG_SIZE("hostname", hostname) +
+                                    2 + strlen(tag) + 2 * group->len +
+                                    2 * LP_FIELD_SIZE("processes")) == -1,
+                      return -1, "influxdb_serialize_process_stat: lp_line_begin");
+        lp_measurement(w, "process");
+        if(table->by_cgroup) lp_tag_n(w, tag, group->name, group->len);
+        lp_tag(w, "hostname", hostname);
+        if(!table->by_cgroup) lp_tag_n(w, tag, group->name, group->len);
+        lp_field_int(w, "processes", group->processes);
+        lp_field_int(w, "rss", group->rss);
+        lp_field_float(w, "user", sizeof("user") - 1, "_pct", 100.0 * group->utime / ticks);
+        lp_field_float(w, "system", sizeof("system") - 1, "_pct", 100.0 * group->stime / ticks);
+        lp_field_float(w, "read_bytes", sizeof("read_bytes") - 1, "_rate",
+                       group->read_bytes / table->seconds);
+        lp_field_float(w, "write_bytes", sizeof("write_bytes") - 1, "_rate",
+                       group->write_bytes / table->seconds);
+        lp_field_float(w, "voluntary_ctxt_switches", sizeof("voluntary_ctxt_switches") - 1, "_rate",
+                       group->voluntary / table->seconds);
+        lp_field_float(w, "nonvoluntary_ctxt_switches", sizeof("nonvoluntary_ctxt_switches") - 1,
+                       "_rate", group->nonvoluntary / table->seconds);
+        lp_timestamp(w, ts);
+    }
     return 0;
 }
 
+/* memory.stat keys that count events, the others are sizes or current levels */
+int influxdb_cgroup_is_counter(const struct span *key) {
+    assert(key != NULL);
 
-int influxdb_serialize_memory_stat(const char *hostname,
+    static const char *prefixes[] = {
+        "pg", "workingset_refault", "workingset_activate", "workingset_restore",
+        "workingset_nodereclaim", "thp_", "zswpin", "zswpout", "zswpwb", "swpin", "swpout", "numa_",
+        NULL
+    };
+    for(const char **prefix = prefixes; *prefix != NULL; ++prefix) {
+        if(span_has_prefix(key, *prefix, strlen(*prefix))) return 1;
+    }
+    return 0;
+}
+
+/* field key of a cgroup file, prefixed by its controller; NULL when it does not fit */
+static inline const char *influxdb_cgroup_key(char *key, size_t size,
+                                              const char *prefix, const struct span *name) {
+    size_t len = strlen(prefix);
+    if(len + name->len >= size) return NULL;
+    memcpy(key, prefix, len);
+    memcpy(key + len, name->ptr, name->len);
+    key[len + name->len] = 0;
+    return key;
+}
+
+int influxdb_serialize_cgroup_stat(const struct cgroup_tree *tree,
+                                   const struct cgroup *cgroup,
+                                   const char *hostname,
                                    const struct timespec *ts,
-                                   char *buf, size_t *buflen) {
+                                   struct lp_writer *w) {
+    assert(tree != NULL);
+    assert(cgroup != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
-
-    struct sysinfo si;
-    HANDLE_POSIX_RESULT(sysinfo(&si), return -1,
-                        "influxdb_serialize_memory_stat: sysinfo");
-
-    size_t len = *buflen;
-    HANDLE_RESULT(format(&buf, &len,
-                         "memory,hostname=%s,unit=%di "
-                         "totalram=%lui,freeram=%lui,sharedram=%lui,bufferram=%lui,"
-                         "totalswap=%lui,freeswap=%lui,"
-                         "totalhigh=%lui,freehigh=%lui "
-                         "%ld%09ld\n",
-                         hostname, si.mem_unit,
-                         si.totalram, si.freeram, si.sharedram, si.bufferram,
-                         si.totalswap, si.freeswap,
-                         si.totalhigh, si.freehigh,
-                         ts->tv_sec, ts->tv_nsec) == -1,
-                  return -1, "influxdb_serialize_memory_stat: format");
-    assert(*buf == 0);
-    *buflen -= len;
-
-    /* struct sysinfo { */
-    /*         long uptime;             /\* Seconds since boot *\/ */
-    /*         unsigned long loads[3];  /\* 1, 5, and 15 minute load averages *\/ */
-    /*         unsigned long totalram;  /\* Total usable main memory size *\/ */
-    /*         unsigned long freeram;   /\* Available memory size *\/ */
-    /*         unsigned long sharedram; /\* Amount of shared memory *\/ */
-    /*         unsigned long bufferram; /\* Memory used by buffers *\/ */
-    /*         unsigned long totalswap; /\* Total swap space size *\/ */
-    /*         unsigned long freeswap;  /\* swap space still available *\/ */
-    /*         unsigned short procs;    /\* Number of current processes *\/ */
-    /*         unsigned long totalhigh; /\* Total high memory size *\/ */
-    /*         unsigned long freehigh;  /\* Available high memory size *\/ */
-    /*         unsigned int mem_unit;   /\* Memory unit size in bytes *\/ */
-    /*         char _f[20-2*sizeof(long)-sizeof(int)]; /\* Padding to 64 bytes *\/ */
-    /*     }; */
+    assert(w != NULL);
+
+    /* io.stat has a line per device, they are summed up */
+    static const char *io_keys[] = { "rbytes", "wbytes", "rios", "wios", "dbytes", "dios" };
+    enum { IO_KEYS = sizeof(io_keys) / sizeof(*io_keys), KEY_SIZE = 64 };
+
+    HANDLE_RESULT(lp_line_begin(w, sizeof("cgroup") +
+                                LP_TAG_SIZE("cgroup", cgroup->path) +
+                                LP_TAG_SIZE("hostname", hostname)) == -1,
+                  return -1, "influxdb_serialize_cgroup_stat: lp_line_begin");
+    lp_measurement(w, "cgroup");
+    lp_tag(w, "cgroup", cgroup->path);
+    lp_tag(w, "hostname", hostname);
+
+    /* lines that don't parse, e.g. of newer kernels, are skipped */
+    char key[KEY_SIZE];
+    struct scanner sc, fields;
+    struct span line, name, value;
+    uint64_t v;
+    for(int file = CGROUP_CPU; file <= CGROUP_MEMORY; ++file) {
+        /* key value */
+        const char *prefix = file == CGROUP_CPU ? "cpu_" : "memory_";
+        scanner_init(&sc, tree->files[file], tree->lens[file]);
+        while(scan_line(&sc, &line)) {
+            scanner_init_span(&fields, &line);
+            if(!scan_field(&fields, &name) || !scan_field(&fields, &value) ||
+               span_parse_u64(&value, &v) == -1 ||
+               influxdb_cgroup_key(key, sizeof(key), prefix, &name) == NULL) {
+                continue;
+            }
+            HANDLE_RESULT(lp_reserve(w, LP_FIELD_SIZE(key)) == -1, lp_line_abort(w); return -1,
+                          "influxdb_serialize_cgroup_stat: lp_reserve");
+            if(file == CGROUP_CPU || influxdb_cgroup_is_counter(&name)) {
+                lp_counter_int(w, key, v, 64);
+            } else {
+                lp_field_int(w, key, v);
+            }
+        }
+    }
+
+    scanner_init(&sc, tree->files[CGROUP_PRESSURE], tree->lens[CGROUP_PRESSURE]);
+    while(scan_line(&sc, &line)) {
+        /* some|full avg10=0.00 avg60=0.00 avg300=0.00 total=0, total in microseconds */
+        char prefix[KEY_SIZE];
+        struct span kind, field;
+        scanner_init_span(&fields, &line);
+        if(!scan_field(&fields, &kind) || kind.len > 8) continue;
+        snprintf(prefix, sizeof(prefix), "memory_pressure_%.*s_", (int)kind.len, kind.ptr);
+        while(scan_field(&fields, &field)) {
+            const char *eq = memchr(field.ptr, '=', field.len);
+            if(eq == NULL) continue;
+            name.ptr = field.ptr;
+            name.len = eq - field.ptr;
+            value.ptr = eq + 1;
+            value.len = field.ptr + field.len - eq - 1;
+            if(value.len == 0 || influxdb_cgroup_key(key, sizeof(key), prefix, &name) == NULL) continue;
+            HANDLE_RESULT(lp_reserve(w, LP_FIELD_SIZE(key) + value.len) == -1,
+                          lp_line_abort(w); return -1, "influxdb_serialize_cgroup_stat: lp_reserve");
+            if(!span_equals(&name, "total", sizeof("total") - 1)) {
+                lp_field_raw(w, key, strlen(key), value.ptr, value.len);
+            } else if(span_parse_u64(&value, &v) == 0) {
+                lp_counter_int(w, key, v, 64);
+            }
+        }
+    }
+
+    /* the file exists when the io controller is enabled, it is empty until there was io */
+    if(cgroup->fds[CGROUP_IO] == -1) {
+        lp_timestamp(w, ts);
+        return 0;
+    }
+    uint64_t io[IO_KEYS] = { 0 };
+    scanner_init(&sc, tree->files[CGROUP_IO], tree->lens[CGROUP_IO]);
+    while(scan_line(&sc, &line)) {
+        /* major:minor rbytes=0 wbytes=0 rios=0 wios=0 dbytes=0 dios=0 */
+        struct span device, field;
+        scanner_init_span(&fields, &line);
+        if(!scan_field(&fields, &device)) continue;
+        while(scan_field(&fields, &field)) {
+            const char *eq = memchr(field.ptr, '=', field.len);
+            if(eq == NULL) continue;
+            name.ptr = field.ptr;
+            name.len = eq - field.ptr;
+            value.ptr = eq + 1;
+            value.len = field.ptr + field.len - eq - 1;
+            for(size_t i = 0; i < IO_KEYS; ++i) {
+                if(span_equals(&name, io_keys[i], strlen(io_keys[i])) &&
+                   span_parse_u64(&value, &v) == 0) {
+                    io[i] += v;
+                    break;
+                }
+            }
+        }
+    }
+    HANDLE_RESULT(lp_reserve(w, IO_KEYS * LP_FIELD_SIZE("io_rbytes")) == -1,
+                  lp_line_abort(w); return -1, "influxdb_serialize_cgroup_stat: lp_reserve");
+    for(size_t i = 0; i < IO_KEYS; ++i) {
+        struct span io_key = { io_keys[i], strlen(io_keys[i]) };
+        lp_counter_int(w, influxdb_cgroup_key(key, sizeof(key), "io_", &io_key), io[i], 64);
+    }
+    lp_timestamp(w, ts);
     return 0;
 }
 
-int influxdb_serialize_nic_stat(const char *hostname,
-                                const struct timespec *ts,
-                                char *buf, size_t *buflen) {
+int influxdb_serialize_irq_matrix(const struct irq_matrix *matrix,
+                                  const char *measurement,
+                                  const char *tag,
+                                  const char *hostname,
+                                  const struct timespec *ts,
+                                  struct lp_writer *w) {
+    assert(matrix != NULL);
+    assert(measurement != NULL);
+    assert(tag != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
-
-    struct ifaddrs *ifa = NULL;
-    HANDLE_POSIX_RESULT(getifaddrs(&ifa), goto IFADDRS_CLEANUP,
-                        "influxdb_serialize_nic_stat: getifaddrs");
-    assert(ifa != NULL);
-    size_t offset = 0;
-    for (struct ifaddrs *cifa = ifa; cifa != NULL; cifa = cifa->ifa_next) {
-        char *b = buf + offset;
-        size_t blen = *buflen - offset;
-        assert(cifa != NULL);
-        if(cifa->ifa_flags & IFF_LOOPBACK) continue;
-        if(!(cifa->ifa_flags & IFF_UP && cifa->ifa_flags & IFF_RUNNING)) continue;
-        if(cifa->ifa_addr == NULL || cifa->ifa_addr->sa_family != AF_PACKET) continue;
-        if(cifa->ifa_data == NULL) continue;
-        struct rtnl_link_stats *stats = cifa->ifa_data;
-
-        HANDLE_RESULT(format(&b, &blen,
-                             "nic,hostname=%s,if=%s "
-                             "rx_packets=%ui,tx_packets=%ui,rx_bytes=%ui,tx_bytes=%ui,"
-                             "rx_errors=%ui,tx_errors=%ui,rx_dropped=%ui,tx_dropped=%ui,"
-                             "multicast=%ui,collisions=%ui,"
-                             "rx_length_errors=%ui,rx_over_errors=%ui,rx_crc_errors=%ui,"
-                             "rx_frame_errors=%ui,rx_fifo_errors=%ui,rx_missed_errors=%ui,"
-                             "tx_aborted_errors=%ui,tx_carrier_errors=%ui,tx_fifo_errors=%ui,"
-                             "tx_heartbeat_errors=%ui,tx_window_errors=%ui "
-                             "%ld%09ld\n",
-                             hostname, cifa->ifa_name,
-                             stats->rx_packets, stats->tx_packets, stats->rx_bytes, stats->tx_bytes,
-                             stats->rx_errors, stats->tx_errors, stats->rx_dropped, stats->tx_dropped,
-                             stats->multicast, stats->collisions,
-                             stats->rx_length_errors, stats->rx_over_errors, stats->rx_crc_errors,
-                             stats->rx_frame_errors, stats->rx_fifo_errors, stats->rx_missed_errors,
-                             stats->tx_aborted_errors, stats->tx_carrier_errors, stats->tx_fifo_errors,
-                             stats->tx_heartbeat_errors, stats->tx_window_errors,
-                             ts->tv_sec, ts->tv_nsec) == -1,
-                      (void)stats, "influxdb_serialize_nic_stat: format");
-        assert(*b == 0);
-        offset = *buflen - blen;
-        assert(buf[offset] == 0);
-
-/*
-        struct rtnl_link_stats {
-        __u32   rx_packets;             / * total packets received       * /
-        __u32   tx_packets;             / * total packets transmitted    * /
-        __u32   rx_bytes;               / * total bytes received         * /
-        __u32   tx_bytes;               / * total bytes transmitted      * /
-        __u32   rx_errors;              / * bad packets received         * /
-        __u32   tx_errors;              / * packet transmit problems     * /
-        __u32   rx_dropped;             / * no space in linux buffers    * /
-        __u32   tx_dropped;             / * no space available in linux  * /
-        __u32   multicast;              / * multicast packets received   * /
-        __u32   collisions;
-
-        / * detailed rx_errors: * /
-        __u32   rx_length_errors;
-        __u32   rx_over_errors;         / * receiver ring buff overflow  * /
-        __u32   rx_crc_errors;          / * recved pkt with crc error    * /
-        __u32   rx_frame_errors;        / * recv'd frame alignment error * /
-        __u32   rx_fifo_errors;         / * recv'r fifo overrun          * /
-        __u32   rx_missed_errors;       / * receiver missed packet       * /
-
-        / * detailed tx_errors * /
-        __u32   tx_aborted_errors;
-        __u32   tx_carrier_errors;
-        __u32   tx_fifo_errors;
-        __u32   tx_heartbeat_errors;
-        __u32   tx_window_errors;
-
-        / * for cslip etc * /
-        __u32   rx_compressed;
-        __u32   tx_compressed;
-
-        __u32   rx_nohandler;           / * dropped, no handler found    * /
-};
-*/
+    assert(w != NULL);
+
+    /* the counts are deltas of the tick, they are always sent as rates; idle rows are left out */
+    if(matrix->seconds == 0) return 0;
+    char cells[32];
+    snprintf(cells, sizeof(cells), "%s_cpu", measurement);
+    for(const struct irq_row *row = matrix->rows; row < matrix->rows + matrix->count; ++row) {
+        if(row->total == 0) continue;
+        size_t reserve = strlen(cells) + LP_TAG_SIZE("hostname", hostname) +
+                         LP_TAG_SIZE(tag, row->label) + LP_TAG_SIZE("name", row->name) +
+                         2 * LP_FIELD_SIZE("max_cpu") + 2 * (LP_FLOAT_SIZE + LP_FIELD_SIZE("count_rate"));
+        if(!matrix->cells) {
+            /* how evenly the interrupts are spread over the CPUs */
+            HANDLE_RESULT(lp_line_begin(w, reserve) == -1,
+                          return -1, "influxdb_serialize_irq_matrix: lp_line_begin");
+            lp_measurement(w, measurement);
+            lp_tag(w, "hostname", hostname);
+            lp_tag(w, tag, row->label);
+            if(row->name[0] != 0) lp_tag(w, "name", row->name);
+            lp_field_float(w, "count", sizeof("count") - 1, "_rate", row->total / matrix->seconds);
+            if(row->columns > 1) {
+                lp_field_int(w, "cpus", row->cpus);
+                lp_field_int(w, "max_cpu", matrix->cpus[row->max_column]);
+                lp_field_float(w, "max", sizeof("max") - 1, "_pct", 100.0 * row->max / row->total);
+            }
+            lp_timestamp(w, ts);
+            continue;
+        }
+        const uint32_t *deltas = &matrix->deltas[(row - matrix->rows) * matrix->column_capacity];
+        for(size_t c = 0; c < row->columns; ++c) {
+            if(deltas[c] == 0) continue;
+            char cpu[LP_INT_SIZE];
+            *lp_format_uint(cpu, matrix->cpus[c]) = 0;
+            HANDLE_RESULT(lp_line_begin(w, reserve + LP_TAG_SIZE("cpu", cpu)) == -1,
+                          return -1, "influxdb_serialize_irq_matrix: lp_line_begin");
+            lp_measurement(w, cells);
+            lp_tag(w, "cpu", cpu);
+            lp_tag(w, "hostname", hostname);
+            lp_tag(w, tag, row->label);
+            if(row->name[0] != 0) lp_tag(w, "name", row->name);
+            lp_field_float(w, "count", sizeof("count") - 1, "_rate", deltas[c] / matrix->seconds);
+            lp_timestamp(w, ts);
+        }
     }
-    assert(buf[offset] == 0);
-    *buflen = offset;
+    return 0;
+}
+
+int influxdb_serialize_nic_queue_stat(const struct netlink_queue *queues, size_t count,
+                                      const char *hostname,
+                                      const struct timespec *ts,
+                                      struct lp_writer *w) {
+    assert(queues != NULL || count == 0);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    for(const struct netlink_queue *queue = queues; queue < queues + count; ++queue) {
+        char name[sizeof("rx-") + LP_INT_SIZE];
+        memcpy(name, queue->tx ? "tx-" : "rx-", 3);
+        *lp_format_uint(name + 3, queue->id) = 0;
 
-IFADDRS_CLEANUP:
-    freeifaddrs(ifa);
+        HANDLE_RESULT(lp_line_begin(w, sizeof("nic_queue") +
+                                    LP_TAG_SIZE("hostname", hostname) +
+                                    LP_TAG_SIZE("if", queue->name) +
+                                    LP_TAG_SIZE("queue", name) +
+                                    2 * LP_FIELD_SIZE("packets")) == -1,
+                      return -1, "influxdb_serialize_nic_queue_stat: lp_line_begin");
+        lp_measurement(w, "nic_queue");
+        lp_tag(w, "hostname", hostname);
+        lp_tag(w, "if", queue->name);
+        lp_tag(w, "queue", name);
+        lp_counter_int(w, "packets", queue->packets, 64);
+        lp_counter_int(w, "bytes", queue->bytes, 64);
+        lp_timestamp(w, ts);
+    }
     return 0;
 }
 
 
-int influxdb_serialize_cpu_stat(char *stat,
+int influxdb_serialize_cpu_stat(const struct span *line,
+                                const char *tag,
                                 const char *hostname,
-                                char *buf, size_t *buflen) {
-    assert(stat != NULL);
+                                struct lp_writer *w) {
+    assert(line != NULL);
+    assert(tag != NULL);
     assert(hostname != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
+    assert(w != NULL);
 
-    static const char *tag = "cpu";
     static const char *names[] = {
         "user",
         "nice",
@@ -204,329 +540,585 @@ int influxdb_serialize_cpu_stat(char *stat,
     const long USER_HZ = sysconf(_SC_CLK_TCK);
     HANDLE_POSIX_RESULT(USER_HZ,
                         return -1, "influxdb_serialize_cpu_stat: sysconf(_SC_CLK_TCK)");
+    char user_hz[LP_INT_SIZE + 2];
+    char *end = lp_format_uint(user_hz, USER_HZ);
+    *end++ = 'i';
+    *end = 0;
 
-    size_t len = *buflen;
-    char *stash = NULL, *token = strtok_r(stat, " ", &stash);
-    HANDLE_RESULT(format(&buf, &len, ",cpu=%s",
-                         *(token + strlen(tag)) == 0 ? "all" : token + strlen(tag)) == -1,
-                  return -1, "influxdb_serialize_cpu_stat: cpu tag");
-    HANDLE_RESULT(format(&buf, &len, ",hostname=%s,user_hz=%ldi ", hostname, USER_HZ) == -1,
-                  return -1, "influxdb_serialize_cpu_stat: tags");
+    struct scanner sc;
+    struct span token;
+    scanner_init_span(&sc, line);
+    HANDLE_RESULT(!scan_field(&sc, &token),
+                  return -1, "influxdb_serialize_cpu_stat: invalid format");
+    size_t taglen = strlen(tag);
+    struct span cpu = { token.ptr + taglen, token.len - taglen };
+    if(cpu.len == 0) {
+        cpu.ptr = "all";
+        cpu.len = sizeof("all") - 1;
+    }
+    HANDLE_RESULT(lp_line_begin(w, 2 * taglen + 2 * cpu.len +
+                                LP_TAG_SIZE("cpu", "") +
+                                LP_TAG_SIZE("hostname", hostname) +
+                                LP_TAG_SIZE("user_hz", user_hz) +
+                                11 * LP_FIELD_SIZE("guest_nice")) == -1,
+                  return -1, "influxdb_serialize_cpu_stat: lp_line_begin");
+    lp_measurement(w, tag);
+    lp_tag_n(w, "cpu", cpu.ptr, cpu.len);
+    lp_tag(w, "hostname", hostname);
+    lp_tag(w, "user_hz", user_hz);
 
+    uint64_t values[sizeof(names) / sizeof(*names)];
     uint64_t total = 0;
-    for(const char **name = names, *token = strtok_r(NULL, " ", &stash);
-        token != NULL && name != NULL;
-        token = strtok_r(NULL, " ", &stash), ++name) {
-
-        char *err = NULL;
-        uint64_t value = strtoull(token, &err, 10);
-        HANDLE_RESULT(*err != 0, return -1, "influxdb_serialize_cpu_stat: strtoull");
-        total += value;
+    size_t count = 0;
+    for(; names[count] != NULL && scan_field(&sc, &token); ++count) {
+        HANDLE_RESULT(span_parse_u64(&token, &values[count]) == -1,
+                      return -1, "influxdb_serialize_cpu_stat: %s", names[count]);
+        total += values[count];
+    }
 
-        HANDLE_RESULT(format(&buf, &len, "%s=%si,", *name, token) == -1,
-                      return -1, "influxdb_serialize_cpu_stat: values");
+    if(w->rate) {
+        /* rate mode: share of the elapsed jiffies spent in every state */
+        uint64_t deltas[sizeof(names) / sizeof(*names)];
+        int valid[sizeof(names) / sizeof(*names)];
+        uint64_t elapsed = 0;
+        double seconds = 0;
+        for(size_t i = 0; i < count; ++i) {
+            valid[i] = lp_counter_delta(w, names[i], strlen(names[i]), values[i], 64,
+                                        &deltas[i], &seconds);
+        }
+        if(!lp_counter_delta(w, "total", sizeof("total") - 1, total, 64, &elapsed, &seconds) ||
+           elapsed == 0) {
+            return 0;
+        }
+        for(size_t i = 0; i < count; ++i) {
+            if(!valid[i]) continue;
+            lp_field_float(w, names[i], strlen(names[i]), "_pct", 100.0 * deltas[i] / elapsed);
+        }
+        return 0;
     }
-    HANDLE_RESULT(format(&buf, &len, "total=%" PRIu64 "i ", total) == -1,
-                  return -1, "influxdb_serialize_cpu_stat: total");
 
-    *buflen -= len;
+    for(size_t i = 0; i < count; ++i) {
+        lp_field_int(w, names[i], values[i]);
+    }
+    lp_field_int(w, "total", total);
     return 0;
 }
 
-int influxdb_serialize_ctx_stat(char *stat,
+int influxdb_serialize_ctx_stat(const struct span *line,
+                                const char *tag,
                                 const char *hostname,
-                                char *buf, size_t *buflen) {
-    assert(stat != NULL);
+                                struct lp_writer *w) {
+    assert(line != NULL);
+    assert(tag != NULL);
     assert(hostname != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
-
-    size_t len = *buflen;
-    HANDLE_RESULT(format(&buf, &len, ",hostname=%s ", hostname) == -1,
-                  return -1, "influxdb_serialize_ctx_stat: tags");
+    assert(w != NULL);
 
-    char *stash = NULL, *token = strtok_r(stat, " ", &stash);
-    token = strtok_r(NULL, " ", &stash);
-    HANDLE_RESULT(token == NULL,
+    struct scanner sc;
+    struct span token;
+    scanner_init_span(&sc, line);
+    HANDLE_RESULT(!scan_field(&sc, &token) || !scan_field(&sc, &token),
                   return -1, "influxdb_serialize_ctx_stat: invalid format");
-    HANDLE_RESULT(format(&buf, &len, "count=%s ", token) == -1,
-                  return -1, "influxdb_serialize_ctx_stat: value");
-    *buflen -= len;
+    HANDLE_RESULT(lp_line_begin(w, 2 * strlen(tag) +
+                                LP_TAG_SIZE("hostname", hostname) +
+                                LP_FIELD_SIZE("count") + token.len) == -1,
+                  return -1, "influxdb_serialize_ctx_stat: lp_line_begin");
+    lp_measurement(w, tag);
+    lp_tag(w, "hostname", hostname);
+    lp_counter_raw(w, "count", sizeof("count") - 1, token.ptr, token.len);
     return 0;
 }
 
-int influxdb_serialize_irq_stat(char *stat,
+int influxdb_serialize_irq_stat(const struct span *line,
+                                const char *tag,
                                 const char *hostname,
-                                char *buf, size_t *buflen) {
-    assert(stat != NULL);
+                                struct lp_writer *w) {
+    assert(line != NULL);
+    assert(tag != NULL);
     assert(hostname != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
-
-    size_t len = *buflen;
-    HANDLE_RESULT(format(&buf, &len, ",hostname=%s ", hostname) == -1,
-                  return -1, "influxdb_serialize_irq_stat: tags");
-    assert(*buf == 0);
-    char *stash = NULL, *token = strtok_r(stat, " ", &stash);
-    token = strtok_r(NULL, " ", &stash);
-    HANDLE_RESULT(token == NULL,
-                  return -1, "influxdb_serialize_irq_stat: invalid format");
-    HANDLE_RESULT(format(&buf, &len, "count=%s,", token) == -1,
-                  return -1, "influxdb_serialize_irq_stat: total");
-    assert(*buf == 0);
+    assert(w != NULL);
 
-    size_t idx = 0;
-    for(token = strtok_r(NULL, " ", &stash);
-        token != NULL;
-        token = strtok_r(NULL, " ", &stash), ++idx) {
+    /* every value grows at most by "irq", 4 digits of index, '=' and ',' */
+    HANDLE_RESULT(lp_line_begin(w, 2 * strlen(tag) +
+                                LP_TAG_SIZE("hostname", hostname) +
+                                5 * line->len + LP_FIELD_SIZE("count")) == -1,
+                  return -1, "influxdb_serialize_irq_stat: lp_line_begin");
+    lp_measurement(w, tag);
+    lp_tag(w, "hostname", hostname);
 
-        if(strncmp(token, "0", sizeof("0")) == 0) continue;
-        HANDLE_RESULT(format(&buf, &len, "irq%zd=%s,", idx, token) == -1,
-                      return -1, "influxdb_serialize_irq_stat: irq%zd", idx);
-        assert(*buf == 0);
-    }
+    struct scanner sc;
+    struct span token;
+    scanner_init_span(&sc, line);
+    HANDLE_RESULT(!scan_field(&sc, &token) || !scan_field(&sc, &token),
+                  return -1, "influxdb_serialize_irq_stat: invalid format");
+    lp_counter_raw(w, "count", sizeof("count") - 1, token.ptr, token.len);
 
-    if(*(buf - 1) == ',') *(buf - 1) = ' ';
-    *buflen -= len;
+    char key[sizeof("irq") + LP_INT_SIZE] = "irq";
+    for(size_t idx = 0; scan_field(&sc, &token); ++idx) {
+        if(token.len == 1 && token.ptr[0] == '0') continue;
+        size_t keylen = lp_format_uint(key + sizeof("irq") - 1, idx) - key;
+        lp_counter_raw(w, key, keylen, token.ptr, token.len);
+    }
     return 0;
 }
 
-int influxdb_serialize_nop(char *stat,
-                           const char *hostname,
-                           char *buf, size_t *buflen) {
-    assert(stat != NULL);
-    (void)stat;
-    assert(hostname != NULL);
-    (void)hostname;
-    assert(buf != NULL);
-    (void)buf;
-    assert(buflen != NULL);
-    (void)buflen;
-    return -1;
-}
 
+struct proc_stat_serializer {
+    const char* tag;
+    size_t taglen;
+    int(*handler)(const struct span *line,
+                  const char *tag,
+                  const char *hostname,
+                  struct lp_writer *w);
+};
+
+#define PROC_STAT_SERIALIZER(name, fn) \
+    { .tag = name, .taglen = sizeof(name) - 1, .handler = fn }
+
+/* picks the serializer by the first character of the line */
+const struct proc_stat_serializer *influxdb_proc_stat_dispatch(const struct span *line) {
+    assert(line != NULL);
+
+    static const struct proc_stat_serializer cpu =
+        PROC_STAT_SERIALIZER("cpu", &influxdb_serialize_cpu_stat);
+    static const struct proc_stat_serializer ctxt =
+        PROC_STAT_SERIALIZER("ctxt", &influxdb_serialize_ctx_stat);
+    static const struct proc_stat_serializer intr =
+        PROC_STAT_SERIALIZER("intr", &influxdb_serialize_irq_stat);
+    static const struct proc_stat_serializer softirq =
+        PROC_STAT_SERIALIZER("softirq", &influxdb_serialize_irq_stat);
 
-int influxdb_serialize_proc_stat(char *stat,
+    const struct proc_stat_serializer *s = NULL;
+    switch(line->len > 0 ? line->ptr[0] : 0) {
+        case 'c':
+            s = line->len > 1 && line->ptr[1] == 'p' ? &cpu : &ctxt;
+            break;
+        case 'i':
+            s = &intr;
+            break;
+        case 's':
+            s = &softirq;
+            break;
+        default:
+            return NULL;
+    }
+    return span_has_prefix(line, s->tag, s->taglen) ? s : NULL;
+}
+
+int influxdb_serialize_proc_stat(const char *stat, size_t statlen,
                                  const char *hostname,
                                  const struct timespec *ts,
-                                 char *buf, size_t *buflen) {
+                                 struct lp_writer *w) {
     assert(stat != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
+    assert(w != NULL);
 
-    struct serializer {
-        const char* tag;
-        int(*handler)(char *stat,
-                      const char *hostname,
-                      char *buf, size_t *buflen);
-    };
+    struct scanner sc;
+    struct span line;
+    scanner_init(&sc, stat, statlen);
+    while(scan_line(&sc, &line)) {
+        const struct proc_stat_serializer *s = influxdb_proc_stat_dispatch(&line);
+        if(s == NULL) continue;
+        HANDLE_RESULT((*s->handler)(&line, s->tag, hostname, w) == -1,
+                      lp_line_abort(w); goto NEXT_LINE,
+                      "influxdb_serialize_proc_stat[%s]: "
+                      "failed to serialize content", s->tag);
+        lp_timestamp(w, ts);
+NEXT_LINE:
+        ;
+    }
+    return 0;
+}
 
-    static const struct serializer serializer[] = {
-        {
-            .tag = "cpu",
-            .handler = &influxdb_serialize_cpu_stat
-        },
-        {
-            .tag = "intr",
-            .handler = &influxdb_serialize_irq_stat
-        },
-        {
-            .tag = "ctxt",
-            .handler = &influxdb_serialize_ctx_stat
-        },
-        {
-            .tag = "softirq",
-            .handler = &influxdb_serialize_irq_stat
-        },
-        {
-            .tag = NULL,
-            .handler = NULL
-        }
-    };
 
-    size_t offset = 0;
-    for(char *stash = NULL, *token = strtok_r(stat, "\n", &stash);
-        token != NULL;
-        token = strtok_r(NULL, "\n", &stash)) {
-        for(const struct serializer *s = serializer; s->tag != NULL; ++s) {
-            if(strncmp(token, s->tag, strlen(s->tag)) == 0) {
-                char *b = buf + offset;
-                size_t blen = *buflen - offset;
-                HANDLE_RESULT(format(&b, &blen, "%s", s->tag) == -1,
-                              goto NEXT_TOKEN,
-                              "influxdb_serialize_proc_stat[%s]: "
-                              "failed to serialize tag", s->tag);
-                assert(*b == 0);
-                size_t clen = blen;
-                HANDLE_RESULT((*s->handler)(token, hostname, b, &clen) == -1,
-                              goto NEXT_TOKEN,
-                              "influxdb_serialize_proc_stat[%s]: "
-                              "failed to serialize content", s->tag);
-                b += clen;
-                blen -= clen;
-                assert(*b == 0);
-                HANDLE_RESULT(format(&b, &blen, "%ld%09ld\n",
-                                     ts->tv_sec, ts->tv_nsec) == -1,
-                              goto NEXT_TOKEN,
-                              "influxdb_serialize_proc_stat[%s]: "
-                              "failed to serialize timestamp", s->tag);
-                assert(*b == 0);
-                offset = *buflen - blen;
-                assert(buf[offset] == 0);
-        NEXT_TOKEN:
-                buf[offset] = 0;
-            }
-        }
+/* snmp values that are settings or current levels rather than counters */
+int influxdb_is_gauge(const struct span *key) {
+    assert(key != NULL);
+
+    static const char *gauges[] = {
+        "Forwarding", "DefaultTTL", /* Ip */
+        "RtoAlgorithm", "RtoMin", "RtoMax", "MaxConn", "CurrEstab", /* Tcp */
+        NULL
+    };
+    for(const char **gauge = gauges; *gauge != NULL; ++gauge) {
+        if(span_equals(key, *gauge, strlen(*gauge))) return 1;
     }
-    assert(buf[offset] == 0);
-    *buflen = offset;
     return 0;
 }
 
-
-int influxdb_serialize_kv(char *keys, char *values,
+int influxdb_serialize_kv(const struct span *keys, const struct span *values,
                           const char *hostname,
-                          char *buf, size_t *buflen) {
+                          struct lp_writer *w) {
     assert(keys != NULL);
     assert(values != NULL);
     assert(hostname != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
-
-    size_t len = *buflen;
+    assert(w != NULL);
 
-    char *kstash = NULL;
-    char *vstash = NULL;
-
-    char *ktag = strtok_r(keys, ": ", &kstash);
-    char *vtag = strtok_r(values, ": ", &vstash);
-    HANDLE_RESULT(ktag == NULL || vtag == NULL || strcmp(ktag, vtag) != 0,
+    struct scanner ksc, vsc;
+    struct span ktag = { "", 0 }, vtag = { "", 0 };
+    scanner_init_span(&ksc, keys);
+    scanner_init_span(&vsc, values);
+    HANDLE_RESULT(!scan_field(&ksc, &ktag) || !scan_field(&vsc, &vtag) ||
+                  ktag.len < 2 || ktag.ptr[ktag.len - 1] != ':' ||
+                  !span_equals(&ktag, vtag.ptr, vtag.len),
                   return -1, "influxdb_serialize_kv: tag mismatch - "
-                  "key=%s, value=%s\n", ktag, vtag);
+                  "key=%.*s, value=%.*s\n",
+                  (int)ktag.len, ktag.ptr, (int)vtag.len, vtag.ptr);
+    --ktag.len; /* drop ':' */
 
-    HANDLE_RESULT(format(&buf, &len, "%s,hostname=%s ", ktag, hostname) == -1,
-                  return -1, "influxdb_serialize_kv: tag=%s", ktag);
-    assert(*buf == 0);
+    /* keys are escaped at most twice their length, values are copied */
+    HANDLE_RESULT(lp_line_begin(w, 2 * keys->len + values->len +
+                                LP_TAG_SIZE("hostname", hostname)) == -1,
+                  return -1, "influxdb_serialize_kv: tag=%.*s", (int)ktag.len, ktag.ptr);
+    lp_measurement_n(w, ktag.ptr, ktag.len);
+    lp_tag(w, "hostname", hostname);
 
-    char *key = strtok_r(NULL, " ", &kstash);
-    char *value = strtok_r(NULL, " ", &vstash);
-    while(key != NULL && value != NULL) {
-        HANDLE_RESULT(format(&buf, &len, "%s=%s,", key, value) == -1,
-                      return -1, "influxdb_serialize_kv: %s=%s", key, value);
-        assert(*buf == 0);
-        key = strtok_r(NULL, " ", &kstash);
-        value = strtok_r(NULL, " ", &vstash);
+    struct span key, value;
+    int haskey = scan_field(&ksc, &key);
+    int hasvalue = scan_field(&vsc, &value);
+    while(haskey && hasvalue) {
+        if(w->rate && !influxdb_is_gauge(&key)) {
+            lp_counter_raw(w, key.ptr, key.len, value.ptr, value.len);
+        } else {
+            lp_field_raw(w, key.ptr, key.len, value.ptr, value.len);
+        }
+        haskey = scan_field(&ksc, &key);
+        hasvalue = scan_field(&vsc, &value);
     }
 
-    HANDLE_RESULT(key != NULL,
+    HANDLE_RESULT(haskey,
                   return -1, "influxdb_serialize_kv: too many keys");
-    HANDLE_RESULT(value != NULL,
+    HANDLE_RESULT(hasvalue,
                   return -1, "influxdb_serialize_kv: too many values");
-
-    assert(*buf == 0);
-    if(*(buf - 1) == ',') *(buf - 1) = ' ';
-    *buflen -= len;
     return 0;
 }
 
-int influxdb_serialize_net_stat(char *stat,
+int influxdb_serialize_net_stat(const char *stat, size_t statlen,
                                 const char **tags,
                                 const char *hostname,
                                 const struct timespec *ts,
-                                char *buf, size_t *buflen) {
+                                struct lp_writer *w) {
     assert(stat != NULL);
     assert(tags != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
+    assert(w != NULL);
 
-    size_t offset = 0;
-    char *stash = NULL;
-    for(char *names = strtok_r(stat, "\n", &stash), *values = strtok_r(NULL, "\n", &stash);
-        names != NULL && values != NULL;
-        names = strtok_r(NULL, "\n", &stash), values = strtok_r(NULL, "\n", &stash)) {
+    struct scanner sc;
+    struct span names, values;
+    scanner_init(&sc, stat, statlen);
+    while(scan_line(&sc, &names) && scan_line(&sc, &values)) {
+        const char *colon = scan_find(names.ptr, names.ptr + names.len, ':');
+        size_t namelen = colon - names.ptr;
         for(const char **tag = tags; *tag != NULL; ++tag) {
-            if(strncmp(names, *tag, strlen(*tag)) != 0 || *(names + strlen(*tag)) != ':') {
+            if(namelen == 0 || (*tag)[0] != names.ptr[0] || strlen(*tag) != namelen ||
+               memcmp(names.ptr, *tag, namelen) != 0) {
                 continue;
             }
-            char *b = buf + offset;
-            size_t blen = *buflen - offset;
-            size_t clen = blen;
-            HANDLE_RESULT(influxdb_serialize_kv(names, values, hostname, b, &clen) == -1,
-                          goto NEXT_TOKEN,
+            HANDLE_RESULT(influxdb_serialize_kv(&names, &values, hostname, w) == -1,
+                          lp_line_abort(w); goto NEXT_LINE,
                           "influxdb_serialize_net_stat[%s]: "
                           "failed to serialize content", *tag);
-            b += clen;
-            blen -= clen;
-            assert(*b == 0);
-            HANDLE_RESULT(format(&b, &blen, "%ld%09ld\n",
-                                 ts->tv_sec, ts->tv_nsec) == -1,
-                          goto NEXT_TOKEN,
-                          "influxdb_serialize_net_stat[%s]: "
-                          "failed to serialize timestamp", *tag);
-            assert(*b == 0);
-            offset = *buflen - blen;
-            assert(buf[offset] == 0);
-        NEXT_TOKEN:
-            buf[offset] = 0;
+            lp_timestamp(w, ts);
+        NEXT_LINE:
+            break;
         }
     }
-    assert(buf[offset] == 0);
-    *buflen = offset;
     return 0;
 }
 
-int influxdb_serialize_softnet_stat(char *stat,
+int influxdb_serialize_softnet_stat(const char *stat, size_t statlen,
                                     const char *hostname,
                                     const struct timespec *ts,
-                                    char *buf, size_t *buflen) {
+                                    struct lp_writer *w) {
     assert(stat != NULL);
     assert(hostname != NULL);
     assert(ts != NULL);
-    assert(buf != NULL);
-    assert(buflen != NULL);
-
-    size_t cpu = 0;
-    size_t offset = 0;
-    for(char *stash = NULL, *line = strtok_r(stat, "\n", &stash);
-        line != NULL;
-        line = strtok_r(NULL, "\n", &stash), ++cpu) {
-        unsigned int processed = 0, dropped = 0, timeout = 0;
-        unsigned int unused = 0;
-        unsigned int cpu_collision = 0, received_rps = 0, flow_limit_count = 0;
-        HANDLE_RESULT(
-            sscanf(line, "%08x %08x %08x %08x %08x %08x %08x %08x %08x %08x %08x",
-                   &processed, &dropped, &timeout,
-                   &unused, &unused, &unused, &unused, &unused,
-                   &cpu_collision, &received_rps, &flow_limit_count) < 11,
-            goto NEXT_TOKEN,
-            "influxdb_serialize_softnet_stat: "
-            "unable deserialize string %s\n", line);
-
-        char *b = buf + offset;
-        size_t blen = *buflen - offset;
-        HANDLE_RESULT(format(&b, &blen,
-                             "softnet,cpu=%zu,hostname=%s "
-                             "processed=%u,dropped=%u,timeout=%u,"
-                             "cpu_collision=%u,received_rps=%u,flow_limit_count=%u "
-                             "%ld%09ld\n",
-                             cpu, hostname,
-                             processed, dropped, timeout,
-                             cpu_collision, received_rps, flow_limit_count,
-                             ts->tv_sec, ts->tv_nsec) == -1,
+    assert(w != NULL);
+
+    enum {
+        PROCESSED = 0, DROPPED = 1, TIMEOUT = 2,
+        CPU_COLLISION = 8, RECEIVED_RPS = 9, FLOW_LIMIT_COUNT = 10,
+        COLUMNS = 11
+    };
+
+    struct scanner sc;
+    struct span line;
+    scanner_init(&sc, stat, statlen);
+    for(size_t cpu = 0; scan_line(&sc, &line); ++cpu) {
+        uint64_t values[COLUMNS];
+        struct scanner fields;
+        struct span field;
+        size_t column = 0;
+        scanner_init_span(&fields, &line);
+        for(; column < COLUMNS && scan_field(&fields, &field); ++column) {
+            HANDLE_RESULT(span_parse_hex(&field, &values[column]) == -1,
+                          goto NEXT_TOKEN,
+                          "influxdb_serialize_softnet_stat: "
+                          "unable deserialize string %.*s\n", (int)line.len, line.ptr);
+        }
+        HANDLE_RESULT(column < COLUMNS,
+                      goto NEXT_TOKEN,
+                      "influxdb_serialize_softnet_stat: "
+                      "unable deserialize string %.*s\n", (int)line.len, line.ptr);
+
+        HANDLE_RESULT(lp_line_begin(w, sizeof("softnet") +
+                                    LP_TAG_SIZE("cpu", "") + LP_INT_SIZE +
+                                    LP_TAG_SIZE("hostname", hostname) +
+                                    6 * LP_FIELD_SIZE("flow_limit_count")) == -1,
                       goto NEXT_TOKEN,
                       "influxdb_serialize_softnet_stat: "
                       "failed to serialize for cpu%zu", cpu);
-        assert(*b == 0);
-        offset = *buflen - blen;
-        assert(buf[offset] == 0);
+        char cpuid[LP_INT_SIZE];
+        lp_measurement(w, "softnet");
+        lp_tag_n(w, "cpu", cpuid, lp_format_uint(cpuid, cpu) - cpuid);
+        lp_tag(w, "hostname", hostname);
+        lp_counter_number(w, "processed", values[PROCESSED], 32);
+        lp_counter_number(w, "dropped", values[DROPPED], 32);
+        lp_counter_number(w, "timeout", values[TIMEOUT], 32);
+        lp_counter_number(w, "cpu_collision", values[CPU_COLLISION], 32);
+        lp_counter_number(w, "received_rps", values[RECEIVED_RPS], 32);
+        lp_counter_number(w, "flow_limit_count", values[FLOW_LIMIT_COUNT], 32);
+        lp_timestamp(w, ts);
 NEXT_TOKEN:
         ;
     }
-    assert(buf[offset] == 0);
-    *buflen = offset;
+    return 0;
+}
+
+/* a device passes when it matches an include pattern (if any) and no exclude pattern */
+int influxdb_select_device(const char *name, const char **include, const char **exclude) {
+    assert(name != NULL);
+
+    if(include != NULL && *include != NULL) {
+        while(*include != NULL && fnmatch(*include, name, 0) != 0) ++include;
+        if(*include == NULL) return 0;
+    }
+    for(; exclude != NULL && *exclude != NULL; ++exclude) {
+        if(fnmatch(*exclude, name, 0) == 0) return 0;
+    }
+    return 1;
+}
+
+int influxdb_serialize_disk_stat(const char *diskstats, size_t len,
+                                 const char **include,
+                                 const char **exclude,
+                                 const char *hostname,
+                                 const struct timespec *ts,
+                                 struct lp_writer *w) {
+    assert(diskstats != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    /* columns after major, minor and name; discards came with 4.18, flushes with 5.5 */
+    static const struct {
+        const char *key;
+        unsigned width;     /* times in ms are printed as unsigned int */
+        unsigned scale;     /* sectors are 512 bytes whatever the device */
+    } columns[] = {
+        { "reads", 64, 1 },
+        { "reads_merged", 64, 1 },
+        { "read_bytes", 64, 512 },
+        { "read_time_ms", 32, 1 },
+        { "writes", 64, 1 },
+        { "writes_merged", 64, 1 },
+        { "write_bytes", 64, 512 },
+        { "write_time_ms", 32, 1 },
+        { "in_flight", 0, 1 },      /* a gauge */
+        { "io_time_ms", 32, 1 },
+        { "weighted_io_time_ms", 32, 1 },
+        { "discards", 64, 1 },
+        { "discards_merged", 64, 1 },
+        { "discard_bytes", 64, 512 },
+        { "discard_time_ms", 32, 1 },
+        { "flushes", 64, 1 },
+        { "flush_time_ms", 32, 1 }
+    };
+    enum { COLUMNS = sizeof(columns) / sizeof(*columns), MIN_COLUMNS = 11 };
+
+    struct scanner sc;
+    struct span line;
+    scanner_init(&sc, diskstats, len);
+    while(scan_line(&sc, &line)) {
+        uint64_t values[COLUMNS];
+        struct scanner fields;
+        struct span major, minor, device;
+        scanner_init_span(&fields, &line);
+        HANDLE_RESULT(!scan_field(&fields, &major) || !scan_field(&fields, &minor) ||
+                      !scan_field(&fields, &device) || device.len > 32,
+                      goto NEXT_DEVICE,
+                      "influxdb_serialize_disk_stat: "
+                      "unable deserialize string %.*s\n", (int)line.len, line.ptr);
+        char name[33];
+        memcpy(name, device.ptr, device.len);
+        name[device.len] = 0;
+        if(!influxdb_select_device(name, include, exclude)) continue;
+
+        size_t count = 0;
+        struct span field;
+        for(; count < COLUMNS && scan_field(&fields, &field); ++count) {
+            HANDLE_RESULT(span_parse_u64(&field, &values[count]) == -1,
+                          goto NEXT_DEVICE,
+                          "influxdb_serialize_disk_stat: "
+                          "unable deserialize string %.*s\n", (int)line.len, line.ptr);
+        }
+        HANDLE_RESULT(count < MIN_COLUMNS,
+                      goto NEXT_DEVICE,
+                      "influxdb_serialize_disk_stat: "
+                      "unable deserialize string %.*s\n", (int)line.len, line.ptr);
+
+        HANDLE_RESULT(lp_line_begin(w, sizeof("disk") +
+                                    LP_TAG_SIZE("device", name) +
+                                    LP_TAG_SIZE("hostname", hostname) +
+                                    COLUMNS * LP_FIELD_SIZE("weighted_io_time_ms")) == -1,
+                      goto NEXT_DEVICE,
+                      "influxdb_serialize_disk_stat: failed to serialize for %s", name);
+        lp_measurement(w, "disk");
+        lp_tag(w, "device", name);
+        lp_tag(w, "hostname", hostname);
+        for(size_t i = 0; i < count; ++i) {
+            if(columns[i].width == 0) {
+                lp_field_int(w, columns[i].key, values[i]);
+            } else {
+                lp_counter_int(w, columns[i].key, values[i] * columns[i].scale, columns[i].width);
+            }
+        }
+        lp_timestamp(w, ts);
+NEXT_DEVICE:
+        ;
+    }
+    return 0;
+}
+
+int influxdb_serialize_collector_stat(const char *collector,
+                                      const struct telemetry *t,
+                                      const char *hostname,
+                                      const struct timespec *ts,
+                                      struct lp_writer *w) {
+    assert(collector != NULL);
+    assert(t != NULL);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    /* upper bounds of the latency buckets */
+    static const char *buckets[TELEMETRY_BUCKETS] = {
+        "latency_lt_1us", "latency_lt_2us", "latency_lt_4us", "latency_lt_8us",
+        "latency_lt_16us", "latency_lt_32us", "latency_lt_64us", "latency_lt_128us",
+        "latency_lt_256us", "latency_lt_512us", "latency_lt_1024us", "latency_lt_2048us",
+        "latency_lt_4096us", "latency_lt_8192us", "latency_lt_16384us", "latency_lt_32768us",
+        "latency_lt_65536us", "latency_lt_131072us", "latency_lt_262144us", "latency_lt_524288us",
+        "latency_lt_1048576us", "latency_lt_2097152us", "latency_lt_4194304us", "latency_inf"
+    };
+
+    uint64_t samples = 0;
+    for(size_t i = 0; i < TELEMETRY_BUCKETS; ++i) samples += t->latency[i];
+
+    HANDLE_RESULT(lp_line_begin(w, sizeof("agent") +
+                                LP_TAG_SIZE("collector", collector) +
+                                LP_TAG_SIZE("hostname", hostname) +
+                                (14 + TELEMETRY_BUCKETS) * LP_FIELD_SIZE("latency_lt_4194304us")) == -1,
+                  return -1, "influxdb_serialize_collector_stat: lp_line_begin");
+    lp_measurement(w, "agent");
+    lp_tag(w, "collector", collector);
+    lp_tag(w, "hostname", hostname);
+    lp_counter_int(w, "samples", samples, 64);
+    lp_counter_int(w, "errors", t->errors, 64);
+    lp_counter_int(w, "send_errors", __atomic_load_n(&t->send_errors, __ATOMIC_RELAXED), 64);
+    lp_counter_int(w, "overruns", t->overruns, 64);
+    lp_counter_int(w, "dropped", t->dropped, 64);
+    lp_counter_int(w, "bytes", t->bytes, 64);
+    lp_counter_int(w, "lines", t->lines, 64);
+    lp_counter_int(w, "allocations", t->allocations, 64);
+    lp_counter_int(w, "growths", t->growths, 64);
+    lp_counter_int(w, "latency_ns", t->latency_sum, 64);
+    lp_field_int(w, "latency_max_ns", t->latency_max);
+    lp_counter_int(w, "sends", __atomic_load_n(&t->sends, __ATOMIC_RELAXED), 64);
+    lp_counter_int(w, "send_delay_ns", __atomic_load_n(&t->send_delay_sum, __ATOMIC_RELAXED), 64);
+    lp_field_int(w, "send_delay_max_ns", __atomic_load_n(&t->send_delay_max, __ATOMIC_RELAXED));
+    /* buckets show up once they were hit */
+    for(size_t i = 0; i < TELEMETRY_BUCKETS; ++i) {
+        if(t->latency[i] != 0) lp_counter_int(w, buckets[i], t->latency[i], 64);
+    }
+    lp_timestamp(w, ts);
+    return 0;
+}
+
+/* the http and spool pointers are set when the sink opens, the counters change while it sends */
+static inline void influxdb_sink_fields(struct lp_writer *w, const struct sink *sink,
+                                        const struct sink_stat *stat) {
+    lp_counter_int(w, "sent_bytes", __atomic_load_n(&stat->bytes, __ATOMIC_RELAXED), 64);
+    lp_counter_int(w, "sent_datagrams", __atomic_load_n(&stat->datagrams, __ATOMIC_RELAXED), 64);
+    lp_counter_int(w, "send_errors", __atomic_load_n(&stat->errors, __ATOMIC_RELAXED), 64);
+    if(sink->http != NULL) {
+        lp_counter_int(w, "http_requests", __atomic_load_n(&stat->http_requests, __ATOMIC_RELAXED), 64);
+        lp_counter_int(w, "http_failures", __atomic_load_n(&stat->http_failures, __ATOMIC_RELAXED), 64);
+        lp_field_int(w, "http_queued", __atomic_load_n(&stat->http_queued, __ATOMIC_RELAXED));
+    }
+    if(sink->spool != NULL) {
+        lp_field_int(w, "spooled", __atomic_load_n(&stat->spooled, __ATOMIC_RELAXED));
+        lp_counter_int(w, "spool_dropped", __atomic_load_n(&stat->spool_dropped, __ATOMIC_RELAXED), 64);
+        lp_field_int(w, "healthy", __atomic_load_n(&stat->healthy, __ATOMIC_RELAXED));
+    }
+}
+
+/* the sink fields are on the agent line, or on a line per sink when there are several */
+int influxdb_serialize_agent_stat(const char *statm, size_t statmlen, /* content of /proc/self/statm */
+                                  const struct sink *sinks,
+                                  const struct sink_stat *stats,
+                                  size_t count,
+                                  const char *hostname,
+                                  const struct timespec *ts,
+                                  struct lp_writer *w) {
+    assert(statm != NULL);
+    assert(sinks != NULL);
+    assert(stats != NULL);
+    assert(count > 0);
+    assert(hostname != NULL);
+    assert(ts != NULL);
+    assert(w != NULL);
+
+    /* size resident shared text lib data dt, in pages */
+    struct scanner sc;
+    struct span token;
+    uint64_t resident = 0;
+    scanner_init(&sc, statm, statmlen);
+    HANDLE_RESULT(!scan_field(&sc, &token) || !scan_field(&sc, &token) ||
+                  span_parse_u64(&token, &resident) == -1,
+                  return -1, "influxdb_serialize_agent_stat: "
+                  "unable deserialize string %.*s", (int)statmlen, statm);
+
+    struct rusage usage;
+    HANDLE_POSIX_RESULT(getrusage(RUSAGE_SELF, &usage), return -1,
+                        "influxdb_serialize_agent_stat: getrusage");
+
+    HANDLE_RESULT(lp_line_begin(w, sizeof("agent") +
+                                LP_TAG_SIZE("hostname", hostname) +
+                                13 * LP_FIELD_SIZE("sent_datagrams")) == -1,
+                  return -1, "influxdb_serialize_agent_stat: lp_line_begin");
+    lp_measurement(w, "agent");
+    lp_tag(w, "hostname", hostname);
+    lp_field_int(w, "rss", resident * sysconf(_SC_PAGESIZE));
+    lp_field_int(w, "maxrss", (int64_t)usage.ru_maxrss * 1024);
+    lp_counter_int(w, "utime_us", usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec, 64);
+    lp_counter_int(w, "stime_us", usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec, 64);
+    if(count == 1) influxdb_sink_fields(w, &sinks[0], &stats[0]);
+    lp_timestamp(w, ts);
+
+    for(size_t i = 0; count > 1 && i < count; ++i) {
+        const struct sink *sink = &sinks[i];
+        HANDLE_RESULT(lp_line_begin(w, sizeof("agent") +
+                                    LP_TAG_SIZE("hostname", hostname) +
+                                    LP_TAG_SIZE("sink", sink->name) +
+                                    10 * LP_FIELD_SIZE("sent_datagrams")) == -1,
+                      return -1, "influxdb_serialize_agent_stat: lp_line_begin");
+        lp_measurement(w, "agent");
+        lp_tag(w, "hostname", hostname);
+        lp_tag(w, "sink", sink->name);
+        influxdb_sink_fields(w, sink, &stats[i]);
+        lp_field_int(w, "available", __atomic_load_n(&stats[i].available, __ATOMIC_RELAXED));
+        lp_timestamp(w, ts);
+    }
     return 0;
 }
@@ -3,28 +3,122 @@
 
 #include <sys/types.h>
 
-int influxdb_serialize_memory_stat(const char *hostname,
+#include <stdint.h>
+
+#include "line_protocol.h"
+
+/*
+ * Fields of the "key value" lines of /proc/meminfo and /proc/vmstat. Their
+ * keys and order don't change while the kernel runs, so the lines are looked
+ * up once, on the first read, and later reads only parse the values of the
+ * selected lines. The layout is checked on every read with the position of
+ * the separator and the first letter of each key; when it changed (e.g.
+ * snapshots of another kernel) the lines are looked up again.
+ */
+#define INFLUXDB_FIELDS 512         /* lines of a file, the rest are ignored */
+#define INFLUXDB_FIELD_SIZE 48
+
+struct influxdb_field {
+    char name[INFLUXDB_FIELD_SIZE]; /* field key, empty when the line is not sent */
+    uint8_t keylen;                 /* length of the key in the file, 0 for an unknown line */
+    char first;                     /* its first character */
+    uint8_t counter;                /* a cumulative counter rather than a current value */
+    uint16_t scale;                 /* 1024 for kB */
+};
+
+struct influxdb_field_map {
+    const char **include;       /* NULL terminated fnmatch(3) patterns of the field keys, all if empty */
+    struct influxdb_field fields[INFLUXDB_FIELDS];
+    size_t count;               /* lines looked up, 0 before the first read */
+    size_t reserve;             /* worst case size of the selected fields */
+};
+
+int influxdb_serialize_memory_stat(struct influxdb_field_map *map,
+                                   const char *meminfo, size_t meminfolen, /* content of /proc/meminfo */
+                                   const char *hostname,
                                    const struct timespec *ts,
-                                   char *buf, size_t *buflen);
+                                   struct lp_writer *w);
+
+int influxdb_serialize_vmstat(struct influxdb_field_map *map,
+                              const char *vmstat, size_t vmstatlen, /* content of /proc/vmstat */
+                              const char *hostname,
+                              const struct timespec *ts,
+                              struct lp_writer *w);
 
-int influxdb_serialize_nic_stat(const char *hostname,
+struct sink;
+struct sink_stat;
+struct telemetry;
+
+int influxdb_serialize_collector_stat(const char *collector,
+                                      const struct telemetry *t,
+                                      const char *hostname,
+                                      const struct timespec *ts,
+                                      struct lp_writer *w);
+
+int influxdb_serialize_agent_stat(const char *statm, size_t statmlen, /* content of /proc/self/statm */
+                                  const struct sink *sinks,
+                                  const struct sink_stat *stats,    /* per sink, see fanout_publish() */
+                                  size_t count,
+                                  const char *hostname,
+                                  const struct timespec *ts,
+                                  struct lp_writer *w);
+
+struct netlink_link;
+struct netlink_queue;
+struct process_table;
+struct cgroup_tree;
+struct cgroup;
+struct irq_matrix;
+
+int influxdb_serialize_nic_stat(const struct netlink_link *links, size_t count,
+                                const char *hostname,
                                 const struct timespec *ts,
-                                char *buf, size_t *buflen);
+                                struct lp_writer *w);
 
-int influxdb_serialize_proc_stat(char *stat, /* content of /proc/stat */
+int influxdb_serialize_nic_queue_stat(const struct netlink_queue *queues, size_t count,
+                                      const char *hostname,
+                                      const struct timespec *ts,
+                                      struct lp_writer *w);
+
+int influxdb_serialize_process_stat(const struct process_table *table,
+                                    const char *hostname,
+                                    const struct timespec *ts,
+                                    struct lp_writer *w);
+
+int influxdb_serialize_cgroup_stat(const struct cgroup_tree *tree,  /* holding the files of cgroup */
+                                   const struct cgroup *cgroup,
+                                   const char *hostname,
+                                   const struct timespec *ts,
+                                   struct lp_writer *w);
+
+int influxdb_serialize_irq_matrix(const struct irq_matrix *matrix,
+                                  const char *measurement,  /* interrupts or softirqs */
+                                  const char *tag,          /* of the row label */
+                                  const char *hostname,
+                                  const struct timespec *ts,
+                                  struct lp_writer *w);
+
+int influxdb_serialize_proc_stat(const char *stat, size_t statlen, /* content of /proc/stat */
                                  const char *hostname,
                                  const struct timespec *ts,
-                                 char *buf, size_t *buflen);
+                                 struct lp_writer *w);
 
-int influxdb_serialize_net_stat(char *stat, /* content of /proc/net/(netstat|snmp) */
+int influxdb_serialize_net_stat(const char *stat, size_t statlen, /* content of /proc/net/(netstat|snmp) */
                                 const char **tags,
                                 const char *hostname,
                                 const struct timespec *ts,
-                                char *buf, size_t *buflen);
+                                struct lp_writer *w);
+
+int influxdb_serialize_disk_stat(const char *diskstats, size_t len, /* content of /proc/diskstats */
+                                 const char **include,  /* NULL terminated fnmatch(3) patterns */
+                                 const char **exclude,
+                                 const char *hostname,
+                                 const struct timespec *ts,
+                                 struct lp_writer *w);
 
-int influxdb_serialize_softnet_stat(char *stat,
+int influxdb_serialize_softnet_stat(const char *stat, size_t statlen,
                                     const char *hostname,
                                     const struct timespec *ts,
-                                    char *buf, size_t *buflen);
+                                    struct lp_writer *w);
 
 #endif // INFLUXDB_H_
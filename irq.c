@@ -0,0 +1,196 @@
+#include "irq.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "error_handling.h"
+#include "scanner.h"
+
+/* columns are printed as "%10u ", each count is skipped to and parsed in one pass */
+static inline const char *irq_parse_count(const char *p, const char *end, uint32_t *value) {
+    while(p < end && *p == ' ') ++p;
+    if(p == end || (unsigned)(*p - '0') > 9) return NULL;
+    uint32_t v = 0;
+    for(; p < end && (unsigned)(*p - '0') <= 9; ++p) v = v * 10 + (*p - '0');
+    *value = v;
+    return p;
+}
+
+/* "  24:" -> "24", NULL when the line has no label */
+static inline const char *irq_label(const struct span *line, struct span *label) {
+    const char *end = line->ptr + line->len;
+    const char *p = line->ptr;
+    while(p < end && *p == ' ') ++p;
+    const char *colon = memchr(p, ':', end - p);
+    if(colon == NULL) return NULL;
+    label->ptr = p;
+    label->len = colon - p;
+    return colon + 1;
+}
+
+/* actions of an interrupt follow two spaces, e.g. "IO-APIC   2-edge      timer" */
+void irq_name(char *name, const char *p, const char *end) {
+    assert(name != NULL);
+
+    while(p < end && *p == ' ') ++p;
+    const char *start = p;
+    for(const char *q = p; q + 1 < end; ++q) {
+        if(q[0] == ' ' && q[1] == ' ') start = q + 2;
+    }
+    while(start < end && *start == ' ') ++start;
+    while(end > start && end[-1] == ' ') --end;
+    size_t len = end - start < IRQ_NAME_SIZE ? (size_t)(end - start) : IRQ_NAME_SIZE - 1;
+    memcpy(name, start, len);
+    name[len] = 0;
+    for(char *c = name; *c != 0; ++c) {
+        if((unsigned char)*c < ' ' || *c == 0x7f) *c = '?';
+    }
+}
+
+/* builds the matrix for the layout of buf and takes its counts as the baseline */
+int irq_layout(struct irq_matrix *matrix, const char *buf, size_t len) {
+    assert(matrix != NULL);
+    assert(buf != NULL);
+
+    struct scanner sc;
+    struct span header, line, field;
+    scanner_init(&sc, buf, len);
+    HANDLE_RESULT(!scan_line(&sc, &header), return -1, "irq_layout: no header");
+
+    size_t columns = 0, rows = 0;
+    struct scanner fields;
+    scanner_init_span(&fields, &header);
+    while(scan_field(&fields, &field)) columns += span_has_prefix(&field, "CPU", 3);
+    for(struct scanner rest = sc; scan_line(&rest, &line);) ++rows;
+    HANDLE_RESULT(columns == 0, return -1, "irq_layout: no CPU columns");
+
+    if(rows > matrix->capacity || columns > matrix->column_capacity) {
+        size_t capacity = rows > matrix->capacity ? rows + rows / 4 : matrix->capacity;
+        size_t column_capacity = columns > matrix->column_capacity ? columns : matrix->column_capacity;
+        free(matrix->rows);
+        free(matrix->counts);
+        free(matrix->deltas);
+        free(matrix->cpus);
+        matrix->rows = calloc(capacity, sizeof(*matrix->rows));
+        matrix->counts = calloc(capacity * column_capacity, sizeof(*matrix->counts));
+        matrix->deltas = calloc(capacity * column_capacity, sizeof(*matrix->deltas));
+        matrix->cpus = calloc(column_capacity, sizeof(*matrix->cpus));
+        matrix->capacity = matrix->column_capacity = 0;
+        HANDLE_RESULT(matrix->rows == NULL || matrix->counts == NULL ||
+                      matrix->deltas == NULL || matrix->cpus == NULL,
+                      return -1, "irq_layout: can't allocate %zu x %zu", capacity, column_capacity);
+        matrix->capacity = capacity;
+        matrix->column_capacity = column_capacity;
+    }
+    char *copy = realloc(matrix->header, header.len + 1);
+    HANDLE_RESULT(copy == NULL, return -1, "irq_layout: can't allocate header");
+    memcpy(copy, header.ptr, header.len);
+    copy[header.len] = 0;
+    matrix->header = copy;
+    matrix->headerlen = header.len;
+
+    /* offline CPUs have no column */
+    matrix->columns = 0;
+    scanner_init_span(&fields, &header);
+    while(scan_field(&fields, &field)) {
+        if(!span_has_prefix(&field, "CPU", 3)) continue;
+        struct span id = { field.ptr + 3, field.len - 3 };
+        uint64_t cpu = matrix->columns;
+        span_parse_u64(&id, &cpu);
+        matrix->cpus[matrix->columns++] = cpu;
+    }
+
+    matrix->count = 0;
+    while(scan_line(&sc, &line)) {
+        struct span label;
+        const char *p = irq_label(&line, &label);
+        if(p == NULL) continue;
+        struct irq_row *row = &matrix->rows[matrix->count];
+        uint32_t *counts = &matrix->counts[matrix->count * matrix->column_capacity];
+        const char *end = line.ptr + line.len;
+        memset(row, 0, sizeof(*row));
+        size_t labellen = label.len < IRQ_LABEL_SIZE ? label.len : IRQ_LABEL_SIZE - 1;
+        memcpy(row->label, label.ptr, labellen);
+        for(const char *next; row->columns < matrix->columns &&
+            (next = irq_parse_count(p, end, &counts[row->columns])) != NULL; p = next) {
+            ++row->columns;
+        }
+        irq_name(row->name, p, end);
+        ++matrix->count;
+    }
+    syslog(LOG_DEBUG, "interrupt matrix of %zu rows and %zu CPUs", matrix->count, matrix->columns);
+    return 0;
+}
+
+int irq_read(struct irq_matrix *matrix, const char *buf, size_t len, const struct timespec *ts) {
+    assert(matrix != NULL);
+    assert(buf != NULL);
+    assert(ts != NULL);
+
+    struct scanner sc;
+    struct span header, line;
+    size_t r = 0;
+    scanner_init(&sc, buf, len);
+    if(matrix->count == 0 || !scan_line(&sc, &header) ||
+       !span_equals(&header, matrix->header, matrix->headerlen)) {
+        goto LAYOUT;
+    }
+    while(scan_line(&sc, &line)) {
+        struct span label;
+        const char *p = irq_label(&line, &label);
+        if(p == NULL) continue;
+        if(r == matrix->count) goto LAYOUT;
+        struct irq_row *row = &matrix->rows[r];
+        size_t labellen = label.len < IRQ_LABEL_SIZE ? label.len : IRQ_LABEL_SIZE - 1;
+        if(memcmp(row->label, label.ptr, labellen) != 0 || row->label[labellen] != 0) goto LAYOUT;
+        uint32_t *counts = &matrix->counts[r * matrix->column_capacity];
+        uint32_t *deltas = &matrix->deltas[r * matrix->column_capacity];
+        const char *end = line.ptr + line.len;
+        row->total = row->max = row->max_column = row->cpus = 0;
+        for(size_t c = 0; c < row->columns; ++c) {
+            uint32_t value;
+            p = irq_parse_count(p, end, &value);
+            if(p == NULL) goto LAYOUT;
+            /* the counts are unsigned int and wrap */
+            uint32_t delta = value - counts[c];
+            counts[c] = value;
+            deltas[c] = delta;
+            if(delta == 0) continue;
+            row->total += delta;
+            ++row->cpus;
+            if(delta > row->max) {
+                row->max = delta;
+                row->max_column = c;
+            }
+        }
+        ++r;
+    }
+    if(r != matrix->count) goto LAYOUT;
+
+    double seconds = (ts->tv_sec - matrix->last.tv_sec) + (ts->tv_nsec - matrix->last.tv_nsec) / 1e9;
+    matrix->seconds = seconds > 0 ? seconds : 0;
+    matrix->last = *ts;
+    return 0;
+
+LAYOUT:
+    if(matrix->count != 0) syslog(LOG_INFO, "interrupts changed, the next tick has their deltas");
+    matrix->count = 0;
+    matrix->seconds = 0;
+    matrix->last = *ts;
+    HANDLE_RESULT(irq_layout(matrix, buf, len) == -1, matrix->count = 0; return -1,
+                  "irq_read: irq_layout");
+    return 0;
+}
+
+void irq_close(struct irq_matrix *matrix) {
+    assert(matrix != NULL);
+
+    free(matrix->header);
+    free(matrix->cpus);
+    free(matrix->rows);
+    free(matrix->counts);
+    free(matrix->deltas);
+    memset(matrix, 0, sizeof(*matrix));
+}
@@ -0,0 +1,55 @@
+#ifndef IRQ_H_
+#define IRQ_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-CPU counts of /proc/interrupts and /proc/softirqs: a header line of
+ * CPU columns and a row per interrupt with a count per CPU. On a host with
+ * hundreds of CPUs the file is a matrix of about a megabyte.
+ *
+ * The counts are kept in a matrix allocated for the layout of the file,
+ * which is built on the first read. Later reads walk the rows and only
+ * check the label of each row and the header against the layout; they
+ * parse the columns straight into the matrix and sum up the deltas of the
+ * tick per row as they go. A changed layout (CPU hotplug, an interrupt
+ * registered or freed) rebuilds the matrix and the read becomes the
+ * baseline, there are no deltas until the next one.
+ */
+#define IRQ_LABEL_SIZE 16
+#define IRQ_NAME_SIZE 64
+
+struct irq_row {
+    char label[IRQ_LABEL_SIZE];     /* "24", "LOC", "NET_RX" */
+    char name[IRQ_NAME_SIZE];       /* devices or description, "" when none */
+    size_t columns;                 /* counts in the row, 1 for ERR and MIS */
+    uint64_t total;                 /* deltas of the tick summed over the CPUs */
+    uint32_t max;                   /* largest delta of a CPU */
+    size_t max_column;
+    size_t cpus;                    /* CPUs with a delta */
+};
+
+struct irq_matrix {
+    int cells;              /* report the deltas per CPU rather than per row */
+    char *header;           /* the CPU columns of the layout */
+    size_t headerlen;
+    unsigned *cpus;         /* CPU of each column */
+    size_t columns;
+    struct irq_row *rows;
+    size_t count;           /* rows of the layout */
+    size_t capacity;        /* allocated rows */
+    size_t column_capacity; /* allocated columns */
+    uint32_t *counts;       /* capacity x column_capacity, of the last read */
+    uint32_t *deltas;
+
+    struct timespec last;   /* time of the previous read */
+    double seconds;         /* since the previous read, 0 when there are no deltas */
+};
+
+int irq_read(struct irq_matrix *matrix, const char *buf, size_t len, const struct timespec *ts);
+void irq_close(struct irq_matrix *matrix);
+
+#endif /* IRQ_H_ */
@@ -0,0 +1,470 @@
+#include "line_protocol.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "error_handling.h"
+#include "scanner.h"
+
+static const char digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static size_t count_digits(uint64_t value) {
+    size_t n = 1;
+    for(;;) {
+        if(value < 10) return n;
+        if(value < 100) return n + 1;
+        if(value < 1000) return n + 2;
+        if(value < 10000) return n + 3;
+        value /= 10000;
+        n += 4;
+    }
+}
+
+/* writes value in decimal two digits at a time, returns end of the output */
+char *lp_format_uint(char *p, uint64_t value) {
+    size_t n = count_digits(value);
+    char *end = p + n;
+    char *q = end;
+    while(value >= 100) {
+        size_t i = (value % 100) * 2;
+        value /= 100;
+        *--q = digits[i + 1];
+        *--q = digits[i];
+    }
+    if(value >= 10) {
+        *--q = digits[value * 2 + 1];
+        *--q = digits[value * 2];
+    } else {
+        *--q = '0' + value;
+    }
+    assert(q == p);
+    return end;
+}
+
+/* characters to escape, indexed by character, bits are enum lp_escape */
+static const uint8_t escapes[256] = {
+    [','] = LP_ESCAPE_MEASUREMENT | LP_ESCAPE_KEY,
+    [' '] = LP_ESCAPE_MEASUREMENT | LP_ESCAPE_KEY,
+    ['='] = LP_ESCAPE_KEY,
+    ['"'] = LP_ESCAPE_STRING,
+    ['\\'] = LP_ESCAPE_STRING,
+};
+
+/* non-negative value with up to 3 decimals, trailing zeros dropped: 12.5 */
+char *lp_format_fixed(char *p, double value) {
+    assert(value >= 0);
+
+    if(value >= 1e15) {
+        return lp_format_uint(p, value);
+    }
+    uint64_t scaled = value * 1000 + 0.5;
+    p = lp_format_uint(p, scaled / 1000);
+    unsigned frac = scaled % 1000;
+    if(frac != 0) {
+        *p++ = '.';
+        *p++ = '0' + frac / 100;
+        frac %= 100;
+        if(frac != 0) {
+            *p++ = '0' + frac / 10;
+            frac %= 10;
+            if(frac != 0) *p++ = '0' + frac;
+        }
+    }
+    return p;
+}
+
+char *lp_format_escaped(char *p, const char *s, size_t len, enum lp_escape escape) {
+    assert(s != NULL);
+
+    for(const char *end = s + len; s < end; ++s) {
+        if(escapes[(unsigned char)*s] & escape) *p++ = '\\';
+        *p++ = *s;
+    }
+    return p;
+}
+
+
+void lp_writer_init(struct lp_writer *w, char *buf, size_t size) {
+    assert(w != NULL);
+    assert(buf != NULL);
+    assert(size > 0);
+
+    w->buf = buf;
+    w->size = size;
+    w->limit = size;
+    w->len = 0;
+    w->lines = 0;
+    w->pos = buf;
+    w->end = buf;
+    w->sep = ' ';
+    w->fields = 0;
+    w->overflow = 0;
+    w->field = buf;
+    w->value = buf;
+    w->state = NULL;
+    w->rate = 0;
+    w->keyframe = 0;
+    w->tick = 0;
+    w->now = 0;
+    w->series = STATE_HASH_SEED;
+    w->undo = 0;
+    w->aggregate = NULL;
+    w->flush = 0;
+    w->registry = NULL;
+    w->nparts = 0;
+    w->key = 0;
+    w->stamplen = 0;
+    buf[0] = 0;
+}
+
+/* lets lp_reserve() realloc() the buffer, the owner has to pick up w->buf */
+void lp_writer_growable(struct lp_writer *w, size_t limit) {
+    assert(w != NULL);
+    assert(limit >= w->size);
+
+    w->limit = limit;
+}
+
+int lp_grow(struct lp_writer *w, size_t need) {
+    assert(w != NULL);
+
+    size_t size = w->size;
+    while(size < need && size < w->limit) size *= 2;
+    if(size > w->limit) size = w->limit;
+    HANDLE_RESULT(size < need, return -1,
+                  "lp_grow: buffer limit reached: has %zu need %zu bytes", w->limit, need);
+    char *buf = realloc(w->buf, size);
+    HANDLE_RESULT(buf == NULL, return -1, "lp_grow: can't allocate %zu bytes", size);
+    syslog(LOG_DEBUG, "line protocol buffer grown to %zu bytes", size);
+
+    w->pos = buf + (w->pos - w->buf);
+    w->end = buf + (w->end - w->buf);
+    w->field = buf + (w->field - w->buf);
+    w->value = buf + (w->value - w->buf);
+    w->buf = buf;
+    w->size = size;
+    return 0;
+}
+
+/* attaches the state for rate mode and suppression, ts is the time of the sample */
+void lp_writer_state(struct lp_writer *w, struct state_table *state, const struct timespec *ts) {
+    assert(w != NULL);
+    assert(state != NULL);
+    assert(ts != NULL);
+
+    w->state = state;
+    w->now = (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+    w->undo = state->journaled;
+}
+
+/* attaches the registry of series prefixes, kept across samples */
+void lp_writer_registry(struct lp_writer *w, struct series_registry *registry) {
+    assert(w != NULL);
+    assert(registry != NULL);
+
+    w->registry = registry;
+}
+
+int lp_line_begin(struct lp_writer *w, size_t reserve) {
+    assert(w != NULL);
+
+    w->nparts = 0;
+    w->pos = w->buf + w->len;
+    w->end = w->pos;
+    w->sep = ' ';
+    w->fields = 0;
+    w->overflow = 0;
+    w->series = STATE_HASH_SEED;
+    if(w->state != NULL) w->undo = w->state->journaled;
+    return lp_reserve(w, reserve);
+}
+
+int lp_reserve(struct lp_writer *w, size_t reserve) {
+    assert(w != NULL);
+
+    if(w->nparts != 0) lp_series_write(w);
+    /* the line gets the timestamp and the buffer keeps the NUL terminator */
+    size_t need = (w->pos - w->buf) + reserve + LP_TIMESTAMP_SIZE + 1;
+    HANDLE_RESULT(need > w->size && w->limit > w->size && lp_grow(w, need) == -1,
+                  return -1, "lp_reserve: lp_grow");
+    HANDLE_RESULT(need > w->size, return -1,
+                  "lp_reserve: buffer too small: has %zu need %zu bytes",
+                  w->size, need);
+    if(w->pos + reserve > w->end) {
+        w->end = w->pos + reserve;
+    }
+    return 0;
+}
+
+/* checked variant of the reservation for appenders of unpredictable size */
+static int lp_ensure(struct lp_writer *w, size_t size) {
+    if(w->nparts != 0) lp_series_write(w);
+    if(w->overflow) return 0;
+    if(w->pos + size <= w->end) return 1;
+    if(lp_reserve(w, size) == 0) return 1;
+    w->overflow = 1;
+    return 0;
+}
+
+int lp_counter_delta(struct lp_writer *w, const char *key, size_t keylen,
+                     uint64_t value, unsigned width,
+                     uint64_t *delta, double *seconds) {
+    assert(w != NULL);
+    assert(w->state != NULL);
+    assert(w->rate);
+    assert(key != NULL);
+
+    if(w->nparts != 0) lp_series_write(w);
+    return state_delta(w->state, state_hash(w->series, key, keylen),
+                       value, width, w->now, delta, seconds);
+}
+
+void lp_field_float(struct lp_writer *w, const char *key, size_t keylen,
+                    const char *suffix, double value) {
+    assert(w != NULL);
+    assert(key != NULL);
+    assert(suffix != NULL);
+
+    size_t suffixlen = strlen(suffix);
+    if(!lp_ensure(w, 2 + 2 * (keylen + suffixlen) + LP_FLOAT_SIZE)) return;
+    lp_field_key(w, key, keylen);
+    --w->pos; /* '=' goes after the suffix */
+    w->pos = lp_format_escaped(w->pos, suffix, suffixlen, LP_ESCAPE_KEY);
+    *w->pos++ = '=';
+    w->value = w->pos;
+    w->pos = lp_format_fixed(w->pos, value);
+    lp_field_end(w);
+}
+
+void lp_field_rate(struct lp_writer *w, const char *key, size_t keylen,
+                   uint64_t value, unsigned width) {
+    assert(w != NULL);
+
+    uint64_t delta = 0;
+    double seconds = 0;
+    if(lp_counter_delta(w, key, keylen, value, width, &delta, &seconds)) {
+        lp_field_float(w, key, keylen, "_rate", delta / seconds);
+    }
+}
+
+void lp_field_rate_raw(struct lp_writer *w, const char *key, size_t keylen,
+                       const char *value, size_t len) {
+    assert(w != NULL);
+    assert(value != NULL);
+
+    uint64_t v = 0;
+    struct span span = { value, len };
+    if(span_parse_u64(&span, &v) == -1) {
+        /* not a counter, e.g. a negative limit; keep it as is */
+        if(lp_ensure(w, 2 + 2 * keylen + len)) lp_field_raw(w, key, keylen, value, len);
+        return;
+    }
+    lp_field_rate(w, key, keylen, v, 64);
+}
+
+/* drops the field just written when its value is the one sent last time */
+void lp_field_suppress(struct lp_writer *w) {
+    assert(w != NULL);
+    assert(w->keyframe != 0);
+    assert(w->state != NULL);
+
+    uint64_t key = state_hash(w->series, w->field + 1, w->value - w->field - 1);
+    ssize_t slot = state_table_slot(w->state, ~key, w->now);
+    if(slot == -1) return;
+    state_table_save(w->state, slot);
+    w->state->stamps[slot] = w->now;
+
+    /* 0 marks a field that was never sent */
+    uint64_t value = state_hash(STATE_HASH_SEED, w->value, w->pos - w->value) | 1;
+    int keyframe = (w->tick + w->series) % w->keyframe == 0;
+    if(keyframe || w->state->values[slot] != value) {
+        w->state->values[slot] = value;
+        return;
+    }
+    w->pos = w->field;
+    if(--w->fields == 0) w->sep = ' ';
+}
+
+/* value of a field as written: integer, fixed point or raw /proc token */
+int lp_parse_number(const char *p, const char *end, double *value) {
+    assert(p != NULL);
+    assert(value != NULL);
+
+    if(end > p && (end[-1] == 'i' || end[-1] == 'u')) --end;
+    int negative = p < end && *p == '-';
+    p += negative;
+    if(p == end) return 0;
+
+    uint64_t integral = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; ++p) integral = integral * 10 + (*p - '0');
+    double v = integral;
+    if(p < end && *p == '.') {
+        double scale = 1;
+        uint64_t fraction = 0;
+        for(++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+            fraction = fraction * 10 + (*p - '0');
+            scale *= 10;
+        }
+        v += fraction / scale;
+    }
+    if(p != end) return 0;
+    *value = negative ? -v : v;
+    return 1;
+}
+
+/* appends an aggregate of the field whose escaped key is given */
+void lp_field_stat(struct lp_writer *w, const char *key, size_t keylen,
+                   const char *suffix, size_t suffixlen, double value) {
+    assert(w != NULL);
+
+    if(!lp_ensure(w, 2 + keylen + suffixlen + LP_FLOAT_SIZE)) return;
+    *w->pos++ = w->sep;
+    w->sep = ',';
+    ++w->fields;
+    lp_append(w, key, keylen);
+    lp_append(w, suffix, suffixlen);
+    *w->pos++ = '=';
+    if(value < 0) {
+        *w->pos++ = '-';
+        value = -value;
+    }
+    w->pos = lp_format_fixed(w->pos, value);
+    assert(w->pos <= w->end);
+}
+
+/* records the field just written; it is only kept in the line on flush, as aggregates */
+void lp_field_aggregate(struct lp_writer *w) {
+    assert(w != NULL);
+    assert(w->aggregate != NULL);
+    assert(w->state != NULL);
+
+    char key[LP_AGGREGATE_KEY_SIZE];
+    size_t keylen = w->value - w->field - 2;   /* without separator and '=' */
+    double value = 0;
+    ssize_t slot = -1;
+    if(keylen <= sizeof(key) && lp_parse_number(w->value, w->pos, &value)) {
+        memcpy(key, w->field + 1, keylen);
+        slot = aggregate_record(w->aggregate, state_hash(w->series, key, keylen) | 1, value);
+    }
+    /* strings and fields that did not fit are sent as last seen */
+    if(w->flush && slot == -1) return;
+
+    w->pos = w->field;
+    if(--w->fields == 0) w->sep = ' ';
+    if(!w->flush) return;
+
+    struct aggregate_stats stats;
+    aggregate_stats(w->aggregate, slot, &stats);
+    lp_field_stat(w, key, keylen, "_min", 4, stats.min);
+    lp_field_stat(w, key, keylen, "_max", 4, stats.max);
+    lp_field_stat(w, key, keylen, "_mean", 5, stats.mean);
+    lp_field_stat(w, key, keylen, "_last", 5, stats.last);
+    if(w->aggregate->history != NULL) lp_field_stat(w, key, keylen, "_p99", 4, stats.p99);
+}
+
+/*
+ * Writes the prefix of the series noted by lp_measurement() and lp_tag().
+ * A new series is formatted where the prefix goes and handed to the
+ * registry, which merges the global tags into it and keeps it.
+ */
+void lp_series_write(struct lp_writer *w) {
+    assert(w != NULL);
+    assert(w->registry != NULL);
+    assert(w->nparts != 0);
+
+    size_t nparts = w->nparts;
+    w->nparts = 0;
+    /* the reservation of the caller does not cover the global tags */
+    size_t tagslen = w->registry->tagslen;
+    if(tagslen > 0 && lp_reserve(w, (w->end - w->pos) + tagslen) == -1) {
+        w->overflow = 1;
+        return;
+    }
+
+    const struct series_entry *entry = series_lookup(w->registry, w->key);
+    if(entry == NULL) {
+        char *start = w->pos;
+        w->pos = lp_format_escaped(w->pos, w->parts[0].s, w->parts[0].len, LP_ESCAPE_MEASUREMENT);
+        for(size_t i = 1; i + 1 < nparts; i += 2) {
+            *w->pos++ = ',';
+            w->pos = lp_format_escaped(w->pos, w->parts[i].s, w->parts[i].len, LP_ESCAPE_KEY);
+            *w->pos++ = '=';
+            w->pos = lp_format_escaped(w->pos, w->parts[i + 1].s, w->parts[i + 1].len, LP_ESCAPE_KEY);
+        }
+        assert(w->pos <= w->end);
+        size_t len = w->pos - start;
+        w->pos = start;
+        entry = series_insert(w->registry, w->key, start, len);
+        HANDLE_RESULT(entry == NULL, w->overflow = 1; return,
+                      "lp_series_write: series key of %zu bytes not kept", len);
+    }
+    lp_append(w, series_prefix(w->registry, entry), entry->len);
+    w->series = entry->hash;
+}
+
+static void lp_line_reset(struct lp_writer *w) {
+    w->nparts = 0;
+    w->pos = w->buf + w->len;
+    w->end = w->pos;
+    w->buf[w->len] = 0;
+}
+
+/* drops the line being written, its state is put back as its values are not sent */
+void lp_line_abort(struct lp_writer *w) {
+    assert(w != NULL);
+
+    if(w->state != NULL) state_table_rollback(w->state, w->undo);
+    lp_line_reset(w);
+}
+
+void lp_timestamp(struct lp_writer *w, const struct timespec *ts) {
+    assert(w != NULL);
+    assert(ts != NULL);
+    assert(ts->tv_sec >= 0);
+    assert(ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000);
+
+    HANDLE_RESULT(w->overflow, lp_line_abort(w); return, "lp_timestamp: line does not fit, dropped");
+    /* all fields suppressed or first sample of rates: the state is the one to keep */
+    if(w->fields == 0) {
+        lp_line_reset(w);
+        return;
+    }
+
+    /* the lines of a sample share their time, it is rendered once */
+    if(w->stamplen == 0 || ts->tv_sec != w->stamped.tv_sec || ts->tv_nsec != w->stamped.tv_nsec) {
+        char *p = w->stamp;
+        *p++ = ' ';
+        p = lp_format_uint(p, ts->tv_sec);
+        /* nanoseconds are always 9 digits wide */
+        uint64_t nsec = ts->tv_nsec;
+        for(char *q = p + 8; q >= p; --q) {
+            *q = '0' + nsec % 10;
+            nsec /= 10;
+        }
+        p += 9;
+        *p++ = '\n';
+        w->stamplen = p - w->stamp;
+        w->stamped = *ts;
+    }
+    char *p = w->pos;
+    memcpy(p, w->stamp, w->stamplen);
+    p += w->stamplen;
+    *p = 0;
+    assert(p < w->buf + w->size);
+    w->len = p - w->buf;
+    ++w->lines;
+    w->pos = p;
+    w->end = p;
+}
@@ -0,0 +1,271 @@
+#ifndef LINE_PROTOCOL_H_
+#define LINE_PROTOCOL_H_
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "aggregate.h"
+#include "series.h"
+#include "state.h"
+
+/*
+ * InfluxDB line protocol writer.
+ *
+ * A line is started with lp_line_begin(), which checks once that the
+ * requested worst-case size fits into the buffer. Appenders then write
+ * without further bounds checks (asserted in debug builds only), and
+ * lp_timestamp() terminates and commits the line. Appenders are inline so
+ * that strlen() of literal keys folds into a constant.
+ *
+ * With a state table attached the writer can
+ *  - in rate mode, write counters as per-second <key>_rate floats computed
+ *    against the previous sample. Their size is not known upfront, so they
+ *    check and extend the reservation on their own;
+ *  - with a keyframe interval, suppress fields whose value did not change
+ *    since it was last sent. Every series is sent in full once per interval,
+ *    series are spread over the interval by their hash.
+ * With an aggregate attached numeric fields are recorded instead of written;
+ * on the flush sample each of them is replaced by <key>_min, _max, _mean,
+ * _last (and _p99) of the samples since the previous flush.
+ * With a series registry attached the measurement and tags are only noted
+ * and the line gets the prefix of its series from the registry with the
+ * first field (see series.h). lp_timestamp() renders the timestamp once per
+ * sample time and copies it into every further line.
+ * A line that runs out of space or ends up without fields is dropped by
+ * lp_timestamp().
+ */
+#define LP_TIMESTAMP_SIZE 32    /* " " seconds, 9 digits of nanoseconds, "\n" */
+#define LP_SERIES_PARTS 17      /* measurement and 8 tags noted for the registry */
+
+struct lp_part {
+    const char *s;
+    size_t len;
+};
+
+struct lp_writer {
+    char *buf;
+    size_t size;    /* capacity of buf, including the terminating NUL */
+    size_t limit;   /* buf is heap allocated and may be grown up to limit */
+    size_t len;     /* length of committed lines */
+    size_t lines;   /* number of committed lines */
+    char *pos;      /* write position inside the current line */
+    char *end;      /* end of the space reserved for the current line */
+    char sep;       /* separator to put before the next field */
+    size_t fields;  /* number of fields in the current line */
+    int overflow;   /* a checked appender ran out of space */
+
+    char *field;    /* start of the last field, including the separator */
+    char *value;    /* start of the value of the last field */
+
+    struct state_table *state;  /* per-series state, NULL when not needed */
+    int rate;                   /* counters as per-second rates */
+    unsigned keyframe;          /* suppress unchanged fields, full refresh every N ticks */
+    uint64_t tick;              /* number of the current tick */
+    int64_t now;                /* time of the sample, ns */
+    uint64_t series;            /* hash of measurement and tags of the current line */
+    size_t undo;                /* journal of the state when the line began */
+
+    struct aggregate *aggregate;    /* high frequency samples, NULL when not aggregating */
+    int flush;                      /* write the aggregates with this sample */
+
+    struct series_registry *registry;   /* series prefixes, NULL to format every line */
+    struct lp_part parts[LP_SERIES_PARTS];  /* measurement, tag keys and values of the line */
+    size_t nparts;                      /* 0 once the prefix is written */
+    uint64_t key;                       /* series_key() of the parts */
+
+    char stamp[LP_TIMESTAMP_SIZE];      /* rendered timestamp of stamped */
+    size_t stamplen;
+    struct timespec stamped;
+};
+
+#define LP_INT_SIZE 21          /* "-9223372036854775808" or "18446744073709551615" */
+
+/* worst case sizes of the elements, used to compute reservations */
+#define LP_TAG_SIZE(key, value) (2 + strlen(key) + 2 * strlen(value))
+#define LP_FIELD_SIZE(key) (3 + 2 * strlen(key) + LP_INT_SIZE)
+#define LP_FLOAT_SIZE 32        /* fixed point with 3 decimals */
+#define LP_AGGREGATE_KEY_SIZE 128   /* longer keys are sent unaggregated */
+
+void lp_writer_init(struct lp_writer *w, char *buf, size_t size);
+void lp_writer_growable(struct lp_writer *w, size_t limit);
+void lp_writer_state(struct lp_writer *w, struct state_table *state, const struct timespec *ts);
+void lp_writer_registry(struct lp_writer *w, struct series_registry *registry);
+int lp_line_begin(struct lp_writer *w, size_t reserve);
+int lp_reserve(struct lp_writer *w, size_t reserve);
+void lp_line_abort(struct lp_writer *w);
+void lp_timestamp(struct lp_writer *w, const struct timespec *ts);
+
+char *lp_format_uint(char *p, uint64_t value);
+char *lp_format_fixed(char *p, double value);
+enum lp_escape {
+    LP_ESCAPE_MEASUREMENT = 1,  /* ',' and ' ' */
+    LP_ESCAPE_KEY = 2,          /* ',', '=' and ' ' in tag keys, tag values and field keys */
+    LP_ESCAPE_STRING = 4        /* '"' and '\\' in string field values */
+};
+
+char *lp_format_escaped(char *p, const char *s, size_t len, enum lp_escape escape);
+
+int lp_counter_delta(struct lp_writer *w, const char *key, size_t keylen,
+                     uint64_t value, unsigned width,
+                     uint64_t *delta, double *seconds);
+void lp_field_float(struct lp_writer *w, const char *key, size_t keylen,
+                    const char *suffix, double value);
+void lp_field_rate(struct lp_writer *w, const char *key, size_t keylen,
+                   uint64_t value, unsigned width);
+void lp_field_rate_raw(struct lp_writer *w, const char *key, size_t keylen,
+                       const char *value, size_t len);
+void lp_field_suppress(struct lp_writer *w);
+void lp_field_aggregate(struct lp_writer *w);
+void lp_series_write(struct lp_writer *w);
+
+static inline void lp_append(struct lp_writer *w, const char *s, size_t len) {
+    assert(w->pos + len <= w->end);
+    memcpy(w->pos, s, len);
+    w->pos += len;
+}
+
+static inline void lp_series(struct lp_writer *w, const char *start) {
+    if(w->state != NULL) w->series = state_hash(w->series, start, w->pos - start);
+}
+
+static inline void lp_measurement_n(struct lp_writer *w, const char *name, size_t len) {
+    if(w->registry != NULL) {
+        w->parts[0] = (struct lp_part){ name, len };
+        w->nparts = 1;
+        w->key = series_key(SERIES_KEY_SEED, name, len);
+        return;
+    }
+    char *start = w->pos;
+    w->pos = lp_format_escaped(w->pos, name, len, LP_ESCAPE_MEASUREMENT);
+    lp_series(w, start);
+    assert(w->pos <= w->end);
+}
+
+static inline void lp_measurement(struct lp_writer *w, const char *name) {
+    lp_measurement_n(w, name, strlen(name));
+}
+
+static inline void lp_tag_n(struct lp_writer *w, const char *key,
+                            const char *value, size_t len) {
+    size_t keylen = strlen(key);
+    if(w->nparts != 0 && w->nparts + 2 <= LP_SERIES_PARTS) {
+        w->parts[w->nparts++] = (struct lp_part){ key, keylen };
+        w->parts[w->nparts++] = (struct lp_part){ value, len };
+        w->key = series_key(series_key(w->key, key, keylen), value, len);
+        return;
+    }
+    /* more tags than noted are formatted along */
+    if(w->nparts != 0) lp_series_write(w);
+    char *start = w->pos;
+    *w->pos++ = ',';
+    w->pos = lp_format_escaped(w->pos, key, keylen, LP_ESCAPE_KEY);
+    *w->pos++ = '=';
+    w->pos = lp_format_escaped(w->pos, value, len, LP_ESCAPE_KEY);
+    lp_series(w, start);
+    assert(w->pos <= w->end);
+}
+
+static inline void lp_tag(struct lp_writer *w, const char *key, const char *value) {
+    lp_tag_n(w, key, value, strlen(value));
+}
+
+static inline void lp_field_key(struct lp_writer *w, const char *key, size_t len) {
+    if(w->nparts != 0) lp_series_write(w);
+    w->field = w->pos;
+    *w->pos++ = w->sep;
+    w->sep = ',';
+    ++w->fields;
+    w->pos = lp_format_escaped(w->pos, key, len, LP_ESCAPE_KEY);
+    *w->pos++ = '=';
+    w->value = w->pos;
+}
+
+static inline void lp_field_end(struct lp_writer *w) {
+    assert(w->pos <= w->end);
+    if(w->aggregate != NULL) {
+        lp_field_aggregate(w);
+    } else if(w->keyframe != 0) {
+        lp_field_suppress(w);
+    }
+}
+
+/* integer field: 42i */
+static inline void lp_field_int(struct lp_writer *w, const char *key, int64_t value) {
+    lp_field_key(w, key, strlen(key));
+    if(value < 0) {
+        *w->pos++ = '-';
+        w->pos = lp_format_uint(w->pos, -(uint64_t)value);
+    } else {
+        w->pos = lp_format_uint(w->pos, value);
+    }
+    *w->pos++ = 'i';
+    lp_field_end(w);
+}
+
+/* unsigned field: 42u */
+static inline void lp_field_uint(struct lp_writer *w, const char *key, uint64_t value) {
+    lp_field_key(w, key, strlen(key));
+    w->pos = lp_format_uint(w->pos, value);
+    *w->pos++ = 'u';
+    lp_field_end(w);
+}
+
+/* integral value without type suffix, InfluxDB stores it as float: 42 */
+static inline void lp_field_number(struct lp_writer *w, const char *key, uint64_t value) {
+    lp_field_key(w, key, strlen(key));
+    w->pos = lp_format_uint(w->pos, value);
+    lp_field_end(w);
+}
+
+/* value copied verbatim, e.g. a number token taken from /proc */
+static inline void lp_field_raw(struct lp_writer *w, const char *key, size_t keylen,
+                                const char *value, size_t len) {
+    lp_field_key(w, key, keylen);
+    lp_append(w, value, len);
+    lp_field_end(w);
+}
+
+/* string field: "value" with quotes and backslashes escaped */
+static inline void lp_field_string(struct lp_writer *w, const char *key, const char *value) {
+    lp_field_key(w, key, strlen(key));
+    *w->pos++ = '"';
+    w->pos = lp_format_escaped(w->pos, value, strlen(value), LP_ESCAPE_STRING);
+    *w->pos++ = '"';
+    lp_field_end(w);
+}
+
+/* cumulative counter written as integer: 42i */
+static inline void lp_counter_int(struct lp_writer *w, const char *key,
+                                  uint64_t value, unsigned width) {
+    if(w->rate) {
+        lp_field_rate(w, key, strlen(key), value, width);
+    } else {
+        lp_field_int(w, key, value);
+    }
+}
+
+/* cumulative counter written without type suffix: 42 */
+static inline void lp_counter_number(struct lp_writer *w, const char *key,
+                                     uint64_t value, unsigned width) {
+    if(w->rate) {
+        lp_field_rate(w, key, strlen(key), value, width);
+    } else {
+        lp_field_number(w, key, value);
+    }
+}
+
+/* cumulative counter copied verbatim from /proc */
+static inline void lp_counter_raw(struct lp_writer *w, const char *key, size_t keylen,
+                                  const char *value, size_t len) {
+    if(w->rate) {
+        lp_field_rate_raw(w, key, keylen, value, len);
+    } else {
+        lp_field_raw(w, key, keylen, value, len);
+    }
+}
+
+#endif /* LINE_PROTOCOL_H_ */
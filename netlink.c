@@ -0,0 +1,544 @@
+#include "netlink.h"
+
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "scanner.h"
+
+#define NETLINK_BUFFER_SIZE 32768   /* largest dump message the kernel builds */
+#define NETLINK_REQUEST_SIZE 128
+#define NETLINK_LINKS 64            /* initial size of the link and queue tables */
+
+/* netdev generic netlink family, from linux/netdev.h which older headers lack */
+#define NETDEV_FAMILY "netdev"
+enum {
+    NETDEV_QSTATS_GET = 12,         /* NETDEV_CMD_QSTATS_GET */
+    NETDEV_QSTATS_IFINDEX = 1,      /* NETDEV_A_QSTATS_* */
+    NETDEV_QSTATS_QUEUE_TYPE = 2,
+    NETDEV_QSTATS_QUEUE_ID = 3,
+    NETDEV_QSTATS_SCOPE = 4,
+    NETDEV_QSTATS_RX_PACKETS = 8,
+    NETDEV_QSTATS_RX_BYTES = 9,
+    NETDEV_QSTATS_TX_PACKETS = 10,
+    NETDEV_QSTATS_TX_BYTES = 11,
+    NETDEV_QSTATS_SCOPE_QUEUE = 1,
+    NETDEV_QUEUE_TYPE_TX = 1
+};
+
+typedef int(*netlink_handler)(struct netlink *nl, const struct nlmsghdr *msg);
+
+/* rtattr and nlattr share their layout, RTA_* macros are used for both */
+void netlink_put(struct nlmsghdr *msg, unsigned short type, const void *data, size_t len) {
+    assert(msg != NULL);
+    assert(NLMSG_ALIGN(msg->nlmsg_len) + RTA_SPACE(len) <= NETLINK_REQUEST_SIZE);
+
+    struct rtattr *rta = (struct rtattr *)((char *)msg + NLMSG_ALIGN(msg->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + RTA_SPACE(len);
+}
+
+uint64_t netlink_uint(const struct rtattr *rta) {
+    assert(rta != NULL);
+
+    /* NLA_UINT attributes are 4 or 8 bytes long */
+    if(RTA_PAYLOAD(rta) >= sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, RTA_DATA(rta), sizeof(value));
+        return value;
+    }
+    uint32_t value = 0;
+    memcpy(&value, RTA_DATA(rta), RTA_PAYLOAD(rta) < sizeof(value) ? RTA_PAYLOAD(rta) : sizeof(value));
+    return value;
+}
+
+/* sends a request and feeds every reply to handler, always reading up to the end of a dump */
+int netlink_request(struct netlink *nl, int fd, struct nlmsghdr *req, netlink_handler handler) {
+    assert(nl != NULL);
+    assert(fd != -1);
+    assert(req != NULL);
+    assert(handler != NULL);
+
+    int result = 0;
+    req->nlmsg_seq = ++nl->seq;
+    HANDLE_POSIX_RESULT(send(fd, req, req->nlmsg_len, 0),
+                        return -1, "fd=%d: netlink_request: send", fd);
+    for(;;) {
+        int len = recv(fd, nl->buf, nl->bufsize, MSG_TRUNC);
+        HANDLE_POSIX_RESULT(len, return -1, "fd=%d: netlink_request: recv", fd);
+        HANDLE_RESULT((size_t)len > nl->bufsize, return -1,
+                      "fd=%d: netlink_request: reply of %d bytes truncated", fd, len);
+        for(const struct nlmsghdr *msg = (const struct nlmsghdr *)nl->buf;
+            NLMSG_OK(msg, len);
+            msg = NLMSG_NEXT(msg, len)) {
+            if(msg->nlmsg_seq != nl->seq) continue;    /* left over from an earlier request */
+            if(msg->nlmsg_type == NLMSG_DONE || msg->nlmsg_type == NLMSG_ERROR) {
+                const int *error = NLMSG_DATA(msg);   /* nlmsgerr starts with the error too */
+                if(msg->nlmsg_len >= NLMSG_LENGTH(sizeof(*error)) && *error < 0) {
+                    errno = -*error;
+                    return -1;
+                }
+                return result;
+            }
+            if(result == 0 && handler(nl, msg) == -1) {
+                result = -1;
+            }
+        }
+    }
+}
+
+int netlink_select(const struct netlink *nl, const struct netlink_link *link) {
+    assert(nl != NULL);
+    assert(link != NULL);
+
+    if(link->flags & IFF_LOOPBACK) return 0;
+    if(!(link->flags & IFF_UP && link->flags & IFF_RUNNING)) return 0;
+    if(nl->include != NULL && *nl->include != NULL) {
+        const char **pattern = nl->include;
+        while(*pattern != NULL && fnmatch(*pattern, link->name, 0) != 0) ++pattern;
+        if(*pattern == NULL) return 0;
+    }
+    for(const char **pattern = nl->exclude; pattern != NULL && *pattern != NULL; ++pattern) {
+        if(fnmatch(*pattern, link->name, 0) == 0) return 0;
+    }
+    return 1;
+}
+
+int netlink_compare_links(const void *a, const void *b) {
+    const struct netlink_link *la = a;
+    const struct netlink_link *lb = b;
+    return (la->index > lb->index) - (la->index < lb->index);
+}
+
+struct netlink_link *netlink_find(struct netlink *nl, int index) {
+    assert(nl != NULL);
+
+    struct netlink_link key = { .index = index };
+    return bsearch(&key, nl->links, nl->count, sizeof(*nl->links), &netlink_compare_links);
+}
+
+int netlink_parse_link(struct netlink *nl, const struct nlmsghdr *msg) {
+    assert(nl != NULL);
+    assert(msg != NULL);
+
+    if(msg->nlmsg_type != RTM_NEWLINK) return 0;
+    if(nl->count == nl->capacity) {
+        size_t capacity = nl->capacity * 2;
+        struct netlink_link *links = realloc(nl->links, capacity * sizeof(*links));
+        HANDLE_RESULT(links == NULL, return -1,
+                      "netlink_parse_link: can't allocate %zu links", capacity);
+        nl->links = links;
+        nl->capacity = capacity;
+    }
+
+    const struct ifinfomsg *ifi = NLMSG_DATA(msg);
+    struct netlink_link *link = &nl->links[nl->count];
+    memset(link, 0, sizeof(*link));
+    link->index = ifi->ifi_index;
+    link->flags = ifi->ifi_flags;
+    int len = IFLA_PAYLOAD(msg);
+    for(const struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if(rta->rta_type == IFLA_IFNAME) {
+            size_t namelen = strnlen(RTA_DATA(rta), RTA_PAYLOAD(rta));
+            if(namelen >= IF_NAMESIZE) namelen = IF_NAMESIZE - 1;
+            memcpy(link->name, RTA_DATA(rta), namelen);
+            link->name[namelen] = 0;
+        }
+    }
+    if(link->name[0] == 0) return 0;
+    link->selected = netlink_select(nl, link);
+    ++nl->count;
+    return 0;
+}
+
+int netlink_parse_stats(struct netlink *nl, const struct nlmsghdr *msg) {
+    assert(nl != NULL);
+    assert(msg != NULL);
+
+    if(msg->nlmsg_type != RTM_NEWSTATS) return 0;
+    const struct if_stats_msg *ifsm = NLMSG_DATA(msg);
+    struct netlink_link *link = netlink_find(nl, ifsm->ifindex);
+    if(link == NULL) {
+        nl->stale = 1;  /* appeared since the last refresh, picked up next tick */
+        return 0;
+    }
+    if(!link->selected) return 0;
+
+    int len = NLMSG_PAYLOAD(msg, sizeof(*ifsm));
+    const struct rtattr *rta = (const struct rtattr *)((const char *)ifsm + NLMSG_ALIGN(sizeof(*ifsm)));
+    for(; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if(rta->rta_type == IFLA_STATS_LINK_64) {
+            /* older kernels know fewer fields, the rest stays 0 */
+            size_t size = RTA_PAYLOAD(rta) < sizeof(link->stats) ? RTA_PAYLOAD(rta) : sizeof(link->stats);
+            memset(&link->stats, 0, sizeof(link->stats));
+            memcpy(&link->stats, RTA_DATA(rta), size);
+            link->has_stats = 1;
+        }
+    }
+    return 0;
+}
+
+int netlink_parse_queue(struct netlink *nl, const struct nlmsghdr *msg) {
+    assert(nl != NULL);
+    assert(msg != NULL);
+
+    if(msg->nlmsg_type != nl->netdev) return 0;
+    if(nl->queue_count == nl->queue_capacity) {
+        size_t capacity = nl->queue_capacity * 2;
+        struct netlink_queue *queues = realloc(nl->queues, capacity * sizeof(*queues));
+        HANDLE_RESULT(queues == NULL, return -1,
+                      "netlink_parse_queue: can't allocate %zu queues", capacity);
+        nl->queues = queues;
+        nl->queue_capacity = capacity;
+    }
+
+    struct netlink_queue *queue = &nl->queues[nl->queue_count];
+    struct netlink_link *link = NULL;
+    memset(queue, 0, sizeof(*queue));
+    int len = msg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    const struct rtattr *rta = (const struct rtattr *)((const char *)NLMSG_DATA(msg) + GENL_HDRLEN);
+    for(; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch(rta->rta_type & NLA_TYPE_MASK) {
+            case NETDEV_QSTATS_IFINDEX:
+                link = netlink_find(nl, netlink_uint(rta));
+                break;
+            case NETDEV_QSTATS_QUEUE_TYPE:
+                queue->tx = netlink_uint(rta) == NETDEV_QUEUE_TYPE_TX;
+                break;
+            case NETDEV_QSTATS_QUEUE_ID:
+                queue->id = netlink_uint(rta);
+                break;
+            case NETDEV_QSTATS_RX_PACKETS:
+            case NETDEV_QSTATS_TX_PACKETS:
+                queue->packets = netlink_uint(rta);
+                break;
+            case NETDEV_QSTATS_RX_BYTES:
+            case NETDEV_QSTATS_TX_BYTES:
+                queue->bytes = netlink_uint(rta);
+                break;
+        }
+    }
+    if(link == NULL || !link->selected) return 0;
+    memcpy(queue->name, link->name, sizeof(queue->name));
+    ++nl->queue_count;
+    return 0;
+}
+
+int netlink_parse_family(struct netlink *nl, const struct nlmsghdr *msg) {
+    assert(nl != NULL);
+    assert(msg != NULL);
+
+    if(msg->nlmsg_type != GENL_ID_CTRL) return 0;
+    int qstats = 0;
+    int len = msg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    const struct rtattr *rta = (const struct rtattr *)((const char *)NLMSG_DATA(msg) + GENL_HDRLEN);
+    for(; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if(rta->rta_type == CTRL_ATTR_FAMILY_ID) {
+            nl->netdev = netlink_uint(rta);
+        }
+        else if((rta->rta_type & NLA_TYPE_MASK) == CTRL_ATTR_OPS) {
+            /* nested array of ops, each a nest holding CTRL_ATTR_OP_ID */
+            int opslen = RTA_PAYLOAD(rta);
+            for(const struct rtattr *op = RTA_DATA(rta); RTA_OK(op, opslen); op = RTA_NEXT(op, opslen)) {
+                int oplen = RTA_PAYLOAD(op);
+                for(const struct rtattr *a = RTA_DATA(op); RTA_OK(a, oplen); a = RTA_NEXT(a, oplen)) {
+                    if(a->rta_type == CTRL_ATTR_OP_ID && netlink_uint(a) == NETDEV_QSTATS_GET) {
+                        qstats = 1;
+                    }
+                }
+            }
+        }
+    }
+    if(!qstats) nl->netdev = 0;
+    return 0;
+}
+
+int netlink_refresh(struct netlink *nl) {
+    assert(nl != NULL);
+
+    char buf[NETLINK_REQUEST_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *req = (struct nlmsghdr *)buf;
+    memset(buf, 0, sizeof(buf));
+    req->nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req->nlmsg_type = RTM_GETLINK;
+    req->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    ((struct ifinfomsg *)NLMSG_DATA(req))->ifi_family = AF_UNSPEC;
+    uint32_t mask = RTEXT_FILTER_SKIP_STATS;
+    netlink_put(req, IFLA_EXT_MASK, &mask, sizeof(mask));
+
+    nl->count = 0;
+    nl->stale = 0;
+    HANDLE_RESULT(netlink_request(nl, nl->fd, req, &netlink_parse_link) == -1,
+                  goto FAIL, "fd=%d: netlink_refresh: RTM_GETLINK", nl->fd);
+    qsort(nl->links, nl->count, sizeof(*nl->links), &netlink_compare_links);
+
+    size_t selected = 0;
+    for(size_t i = 0; i < nl->count; ++i) selected += nl->links[i].selected;
+    syslog(LOG_DEBUG, "fd=%d: %zu links, %zu selected", nl->fd, nl->count, selected);
+    return 0;
+
+FAIL:
+    nl->count = 0;
+    nl->stale = 1;
+    return -1;
+}
+
+/* drains link notifications, any of them invalidates the link table */
+void netlink_poll(struct netlink *nl) {
+    assert(nl != NULL);
+
+    if(nl->monitor == -1) {
+        nl->stale = 1;
+        return;
+    }
+    for(;;) {
+        ssize_t len = recv(nl->monitor, nl->buf, nl->bufsize, MSG_DONTWAIT | MSG_TRUNC);
+        if(len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        nl->stale = 1;  /* ENOBUFS means notifications were lost */
+        HANDLE_POSIX_RESULT(len == -1 && errno != ENOBUFS && errno != EINTR ? -1 : 0,
+                            return, "fd=%d: netlink_poll: recv", nl->monitor);
+    }
+}
+
+int netlink_read(struct netlink *nl) {
+    assert(nl != NULL);
+    assert(nl->fd != -1);
+
+    netlink_poll(nl);
+    if(nl->stale) {
+        HANDLE_RESULT(netlink_refresh(nl) == -1, return -1, "netlink_read: netlink_refresh");
+    }
+
+    char buf[NETLINK_REQUEST_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *req = (struct nlmsghdr *)buf;
+    memset(buf, 0, sizeof(buf));
+    req->nlmsg_len = NLMSG_LENGTH(sizeof(struct if_stats_msg));
+    req->nlmsg_type = RTM_GETSTATS;
+    req->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    struct if_stats_msg *ifsm = NLMSG_DATA(req);
+    ifsm->family = AF_UNSPEC;
+    ifsm->filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+    for(size_t i = 0; i < nl->count; ++i) nl->links[i].has_stats = 0;
+    HANDLE_RESULT(netlink_request(nl, nl->fd, req, &netlink_parse_stats) == -1,
+                  return -1, "fd=%d: netlink_read: RTM_GETSTATS", nl->fd);
+
+    nl->queue_count = 0;
+    if(nl->genl == -1) return 0;
+
+    memset(buf, 0, sizeof(buf));
+    req->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    req->nlmsg_type = nl->netdev;
+    req->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    struct genlmsghdr *genl = NLMSG_DATA(req);
+    genl->cmd = NETDEV_QSTATS_GET;
+    genl->version = 1;
+    uint32_t scope = NETDEV_QSTATS_SCOPE_QUEUE;
+    netlink_put(req, NETDEV_QSTATS_SCOPE, &scope, sizeof(scope));
+
+    HANDLE_POSIX_RESULT(netlink_request(nl, nl->genl, req, &netlink_parse_queue),
+                        goto NO_QUEUES, "fd=%d: netlink_read: qstats, per-queue stats disabled",
+                        nl->genl);
+    return 0;
+
+NO_QUEUES:
+    /* link stats are still good, only give up on queues */
+    HANDLE_POSIX_RESULT(close(nl->genl), (void)nl, "fd=%d: close: genl", nl->genl);
+    nl->genl = -1;
+    nl->queue_count = 0;
+    return 0;
+}
+
+int netlink_socket(int protocol, unsigned groups) {
+    int fd = -1;
+    struct sockaddr_nl addr;
+
+    HANDLE_POSIX_RESULT(fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol),
+                        return -1, "netlink_socket: socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    HANDLE_POSIX_RESULT(bind(fd, (struct sockaddr *)&addr, sizeof(addr)),
+                        goto FAIL, "fd=%d: netlink_socket: bind", fd);
+    return fd;
+
+FAIL:
+    HANDLE_POSIX_RESULT(close(fd), (void)fd, "fd=%d: close", fd);
+    return -1;
+}
+
+/* resolves the netdev family, leaves genl at -1 when it has no qstats */
+void netlink_open_netdev(struct netlink *nl) {
+    assert(nl != NULL);
+
+    char buf[NETLINK_REQUEST_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *req = (struct nlmsghdr *)buf;
+    memset(buf, 0, sizeof(buf));
+    req->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    req->nlmsg_type = GENL_ID_CTRL;
+    req->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    struct genlmsghdr *genl = NLMSG_DATA(req);
+    genl->cmd = CTRL_CMD_GETFAMILY;
+    genl->version = 1;
+    netlink_put(req, CTRL_ATTR_FAMILY_NAME, NETDEV_FAMILY, sizeof(NETDEV_FAMILY));
+
+    HANDLE_RESULT((nl->genl = netlink_socket(NETLINK_GENERIC, 0)) == -1,
+                  return, "netlink_open_netdev: netlink_socket");
+    nl->netdev = 0;
+    if(netlink_request(nl, nl->genl, req, &netlink_parse_family) == -1 || nl->netdev == 0) {
+        syslog(LOG_INFO, "fd=%d: no netdev qstats, per-queue stats disabled", nl->genl);
+        HANDLE_POSIX_RESULT(close(nl->genl), (void)nl, "fd=%d: close: genl", nl->genl);
+        nl->genl = -1;
+    }
+}
+
+/* tables only, without sockets, for links parsed from snapshots */
+int netlink_init(struct netlink *nl, const char **include, const char **exclude) {
+    assert(nl != NULL);
+
+    memset(nl, 0, sizeof(*nl));
+    nl->fd = nl->monitor = nl->genl = -1;
+    nl->include = include;
+    nl->exclude = exclude;
+    nl->stale = 1;
+    nl->bufsize = NETLINK_BUFFER_SIZE;
+    nl->buf = malloc(nl->bufsize);
+    nl->capacity = nl->queue_capacity = NETLINK_LINKS;
+    nl->links = malloc(nl->capacity * sizeof(*nl->links));
+    nl->queues = malloc(nl->queue_capacity * sizeof(*nl->queues));
+    HANDLE_RESULT(nl->buf == NULL || nl->links == NULL || nl->queues == NULL,
+                  goto FAIL, "netlink_init: can't allocate buffers");
+    return 0;
+
+FAIL:
+    netlink_close(nl);
+    return -1;
+}
+
+int netlink_open(struct netlink *nl, const char **include, const char **exclude) {
+    assert(nl != NULL);
+
+    HANDLE_RESULT(netlink_init(nl, include, exclude) == -1,
+                  return -1, "netlink_open: netlink_init");
+    HANDLE_RESULT((nl->fd = netlink_socket(NETLINK_ROUTE, 0)) == -1,
+                  goto FAIL, "netlink_open: netlink_socket");
+    /* without notifications the link table is refreshed every tick */
+    HANDLE_RESULT((nl->monitor = netlink_socket(NETLINK_ROUTE, RTMGRP_LINK)) == -1,
+                  (void)nl, "netlink_open: can't subscribe to link changes");
+    netlink_open_netdev(nl);
+    HANDLE_RESULT(netlink_refresh(nl) == -1, goto FAIL, "netlink_open: netlink_refresh");
+    syslog(LOG_DEBUG, "fd=%d: netlink opened", nl->fd);
+    return 0;
+
+FAIL:
+    netlink_close(nl);
+    return -1;
+}
+
+void netlink_close(struct netlink *nl) {
+    assert(nl != NULL);
+
+    if(nl->fd != -1) {
+        HANDLE_POSIX_RESULT(close(nl->fd), (void)nl, "fd=%d: close: netlink", nl->fd);
+    }
+    if(nl->monitor != -1) {
+        HANDLE_POSIX_RESULT(close(nl->monitor), (void)nl, "fd=%d: close: monitor", nl->monitor);
+    }
+    if(nl->genl != -1) {
+        HANDLE_POSIX_RESULT(close(nl->genl), (void)nl, "fd=%d: close: genl", nl->genl);
+    }
+    free(nl->buf);
+    free(nl->links);
+    free(nl->queues);
+    memset(nl, 0, sizeof(*nl));
+    nl->fd = nl->monitor = nl->genl = -1;
+}
+
+/*
+ * Fills the link table from the text of /proc/net/dev, the stand-in for
+ * RTM_GETSTATS when reading a snapshot. Its links have no flags, they are
+ * taken as up and running, and "lo" as the loopback.
+ */
+int netlink_parse_dev(struct netlink *nl, const char *dev, size_t len) {
+    assert(nl != NULL);
+    assert(dev != NULL);
+
+    /* receive: bytes packets errs drop fifo frame compressed multicast,
+     * transmit: bytes packets errs drop fifo colls carrier compressed */
+    enum { COLUMNS = 16 };
+
+    struct scanner sc;
+    struct span line;
+    nl->count = 0;
+    nl->queue_count = 0;
+    scanner_init(&sc, dev, len);
+    while(scan_line(&sc, &line)) {
+        const char *colon = memchr(line.ptr, ':', line.len);
+        if(colon == NULL) continue;    /* header */
+
+        if(nl->count == nl->capacity) {
+            size_t capacity = nl->capacity * 2;
+            struct netlink_link *links = realloc(nl->links, capacity * sizeof(*links));
+            HANDLE_RESULT(links == NULL, return -1,
+                          "netlink_parse_dev: can't allocate %zu links", capacity);
+            nl->links = links;
+            nl->capacity = capacity;
+        }
+        struct netlink_link *link = &nl->links[nl->count];
+        struct scanner fields;
+        struct span field;
+        memset(link, 0, sizeof(*link));
+        scanner_init(&fields, line.ptr, colon - line.ptr);
+        HANDLE_RESULT(!scan_field(&fields, &field) || field.len >= IF_NAMESIZE,
+                      goto NEXT_LINE, "netlink_parse_dev: bad line %.*s", (int)line.len, line.ptr);
+        memcpy(link->name, field.ptr, field.len);
+
+        uint64_t values[COLUMNS];
+        size_t column = 0;
+        scanner_init(&fields, colon + 1, line.ptr + line.len - colon - 1);
+        for(; column < COLUMNS && scan_field(&fields, &field); ++column) {
+            HANDLE_RESULT(span_parse_u64(&field, &values[column]) == -1, goto NEXT_LINE,
+                          "netlink_parse_dev: bad line %.*s", (int)line.len, line.ptr);
+        }
+        HANDLE_RESULT(column < COLUMNS, goto NEXT_LINE,
+                      "netlink_parse_dev: bad line %.*s", (int)line.len, line.ptr);
+
+        struct rtnl_link_stats64 *stats = &link->stats;
+        stats->rx_bytes = values[0];
+        stats->rx_packets = values[1];
+        stats->rx_errors = values[2];
+        stats->rx_dropped = values[3];
+        stats->rx_fifo_errors = values[4];
+        stats->rx_frame_errors = values[5];
+        stats->rx_compressed = values[6];
+        stats->multicast = values[7];
+        stats->tx_bytes = values[8];
+        stats->tx_packets = values[9];
+        stats->tx_errors = values[10];
+        stats->tx_dropped = values[11];
+        stats->tx_fifo_errors = values[12];
+        stats->collisions = values[13];
+        stats->tx_carrier_errors = values[14];
+        stats->tx_compressed = values[15];
+        link->index = nl->count + 1;
+        link->flags = IFF_UP | IFF_RUNNING | (strcmp(link->name, "lo") == 0 ? IFF_LOOPBACK : 0);
+        link->selected = netlink_select(nl, link);
+        link->has_stats = 1;
+        ++nl->count;
+NEXT_LINE:
+        ;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef NETLINK_H_
+#define NETLINK_H_
+
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Link statistics over a persistent NETLINK_ROUTE socket.
+ *
+ * The link table (index, name, flags) is dumped with RTM_GETLINK only when a
+ * second socket subscribed to RTNLGRP_LINK reports a change; every tick a
+ * RTM_GETSTATS dump filtered to IFLA_STATS_LINK_64 is parsed straight into
+ * the table. Include/exclude patterns (fnmatch(3)) are evaluated when the
+ * table is refreshed, so excluded links cost one skipped message per tick.
+ *
+ * Per-queue counters come from the netdev generic netlink family (Linux 6.9+)
+ * and are only collected when the kernel offers it.
+ */
+struct netlink_link {
+    int index;
+    unsigned flags;
+    int selected;       /* up, running, not loopback and passing the patterns */
+    int has_stats;      /* stats were filled in by the last read */
+    char name[IF_NAMESIZE];
+    struct rtnl_link_stats64 stats;
+};
+
+struct netlink_queue {
+    char name[IF_NAMESIZE];     /* of the link */
+    int tx;
+    unsigned id;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+struct netlink {
+    int fd;         /* dump requests */
+    int monitor;    /* link notifications, -1 when unavailable */
+    int genl;       /* netdev family requests, -1 when unavailable */
+    uint16_t netdev;
+    uint32_t seq;
+    char *buf;
+    size_t bufsize;
+    const char **include;
+    const char **exclude;
+    int stale;      /* link table has to be dumped again */
+
+    struct netlink_link *links;     /* sorted by index */
+    size_t count;
+    size_t capacity;
+    struct netlink_queue *queues;
+    size_t queue_count;
+    size_t queue_capacity;
+};
+
+int netlink_init(struct netlink *nl, const char **include, const char **exclude);
+int netlink_open(struct netlink *nl, const char **include, const char **exclude);
+int netlink_read(struct netlink *nl);
+void netlink_close(struct netlink *nl);
+int netlink_parse_dev(struct netlink *nl, const char *dev, size_t len);
+
+#endif /* NETLINK_H_ */
@@ -0,0 +1,450 @@
+#include "options.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "error_handling.h"
+#include "process.h"
+#include "sink.h"
+#include "worker.h"
+
+/* the content of the options file, NUL terminated */
+static int options_read(const char *path, char **file, size_t *len) {
+    int result = -1;
+    int fd = -1;
+    *file = malloc(OPTIONS_FILE_SIZE + 1);
+    *len = 0;
+    HANDLE_RESULT(*file == NULL, return -1, "options_read: can't allocate %d bytes", OPTIONS_FILE_SIZE);
+    HANDLE_POSIX_RESULT(fd = open(path, O_RDONLY | O_CLOEXEC), goto CLEANUP, "%s: open", path);
+    for(;;) {
+        ssize_t r = read(fd, *file + *len, OPTIONS_FILE_SIZE + 1 - *len);
+        HANDLE_POSIX_RESULT(r, goto CLEANUP, "%s: read", path);
+        if(r == 0) break;
+        *len += r;
+        HANDLE_RESULT(*len > OPTIONS_FILE_SIZE, goto CLEANUP,
+                      "%s: longer than %d bytes", path, OPTIONS_FILE_SIZE);
+    }
+    (*file)[*len] = 0;
+    result = 0;
+
+CLEANUP:
+    if(fd != -1) {
+        HANDLE_POSIX_RESULT(close(fd), (void)fd, "fd=%d: close: %s", fd, path);
+    }
+    if(result == -1) {
+        free(*file);
+        *file = NULL;
+    }
+    return result;
+}
+
+static inline int options_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* copies the arguments and the words of the file into text, argv points into it */
+static int options_split(struct agent_options *options, int argc, char **argv,
+                         const char *file, size_t filelen) {
+    size_t size = filelen + 1;
+    size_t count = argc + 1;
+    for(int i = 0; i < argc; ++i) size += strlen(argv[i]) + 1;
+    /* an option and its argument per line at most */
+    for(size_t i = 0; i < filelen; ++i) count += 2 * (file[i] == '\n');
+    count += 2;
+    options->text = malloc(size);
+    options->argv = calloc(count, sizeof(*options->argv));
+    HANDLE_RESULT(options->text == NULL || options->argv == NULL, return -1,
+                  "options_split: can't allocate %zu arguments", count);
+
+    char *p = options->text;
+    for(int i = 0; i < argc; ++i) {
+        options->argv[options->argc++] = p;
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    const char *end = file + filelen;
+    for(const char *line = file; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if(eol == NULL) eol = end;
+        const char *s = line;
+        const char *e = eol;
+        line = eol + 1;
+        while(s < e && options_blank(*s)) ++s;
+        while(e > s && options_blank(e[-1])) --e;
+        if(s == e || *s == '#') continue;
+        /* "-x argument" is an option and the rest of the line, anything else a sink */
+        const char *arg = e;
+        if(*s == '-') {
+            arg = s;
+            while(arg < e && !options_blank(*arg)) ++arg;
+        }
+        options->argv[options->argc++] = p;
+        memcpy(p, s, arg - s);
+        p += arg - s;
+        *p++ = 0;
+        while(arg < e && options_blank(*arg)) ++arg;
+        if(arg < e) {
+            options->argv[options->argc++] = p;
+            memcpy(p, arg, e - arg);
+            p += e - arg;
+            *p++ = 0;
+        }
+    }
+    options->argv[options->argc] = NULL;
+    return 0;
+}
+
+static int options_parse(struct agent_options *options, int argc, char **argv,
+                         const char *file, size_t filelen) {
+    memset(options, 0, sizeof(*options));
+    HANDLE_RESULT(options_split(options, argc, argv, file, filelen) == -1,
+                  return -1, "options_parse: options_split");
+    argc = options->argc;
+    argv = options->argv;
+
+    int hostnamelen = sysconf(_SC_HOST_NAME_MAX);
+    HANDLE_POSIX_RESULT(hostnamelen,
+                        hostnamelen = _POSIX_HOST_NAME_MAX,
+                        "sysconf: _SC_HOST_NAME_MAX");
+    char *hostname = options->hostname = malloc(hostnamelen + 1); // HOST_NAME_MAX does not include \0
+
+    /* patterns point into argv, there can't be more of them than arguments */
+    const char **include = options->nic_include = calloc(argc + 1, sizeof(*include));
+    const char **exclude = options->nic_exclude = calloc(argc + 1, sizeof(*exclude));
+    const char **disk_include = options->disk_include = calloc(argc + 1, sizeof(*disk_include));
+    const char **disk_exclude = options->disk_exclude = calloc(argc + 1, sizeof(*disk_exclude));
+    const char **cgroup_include = options->cgroup_include = calloc(argc + 1, sizeof(*cgroup_include));
+    const char **cgroup_exclude = options->cgroup_exclude = calloc(argc + 1, sizeof(*cgroup_exclude));
+    const char **memory_include = options->memory_include = calloc(argc + 1, sizeof(*memory_include));
+    const char **vmstat_include = options->vmstat_include = calloc(argc + 1, sizeof(*vmstat_include));
+    const char **tags = options->tags = calloc(argc + 1, sizeof(*tags));
+    struct agent_schedule *schedules = options->schedules = calloc(argc + 1, sizeof(*schedules));
+    size_t includes = 0;
+    size_t excludes = 0;
+    size_t disk_includes = 0;
+    size_t disk_excludes = 0;
+    size_t cgroup_includes = 0;
+    size_t cgroup_excludes = 0;
+    size_t memory_includes = 0;
+    size_t vmstat_includes = 0;
+    size_t tagged = 0;
+    size_t scheduled = 0;
+    char *service = NULL;
+    char *end = NULL;
+    int opt = 0;
+    struct agent_config config = {
+        .rate = 0,
+        .keyframe = 0,
+        .state_capacity = AGENT_STATE_CAPACITY,
+        .payload = SINK_DEFAULT_PAYLOAD,
+        .gso = 0,
+        .flush = 0,
+        .percentile = 0,
+        .aggregate_capacity = AGENT_AGGREGATE_CAPACITY,
+        .spool = NULL,
+        .spool_size = SINK_SPOOL_SIZE,
+        .replay_rate = SINK_REPLAY_RATE,
+        .proc_root = NULL,
+        .snapshots = NULL,
+        .uring = 0,
+        .process_top = PROCESS_TOP,
+        .process_cgroup = 0,
+        .cgroup_depth = CGROUP_DEPTH,
+        .database = NULL,
+        .http_flush = SINK_HTTP_FLUSH,
+        .gzip = 0,
+        .shard = 0,
+        .irq_cells = 0,
+        .lock = 0,
+        .sched = { .pinned = 0, .idle = 0, .nice = 0 },
+        .slack = 0,
+        .worker = 0,
+        .file = NULL
+    };
+
+    HANDLE_RESULT(hostname == NULL || include == NULL || exclude == NULL || schedules == NULL ||
+                  disk_include == NULL || disk_exclude == NULL ||
+                  cgroup_include == NULL || cgroup_exclude == NULL ||
+                  memory_include == NULL || vmstat_include == NULL || tags == NULL,
+                  return -1, "can't allocate arguments");
+    HANDLE_POSIX_RESULT(gethostname(hostname, hostnamelen),
+                        return -1, "gethostname");
+    hostname[hostnamelen] = 0;
+
+    /* scanning starts over, the file is parsed after the command line */
+    optind = 0;
+    while ((opt = getopt(argc, argv, "a:b:B:c:C:d:D:E:f:F:gG:H:i:Ik:Lm:M:n:N:p:PQ:rR:s:St:T:uV:wx:z")) != -1) {
+        switch (opt) {
+            case 'm':
+                config.payload = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0 ||
+                              config.payload == 0 || config.payload > SINK_MAX_PAYLOAD,
+                              return -1, "Invalid payload size: %s", optarg);
+                break;
+            case 'p':
+                service = optarg;
+                break;
+            case 'g':
+                config.gso = 1;
+                break;
+            case 'k':
+                config.keyframe = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0 || config.keyframe == 0,
+                              return -1, "Invalid keyframe interval: %s", optarg);
+                break;
+            case 'r':
+                config.rate = 1;
+                break;
+            case 'F':
+                config.state_capacity = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0 || config.state_capacity == 0 ||
+                              config.state_capacity > AGENT_STATE_LIMIT,
+                              return -1, "Invalid number of fields: %s", optarg);
+                break;
+            case 'c': {
+                /* collector:interval[:offset], in milliseconds; interval 0 turns it off */
+                struct agent_schedule *schedule = &schedules[scheduled++];
+                char *interval = strchr(optarg, ':');
+                HANDLE_RESULT(interval == NULL, return -1, "Invalid schedule: %s", optarg);
+                *interval++ = 0;
+                schedule->collector = optarg;
+                schedule->interval = strtoul(interval, &end, 10);
+                schedule->offset = -1;
+                if(*end == ':') {
+                    schedule->offset = strtol(end + 1, &end, 10);
+                }
+                HANDLE_RESULT(*interval == 0 || *end != 0 || schedule->offset < -1 ||
+                              (schedule->interval == 0 && schedule->offset != -1),
+                              return -1, "Invalid schedule of %s: %s", optarg, interval);
+                break;
+            }
+            case 'a':
+                config.flush = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0 || config.flush == 0,
+                              return -1, "Invalid flush interval: %s", optarg);
+                break;
+            case 'P':
+                config.percentile = 1;
+                break;
+            case 's': {
+                /* path[:MiB] */
+                char *size = strrchr(optarg, ':');
+                if(size != NULL) {
+                    *size++ = 0;
+                    config.spool_size = strtoul(size, &end, 10) * 1024 * 1024;
+                    HANDLE_RESULT(*size == 0 || *end != 0 || config.spool_size == 0,
+                                  return -1, "Invalid spool size: %s", size);
+                }
+                config.spool = optarg;
+                break;
+            }
+            case 'R':
+                config.replay_rate = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0 || config.replay_rate == 0,
+                              return -1, "Invalid replay rate: %s", optarg);
+                break;
+            case 'H': {
+                /* database[:flush] */
+                char *flush = strrchr(optarg, ':');
+                if(flush != NULL) {
+                    *flush++ = 0;
+                    config.http_flush = strtoul(flush, &end, 10);
+                    HANDLE_RESULT(*flush == 0 || *end != 0 || config.http_flush == 0,
+                                  return -1, "Invalid HTTP flush interval: %s", flush);
+                }
+                HANDLE_RESULT(*optarg == 0, return -1, "Invalid database: %s", optarg);
+                config.database = optarg;
+                break;
+            }
+            case 'z':
+                config.gzip = 1;
+                break;
+            case 'S':
+                config.shard = 1;
+                break;
+            case 'd':
+                config.proc_root = optarg;
+                break;
+            case 'D':
+                config.snapshots = optarg;
+                break;
+            case 'u':
+                config.uring = 1;
+                break;
+            case 't':
+                /* top[:name|cgroup] */
+                config.process_top = strtoul(optarg, &end, 10);
+                if(*end == ':') {
+                    config.process_cgroup = strcmp(end + 1, "cgroup") == 0;
+                    HANDLE_RESULT(!config.process_cgroup && strcmp(end + 1, "name") != 0,
+                                  return -1, "Invalid process grouping: %s", end + 1);
+                    end += strlen(end);
+                }
+                HANDLE_RESULT(*optarg == 0 || *end != 0 || config.process_top == 0,
+                              return -1, "Invalid process top: %s", optarg);
+                break;
+            case 'i':
+                include[includes++] = optarg;
+                break;
+            case 'x':
+                exclude[excludes++] = optarg;
+                break;
+            case 'b':
+                disk_include[disk_includes++] = optarg;
+                break;
+            case 'B':
+                disk_exclude[disk_excludes++] = optarg;
+                break;
+            case 'G':
+                config.cgroup_depth = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0,
+                              return -1, "Invalid cgroup depth: %s", optarg);
+                break;
+            case 'n':
+                cgroup_include[cgroup_includes++] = optarg;
+                break;
+            case 'N':
+                cgroup_exclude[cgroup_excludes++] = optarg;
+                break;
+            case 'I':
+                config.irq_cells = 1;
+                break;
+            case 'M':
+                memory_include[memory_includes++] = optarg;
+                break;
+            case 'V':
+                vmstat_include[vmstat_includes++] = optarg;
+                break;
+            case 'L':
+                config.lock = 1;
+                break;
+            case 'C':
+                HANDLE_RESULT(worker_parse_cpus(optarg, &config.sched.cpus) == -1,
+                              return -1, "Invalid CPU list: %s", optarg);
+                config.sched.pinned = 1;
+                break;
+            case 'Q':
+                /* idle or a nice value */
+                config.sched.idle = strcmp(optarg, "idle") == 0;
+                if(!config.sched.idle) {
+                    config.sched.nice = strtol(optarg, &end, 10);
+                    HANDLE_RESULT(*optarg == 0 || *end != 0 ||
+                                  config.sched.nice < -20 || config.sched.nice > 19,
+                                  return -1, "Invalid priority: %s", optarg);
+                }
+                break;
+            case 'E':
+                config.slack = strtoul(optarg, &end, 10);
+                HANDLE_RESULT(*optarg == 0 || *end != 0,
+                              return -1, "Invalid timer slack: %s", optarg);
+                break;
+            case 'w':
+                config.worker = 1;
+                break;
+            case 'T':
+                /* key=value, checked when the registry formats them */
+                tags[tagged++] = optarg;
+                break;
+            case 'f':
+                /* the file can't name another one */
+                HANDLE_RESULT(config.file != NULL && strcmp(optarg, config.file) != 0,
+                              return -1, "Options file %s names another one: %s", config.file, optarg);
+                config.file = optarg;
+                break;
+            default: /* '?' */
+                fprintf(stderr, "Usage: %s [-r] [-k ticks] [-F fields] [-m payload] [-g] [-i pattern] [-x pattern] "
+                        "[-b pattern] [-B pattern] [-G depth] [-n pattern] [-N pattern] [-M pattern] [-V pattern] [-I] "
+                        "[-c collector:interval[:offset]] [-a flush [-P]] [-s spool[:MiB] [-R rate]] "
+                        "[-H database[:flush] [-z]] "
+                        "[-d proc_root | -D snapshots] [-u] [-t top[:name|cgroup]] [-T key=value] [-L] "
+                        "[-C cpus] [-Q idle|nice] [-E slack] [-w] [-S] [-f file] "
+                        "-p port hostname[:port]...|-\n", argv[0]);
+                return -1;
+        }
+    }
+
+    if(file == NULL && config.file != NULL) {
+        /* only the name of the file is needed, the sinks may be in it */
+        options->config = config;
+        return 0;
+    }
+    HANDLE_RESULT(optind >= argc, return -1, "Host not provided");
+    for(int i = optind; i < argc; ++i) {
+        /* a port of its own is "host:port" or "[v6 address]:port" */
+        const char *colon = strrchr(argv[i], ':');
+        int port = colon != NULL && (argv[i][0] == '[' ? colon[-1] == ']' : strchr(argv[i], ':') == colon);
+        HANDLE_RESULT(service == NULL && !port && strcmp(argv[i], SINK_STDOUT) != 0,
+                      return -1, "Port of %s not provided", argv[i]);
+        HANDLE_RESULT(config.database != NULL && strcmp(argv[i], SINK_STDOUT) == 0,
+                      return -1, "HTTP needs a host");
+    }
+    HANDLE_RESULT(config.proc_root != NULL && config.snapshots != NULL,
+                  return -1, "Either a proc root or snapshots to replay");
+
+    config.hostname = hostname;
+    config.remotes = (const char **)&argv[optind];
+    config.service = service;
+    config.nic_include = include;
+    config.nic_exclude = exclude;
+    config.disk_include = disk_include;
+    config.disk_exclude = disk_exclude;
+    config.cgroup_include = cgroup_include;
+    config.cgroup_exclude = cgroup_exclude;
+    config.memory_include = memory_include;
+    config.vmstat_include = vmstat_include;
+    config.tags = tags;
+    config.schedules = schedules;
+    options->config = config;
+    return 0;
+}
+
+int options_load(struct agent_options *options, int argc, char **argv) {
+    assert(options != NULL);
+    assert(argc > 0);
+    assert(argv != NULL);
+
+    int result = -1;
+    char *file = NULL;
+    size_t filelen = 0;
+    /* the command line names the file */
+    HANDLE_RESULT(options_parse(options, argc, argv, NULL, 0) == -1, goto CLEANUP, NULL);
+    if(options->config.file != NULL) {
+        HANDLE_RESULT(options_read(options->config.file, &file, &filelen) == -1, goto CLEANUP,
+                      "can't read options file %s", options->config.file);
+        options_free(options);
+        HANDLE_RESULT(options_parse(options, argc, argv, file, filelen) == -1, goto CLEANUP, NULL);
+    }
+    options->config.argc = argc;
+    options->config.argv = argv;
+    result = 0;
+
+CLEANUP:
+    free(file);
+    if(result == -1) options_free(options);
+    return result;
+}
+
+void options_free(struct agent_options *options) {
+    assert(options != NULL);
+
+    free(options->text);
+    free(options->argv);
+    free(options->hostname);
+    free(options->nic_include);
+    free(options->nic_exclude);
+    free(options->disk_include);
+    free(options->disk_exclude);
+    free(options->cgroup_include);
+    free(options->cgroup_exclude);
+    free(options->memory_include);
+    free(options->vmstat_include);
+    free(options->tags);
+    free(options->schedules);
+    memset(options, 0, sizeof(*options));
+}
@@ -0,0 +1,48 @@
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include <sys/types.h>
+
+#include "agent.h"
+
+/*
+ * Options of the agent: the command line, followed by the lines of the
+ * options file given with -f. A line of the file is an option as it is
+ * written on the command line, with its argument after the first blanks
+ * (the rest of the line, blanks included), or a sink; blank lines and
+ * lines starting with '#' are skipped:
+ *
+ *     -p 8089
+ *     -c process:5000
+ *     -T dc=eu-1
+ *     relay1
+ *
+ * An option given once takes the value of the file, a repeatable one gets
+ * the values of both. The strings of the configuration point into the
+ * options, which own everything they allocated; they can be loaded again
+ * from the same command line to reload the file.
+ */
+struct agent_options {
+    struct agent_config config;
+    char *text;             /* arguments and the file, NUL separated */
+    char **argv;            /* into text, permuted by getopt(3) */
+    int argc;
+    char *hostname;
+    const char **nic_include;
+    const char **nic_exclude;
+    const char **disk_include;
+    const char **disk_exclude;
+    const char **cgroup_include;
+    const char **cgroup_exclude;
+    const char **memory_include;
+    const char **vmstat_include;
+    const char **tags;
+    struct agent_schedule *schedules;
+};
+
+#define OPTIONS_FILE_SIZE (1024 * 1024)     /* bytes of an options file */
+
+int options_load(struct agent_options *options, int argc, char **argv);
+void options_free(struct agent_options *options);
+
+#endif /* OPTIONS_H_ */
@@ -0,0 +1,572 @@
+#include "process.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "scanner.h"
+#include "source.h"
+#include "state.h"
+
+#define PROCESS_DIRENTS_SIZE 65536
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static inline size_t process_hash(pid_t pid) {
+    return (uint32_t)pid * 2654435761U;
+}
+
+static inline uint64_t process_delta(uint64_t value, uint64_t previous) {
+    return value > previous ? value - previous : 0;
+}
+
+/* control characters would break the line protocol */
+void process_sanitize(char *s) {
+    assert(s != NULL);
+
+    for(; *s != 0; ++s) {
+        if((unsigned char)*s < ' ' || *s == 0x7f) *s = '?';
+    }
+}
+
+void process_close_fd(struct process_table *table, int *fd) {
+    assert(table != NULL);
+    assert(fd != NULL);
+
+    if(*fd == -1) return;
+    HANDLE_POSIX_RESULT(close(*fd), (void)fd, "fd=%d: close: process", *fd);
+    *fd = -1;
+    --table->fds;
+}
+
+/* slot of the cgroup path, counted once more; NULL when all slots are taken */
+struct process_cgroup *process_intern(struct process_table *table, const char *path, size_t len) {
+    assert(table != NULL);
+    assert(table->cgroups != NULL);
+    assert(path != NULL);
+
+    char name[PROCESS_CGROUP_SIZE];
+    if(len >= sizeof(name)) len = sizeof(name) - 1;
+    memcpy(name, path, len);
+    name[len] = 0;
+    process_sanitize(name);
+
+    uint64_t hash = state_hash(STATE_HASH_SEED, name, len);
+    size_t mask = 2 * PROCESS_CGROUPS - 1;
+    size_t i = hash & mask;
+    for(; table->cgroup_index[i] != 0; i = (i + 1) & mask) {
+        struct process_cgroup *cgroup = &table->cgroups[table->cgroup_index[i] - 1];
+        if(cgroup->hash == hash && cgroup->len == len && memcmp(cgroup->path, name, len) == 0) {
+            ++cgroup->refs;
+            return cgroup;
+        }
+    }
+    if(table->free_cgroup == PROCESS_CGROUPS) {
+        if(!table->cgroups_full) {
+            syslog(LOG_WARNING, "more than %d cgroups, processes of %s and others are grouped by name",
+                   PROCESS_CGROUPS, name);
+            table->cgroups_full = 1;
+        }
+        return NULL;
+    }
+    struct process_cgroup *cgroup = &table->cgroups[table->free_cgroup];
+    table->cgroup_index[i] = table->free_cgroup + 1;
+    table->free_cgroup = cgroup->next;
+    cgroup->refs = 1;
+    cgroup->hash = hash;
+    cgroup->len = len;
+    memcpy(cgroup->path, name, len + 1);
+    return cgroup;
+}
+
+/* the last process of a cgroup frees its slot, backward shift deletion from the index */
+void process_unintern(struct process_table *table, struct process_cgroup *cgroup) {
+    assert(table != NULL);
+    assert(cgroup != NULL);
+    assert(cgroup->refs > 0);
+
+    if(--cgroup->refs != 0) return;
+    uint32_t slot = cgroup - table->cgroups;
+    size_t mask = 2 * PROCESS_CGROUPS - 1;
+    size_t i = cgroup->hash & mask;
+    while(table->cgroup_index[i] != slot + 1) i = (i + 1) & mask;
+    for(size_t j = (i + 1) & mask; table->cgroup_index[j] != 0; j = (j + 1) & mask) {
+        size_t home = table->cgroups[table->cgroup_index[j] - 1].hash & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            table->cgroup_index[i] = table->cgroup_index[j];
+            i = j;
+        }
+    }
+    table->cgroup_index[i] = 0;
+    cgroup->next = table->free_cgroup;
+    table->free_cgroup = slot;
+    table->cgroups_full = 0;
+}
+
+void process_release(struct process_table *table, struct process *p) {
+    assert(table != NULL);
+    assert(p != NULL);
+
+    process_close_fd(table, &p->stat);
+    process_close_fd(table, &p->io);
+    process_close_fd(table, &p->status);
+    if(p->cgroup != NULL) process_unintern(table, p->cgroup);
+    p->cgroup = NULL;
+    p->flags = 0;
+}
+
+/*
+ * Reads /proc/<pid>/<name> into table->file. The descriptor is kept in *fd
+ * while the table has descriptors to spare; fd NULL reads once. A failed
+ * read closes the descriptor, the next call opens the file again.
+ */
+ssize_t process_file(struct process_table *table, pid_t pid, const char *name, int *fd) {
+    assert(table != NULL);
+    assert(name != NULL);
+
+    int f = fd != NULL ? *fd : -1;
+    if(f == -1) {
+        char path[sizeof("/") + 3 * sizeof(pid_t) + PROCESS_COMM_SIZE];
+        snprintf(path, sizeof(path), "%d/%s", (int)pid, name);
+        f = openat(table->dir, path, O_RDONLY | O_CLOEXEC);
+        if(f == -1) return -1;
+        if(fd != NULL && table->fds < table->max_fds) {
+            *fd = f;
+            ++table->fds;
+        }
+    }
+    ssize_t r = pread(f, table->file, sizeof(table->file) - 1, 0);
+    int error = errno;
+    if(fd == NULL || *fd != f) {
+        close(f);
+    } else if(r == -1) {
+        process_close_fd(table, fd);
+    }
+    errno = error;
+    if(r == -1) return -1;
+    table->file[r] = 0;
+    return r;
+}
+
+/* pid (comm) state ppid ... utime(14) stime(15) ... starttime(22) vsize(23) rss(24) ... */
+int process_parse_stat(const char *buf, size_t len, struct process *sample) {
+    assert(buf != NULL);
+    assert(sample != NULL);
+
+    /* comm can contain anything, parentheses included */
+    const char *open = memchr(buf, '(', len);
+    const char *close = memrchr(buf, ')', len);
+    if(open == NULL || close == NULL || close < open) return -1;
+    size_t commlen = close - open - 1;
+    if(commlen >= PROCESS_COMM_SIZE) commlen = PROCESS_COMM_SIZE - 1;
+    memcpy(sample->comm, open + 1, commlen);
+    sample->comm[commlen] = 0;
+
+    struct scanner sc;
+    struct span field;
+    unsigned index = 3;
+    scanner_init(&sc, close + 1, buf + len - close - 1);
+    for(; index <= 24 && scan_field(&sc, &field); ++index) {
+        uint64_t *value = NULL;
+        switch(index) {
+            case 14: value = &sample->utime; break;
+            case 15: value = &sample->stime; break;
+            case 22: value = &sample->start; break;
+            case 24: value = &sample->rss; break;
+            default: continue;
+        }
+        if(span_parse_u64(&field, value) == -1) return -1;
+    }
+    return index > 24 ? 0 : -1;
+}
+
+/* "key:   value" lines of /proc/<pid>/io and /proc/<pid>/status */
+int process_parse_value(const struct span *line, const char *key, size_t keylen, uint64_t *value) {
+    assert(line != NULL);
+    assert(key != NULL);
+    assert(value != NULL);
+
+    if(line->len <= keylen || memcmp(line->ptr, key, keylen) != 0 || line->ptr[keylen] != ':') {
+        return 0;
+    }
+    struct span number = { line->ptr + keylen + 1, line->len - keylen - 1 };
+    while(number.len > 0 && (*number.ptr == ' ' || *number.ptr == '\t')) {
+        ++number.ptr;
+        --number.len;
+    }
+    return span_parse_u64(&number, value) == 0;
+}
+
+/* the unified hierarchy, or the first one listed on cgroup v1 */
+struct process_cgroup *process_cgroup(struct process_table *table, pid_t pid) {
+    assert(table != NULL);
+
+    ssize_t len = process_file(table, pid, "cgroup", NULL);
+    if(len == -1) return NULL;
+    struct scanner sc;
+    struct span line;
+    struct span path = { "/", 1 };
+    int found = 0, any = 0;
+    scanner_init(&sc, table->file, len);
+    while(!found && scan_line(&sc, &line)) {
+        /* hierarchy-ID:controllers:path */
+        const char *colon = memchr(line.ptr, ':', line.len);
+        colon = colon != NULL ? memchr(colon + 1, ':', line.ptr + line.len - colon - 1) : NULL;
+        if(colon == NULL) continue;
+        found = span_has_prefix(&line, "0::", 3);
+        if(found || !any) {
+            path.ptr = colon + 1;
+            path.len = line.ptr + line.len - colon - 1;
+            any = 1;
+        }
+    }
+    return process_intern(table, path.ptr, path.len);
+}
+
+/* slot of the pid, inserted with generation 0 when missing; NULL when the table is full */
+struct process *process_lookup(struct process_table *table, pid_t pid) {
+    assert(table != NULL);
+    assert(pid > 0);
+
+    size_t mask = table->capacity - 1;
+    for(size_t i = process_hash(pid) & mask;; i = (i + 1) & mask) {
+        struct process *p = &table->processes[i];
+        if(p->pid == pid) return p;
+        if(p->pid != 0) continue;
+        /* keep a quarter free so that probe sequences stay short */
+        if(table->count >= table->capacity - table->capacity / 4) return NULL;
+        memset(p, 0, sizeof(*p));
+        p->pid = pid;
+        p->stat = p->io = p->status = -1;
+        ++table->count;
+        return p;
+    }
+}
+
+/* backward shift deletion: later entries of the probe sequence move into the hole */
+void process_remove(struct process_table *table, size_t i) {
+    assert(table != NULL);
+    assert(i < table->capacity);
+
+    size_t mask = table->capacity - 1;
+    process_release(table, &table->processes[i]);
+    for(size_t j = (i + 1) & mask; table->processes[j].pid != 0; j = (j + 1) & mask) {
+        size_t home = process_hash(table->processes[j].pid) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            table->processes[i] = table->processes[j];
+            i = j;
+        }
+    }
+    table->processes[i].pid = 0;
+    --table->count;
+}
+
+/* reads the stat of a listed process, a new or reused pid starts a baseline */
+void process_sample(struct process_table *table, pid_t pid) {
+    assert(table != NULL);
+
+    struct process *p = process_lookup(table, pid);
+    if(p == NULL) {
+        if(!table->full) {
+            syslog(LOG_WARNING, "process table is full, processes beyond %zu are not tracked",
+                   table->count);
+            table->full = 1;
+        }
+        return;
+    }
+    /* a kept descriptor of an exited process fails, the pid may have been reused */
+    ssize_t len = process_file(table, pid, "stat", &p->stat);
+    if(len == -1 && p->generation != 0) len = process_file(table, pid, "stat", &p->stat);
+    struct process sample;
+    if(len == -1 || process_parse_stat(table->file, len, &sample) == -1) return;
+
+    if(p->generation == 0 || sample.start != p->start) {
+        process_close_fd(table, &p->io);
+        process_close_fd(table, &p->status);
+        if(p->cgroup != NULL) process_unintern(table, p->cgroup);
+        p->cgroup = table->by_cgroup ? process_cgroup(table, pid) : NULL;
+        p->flags = 0;
+        p->start = sample.start;
+        p->user = p->system = 0;
+    } else {
+        p->user = process_delta(sample.utime, p->utime);
+        p->system = process_delta(sample.stime, p->stime);
+    }
+    memcpy(p->comm, sample.comm, sizeof(p->comm));
+    process_sanitize(p->comm);
+    p->utime = sample.utime;
+    p->stime = sample.stime;
+    p->rss = sample.rss * table->pagesize;
+    p->generation = table->generation;
+}
+
+int process_scan(struct process_table *table) {
+    assert(table != NULL);
+    assert(table->dir != -1);
+
+    HANDLE_POSIX_RESULT(lseek(table->dir, 0, SEEK_SET), return -1, "process_scan: lseek");
+    for(;;) {
+        long len = syscall(SYS_getdents64, table->dir, table->buf, table->bufsize);
+        HANDLE_POSIX_RESULT(len, return -1, "process_scan: getdents64");
+        if(len == 0) break;
+        for(long offset = 0; offset < len;) {
+            const struct linux_dirent64 *entry = (const struct linux_dirent64 *)(table->buf + offset);
+            offset += entry->d_reclen;
+            struct span name = { entry->d_name, strlen(entry->d_name) };
+            uint64_t pid = 0;
+            if(span_parse_u64(&name, &pid) == -1 || pid == 0 || pid > INT32_MAX) continue;
+            process_sample(table, pid);
+        }
+    }
+    return 0;
+}
+
+/* group of the name, a slot from an older generation is free */
+struct process_group *process_group(struct process_table *table, const char *name, size_t len) {
+    assert(table != NULL);
+    assert(name != NULL);
+
+    uint64_t hash = state_hash(STATE_HASH_SEED, name, len);
+    size_t mask = table->capacity - 1;
+    /* there are never more groups than processes, so there is a free slot */
+    for(size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct process_group *group = &table->groups[i];
+        if(group->generation != table->generation) {
+            memset(group, 0, sizeof(*group));
+            group->generation = table->generation;
+            group->hash = hash;
+            group->name = name;
+            group->len = len;
+            return group;
+        }
+        if(group->hash == hash && group->len == len && memcmp(group->name, name, len) == 0) {
+            return group;
+        }
+    }
+}
+
+/* counters of a process that ran in this tick, added to its group */
+void process_activity(struct process_table *table, struct process *p, struct process_group *group) {
+    assert(table != NULL);
+    assert(p != NULL);
+    assert(group != NULL);
+
+    struct scanner sc;
+    struct span line;
+    ssize_t len = (p->flags & PROCESS_NO_IO) ? -1 : process_file(table, p->pid, "io", &p->io);
+    if(len == -1 && errno == EACCES) p->flags |= PROCESS_NO_IO;
+    if(len != -1) {
+        uint64_t read_bytes = p->read_bytes, write_bytes = p->write_bytes;
+        scanner_init(&sc, table->file, len);
+        while(scan_line(&sc, &line)) {
+            process_parse_value(&line, "read_bytes", sizeof("read_bytes") - 1, &read_bytes);
+            process_parse_value(&line, "write_bytes", sizeof("write_bytes") - 1, &write_bytes);
+        }
+        if(p->flags & PROCESS_HAS_IO) {
+            group->read_bytes += process_delta(read_bytes, p->read_bytes);
+            group->write_bytes += process_delta(write_bytes, p->write_bytes);
+        }
+        p->read_bytes = read_bytes;
+        p->write_bytes = write_bytes;
+        p->flags |= PROCESS_HAS_IO;
+    }
+
+    len = process_file(table, p->pid, "status", &p->status);
+    if(len != -1) {
+        uint64_t voluntary = p->voluntary, nonvoluntary = p->nonvoluntary;
+        scanner_init(&sc, table->file, len);
+        while(scan_line(&sc, &line)) {
+            process_parse_value(&line, "voluntary_ctxt_switches",
+                                sizeof("voluntary_ctxt_switches") - 1, &voluntary);
+            process_parse_value(&line, "nonvoluntary_ctxt_switches",
+                                sizeof("nonvoluntary_ctxt_switches") - 1, &nonvoluntary);
+        }
+        if(p->flags & PROCESS_HAS_STATUS) {
+            group->voluntary += process_delta(voluntary, p->voluntary);
+            group->nonvoluntary += process_delta(nonvoluntary, p->nonvoluntary);
+        }
+        p->voluntary = voluntary;
+        p->nonvoluntary = nonvoluntary;
+        p->flags |= PROCESS_HAS_STATUS;
+    }
+}
+
+static inline uint64_t process_group_cpu(const struct process_group *group) {
+    return group->utime + group->stime;
+}
+
+void process_sift_down(struct process_group **heap, size_t count, size_t i) {
+    assert(heap != NULL);
+
+    for(;;) {
+        size_t least = i, left = 2 * i + 1, right = left + 1;
+        if(left < count && process_group_cpu(heap[left]) < process_group_cpu(heap[least])) least = left;
+        if(right < count && process_group_cpu(heap[right]) < process_group_cpu(heap[least])) least = right;
+        if(least == i) return;
+        struct process_group *swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/* the groups with the most CPU time on a min-heap, then sorted highest first */
+void process_select(struct process_table *table) {
+    assert(table != NULL);
+
+    struct process_group **heap = table->top;
+    size_t count = 0;
+    for(struct process_group *group = table->groups; group < table->groups + table->capacity; ++group) {
+        if(group->generation != table->generation || process_group_cpu(group) == 0) continue;
+        if(count < table->top_capacity) {
+            size_t i = count++;
+            heap[i] = group;
+            while(i > 0 && process_group_cpu(heap[(i - 1) / 2]) > process_group_cpu(heap[i])) {
+                struct process_group *swap = heap[i];
+                heap[i] = heap[(i - 1) / 2];
+                heap[(i - 1) / 2] = swap;
+                i = (i - 1) / 2;
+            }
+        } else if(process_group_cpu(group) > process_group_cpu(heap[0])) {
+            heap[0] = group;
+            process_sift_down(heap, count, 0);
+        }
+    }
+    table->top_count = count;
+    /* the least goes to the end until the heap is empty */
+    for(size_t n = count; n > 1; --n) {
+        struct process_group *swap = heap[0];
+        heap[0] = heap[n - 1];
+        heap[n - 1] = swap;
+        process_sift_down(heap, n - 1, 0);
+    }
+}
+
+int process_read(struct process_table *table, const struct timespec *ts) {
+    assert(table != NULL);
+    assert(ts != NULL);
+
+    if(++table->generation == 0) ++table->generation;   /* 0 marks new processes */
+    HANDLE_RESULT(process_scan(table) == -1, return -1, "process_read: process_scan");
+
+    /* processes not listed are gone, an entry moved into slot i is checked again */
+    for(size_t i = 0; i < table->capacity;) {
+        struct process *p = &table->processes[i];
+        if(p->pid != 0 && p->generation != table->generation) {
+            process_remove(table, i);
+        } else {
+            ++i;
+        }
+    }
+    if(table->full && table->count < table->capacity / 2) table->full = 0;
+
+    for(struct process *p = table->processes; p < table->processes + table->capacity; ++p) {
+        if(p->pid == 0) continue;
+        struct process_group *group = p->cgroup != NULL ?
+                                      process_group(table, p->cgroup->path, p->cgroup->len) :
+                                      process_group(table, p->comm, strlen(p->comm));
+        ++group->processes;
+        group->rss += p->rss;
+        if(p->user == 0 && p->system == 0) continue;
+        group->utime += p->user;
+        group->stime += p->system;
+        process_activity(table, p, group);
+    }
+    process_select(table);
+
+    double seconds = (ts->tv_sec - table->last.tv_sec) + (ts->tv_nsec - table->last.tv_nsec) / 1e9;
+    table->seconds = table->last.tv_sec != 0 && seconds > 0 ? seconds : 0;
+    table->last = *ts;
+    return 0;
+}
+
+int process_open(struct process_table *table, const char *root, size_t capacity,
+                 size_t top, int by_cgroup) {
+    assert(table != NULL);
+    assert(capacity > 0);
+    assert(top > 0);
+
+    size_t size = 1;
+    while(size < capacity) size <<= 1;
+
+    memset(table, 0, sizeof(*table));
+    table->dir = -1;
+    table->by_cgroup = by_cgroup;
+    table->capacity = size;
+    table->top_capacity = top;
+    table->bufsize = PROCESS_DIRENTS_SIZE;
+    table->buf = malloc(table->bufsize);
+    table->processes = calloc(size, sizeof(*table->processes));
+    table->groups = calloc(size, sizeof(*table->groups));
+    table->top = calloc(top, sizeof(*table->top));
+    HANDLE_RESULT(table->buf == NULL || table->processes == NULL ||
+                  table->groups == NULL || table->top == NULL,
+                  goto FAIL, "process_open: can't allocate %zu slots", size);
+    if(by_cgroup) {
+        table->cgroups = calloc(PROCESS_CGROUPS, sizeof(*table->cgroups));
+        table->cgroup_index = calloc(2 * PROCESS_CGROUPS, sizeof(*table->cgroup_index));
+        HANDLE_RESULT(table->cgroups == NULL || table->cgroup_index == NULL,
+                      goto FAIL, "process_open: can't allocate %d cgroups", PROCESS_CGROUPS);
+        for(uint32_t i = 0; i < PROCESS_CGROUPS; ++i) table->cgroups[i].next = i + 1;
+    }
+    if(root == NULL) root = SOURCE_ROOT;
+    HANDLE_POSIX_RESULT(table->dir = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                        goto FAIL, "process_open: open(%s)", root);
+    table->hz = sysconf(_SC_CLK_TCK);
+    table->pagesize = sysconf(_SC_PAGESIZE);
+
+    /* a stat descriptor per process */
+    struct rlimit limit;
+    HANDLE_POSIX_RESULT(getrlimit(RLIMIT_NOFILE, &limit), goto FAIL, "process_open: getrlimit");
+    if(limit.rlim_cur < limit.rlim_max) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        HANDLE_POSIX_RESULT(setrlimit(RLIMIT_NOFILE, &limit), limit.rlim_cur = soft,
+                            "process_open: setrlimit");
+    }
+    if(limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 3 * size) limit.rlim_cur = 3 * size;
+    table->max_fds = limit.rlim_cur > 2 * PROCESS_FD_RESERVE ?
+                     limit.rlim_cur - PROCESS_FD_RESERVE : limit.rlim_cur / 2;
+    syslog(LOG_DEBUG, "fd=%d: process table of %s with %zu slots, up to %zu descriptors",
+           table->dir, root, size, table->max_fds);
+    return 0;
+
+FAIL:
+    process_close(table);
+    return -1;
+}
+
+void process_close(struct process_table *table) {
+    assert(table != NULL);
+
+    for(size_t i = 0; table->processes != NULL && i < table->capacity; ++i) {
+        if(table->processes[i].pid != 0) process_release(table, &table->processes[i]);
+    }
+    if(table->dir != -1) {
+        HANDLE_POSIX_RESULT(close(table->dir), (void)table, "fd=%d: close: process", table->dir);
+    }
+    free(table->buf);
+    free(table->processes);
+    free(table->groups);
+    free(table->top);
+    free(table->cgroups);
+    free(table->cgroup_index);
+    memset(table, 0, sizeof(*table));
+    table->dir = -1;
+}
@@ -0,0 +1,125 @@
+#ifndef PROCESS_H_
+#define PROCESS_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-process statistics, reported for the top groups of processes.
+ *
+ * Known processes live in an open addressed table keyed by pid (linear
+ * probing, backward shift deletion) with their /proc/<pid>/stat kept open
+ * across ticks. A tick rescans the /proc root with getdents64(2), reads the
+ * stat of every process and drops the ones that are gone. /proc/<pid>/io
+ * and /proc/<pid>/status are read, and then kept open too, only for
+ * processes that accrued CPU time since the previous tick: their counters
+ * don't move otherwise. The first read of a file is the baseline of the
+ * deltas, so a process counts from its second tick on.
+ *
+ * Processes are grouped by name (comm) or cgroup and the groups with the
+ * most CPU time in the tick are picked with a bounded heap, so the number
+ * of series stays bounded however many processes come and go.
+ * Descriptors are kept open up to RLIMIT_NOFILE (the soft limit is raised
+ * to the hard one) less a reserve, beyond that files are opened per read.
+ *
+ * When grouping by cgroup the path of a process is interned in a table of
+ * PROCESS_CGROUPS slots allocated when the table is opened, counted by the
+ * processes in the group and freed with the last one, so that processes
+ * coming and going don't allocate. Processes of a cgroup that finds no
+ * free slot are grouped by name.
+ */
+#define PROCESS_CAPACITY 65536      /* processes tracked, more are ignored */
+#define PROCESS_TOP 10
+#define PROCESS_COMM_SIZE 16        /* TASK_COMM_LEN */
+#define PROCESS_FD_RESERVE 256
+#define PROCESS_CGROUPS 4096        /* distinct cgroups of the processes */
+#define PROCESS_CGROUP_SIZE 256     /* longer paths are cut */
+
+#define PROCESS_HAS_IO 1        /* io counters hold a baseline */
+#define PROCESS_HAS_STATUS 2    /* context switches hold a baseline */
+#define PROCESS_NO_IO 4         /* io is not readable (another user's process) */
+
+struct process {
+    pid_t pid;              /* 0 marks an empty slot */
+    uint32_t generation;    /* scan the process was last seen in */
+    uint64_t start;         /* starttime, tells a reused pid apart */
+    int stat;               /* descriptors, -1 when not open */
+    int io;
+    int status;
+    unsigned flags;
+    char comm[PROCESS_COMM_SIZE];
+    struct process_cgroup *cgroup;  /* only when grouping by cgroup */
+
+    uint64_t utime;         /* clock ticks */
+    uint64_t stime;
+    uint64_t user;          /* clock ticks accrued in the current tick */
+    uint64_t system;
+    uint64_t rss;           /* bytes */
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t voluntary;     /* context switches */
+    uint64_t nonvoluntary;
+};
+
+/* an interned cgroup path */
+struct process_cgroup {
+    uint32_t refs;          /* processes in the group, 0 when the slot is free */
+    uint32_t next;          /* next free slot */
+    uint64_t hash;
+    size_t len;
+    char path[PROCESS_CGROUP_SIZE];
+};
+
+/* sums over the processes of a group, counters are deltas of the tick */
+struct process_group {
+    uint32_t generation;    /* the slot is used in this generation */
+    uint64_t hash;
+    const char *name;       /* comm or cgroup of one of the processes */
+    size_t len;
+    uint64_t processes;
+    uint64_t rss;
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t voluntary;
+    uint64_t nonvoluntary;
+};
+
+struct process_table {
+    int dir;                /* the /proc root */
+    char *buf;              /* directory entries */
+    size_t bufsize;
+    char file[4096];        /* content of a per-process file */
+    int by_cgroup;
+    long hz;                /* clock ticks per second */
+    long pagesize;
+    size_t fds;             /* descriptors kept open */
+    size_t max_fds;
+
+    size_t capacity;        /* power of two, of processes and groups */
+    size_t count;
+    int full;               /* warned about untracked processes */
+    uint32_t generation;
+    struct process *processes;
+    struct process_group *groups;
+    struct process_cgroup *cgroups;     /* PROCESS_CGROUPS slots when grouping by cgroup */
+    uint32_t *cgroup_index;             /* 2 * PROCESS_CGROUPS, slot + 1 by hash, 0 when empty */
+    uint32_t free_cgroup;               /* first free slot, PROCESS_CGROUPS when none */
+    int cgroups_full;                   /* warned about ungrouped cgroups */
+
+    struct process_group **top;     /* by CPU time, highest first */
+    size_t top_count;
+    size_t top_capacity;
+    struct timespec last;   /* time of the previous scan */
+    double seconds;         /* since the previous scan, 0 on the first one */
+};
+
+int process_open(struct process_table *table, const char *root, size_t capacity,
+                 size_t top, int by_cgroup);
+int process_read(struct process_table *table, const struct timespec *ts);
+void process_close(struct process_table *table);
+
+#endif /* PROCESS_H_ */
@@ -0,0 +1,59 @@
+#include "scanner.h"
+
+#include <assert.h>
+
+/* 0-9, a-f and A-F map to 0x10 | value, everything else to 0 */
+static const uint8_t hex_values[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+    ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+};
+
+int span_parse_u64(const struct span *span, uint64_t *value) {
+    assert(span != NULL);
+    assert(value != NULL);
+
+    if(span->len == 0 || span->len > 20) return -1;
+    uint64_t result = 0;
+    for(size_t i = 0; i < span->len; ++i) {
+        unsigned digit = (unsigned char)span->ptr[i] - '0';
+        if(digit > 9) return -1;
+        if(__builtin_mul_overflow(result, 10, &result) ||
+           __builtin_add_overflow(result, digit, &result)) return -1;
+    }
+    *value = result;
+    return 0;
+}
+
+int span_parse_i64(const struct span *span, int64_t *value) {
+    assert(span != NULL);
+    assert(value != NULL);
+
+    struct span digits = *span;
+    int negative = digits.len > 0 && digits.ptr[0] == '-';
+    if(negative) {
+        ++digits.ptr;
+        --digits.len;
+    }
+    uint64_t magnitude = 0;
+    if(span_parse_u64(&digits, &magnitude) == -1) return -1;
+    if(magnitude > (uint64_t)INT64_MAX + negative) return -1;
+    *value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+    return 0;
+}
+
+int span_parse_hex(const struct span *span, uint64_t *value) {
+    assert(span != NULL);
+    assert(value != NULL);
+
+    if(span->len == 0 || span->len > 16) return -1;
+    uint64_t result = 0;
+    for(size_t i = 0; i < span->len; ++i) {
+        uint8_t digit = hex_values[(unsigned char)span->ptr[i]];
+        if(digit == 0) return -1;
+        result = (result << 4) | (digit & 0x0f);
+    }
+    *value = result;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef SCANNER_H_
+#define SCANNER_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Zero-copy scanner over the text of /proc files. It walks the buffer once
+ * and hands out spans pointing into it; the input is never modified and
+ * does not have to be NUL terminated.
+ */
+struct span {
+    const char *ptr;
+    size_t len;
+};
+
+struct scanner {
+    const char *pos;
+    const char *end;
+};
+
+int span_parse_u64(const struct span *span, uint64_t *value);
+int span_parse_i64(const struct span *span, int64_t *value);
+int span_parse_hex(const struct span *span, uint64_t *value);
+
+/* first occurrence of c in [p, end) or end */
+static inline const char *scan_find(const char *p, const char *end, char c) {
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8(c);
+    for(; p + 16 <= end; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if(mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for(; p < end; ++p) {
+        if(*p == c) return p;
+    }
+    return end;
+}
+
+static inline void scanner_init(struct scanner *sc, const char *buf, size_t len) {
+    sc->pos = buf;
+    sc->end = buf + len;
+}
+
+static inline void scanner_init_span(struct scanner *sc, const struct span *span) {
+    scanner_init(sc, span->ptr, span->len);
+}
+
+/* next line without its '\n', returns 0 when the buffer is exhausted */
+static inline int scan_line(struct scanner *sc, struct span *line) {
+    if(sc->pos >= sc->end) return 0;
+    const char *eol = scan_find(sc->pos, sc->end, '\n');
+    line->ptr = sc->pos;
+    line->len = eol - sc->pos;
+    sc->pos = eol < sc->end ? eol + 1 : eol;
+    return 1;
+}
+
+/* next space separated field, runs of spaces are skipped, returns 0 at the end */
+static inline int scan_field(struct scanner *sc, struct span *field) {
+    while(sc->pos < sc->end && *sc->pos == ' ') ++sc->pos;
+    if(sc->pos >= sc->end) return 0;
+    const char *eof = scan_find(sc->pos, sc->end, ' ');
+    field->ptr = sc->pos;
+    field->len = eof - sc->pos;
+    sc->pos = eof;
+    return 1;
+}
+
+static inline int span_has_prefix(const struct span *span, const char *prefix, size_t len) {
+    return span->len >= len && memcmp(span->ptr, prefix, len) == 0;
+}
+
+static inline int span_equals(const struct span *span, const char *s, size_t len) {
+    return span->len == len && memcmp(span->ptr, s, len) == 0;
+}
+
+#endif /* SCANNER_H_ */
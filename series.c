@@ -0,0 +1,215 @@
+#include "series.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "error_handling.h"
+#include "line_protocol.h"
+#include "state.h"
+
+static int series_compare_tags(const void *a, const void *b) {
+    const char *x = *(const char **)a;
+    const char *y = *(const char **)b;
+    size_t xlen = strcspn(x, "=");
+    size_t ylen = strcspn(y, "=");
+    int result = memcmp(x, y, xlen < ylen ? xlen : ylen);
+    return result != 0 ? result : (xlen > ylen) - (xlen < ylen);
+}
+
+/* formats the "key=value" global tags sorted by key into out, their length or -1 */
+static ssize_t series_tags(char *out, size_t size, const char **tags) {
+    size_t count = 0;
+    while(tags != NULL && tags[count] != NULL) ++count;
+    if(count == 0) return 0;
+
+    const char **sorted = malloc(count * sizeof(*sorted));
+    HANDLE_RESULT(sorted == NULL, return -1, "series_tags: can't allocate %zu tags", count);
+    memcpy(sorted, tags, count * sizeof(*sorted));
+    qsort(sorted, count, sizeof(*sorted), &series_compare_tags);
+
+    ssize_t result = -1;
+    char *p = out;
+    for(size_t i = 0; i < count; ++i) {
+        const char *eq = strchr(sorted[i], '=');
+        HANDLE_RESULT(eq == NULL || eq == sorted[i] || eq[1] == 0, goto CLEANUP,
+                      "series_tags: %s is not key=value", sorted[i]);
+        HANDLE_RESULT(i > 0 && series_compare_tags(&sorted[i - 1], &sorted[i]) == 0, goto CLEANUP,
+                      "series_tags: tag %.*s given twice", (int)(eq - sorted[i]), sorted[i]);
+        size_t keylen = eq - sorted[i];
+        size_t valuelen = strlen(eq + 1);
+        HANDLE_RESULT(p + 2 + 2 * (keylen + valuelen) > out + size,
+                      goto CLEANUP, "series_tags: tags longer than %zu bytes", size);
+        *p++ = ',';
+        p = lp_format_escaped(p, sorted[i], keylen, LP_ESCAPE_KEY);
+        *p++ = '=';
+        p = lp_format_escaped(p, eq + 1, valuelen, LP_ESCAPE_KEY);
+    }
+    result = p - out;
+
+CLEANUP:
+    free(sorted);
+    return result;
+}
+
+int series_registry_init(struct series_registry *registry, size_t capacity, size_t size,
+                         const char **tags) {
+    assert(registry != NULL);
+    assert(capacity > 0);
+    assert(size > 0);
+
+    memset(registry, 0, sizeof(*registry));
+    ssize_t tagslen = series_tags(registry->tags, sizeof(registry->tags), tags);
+    HANDLE_RESULT(tagslen == -1, return -1, "series_registry_init: series_tags");
+    registry->tagslen = tagslen;
+
+    size_t slots = 1;
+    while(slots < capacity) slots <<= 1;
+    registry->capacity = slots;
+    registry->entries = calloc(slots, sizeof(*registry->entries));
+    registry->arena = malloc(size);
+    registry->size = size;
+    HANDLE_RESULT(registry->entries == NULL || registry->arena == NULL, goto FAIL,
+                  "series_registry_init: can't allocate %zu series in %zu bytes", slots, size);
+    syslog(LOG_DEBUG, "series registry with %zu slots and %zu bytes allocated", slots, size);
+    return 0;
+
+FAIL:
+    series_registry_destroy(registry);
+    return -1;
+}
+
+void series_registry_destroy(struct series_registry *registry) {
+    assert(registry != NULL);
+
+    free(registry->entries);
+    free(registry->arena);
+    registry->entries = NULL;
+    registry->arena = NULL;
+    registry->capacity = 0;
+    registry->used = 0;
+    registry->size = 0;
+    registry->len = 0;
+}
+
+/* replaces the global tags, every series is formatted again when they changed */
+int series_registry_tags(struct series_registry *registry, const char **tags) {
+    assert(registry != NULL);
+    assert(registry->entries != NULL);
+
+    char formatted[SERIES_TAGS_SIZE];
+    ssize_t tagslen = series_tags(formatted, sizeof(formatted), tags);
+    HANDLE_RESULT(tagslen == -1, return -1, "series_registry_tags: series_tags");
+    if((size_t)tagslen == registry->tagslen && memcmp(formatted, registry->tags, tagslen) == 0) return 0;
+    memcpy(registry->tags, formatted, tagslen);
+    registry->tagslen = tagslen;
+    memset(registry->entries, 0, registry->capacity * sizeof(*registry->entries));
+    registry->used = 0;
+    registry->len = 0;
+    syslog(LOG_INFO, "global tags changed, series are formatted again");
+    return 0;
+}
+
+const struct series_entry *series_lookup(const struct series_registry *registry, uint64_t key) {
+    assert(registry != NULL);
+    assert(registry->entries != NULL);
+
+    if(key == 0) key = 1;
+    size_t mask = registry->capacity - 1;
+    for(size_t i = key & mask;; i = (i + 1) & mask) {
+        const struct series_entry *entry = &registry->entries[i];
+        if(entry->key == key) return entry;
+        if(entry->key == 0) return NULL;
+    }
+}
+
+/* end of the escaped element starting at p, at the first unescaped stop character */
+static inline const char *series_scan(const char *p, const char *end, char stop) {
+    while(p < end && *p != stop) p += *p == '\\' ? 2 : 1;
+    return p < end ? p : end;
+}
+
+/*
+ * Merges the global tags into the tags of the prefix, both sorted by key;
+ * a tag the serializer wrote wins over a global one of the same key.
+ */
+static char *series_merge(char *out, const char *prefix, size_t len,
+                          const char *tags, size_t tagslen) {
+    const char *end = prefix + len;
+    const char *p = series_scan(prefix, end, ',');
+    memcpy(out, prefix, p - prefix);
+    out += p - prefix;
+
+    const char *tagsend = tags + tagslen;
+    const char *g = tags;
+    while(p < end || g < tagsend) {
+        const char *key = p < end ? p + 1 : end;
+        const char *keyend = series_scan(key, end, '=');
+        const char *next = series_scan(keyend, end, ',');
+        const char *gkey = g < tagsend ? g + 1 : tagsend;
+        const char *gkeyend = series_scan(gkey, tagsend, '=');
+        const char *gnext = series_scan(gkeyend, tagsend, ',');
+
+        int order = 0;
+        if(p == end) {
+            order = 1;
+        } else if(g == tagsend) {
+            order = -1;
+        } else {
+            size_t keylen = keyend - key;
+            size_t gkeylen = gkeyend - gkey;
+            order = memcmp(key, gkey, keylen < gkeylen ? keylen : gkeylen);
+            if(order == 0) order = (keylen > gkeylen) - (keylen < gkeylen);
+        }
+        if(order <= 0) {
+            memcpy(out, p, next - p);
+            out += next - p;
+            p = next;
+            if(order == 0) g = gnext;
+        } else {
+            memcpy(out, g, gnext - g);
+            out += gnext - g;
+            g = gnext;
+        }
+    }
+    return out;
+}
+
+/* stores the escaped prefix formatted for a new series, NULL when it can't be kept */
+const struct series_entry *series_insert(struct series_registry *registry, uint64_t key,
+                                         const char *prefix, size_t len) {
+    assert(registry != NULL);
+    assert(registry->entries != NULL);
+    assert(prefix != NULL);
+
+    if(key == 0) key = 1;
+    size_t need = len + registry->tagslen;
+    if(need > registry->size || need > UINT32_MAX) return NULL;
+    /* keep a quarter free so that probe sequences stay short */
+    if(registry->used >= registry->capacity - registry->capacity / 4 ||
+       registry->len + need > registry->size) {
+        if(registry->resets++ == 0) {
+            syslog(LOG_INFO, "series registry is full (%zu series, %zu bytes), starting over",
+                   registry->used, registry->len);
+        }
+        memset(registry->entries, 0, registry->capacity * sizeof(*registry->entries));
+        registry->used = 0;
+        registry->len = 0;
+    }
+
+    size_t mask = registry->capacity - 1;
+    size_t i = key & mask;
+    while(registry->entries[i].key != 0 && registry->entries[i].key != key) i = (i + 1) & mask;
+    struct series_entry *entry = &registry->entries[i];
+    if(entry->key == 0) ++registry->used;
+
+    char *start = registry->arena + registry->len;
+    char *end = series_merge(start, prefix, len, registry->tags, registry->tagslen);
+    entry->key = key;
+    entry->hash = state_hash(STATE_HASH_SEED, start, end - start);
+    entry->offset = registry->len;
+    entry->len = end - start;
+    registry->len += end - start;
+    return entry;
+}
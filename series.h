@@ -0,0 +1,82 @@
+#ifndef SERIES_H_
+#define SERIES_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#define SERIES_CAPACITY 16384           /* series kept */
+#define SERIES_ARENA_SIZE (1024 * 1024) /* bytes of their keys */
+#define SERIES_TAGS_SIZE 1024           /* bytes of the global tags */
+
+/*
+ * Registry of series keys. The escaped "measurement,tag=value,..." prefix
+ * of a line is formatted when its series is first seen, merged with the
+ * global tags in key order and stored in an arena; later lines of the
+ * series copy it with memcpy. The series hash used by the state table is
+ * computed once along with it.
+ *
+ * A series is identified by a hash of the unescaped measurement, tag keys
+ * and tag values the serializer passes, so finding it costs a pass over
+ * those bytes 8 at a time instead of escaping them. Like the state table
+ * it relies on 64 bit hashes not colliding among the series of a host.
+ *
+ * The table and the arena are allocated once. When either is full the
+ * registry starts over, which only costs formatting every series again;
+ * series come and go with processes and cgroups, so a bound is needed.
+ */
+struct series_entry {
+    uint64_t key;       /* 0 marks an empty slot */
+    uint64_t hash;      /* hash of the prefix, see lp_series() */
+    uint32_t offset;    /* prefix in the arena */
+    uint32_t len;
+};
+
+struct series_registry {
+    size_t capacity;    /* power of two */
+    size_t used;
+    struct series_entry *entries;
+    char *arena;
+    size_t size;
+    size_t len;
+    char tags[SERIES_TAGS_SIZE];    /* escaped ",key=value" of the global tags, sorted */
+    size_t tagslen;
+    uint64_t resets;
+};
+
+#define SERIES_KEY_SEED 0x9e3779b97f4a7c15ULL
+
+/* identity of a series, mixed from the unescaped parts of its key */
+static inline uint64_t series_key(uint64_t key, const char *s, size_t len) {
+    const uint64_t m = 0xff51afd7ed558ccdULL;
+    key = (key ^ len) * m;
+    for(; len >= 8; s += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, s, 8);
+        key = (key ^ v) * m;
+        key ^= key >> 29;
+    }
+    if(len > 0) {
+        uint64_t v = 0;
+        memcpy(&v, s, len);
+        key = (key ^ v) * m;
+        key ^= key >> 29;
+    }
+    return key;
+}
+
+int series_registry_init(struct series_registry *registry, size_t capacity, size_t size,
+                         const char **tags);
+void series_registry_destroy(struct series_registry *registry);
+int series_registry_tags(struct series_registry *registry, const char **tags);
+const struct series_entry *series_lookup(const struct series_registry *registry, uint64_t key);
+const struct series_entry *series_insert(struct series_registry *registry, uint64_t key,
+                                         const char *prefix, size_t len);
+
+static inline const char *series_prefix(const struct series_registry *registry,
+                                        const struct series_entry *entry) {
+    return registry->arena + entry->offset;
+}
+
+#endif /* SERIES_H_ */
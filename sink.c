@@ -0,0 +1,520 @@
+#include "sink.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "http.h"
+#include "scanner.h"
+#include "spool.h"
+
+#define SINK_GSO_SEGMENTS 64    /* UDP_MAX_SEGMENTS of older kernels */
+
+int create_sink(const char *remote, const char *service) {
+    assert(remote != NULL);
+    assert(service != NULL);
+
+    int s = -1;
+    struct addrinfo hint;
+    struct addrinfo *result = NULL;
+
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_DGRAM;
+    hint.ai_flags = AI_NUMERICSERV;
+
+    int ec = getaddrinfo(remote, service, &hint, &result);
+    HANDLE_RESULT(ec != 0, return -1, "getaddrinfo: %s", gai_strerror(ec));
+
+    for(struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+        HANDLE_POSIX_RESULT(s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol),
+                            goto NEXT_ADDRESS, "socket");
+        HANDLE_POSIX_RESULT(connect(s, ai->ai_addr, ai->ai_addrlen),
+                            goto NEXT_ADDRESS, "fd=%d: connect", s);
+        syslog(LOG_DEBUG, "fd=%d: sink created", s);
+        break;
+NEXT_ADDRESS:
+        HANDLE_POSIX_RESULT(close(s), (void)s, "fd=%d: close", s);
+        s = -1;
+    }
+    freeaddrinfo(result);
+    return s;
+}
+
+int sink_open(struct sink *sink, const char *remote, const char *service,
+              size_t payload, int gso) {
+    assert(sink != NULL);
+    assert(remote != NULL);
+    assert(payload > 0 && payload <= SINK_MAX_PAYLOAD);
+
+    memset(sink, 0, sizeof(*sink));
+    sink->payload = payload;
+    if(strcmp(remote, SINK_STDOUT) == 0) {
+        snprintf(sink->name, sizeof(sink->name), "stdout");
+        HANDLE_POSIX_RESULT(sink->fd = dup(STDOUT_FILENO), return -1, "sink_open: dup(stdout)");
+        sink->stream = 1;
+        return 0;
+    }
+    assert(service != NULL);
+    snprintf(sink->name, sizeof(sink->name), "%s:%s", remote, service);
+    sink->fd = create_sink(remote, service);
+    HANDLE_RESULT(sink->fd == -1, return -1,
+                  "sink_open: can't connect to %s:%s", remote, service);
+
+    if(gso) {
+        /* probe only: segment size is passed per message, plain sends stay unsegmented */
+        int size = payload;
+        sink->gso = setsockopt(sink->fd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+        HANDLE_RESULT(!sink->gso, (void)sink,
+                      "fd=%d: UDP_SEGMENT is not supported, GSO disabled", sink->fd);
+        size = 0;
+        HANDLE_POSIX_RESULT(sink->gso ? setsockopt(sink->fd, SOL_UDP, UDP_SEGMENT,
+                                                   &size, sizeof(size)) : 0,
+                            goto FAIL, "fd=%d: setsockopt(UDP_SEGMENT)", sink->fd);
+        if(sink->gso) {
+            sink->padding = malloc(payload);
+            HANDLE_RESULT(sink->padding == NULL, goto FAIL,
+                          "sink_open: can't allocate padding");
+            memset(sink->padding, '\n', payload);
+        }
+    }
+    return 0;
+
+FAIL:
+    sink_close(sink);
+    return -1;
+}
+
+int sink_http(struct sink *sink, const char *remote, const char *service,
+              const char *database, int gzip) {
+    assert(sink != NULL);
+    assert(remote != NULL);
+    assert(service != NULL);
+    assert(database != NULL);
+
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+    snprintf(sink->name, sizeof(sink->name), "%s:%s", remote, service);
+    sink->http = malloc(sizeof(*sink->http));
+    HANDLE_RESULT(sink->http == NULL, return -1, "sink_http: can't allocate http sink");
+    HANDLE_RESULT(http_open(sink->http, remote, service, database, gzip) == -1, goto FAIL,
+                  "sink_http: http_open(%s:%s)", remote, service);
+    return 0;
+
+FAIL:
+    free(sink->http);
+    sink->http = NULL;
+    return -1;
+}
+
+/* the HTTP sink connects and flushes from the event loop, the UDP one needs nothing */
+int sink_schedule(struct sink *sink, int ev_loop, unsigned flush) {
+    assert(sink != NULL);
+    assert(ev_loop != -1);
+
+    if(sink->http == NULL) return 0;
+    return http_schedule(sink->http, ev_loop, flush);
+}
+
+/* a sink removed on a reload, an HTTP one delivers its queue before it is closed */
+void sink_retire(struct sink *sink) {
+    assert(sink != NULL);
+
+    if(sink->http != NULL) http_retire(sink->http);
+}
+
+/* the retired sink can be closed, sink_close() does not block on it */
+int sink_retired(struct sink *sink) {
+    assert(sink != NULL);
+
+    return sink->http == NULL || http_retired(sink->http);
+}
+
+void sink_close(struct sink *sink) {
+    assert(sink != NULL);
+
+    if(sink->fd != -1) {
+        HANDLE_POSIX_RESULT(close(sink->fd), (void)sink, "fd=%d: close: sink", sink->fd);
+    }
+    free(sink->msgs);
+    free(sink->iovs);
+    free(sink->control);
+    free(sink->padding);
+    if(sink->http != NULL) {
+        http_close(sink->http);
+        free(sink->http);
+    }
+    if(sink->spool != NULL) {
+        spool_close(sink->spool);
+        free(sink->spool);
+    }
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = -1;
+}
+
+int sink_reserve(struct sink *sink, size_t count) {
+    assert(sink != NULL);
+
+    if(count <= sink->capacity) return 0;
+    size_t capacity = sink->capacity == 0 ? 64 : sink->capacity;
+    while(capacity < count) capacity *= 2;
+
+    /* GSO needs a data and a padding vector per datagram */
+    struct mmsghdr *msgs = realloc(sink->msgs, capacity * sizeof(*msgs));
+    if(msgs != NULL) sink->msgs = msgs;
+    struct iovec *iovs = realloc(sink->iovs, 2 * capacity * sizeof(*iovs));
+    if(iovs != NULL) sink->iovs = iovs;
+    char *control = realloc(sink->control, capacity * CMSG_SPACE(sizeof(uint16_t)));
+    if(control != NULL) sink->control = control;
+    HANDLE_RESULT(msgs == NULL || iovs == NULL || control == NULL, return -1,
+                  "sink_reserve: can't allocate %zu datagrams", capacity);
+    sink->capacity = capacity;
+    return 0;
+}
+
+/* splits buf on line boundaries into iovecs of at most payload bytes */
+ssize_t sink_packetize(struct sink *sink, const char *buf, size_t len) {
+    assert(sink != NULL);
+    assert(buf != NULL);
+
+    size_t count = 0;
+    const char *end = buf + len;
+    const char *start = buf;
+    const char *cut = buf;  /* end of the last complete line of the datagram */
+    while(cut < end) {
+        const char *eol = scan_find(cut, end, '\n');
+        eol = eol < end ? eol + 1 : eol;
+        if((size_t)(eol - start) > sink->payload && cut > start) {
+            /* the line does not fit, close the datagram before it */
+            HANDLE_RESULT(sink_reserve(sink, count + 1) == -1, return -1,
+                          "sink_packetize: sink_reserve");
+            sink->iovs[count].iov_base = (void *)start;
+            sink->iovs[count].iov_len = cut - start;
+            ++count;
+            start = cut;
+        }
+        HANDLE_RESULT((size_t)(eol - cut) > sink->payload, (void)eol,
+                      "sink_packetize: line of %zd bytes exceeds payload of %zu bytes, "
+                      "sending it alone", eol - cut, sink->payload);
+        cut = eol;
+    }
+    if(cut > start) {
+        HANDLE_RESULT(sink_reserve(sink, count + 1) == -1, return -1,
+                      "sink_packetize: sink_reserve");
+        sink->iovs[count].iov_base = (void *)start;
+        sink->iovs[count].iov_len = cut - start;
+        ++count;
+    }
+    return count;
+}
+
+/* lays out datagrams [first, first + count) as one padded GSO message */
+void sink_gso_message(struct sink *sink, struct mmsghdr *msg, struct iovec *iovs,
+                      char *control, size_t first, size_t count) {
+    assert(sink != NULL);
+    assert(sink->gso);
+
+    size_t n = 0;
+    for(size_t i = first; i < first + count; ++i) {
+        iovs[n++] = sink->iovs[i];
+        size_t len = sink->iovs[i].iov_len;
+        if(i + 1 < first + count && len < sink->payload) {
+            iovs[n].iov_base = sink->padding;
+            iovs[n++].iov_len = sink->payload - len;
+        }
+    }
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_hdr.msg_iov = iovs;
+    msg->msg_hdr.msg_iovlen = n;
+    msg->msg_hdr.msg_control = control;
+    msg->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg->msg_hdr);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t *)CMSG_DATA(cm) = sink->payload;
+}
+
+/* -1 with errno of the failed send and *sent messages that went out before it */
+int sink_sendmmsg(struct sink *sink, struct mmsghdr *msgs, size_t count, size_t *sent) {
+    assert(sink != NULL);
+    assert(sent != NULL);
+
+    for(*sent = 0; *sent < count;) {
+        int r = sendmmsg(sink->fd, msgs + *sent, count - *sent, 0);
+        if(r == -1 && errno == EINTR) continue;
+        if(r == -1) return -1;
+        *sent += r;
+    }
+    return 0;
+}
+
+/* datagrams of a GSO message, its vectors less the padding between them */
+size_t sink_gso_datagrams(const struct sink *sink, const struct mmsghdr *msg) {
+    assert(sink != NULL);
+    assert(msg != NULL);
+
+    size_t count = 0;
+    for(size_t i = 0; i < msg->msg_hdr.msg_iovlen; ++i) {
+        count += msg->msg_hdr.msg_iov[i].iov_base != sink->padding;
+    }
+    return count;
+}
+
+/* errors of a GSO send that mean the device or path can't segment */
+static inline int sink_gso_unsupported(int error) {
+    return error == EIO || error == EINVAL || error == EOPNOTSUPP || error == ENOPROTOOPT;
+}
+
+/* output as it is, for files and pipes */
+int sink_write(struct sink *sink, const char *buf, size_t len) {
+    assert(sink != NULL);
+    assert(buf != NULL);
+
+    for(size_t written = 0; written < len;) {
+        ssize_t r = write(sink->fd, buf + written, len - written);
+        HANDLE_POSIX_RESULT(r, ++sink->errors; return -1, "fd=%d: write", sink->fd);
+        written += r;
+    }
+    sink->bytes += len;
+    return 0;
+}
+
+int sink_transmit(struct sink *sink, const char *buf, size_t len) {
+    assert(sink != NULL);
+    assert(sink->fd != -1 || sink->http != NULL);
+    assert(buf != NULL);
+
+    if(sink->stream) return sink_write(sink, buf, len);
+    if(sink->http != NULL) {
+        HANDLE_RESULT(http_queue(sink->http, buf, len) == -1, ++sink->errors; return -1,
+                      "sink_transmit: queue of %s is full", sink->http->host);
+        sink->bytes += len;
+        return 0;
+    }
+
+    ssize_t count = sink_packetize(sink, buf, len);
+    HANDLE_RESULT(count == -1, return -1, "sink_transmit: sink_packetize");
+    size_t first = 0;   /* datagrams that went out as GSO before a fallback */
+    size_t sent = 0;
+
+    if(sink->gso && count > 1) {
+        /* datagrams are rearranged into GSO messages behind the plain ones */
+        size_t segments = SINK_MAX_PAYLOAD / sink->payload;
+        if(segments > SINK_GSO_SEGMENTS) segments = SINK_GSO_SEGMENTS;
+        HANDLE_RESULT(sink_reserve(sink, 2 * count) == -1, return -1,
+                      "sink_transmit: sink_reserve");
+        size_t messages = 0;
+        struct iovec *iovs = sink->iovs + count;
+        for(size_t first = 0; first < (size_t)count; ++messages) {
+            size_t n = (size_t)count - first < segments ? (size_t)count - first : segments;
+            for(size_t i = first; i < first + n; ++i) {
+                /* an oversized line can't be a GSO segment, send it alone */
+                if(sink->iovs[i].iov_len > sink->payload) {
+                    n = i == first ? 1 : i - first;
+                    break;
+                }
+            }
+            sink_gso_message(sink, &sink->msgs[messages], iovs,
+                             sink->control + messages * CMSG_SPACE(sizeof(uint16_t)),
+                             first, n);
+            if(n == 1) sink->msgs[messages].msg_hdr.msg_controllen = 0;
+            iovs += 2 * n;
+            first += n;
+        }
+        if(sink_sendmmsg(sink, sink->msgs, messages, &sent) == 0) goto SENT;
+        int error = errno;
+        /* any other error, e.g. ECONNREFUSED of a receiver gone, is the sink's */
+        HANDLE_RESULT(!sink_gso_unsupported(error), ++sink->errors; errno = error; return -1,
+                      "fd=%d: sendmmsg: %s", sink->fd, strerror(error));
+        /* e.g. EIO when the device can't checksum segmented packets */
+        syslog(LOG_WARNING, "fd=%d: GSO send failed: %s, falling back to sendmmsg",
+               sink->fd, strerror(error));
+        sink->gso = 0;
+        for(size_t i = 0; i < sent; ++i) first += sink_gso_datagrams(sink, &sink->msgs[i]);
+    }
+
+    /* the datagrams not sent yet */
+    for(size_t i = first; i < (size_t)count; ++i) {
+        struct mmsghdr *msg = &sink->msgs[i - first];
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_hdr.msg_iov = &sink->iovs[i];
+        msg->msg_hdr.msg_iovlen = 1;
+    }
+    HANDLE_POSIX_RESULT(sink_sendmmsg(sink, sink->msgs, count - first, &sent),
+                        ++sink->errors; return -1, "fd=%d: sendmmsg", sink->fd);
+
+SENT:
+    sink->datagrams += count;
+    sink->bytes += len;
+    return 0;
+}
+
+void sink_unhealthy(struct sink *sink) {
+    assert(sink != NULL);
+    assert(sink->spool != NULL);
+
+    if(sink->healthy) {
+        syslog(LOG_WARNING, "fd=%d: sink unreachable, spooling to %s", sink->fd, sink->spool->path);
+    }
+    sink->healthy = 0;
+    sink->probing = 0;
+    spool_rewind(sink->spool);
+}
+
+int sink_send(struct sink *sink, const char *buf, size_t len) {
+    assert(sink != NULL);
+    assert(sink->fd != -1 || sink->http != NULL);
+    assert(buf != NULL);
+
+    if(len == 0) return 0;
+    if(sink->spool == NULL) {
+        if(sink_transmit(sink, buf, len) == 0) return 0;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sink->failed = now.tv_sec;
+        return -1;
+    }
+
+    if(sink->healthy) {
+        if(sink_transmit(sink, buf, len) == 0) {
+            spool_commit(sink->spool);
+            return 0;
+        }
+        sink_unhealthy(sink);
+    }
+    HANDLE_RESULT(spool_append(sink->spool, buf, len) == -1, return -1,
+                  "sink_send: spool_append");
+    return 0;
+}
+
+/* a probe got through when the kernel has no error queued for the socket since */
+int sink_probed(struct sink *sink) {
+    assert(sink != NULL);
+
+    /* the probe was queued, requests go through again */
+    if(sink->http != NULL) return http_healthy(sink->http);
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    HANDLE_POSIX_RESULT(getsockopt(sink->fd, SOL_SOCKET, SO_ERROR, &error, &len),
+                        return 0, "fd=%d: sink_probed: getsockopt(SO_ERROR)", sink->fd);
+    return error == 0;
+}
+
+/* sends spooled batches within the rate limit; while the sink is unhealthy one batch a second probes it */
+int sink_replay(struct sink *sink) {
+    assert(sink != NULL);
+    assert(sink->spool != NULL);
+
+    struct timespec now;
+    HANDLE_POSIX_RESULT(clock_gettime(CLOCK_MONOTONIC, &now), return -1,
+                        "sink_replay: clock_gettime");
+    double elapsed = (now.tv_sec - sink->refilled.tv_sec) +
+                     (now.tv_nsec - sink->refilled.tv_nsec) / 1e9;
+    sink->tokens += elapsed * sink->rate;
+    if(sink->tokens > sink->rate) sink->tokens = sink->rate;
+    sink->refilled = now;
+
+    if(sink->probing) {
+        /* an ICMP error for the probe arrives well within a replay interval */
+        sink->probing = 0;
+        if(!sink_probed(sink)) {
+            spool_rewind(sink->spool);
+            return 0;
+        }
+        syslog(LOG_INFO, "fd=%d: sink is back, replaying %" PRIu64 " spooled bytes",
+               sink->fd, spool_size(sink->spool));
+        sink->healthy = 1;
+        spool_commit(sink->spool);
+    }
+
+    const char *buf = NULL;
+    size_t len = 0;
+    /* a batch larger than the budget goes out on a full bucket and is paid off later */
+    while(sink->tokens > 0 && spool_peek(sink->spool, &buf, &len)) {
+        if(!sink->healthy) {
+            if(now.tv_sec == sink->probed) break;
+            sink->probed = now.tv_sec;
+        }
+        if(sink_transmit(sink, buf, len) == -1) {
+            sink_unhealthy(sink);
+            return 0;
+        }
+        /* the batch is pending now, the ones sent before it arrived */
+        spool_advance(sink->spool);
+        spool_commit(sink->spool);
+        sink->tokens -= len;
+        if(!sink->healthy) {
+            sink->probing = 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* whether output should go to the sink rather than fail over; a sink with a spool always takes it */
+int sink_available(const struct sink *sink) {
+    assert(sink != NULL);
+
+    if(sink->spool != NULL) return 1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(sink->http != NULL && sink->http->backoff != 0 && now.tv_sec < sink->http->retry) return 0;
+    return sink->failed == 0 || now.tv_sec - sink->failed >= SINK_RETRY;
+}
+
+void sink_publish(const struct sink *sink, struct sink_stat *stat) {
+    assert(sink != NULL);
+    assert(stat != NULL);
+
+    __atomic_store_n(&stat->bytes, sink->bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&stat->datagrams, sink->datagrams, __ATOMIC_RELAXED);
+    __atomic_store_n(&stat->errors, sink->errors, __ATOMIC_RELAXED);
+    if(sink->http != NULL) {
+        __atomic_store_n(&stat->http_requests, sink->http->requests, __ATOMIC_RELAXED);
+        __atomic_store_n(&stat->http_failures, sink->http->failures, __ATOMIC_RELAXED);
+        __atomic_store_n(&stat->http_queued, http_queued(sink->http), __ATOMIC_RELAXED);
+    }
+    if(sink->spool != NULL) {
+        __atomic_store_n(&stat->spooled, spool_size(sink->spool), __ATOMIC_RELAXED);
+        __atomic_store_n(&stat->spool_dropped, sink->spool->dropped, __ATOMIC_RELAXED);
+        __atomic_store_n(&stat->healthy, sink->healthy, __ATOMIC_RELAXED);
+    }
+}
+
+int sink_spool(struct sink *sink, const char *path, size_t size, size_t rate) {
+    assert(sink != NULL);
+    assert(path != NULL);
+    assert(rate > 0);
+
+    sink->spool = malloc(sizeof(*sink->spool));
+    HANDLE_RESULT(sink->spool == NULL, return -1, "sink_spool: can't allocate spool");
+    HANDLE_RESULT(spool_open(sink->spool, path, size) == -1, goto FAIL,
+                  "sink_spool: spool_open(%s)", path);
+    sink->healthy = 1;
+    sink->rate = rate;
+    sink->tokens = rate;
+    HANDLE_POSIX_RESULT(clock_gettime(CLOCK_MONOTONIC, &sink->refilled), goto FAIL,
+                        "sink_spool: clock_gettime");
+    return 0;
+
+FAIL:
+    free(sink->spool);
+    sink->spool = NULL;
+    return -1;
+}
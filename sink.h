@@ -0,0 +1,103 @@
+#ifndef SINK_H_
+#define SINK_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netdb.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SINK_DEFAULT_PAYLOAD 1472   /* 1500 bytes of Ethernet MTU minus IPv4 and UDP headers */
+#define SINK_MAX_PAYLOAD 65507
+#define SINK_SPOOL_SIZE (64 * 1024 * 1024)
+#define SINK_REPLAY_RATE (256 * 1024)    /* bytes per second */
+#define SINK_REPLAY_INTERVAL 100         /* milliseconds */
+#define SINK_STDOUT "-"                  /* remote that writes to stdout */
+#define SINK_HTTP_FLUSH 5000             /* milliseconds between batches of the HTTP sink */
+#define SINK_RETRY 5                     /* seconds a sink is not available after a failed send */
+
+/*
+ * UDP sink. Output of a tick is split on line boundaries into datagrams of
+ * at most `payload` bytes and all of them go out in a single sendmmsg()
+ * call. A line longer than the payload is sent alone and never split.
+ *
+ * With GSO enabled every datagram but the last one of a batch is padded
+ * with '\n' (InfluxDB skips blank lines) to the payload size, so that the
+ * kernel can segment one large send with UDP_SEGMENT.
+ *
+ * The remote "-" writes the output to stdout instead, as it is. An HTTP
+ * sink queues the output for batched /write requests instead, see http.h;
+ * a full queue is a failed send.
+ *
+ * With a spool attached a failed send marks the sink unhealthy and output
+ * goes to the spool. sink_replay() then sends one spooled batch a second
+ * as a probe; once no error is queued on the socket for it the sink is
+ * healthy again and the spool is replayed at a limited rate, in bytes per
+ * second, next to the live output.
+ */
+struct http;
+struct spool;
+
+/*
+ * Counters of a sink as of its last send, published by the thread that
+ * sends with relaxed atomic stores for the agent collector to read from
+ * the collecting thread with relaxed atomic loads.
+ */
+struct sink_stat {
+    uint64_t bytes;
+    uint64_t datagrams;
+    uint64_t errors;
+    uint64_t http_requests;
+    uint64_t http_failures;
+    uint64_t http_queued;
+    uint64_t spooled;
+    uint64_t spool_dropped;
+    int healthy;
+    int available;          /* set by the fanout */
+};
+
+struct sink {
+    char name[NI_MAXHOST + NI_MAXSERV];     /* "host:port" or "stdout" */
+    int fd;
+    int stream;     /* writes to stdout instead of sending datagrams */
+    size_t payload;
+    int gso;
+
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *control;
+    size_t capacity;    /* datagrams the arrays above can describe */
+    char *padding;
+
+    uint64_t bytes;         /* line protocol sent, spooled output when replayed */
+    uint64_t datagrams;
+    uint64_t errors;        /* failed sends */
+    time_t failed;          /* monotonic second of the last failed send, 0 when none */
+
+    struct http *http;      /* NULL for UDP */
+
+    struct spool *spool;    /* NULL when spooling is disabled */
+    int healthy;
+    int probing;            /* a batch was sent to an unhealthy sink, check it arrived */
+    time_t probed;          /* second of the last probe */
+    double rate;            /* replay limit, bytes per second */
+    double tokens;
+    struct timespec refilled;
+};
+
+int sink_open(struct sink *sink, const char *remote, const char *service,
+              size_t payload, int gso);
+int sink_http(struct sink *sink, const char *remote, const char *service,
+              const char *database, int gzip);
+int sink_schedule(struct sink *sink, int ev_loop, unsigned flush);
+int sink_send(struct sink *sink, const char *buf, size_t len);
+int sink_available(const struct sink *sink);
+void sink_publish(const struct sink *sink, struct sink_stat *stat);
+int sink_spool(struct sink *sink, const char *path, size_t size, size_t rate);
+int sink_replay(struct sink *sink);
+void sink_retire(struct sink *sink);
+int sink_retired(struct sink *sink);
+void sink_close(struct sink *sink);
+
+#endif /* SINK_H_ */
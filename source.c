@@ -0,0 +1,171 @@
+#include "source.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "uring.h"
+
+#define SOURCE_INITIAL_SIZE 4096
+
+int source_reopen(struct source *source) {
+    assert(source != NULL);
+    assert(source->path != NULL);
+
+    if(source->fd != -1) {
+        HANDLE_POSIX_RESULT(close(source->fd), (void)source,
+                            "source_reopen(%s): close fd=%d", source->path, source->fd);
+        source->fd = -1;
+    }
+    HANDLE_POSIX_RESULT(source->fd = open(source->path, O_RDONLY | O_CLOEXEC),
+                        return -1, "source_reopen(%s): open", source->path);
+    syslog(LOG_DEBUG, "fd=%d: source %s opened", source->fd, source->path);
+    return 0;
+}
+
+int source_grow(struct source *source, size_t size) {
+    assert(source != NULL);
+    assert(size > source->bufsize);
+
+    char *buf = realloc(source->buf, size);
+    HANDLE_RESULT(buf == NULL, return -1,
+                  "source_grow(%s): can't allocate %zu bytes", source->path, size);
+    source->buf = buf;
+    source->bufsize = size;
+    return 0;
+}
+
+/* path of the name under root, NULL root for SOURCE_ROOT */
+char *source_path(const char *root, const char *name) {
+    assert(name != NULL);
+
+    char *path = NULL;
+    if(name[0] == '/') return strdup(name);
+    HANDLE_RESULT(asprintf(&path, "%s/%s", root != NULL ? root : SOURCE_ROOT, name) == -1,
+                  return NULL, "source_path(%s): can't allocate path", name);
+    return path;
+}
+
+int source_open(struct source *source, const char *root, const char *name) {
+    assert(source != NULL);
+    assert(name != NULL);
+
+    source->name = name;
+    source->path = source_path(root, name);
+    source->fd = -1;
+    source->buf = NULL;
+    source->bufsize = 0;
+    source->len = 0;
+    source->fresh = 0;
+
+    HANDLE_RESULT(source->path == NULL, return -1, "source_open(%s): source_path", name);
+    HANDLE_RESULT(source_grow(source, SOURCE_INITIAL_SIZE) == -1,
+                  return -1, "source_open(%s): source_grow", source->path);
+    source->buf[0] = 0;
+    return source_reopen(source);
+}
+
+/* the same name under another root, absolute names stay where they are */
+int source_reroot(struct source *source, const char *root) {
+    assert(source != NULL);
+    assert(source->name != NULL);
+
+    if(source->name[0] == '/') return 0;
+    char *path = source_path(root, source->name);
+    HANDLE_RESULT(path == NULL, return -1, "source_reroot(%s): source_path", source->name);
+    free(source->path);
+    source->path = path;
+    return source_reopen(source);
+}
+
+/*
+ * Reads on from *len until pread() returns 0. A short read is not the end
+ * of the file: a seq_file hands out one buffer, usually a page, per call,
+ * so /proc/interrupts, diskstats or net/dev of a large host take several.
+ */
+int source_fill(struct source *source, size_t *len) {
+    assert(source != NULL);
+    assert(len != NULL);
+
+    if(source->fd == -1) return -1;
+    for(;;) {
+        if(*len + 1 == source->bufsize) {
+            HANDLE_RESULT(source_grow(source, source->bufsize * 2) == -1,
+                          return -1, "source_fill(%s): source_grow", source->path);
+        }
+        ssize_t r = -1;
+        HANDLE_POSIX_RESULT(r = pread(source->fd, source->buf + *len, source->bufsize - *len - 1, *len),
+                            return -1, "source_fill(%s): pread fd=%d", source->path, source->fd);
+        if(r == 0) break;
+        *len += r;
+    }
+    source->buf[*len] = 0;
+    source->len = *len;
+    return 0;
+}
+
+/*
+ * Reads the whole file into source->buf. A failed read (file vanished,
+ * descriptor invalidated, namespace switched under /proc/net) closes the
+ * descriptor and retries once with a freshly opened one.
+ */
+int source_read(struct source *source) {
+    assert(source != NULL);
+    assert(source->buf != NULL);
+
+    if(source->fresh) {
+        source->fresh = 0;
+        return 0;
+    }
+    for(int retried = 0;; retried = 1) {
+        size_t len = 0;
+        if(source_fill(source, &len) == 0) return 0;
+        HANDLE_RESULT(retried, return -1,
+                      "source_read(%s): giving up after reopen", source->path);
+        HANDLE_RESULT(source_reopen(source) == -1,
+                      return -1, "source_read(%s): source_reopen", source->path);
+    }
+}
+
+void source_close(struct source *source) {
+    assert(source != NULL);
+
+    if(source->fd != -1) {
+        HANDLE_POSIX_RESULT(close(source->fd), (void)source,
+                            "source_close(%s): close fd=%d", source->path, source->fd);
+        syslog(LOG_DEBUG, "fd=%d: source %s closed", source->fd, source->path);
+    }
+    free(source->buf);
+    free(source->path);
+    source->name = NULL;
+    source->path = NULL;
+    source->fd = -1;
+    source->buf = NULL;
+    source->bufsize = 0;
+    source->len = 0;
+}
+
+/* queues a read of the whole buffer, data comes back with the completion */
+int source_submit(struct source *source, struct uring *ring, uint64_t data) {
+    assert(source != NULL);
+    assert(ring != NULL);
+
+    source->fresh = 0;
+    if(source->fd == -1) return -1;
+    return uring_read(ring, source->fd, source->buf, source->bufsize - 1, 0, data);
+}
+
+void source_complete(struct source *source, int32_t res) {
+    assert(source != NULL);
+
+    /* a failed read is left to source_read(), a short one may not be the whole file */
+    if(res < 0) return;
+    size_t len = res;
+    if(source_fill(source, &len) == -1) return;
+    source->fresh = 1;
+}
@@ -0,0 +1,47 @@
+#ifndef SOURCE_H_
+#define SOURCE_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Persistent handle to a /proc (or /sys) file: the file is opened once and
+ * re-read from offset 0 with pread() on every tick. The read buffer grows to
+ * fit the largest content seen so far and is always NUL terminated.
+ *
+ * A source is named relative to a root directory, /proc unless another one
+ * is given (e.g. a snapshot of the /proc of another host); absolute names
+ * are taken as they are.
+ *
+ * A file is read until pread() returns 0: a short read is not its end, a
+ * seq_file behind /proc hands out one buffer, usually a page, per call.
+ *
+ * Reads can also be batched on an io_uring: source_submit() queues the read
+ * and source_complete() takes its result and reads the rest of the file, at
+ * least the pread() that confirms the end, synchronously. A completed source
+ * is handed out by the next source_read() without a syscall; a failed
+ * batched read leaves it to source_read() to read the file again.
+ */
+#define SOURCE_ROOT "/proc"
+
+struct source {
+    const char *name;
+    char *path;     /* name under the root */
+    int fd;
+    char *buf;
+    size_t bufsize;
+    size_t len;
+    int fresh;      /* buf holds a batched read not taken by source_read() yet */
+};
+
+struct uring;
+
+int source_open(struct source *source, const char *root, const char *name);
+int source_reroot(struct source *source, const char *root);
+int source_read(struct source *source);
+void source_close(struct source *source);
+int source_submit(struct source *source, struct uring *ring, uint64_t data);
+void source_complete(struct source *source, int32_t res);
+
+#endif /* SOURCE_H_ */
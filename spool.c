@@ -0,0 +1,229 @@
+#include "spool.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "state.h"
+
+#define SPOOL_MAGIC 0x4c4f4f5053424449ULL     /* "IDBSPOOL" */
+#define SPOOL_HEADER_SIZE 4096
+#define SPOOL_PAD UINT32_MAX                    /* rest of the ring is unused */
+
+struct spool_record {
+    uint32_t len;
+    uint32_t checksum;
+};
+
+#define SPOOL_ALIGN(len) (((len) + 7) & ~(uint64_t)7)
+#define SPOOL_RECORD_SIZE(len) (sizeof(struct spool_record) + SPOOL_ALIGN(len))
+
+static inline uint32_t spool_checksum(const char *buf, size_t len) {
+    return state_hash(STATE_HASH_SEED, buf, len);
+}
+
+/* the rest of the ring from pos is padding rather than a record */
+static inline int spool_padding(const struct spool *spool, uint64_t pos) {
+    uint64_t offset = pos % spool->capacity;
+    if(spool->capacity - offset < sizeof(struct spool_record)) return 1;
+    return ((const struct spool_record *)(spool->data + offset))->len == SPOOL_PAD;
+}
+
+/* position of the record after the one at pos */
+uint64_t spool_next(const struct spool *spool, uint64_t pos) {
+    assert(spool != NULL);
+
+    uint64_t offset = pos % spool->capacity;
+    if(spool_padding(spool, pos)) return pos + spool->capacity - offset;
+    const struct spool_record *record = (const struct spool_record *)(spool->data + offset);
+    return pos + SPOOL_RECORD_SIZE(record->len);
+}
+
+/* checks the records between tail and head, the ring ends before the first bad one */
+void spool_recover(struct spool *spool) {
+    assert(spool != NULL);
+
+    struct spool_header *header = spool->header;
+    uint64_t records = 0;
+    uint64_t pos = header->tail;
+    while(pos < header->head) {
+        uint64_t offset = pos % spool->capacity;
+        uint64_t rest = spool->capacity - offset;
+        const struct spool_record *record = (const struct spool_record *)(spool->data + offset);
+        if(rest < sizeof(struct spool_record) || record->len == SPOOL_PAD) {
+            pos += rest;
+            continue;
+        }
+        if(SPOOL_RECORD_SIZE(record->len) > rest ||
+           pos + SPOOL_RECORD_SIZE(record->len) > header->head ||
+           spool_checksum((const char *)(record + 1), record->len) != record->checksum) {
+            syslog(LOG_WARNING, "%s: bad record at %" PRIu64 ", %" PRIu64 " bytes discarded",
+                   spool->path, pos, header->head - pos);
+            break;
+        }
+        pos += SPOOL_RECORD_SIZE(record->len);
+        ++records;
+    }
+    header->head = pos < header->head ? pos : header->head;
+    syslog(LOG_INFO, "%s: %" PRIu64 " records, %" PRIu64 " bytes spooled",
+           spool->path, records, header->head - header->tail);
+}
+
+int spool_open(struct spool *spool, const char *path, size_t capacity) {
+    assert(spool != NULL);
+    assert(path != NULL);
+    assert(capacity > 0);
+
+    memset(spool, 0, sizeof(*spool));
+    spool->capacity = SPOOL_ALIGN(capacity);
+    spool->mapsize = SPOOL_HEADER_SIZE + spool->capacity;
+    spool->map = MAP_FAILED;
+    spool->fd = -1;
+
+    spool->path = strdup(path);
+    HANDLE_RESULT(spool->path == NULL, goto FAIL, "%s: can't allocate path", path);
+    HANDLE_POSIX_RESULT(spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600),
+                        goto FAIL, "%s: open", path);
+    struct stat st;
+    HANDLE_POSIX_RESULT(fstat(spool->fd, &st), goto FAIL, "%s: fstat", path);
+    int fresh = (size_t)st.st_size != spool->mapsize;
+    if(fresh) {
+        HANDLE_POSIX_RESULT(ftruncate(spool->fd, 0), goto FAIL, "%s: ftruncate", path);
+        HANDLE_POSIX_RESULT(ftruncate(spool->fd, spool->mapsize), goto FAIL, "%s: ftruncate", path);
+    }
+    spool->map = mmap(NULL, spool->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+    HANDLE_POSIX_RESULT(spool->map == MAP_FAILED ? -1 : 0, goto FAIL, "%s: mmap", path);
+    spool->header = (struct spool_header *)spool->map;
+    spool->data = spool->map + SPOOL_HEADER_SIZE;
+
+    struct spool_header *header = spool->header;
+    if(fresh || header->magic != SPOOL_MAGIC || header->capacity != spool->capacity ||
+       header->tail > header->head || header->head - header->tail > spool->capacity) {
+        if(!fresh) syslog(LOG_WARNING, "%s: not a spool of this size, starting over", path);
+        header->capacity = spool->capacity;
+        header->head = 0;
+        header->tail = 0;
+        header->magic = SPOOL_MAGIC;
+    } else {
+        spool_recover(spool);
+    }
+    spool->cursor = spool->pending = header->tail;
+    syslog(LOG_DEBUG, "fd=%d: spool %s of %" PRIu64 " bytes opened", spool->fd, path, spool->capacity);
+    return 0;
+
+FAIL:
+    spool_close(spool);
+    return -1;
+}
+
+void spool_close(struct spool *spool) {
+    assert(spool != NULL);
+
+    if(spool->map != MAP_FAILED && spool->map != NULL) {
+        HANDLE_POSIX_RESULT(munmap(spool->map, spool->mapsize), (void)spool,
+                            "%s: munmap", spool->path);
+    }
+    if(spool->fd != -1) {
+        HANDLE_POSIX_RESULT(close(spool->fd), (void)spool, "fd=%d: close: spool", spool->fd);
+    }
+    free(spool->path);
+    memset(spool, 0, sizeof(*spool));
+    spool->fd = -1;
+}
+
+int spool_append(struct spool *spool, const char *buf, size_t len) {
+    assert(spool != NULL);
+    assert(spool->header != NULL);
+    assert(buf != NULL);
+
+    struct spool_header *header = spool->header;
+    uint64_t size = SPOOL_RECORD_SIZE(len);
+    HANDLE_RESULT(len >= SPOOL_PAD || size > spool->capacity, return -1,
+                  "%s: batch of %zu bytes does not fit, dropped", spool->path, len);
+
+    uint64_t head = header->head;
+    uint64_t rest = spool->capacity - head % spool->capacity;
+    uint64_t pad = rest < size ? rest : 0;
+    uint64_t tail = header->tail;
+    while(tail < head && head + pad + size - tail > spool->capacity) {
+        if(!spool_padding(spool, tail) && spool->dropped++ == 0) {
+            syslog(LOG_WARNING, "%s: spool is full, dropping the oldest batches", spool->path);
+        }
+        tail = spool_next(spool, tail);
+    }
+    if(tail >= head) tail = head + pad;     /* empty, the ring starts over at the record */
+    header->tail = tail;
+    if(spool->pending < tail) spool->pending = tail;
+    if(spool->cursor < tail) spool->cursor = tail;
+
+    if(pad >= sizeof(struct spool_record)) {
+        ((struct spool_record *)(spool->data + head % spool->capacity))->len = SPOOL_PAD;
+    }
+    head += pad;
+    struct spool_record *record = (struct spool_record *)(spool->data + head % spool->capacity);
+    record->len = len;
+    record->checksum = spool_checksum(buf, len);
+    memcpy(record + 1, buf, len);
+    /* the record is complete before it becomes visible */
+    __atomic_store_n(&header->head, head + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* record to replay next; 0 when everything was handed out */
+int spool_peek(struct spool *spool, const char **buf, size_t *len) {
+    assert(spool != NULL);
+    assert(buf != NULL);
+    assert(len != NULL);
+
+    uint64_t head = spool->header->head;
+    while(spool->cursor < head) {
+        uint64_t offset = spool->cursor % spool->capacity;
+        uint64_t rest = spool->capacity - offset;
+        const struct spool_record *record = (const struct spool_record *)(spool->data + offset);
+        if(rest < sizeof(struct spool_record) || record->len == SPOOL_PAD) {
+            spool->cursor += rest;
+            continue;
+        }
+        *buf = (const char *)(record + 1);
+        *len = record->len;
+        return 1;
+    }
+    return 0;
+}
+
+void spool_advance(struct spool *spool) {
+    assert(spool != NULL);
+    assert(spool->cursor < spool->header->head);
+
+    spool->cursor = spool_next(spool, spool->cursor);
+}
+
+/* a send succeeded: what was sent before it arrived */
+void spool_commit(struct spool *spool) {
+    assert(spool != NULL);
+
+    spool->header->tail = spool->pending;
+    spool->pending = spool->cursor;
+}
+
+/* a send failed: records not confirmed yet are replayed again */
+void spool_rewind(struct spool *spool) {
+    assert(spool != NULL);
+
+    spool->cursor = spool->pending = spool->header->tail;
+}
+
+uint64_t spool_size(const struct spool *spool) {
+    assert(spool != NULL);
+
+    return spool->header->head - spool->header->tail;
+}
@@ -0,0 +1,52 @@
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Bounded spool of line protocol batches in a memory-mapped ring file.
+ *
+ * The file holds a header with the head and tail of the ring followed by
+ * the ring itself. Positions only grow; a record never straddles the end of
+ * the ring, the rest of the ring is padded instead. A record is written
+ * first and published by storing the new head, so a crashed agent leaves
+ * either the whole record or none of it; records are checksummed and the
+ * ring is truncated at the first bad one when the file is opened again.
+ * When the ring is full the oldest records are dropped.
+ *
+ * Replay is at-least-once: a record handed out by spool_peek() is only
+ * removed by the spool_commit() that follows the next successful send,
+ * since a UDP send reports a refused datagram on the send after it.
+ */
+struct spool_header {
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t head;      /* end of the newest record */
+    uint64_t tail;      /* start of the oldest record */
+};
+
+struct spool {
+    char *path;
+    int fd;
+    char *map;
+    size_t mapsize;
+    struct spool_header *header;
+    char *data;
+    uint64_t capacity;
+    uint64_t cursor;    /* next record to replay */
+    uint64_t pending;   /* records from here to cursor were sent, not confirmed */
+    uint64_t dropped;   /* records dropped to make room */
+};
+
+int spool_open(struct spool *spool, const char *path, size_t capacity);
+void spool_close(struct spool *spool);
+int spool_append(struct spool *spool, const char *buf, size_t len);
+int spool_peek(struct spool *spool, const char **buf, size_t *len);
+void spool_advance(struct spool *spool);
+void spool_commit(struct spool *spool);
+void spool_rewind(struct spool *spool);
+uint64_t spool_size(const struct spool *spool);
+
+#endif /* SPOOL_H_ */
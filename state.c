@@ -0,0 +1,184 @@
+#include "state.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "error_handling.h"
+
+int state_table_init(struct state_table *table, size_t capacity) {
+    assert(table != NULL);
+    assert(capacity > 0);
+
+    size_t size = 1;
+    while(size < capacity) size <<= 1;
+
+    table->capacity = size;
+    table->used = 0;
+    table->full = 0;
+    table->ttl = 0;
+    table->swept = 0;
+    table->keys = calloc(size, sizeof(*table->keys));
+    table->values = calloc(size, sizeof(*table->values));
+    table->stamps = calloc(size, sizeof(*table->stamps));
+    table->journal = calloc(size, sizeof(*table->journal));
+    table->journaled = 0;
+    HANDLE_RESULT(table->keys == NULL || table->values == NULL || table->stamps == NULL ||
+                  table->journal == NULL,
+                  goto FAIL, "state_table_init: can't allocate %zu slots", size);
+    syslog(LOG_DEBUG, "state table with %zu slots allocated", size);
+    return 0;
+
+FAIL:
+    state_table_destroy(table);
+    return -1;
+}
+
+void state_table_destroy(struct state_table *table) {
+    assert(table != NULL);
+
+    free(table->keys);
+    free(table->values);
+    free(table->stamps);
+    free(table->journal);
+    table->keys = NULL;
+    table->values = NULL;
+    table->stamps = NULL;
+    table->journal = NULL;
+    table->journaled = 0;
+    table->capacity = 0;
+    table->used = 0;
+}
+
+/* empties the slots sampled before, returns their number */
+static size_t state_table_evict(struct state_table *table, int64_t before) {
+    size_t mask = table->capacity - 1;
+    size_t evicted = 0;
+    /* a quarter is free: starting at an empty slot no probe sequence wraps past the start */
+    size_t start = 0;
+    while(table->keys[start] != 0) start = (start + 1) & mask;
+    for(size_t i = start, scanned = 0; scanned < table->capacity;) {
+        if(table->keys[i] == 0 || table->stamps[i] >= before) {
+            i = (i + 1) & mask;
+            ++scanned;
+            continue;
+        }
+        /* backward shift: a later key of the cluster fills the hole unless it sits before its home */
+        size_t hole = i;
+        for(size_t j = (hole + 1) & mask; table->keys[j] != 0; j = (j + 1) & mask) {
+            size_t home = table->keys[j] & mask;
+            if(((j - home) & mask) < ((j - hole) & mask)) continue;
+            table->keys[hole] = table->keys[j];
+            table->values[hole] = table->values[j];
+            table->stamps[hole] = table->stamps[j];
+            hole = j;
+        }
+        table->keys[hole] = 0;
+        table->values[hole] = 0;
+        table->stamps[hole] = 0;
+        --table->used;
+        ++evicted;
+        /* slot i is checked again, it may hold a key moved back */
+    }
+    return evicted;
+}
+
+/* slot of the key, the key is inserted when missing; -1 when the table is full */
+ssize_t state_table_slot(struct state_table *table, uint64_t key, int64_t now) {
+    assert(table != NULL);
+    assert(table->keys != NULL);
+
+    if(key == 0) key = 1;
+    size_t mask = table->capacity - 1;
+    for(size_t i = key & mask, probe = 0; probe < table->capacity; i = (i + 1) & mask, ++probe) {
+        if(table->keys[i] == key) return i;
+        if(table->keys[i] == 0) {
+            /* keep a quarter free so that probe sequences stay short */
+            if(table->used >= table->capacity - table->capacity / 4) break;
+            table->keys[i] = key;
+            ++table->used;
+            return i;
+        }
+    }
+    if(table->ttl != 0 && now - table->swept >= table->ttl / 4) {
+        table->swept = now;
+        size_t evicted = state_table_evict(table, now - table->ttl);
+        if(evicted != 0) {
+            syslog(LOG_INFO, "state table: %zu fields not sampled for %" PRId64 "s evicted",
+                   evicted, table->ttl / 1000000000);
+            table->full = 0;
+            return state_table_slot(table, key, now);
+        }
+    }
+    if(!table->full) {
+        syslog(LOG_WARNING, "state table is full (%zu slots), new series are not tracked",
+               table->capacity);
+        table->full = 1;
+    }
+    return -1;
+}
+
+/* puts the slots changed since the journal had mark entries back, latest change first */
+void state_table_rollback(struct state_table *table, size_t mark) {
+    assert(table != NULL);
+    assert(mark <= table->journaled);
+
+    size_t mask = table->capacity - 1;
+    while(table->journaled > mark) {
+        const struct state_undo *undo = &table->journal[--table->journaled];
+        /* evictions may have moved the key since, it is looked up again */
+        for(size_t i = undo->key & mask; table->keys[i] != 0; i = (i + 1) & mask) {
+            if(table->keys[i] != undo->key) continue;
+            table->values[i] = undo->value;
+            table->stamps[i] = undo->stamp;
+            break;
+        }
+    }
+}
+
+/* the changes of the tick are kept */
+void state_table_commit(struct state_table *table) {
+    assert(table != NULL);
+
+    table->journaled = 0;
+}
+
+/*
+ * Stores the sample and computes the increment since the previous one.
+ * Counters narrower than 64 bits (width) are unwrapped; a decrease that is
+ * not a plausible wrap is a counter reset. Returns 0 when there is no
+ * usable increment: first sample, reset, or no time passed.
+ */
+int state_delta(struct state_table *table, uint64_t key,
+                uint64_t value, unsigned width, int64_t now,
+                uint64_t *delta, double *seconds) {
+    assert(table != NULL);
+    assert(width > 0 && width <= 64);
+    assert(delta != NULL);
+    assert(seconds != NULL);
+
+    ssize_t slot = state_table_slot(table, key, now);
+    if(slot == -1) return 0;
+
+    int isnew = table->stamps[slot] == 0;
+    uint64_t prev = table->values[slot];
+    int64_t elapsed = now - table->stamps[slot];
+    state_table_save(table, slot);
+    table->values[slot] = value;
+    table->stamps[slot] = now;
+    if(isnew || elapsed <= 0) return 0;
+
+    uint64_t mask = width == 64 ? UINT64_MAX : (1ULL << width) - 1;
+    if(value >= prev) {
+        *delta = value - prev;
+    } else if(width < 64 && prev <= mask && ((value - prev) & mask) <= mask / 2) {
+        *delta = (value - prev) & mask;
+    } else {
+        syslog(LOG_DEBUG, "counter %016" PRIx64 " reset: %" PRIu64 " -> %" PRIu64,
+               key, prev, value);
+        return 0;
+    }
+    *seconds = elapsed / 1e9;
+    return 1;
+}
@@ -0,0 +1,73 @@
+#ifndef STATE_H_
+#define STATE_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Per-series state: an open addressed table keyed by the hash of the series
+ * key and the field name, with the previous sample of every field kept in
+ * parallel arrays. The table is allocated once at startup and never grows.
+ * Series come and go (processes, cgroups, devices), so when it is full the
+ * fields not sampled for ttl are evicted, the fields after them in their
+ * probe sequences moving back; sweeps are at least a quarter of the ttl
+ * apart. When nothing can be evicted new fields are not tracked.
+ *
+ * Slots are saved to a journal before they change, so that the state of
+ * lines that end up not being sent (a line that does not fit, a failed
+ * serializer, a dropped tick) is put back with state_table_rollback().
+ * state_table_commit() empties it once a tick is handed to the sinks. The
+ * journal has as many entries as the table has slots; beyond that changes
+ * are not saved.
+ */
+struct state_undo {
+    uint64_t key;
+    uint64_t value;
+    int64_t stamp;
+};
+
+struct state_table {
+    size_t capacity;    /* power of two */
+    size_t used;
+    int full;           /* set once the table ran out of free slots */
+    int64_t ttl;        /* ns a field is kept without a sample when full, 0 for ever */
+    int64_t swept;      /* time of the last sweep, ns */
+    uint64_t *keys;     /* 0 marks an empty slot */
+    uint64_t *values;   /* previous sample */
+    int64_t *stamps;    /* time of the previous sample, ns */
+    struct state_undo *journal;     /* slots as they were before the tick */
+    size_t journaled;
+};
+
+#define STATE_HASH_SEED 0xcbf29ce484222325ULL
+
+static inline uint64_t state_hash(uint64_t hash, const char *data, size_t len) {
+    /* FNV-1a */
+    for(size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int state_table_init(struct state_table *table, size_t capacity);
+void state_table_destroy(struct state_table *table);
+ssize_t state_table_slot(struct state_table *table, uint64_t key, int64_t now);
+void state_table_rollback(struct state_table *table, size_t mark);
+void state_table_commit(struct state_table *table);
+
+/* called before the slot changes */
+static inline void state_table_save(struct state_table *table, size_t slot) {
+    if(table->journaled == table->capacity) return;
+    struct state_undo *undo = &table->journal[table->journaled++];
+    undo->key = table->keys[slot];
+    undo->value = table->values[slot];
+    undo->stamp = table->stamps[slot];
+}
+
+int state_delta(struct state_table *table, uint64_t key,
+                uint64_t value, unsigned width, int64_t now,
+                uint64_t *delta, double *seconds);
+
+#endif /* STATE_H_ */
@@ -0,0 +1,67 @@
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#define TELEMETRY_BUCKETS 24    /* <1us, <2us, <4us, ... <4.2s, the rest */
+
+/*
+ * Cost of a collector, reported by the agent collector. Latency of the
+ * serializer is kept in a histogram with power of two buckets of
+ * microseconds: bucket 0 counts calls under 1us, bucket i > 0 calls of
+ * [2^(i-1), 2^i) us and the last bucket everything longer. Recording is a
+ * count leading zeros and an increment, cheap enough to stay on.
+ *
+ * The send fields are written by the thread that sends, which is not the
+ * collecting one in worker mode; they are relaxed atomics for that.
+ */
+struct telemetry {
+    uint64_t latency[TELEMETRY_BUCKETS];
+    uint64_t latency_sum;   /* ns */
+    uint64_t latency_max;   /* ns, since the last report */
+    uint64_t bytes;         /* line protocol produced */
+    uint64_t lines;
+    uint64_t errors;        /* failed collections */
+    uint64_t overruns;      /* timer expirations missed */
+    uint64_t dropped;       /* ticks the sending thread had no room for */
+    uint64_t allocations;   /* heap allocations of the collections, see heap.h */
+    uint64_t growths;       /* buffers grown */
+
+    uint64_t sends;         /* ticks handed to the sinks */
+    uint64_t send_errors;
+    uint64_t send_delay_sum;    /* ns from the timer firing to the send */
+    uint64_t send_delay_max;    /* ns, since the last report */
+};
+
+static inline uint64_t telemetry_elapsed(const struct timespec *start, const struct timespec *end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
+
+static inline void telemetry_latency(struct telemetry *t, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    unsigned bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if(bucket >= TELEMETRY_BUCKETS) bucket = TELEMETRY_BUCKETS - 1;
+    ++t->latency[bucket];
+    t->latency_sum += ns;
+    if(ns > t->latency_max) t->latency_max = ns;
+}
+
+static inline int64_t telemetry_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void telemetry_sent(struct telemetry *t, uint64_t ns, int failed) {
+    __atomic_fetch_add(&t->sends, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->send_errors, failed != 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->send_delay_sum, ns, __ATOMIC_RELAXED);
+    if(ns > __atomic_load_n(&t->send_delay_max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&t->send_delay_max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+#endif /* TELEMETRY_H_ */
@@ -0,0 +1,374 @@
+/*
+ * In-process InfluxDB stand-in for the HTTP sink.
+ *
+ *     http
+ *
+ * A listener on the loopback and the client share one event loop. Batches
+ * are queued with http_queue() and sent by the flush timer; the listener
+ * checks the request line, headers and body of every request against the
+ * batch it expects and answers as scripted: 204 for a delivered batch, 503
+ * for one that has to come again after the backoff, 400 for one that is
+ * dropped. All requests of a client have to share one connection, and a
+ * gzip client has to send a body that inflates to the batch. The warnings
+ * of the 503 and the 400 are expected.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "error_handling.h"
+#include "event.h"
+#include "http.h"
+
+#define TEST_BATCHES 5
+#define TEST_BATCH_SIZE 16384
+#define TEST_REQUEST_SIZE (2 * TEST_BATCH_SIZE)
+#define TEST_FLUSH 20               /* milliseconds */
+#define TEST_WATCH 20               /* milliseconds */
+#define TEST_DEADLINE 15            /* seconds, the backoff takes at most 2 */
+#define TEST_DATABASE "test"
+
+struct step {
+    const char *name;
+    int batch;      /* expected body */
+    int status;     /* answer */
+};
+
+struct scenario {
+    const char *name;
+    int gzip;
+    const struct step *steps;
+};
+
+struct server {
+    struct event_handler listener;
+    struct event_handler conn;
+    struct event_handler watch;
+    char request[TEST_REQUEST_SIZE];
+    size_t len;
+    unsigned accepts;
+    unsigned watched;
+    char host[32];      /* expected Host header */
+
+    struct http *http;
+    const struct scenario *scenario;
+    const struct step *step;
+    int failed;
+};
+
+static char batches[TEST_BATCHES][TEST_BATCH_SIZE];
+static size_t batchlen[TEST_BATCHES];
+
+static const struct step plain_steps[] = {
+    { "204", 0, 204 },
+    { "keep-alive", 1, 204 },
+    { "5xx", 2, 503 },
+    { "5xx retried", 2, 204 },
+    { "4xx", 3, 400 },
+    { "after 4xx", 4, 204 },
+    { NULL, 0, 0 }
+};
+
+static const struct step gzip_steps[] = {
+    { "gzip", 0, 204 },
+    { "gzip keep-alive", 4, 204 },
+    { NULL, 0, 0 }
+};
+
+static const struct scenario scenarios[] = {
+    { "plain", 0, plain_steps },
+    { "gzip", 1, gzip_steps },
+    { NULL, 0, NULL }
+};
+
+static inline time_t monotonic_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+void make_batches(void) {
+    for(int b = 0; b < TEST_BATCHES; ++b) {
+        size_t len = 0;
+        for(int i = 0; len + 128 < sizeof(batches[b]); ++i) {
+            len += snprintf(batches[b] + len, sizeof(batches[b]) - len,
+                            "test,batch=%d,line=%d value=%di,text=\"%*d\" %" PRId64 "\n",
+                            b, i, b * 1000 + i, 8 + i % 32, i, (int64_t)1792196808000000000LL + i);
+        }
+        batchlen[b] = len;
+    }
+}
+
+/* the body of a gzip request inflated into out, -1 when it is not a gzip stream */
+ssize_t gunzip(const char *body, size_t len, char *out, size_t size) {
+    assert(body != NULL);
+    assert(out != NULL);
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    HANDLE_RESULT(inflateInit2(&z, 15 + 16) != Z_OK, return -1, "gunzip: inflateInit2");
+    z.next_in = (Bytef *)body;
+    z.avail_in = len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = size;
+    int r = inflate(&z, Z_FINISH);
+    ssize_t result = r == Z_STREAM_END && z.avail_in == 0 ? (ssize_t)(size - z.avail_out) : -1;
+    inflateEnd(&z);
+    return result;
+}
+
+const char *header(const char *headers, const char *end, const char *name) {
+    assert(headers != NULL);
+    assert(name != NULL);
+
+    size_t len = strlen(name);
+    for(const char *p = strstr(headers, "\r\n") + 2; p < end; p = strstr(p, "\r\n") + 2) {
+        if(strncasecmp(p, name, len) == 0 && p[len] == ':') return p + len + 1 + strspn(p + len + 1, " ");
+    }
+    return NULL;
+}
+
+/* the request of the current step is complete: check it and answer */
+int answer(struct server *server, const char *end, const char *body, size_t len) {
+    assert(server != NULL);
+    assert(server->step->name != NULL);
+
+    static char inflated[TEST_REQUEST_SIZE];
+    const struct step *step = server->step;
+    const struct http *http = server->http;
+    const char *expected = batches[step->batch];
+    const char *line = "POST /write?db=" TEST_DATABASE "&precision=ns HTTP/1.1\r\n";
+    HANDLE_RESULT(strncmp(server->request, line, strlen(line)) != 0, return -1,
+                  "%s: bad request line %.*s", step->name,
+                  (int)strcspn(server->request, "\r"), server->request);
+    const char *host = header(server->request, end, "Host");
+    HANDLE_RESULT(host == NULL || strncmp(host, server->host, strlen(server->host)) != 0 ||
+                  host[strlen(server->host)] != '\r', return -1, "%s: bad Host header", step->name);
+    const char *type = header(server->request, end, "Content-Type");
+    HANDLE_RESULT(type == NULL || strncmp(type, "text/plain", sizeof("text/plain") - 1) != 0,
+                  return -1, "%s: bad Content-Type header", step->name);
+    const char *encoding = header(server->request, end, "Content-Encoding");
+    if(server->scenario->gzip) {
+        HANDLE_RESULT(encoding == NULL || strncmp(encoding, "gzip\r\n", 6) != 0, return -1,
+                      "%s: no Content-Encoding: gzip", step->name);
+        ssize_t r = gunzip(body, len, inflated, sizeof(inflated));
+        HANDLE_RESULT(r == -1, return -1, "%s: body of %zu bytes does not inflate", step->name, len);
+        HANDLE_RESULT(len >= (size_t)r, return -1,
+                      "%s: %zd bytes compressed to %zu, not smaller", step->name, r, len);
+        body = inflated;
+        len = r;
+    } else {
+        HANDLE_RESULT(encoding != NULL, return -1, "%s: Content-Encoding without gzip", step->name);
+    }
+    HANDLE_RESULT(len != batchlen[step->batch] || memcmp(body, expected, len) != 0, return -1,
+                  "%s: body of %zu bytes is not batch %d of %zu bytes", step->name, len,
+                  step->batch, batchlen[step->batch]);
+    /* a retry comes after the backoff of the 5xx, a 4xx batch is never sent again */
+    if(step > server->scenario->steps && step[-1].status / 100 == 5) {
+        HANDLE_RESULT(http->backoff == 0 || monotonic_now() < http->retry, return -1,
+                      "%s: sent again before the backoff of %us", step->name, http->backoff);
+    }
+    if(step > server->scenario->steps && step[-1].status / 100 == 4) {
+        HANDLE_RESULT(http->dropped != batchlen[step[-1].batch], return -1,
+                      "%s: %" PRIu64 " bytes dropped, %zu rejected", step->name, http->dropped,
+                      batchlen[step[-1].batch]);
+    }
+    HANDLE_RESULT(server->accepts != 1, return -1, "%s: %u connections, not kept alive",
+                  step->name, server->accepts);
+
+    char response[256];
+    int n = step->status == 204 ?
+            snprintf(response, sizeof(response), "HTTP/1.1 204 No Content\r\n\r\n") :
+            snprintf(response, sizeof(response),
+                     "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s",
+                     step->status, step->status == 400 ? "Bad Request" : "Service Unavailable",
+                     sizeof("{\"error\":\"test\"}") - 1, "{\"error\":\"test\"}");
+    HANDLE_RESULT(send(server->conn.fd, response, n, MSG_NOSIGNAL) != n, return -1,
+                  "%s: can't send response", step->name);
+    printf("%-8s %-16s %5zu bytes, %d\n", server->scenario->name, step->name, len, step->status);
+
+    /* the next batch is queued once its predecessor got its answer */
+    ++server->step;
+    if(server->step->name != NULL && server->step->batch != step->batch) {
+        HANDLE_RESULT(http_queue(server->http, batches[server->step->batch],
+                                 batchlen[server->step->batch]) == -1,
+                      return -1, "%s: http_queue", server->step->name);
+    }
+    return 0;
+}
+
+int handle_conn(int fd, void *data) {
+    assert(data != NULL);
+
+    struct server *server = (struct server *)data;
+    if(fd == -1 || fd != server->conn.fd) return 0;
+    for(;;) {
+        ssize_t r = recv(fd, server->request + server->len, sizeof(server->request) - 1 - server->len, 0);
+        if(r == -1 && errno == EINTR) continue;
+        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if(r <= 0) {
+            /* the client of the previous scenario went away */
+            close(fd);
+            server->conn.fd = -1;
+            server->len = 0;
+            HANDLE_RESULT(r == -1, server->failed = 1; return -1, "handle_conn: recv");
+            return 0;
+        }
+        server->len += r;
+        server->request[server->len] = 0;
+        HANDLE_RESULT(server->len + 1 == sizeof(server->request), server->failed = 1; return -1,
+                      "handle_conn: request too long");
+        const char *end = memmem(server->request, server->len, "\r\n\r\n", 4);
+        if(end == NULL) continue;
+        const char *length = header(server->request, end + 2, "Content-Length");
+        HANDLE_RESULT(length == NULL, server->failed = 1; return -1, "handle_conn: no Content-Length");
+        size_t bodylen = strtoull(length, NULL, 10);
+        size_t headerlen = end + 4 - server->request;
+        if(server->len < headerlen + bodylen) continue;
+        HANDLE_RESULT(server->len > headerlen + bodylen || server->step->name == NULL,
+                      server->failed = 1; return -1, "handle_conn: unexpected request");
+        HANDLE_RESULT(answer(server, end + 2, end + 4, bodylen) == -1, server->failed = 1; return -1, NULL);
+        server->len = 0;
+    }
+}
+
+int handle_listener(int fd, void *data) {
+    assert(data != NULL);
+
+    struct server *server = (struct server *)data;
+    int conn = -1;
+    HANDLE_POSIX_RESULT(conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC),
+                        server->failed = 1; return -1, "handle_listener: accept4");
+    if(server->conn.fd != -1) close(server->conn.fd);
+    server->conn.fd = conn;
+    server->len = 0;
+    ++server->accepts;
+    HANDLE_RESULT(register_event(server->http->ev_loop, EPOLLIN | EPOLLRDHUP, &server->conn) == -1,
+                  server->failed = 1; return -1, "handle_listener: register_event");
+    return 0;
+}
+
+/* leaves the loop once the last answer went through, or at the deadline */
+int handle_watch(int fd, void *data) {
+    assert(data != NULL);
+
+    struct server *server = (struct server *)data;
+    uint64_t v = 0;
+    HANDLE_POSIX_RESULT(read(fd, &v, sizeof(v)), return -1, "handle_watch: read");
+    const struct http *http = server->http;
+    if(server->step->name == NULL && http_queued(http) == 0 && http->state == HTTP_IDLE) return -1;
+    server->watched += v;
+    HANDLE_RESULT(server->watched * TEST_WATCH >= TEST_DEADLINE * 1000, server->failed = 1; return -1,
+                  "%s: timed out at step %s", server->scenario->name,
+                  server->step->name != NULL ? server->step->name : "end");
+    return 0;
+}
+
+int run(int ev_loop, struct server *server, const struct scenario *scenario) {
+    assert(server != NULL);
+    assert(scenario != NULL);
+
+    int result = -1;
+    struct http http;
+    char service[8];
+    snprintf(service, sizeof(service), "%s", strchr(server->host, ':') + 1);
+    HANDLE_RESULT(http_open(&http, "127.0.0.1", service, TEST_DATABASE, scenario->gzip) == -1,
+                  return -1, "%s: http_open", scenario->name);
+    HANDLE_RESULT(http_schedule(&http, ev_loop, TEST_FLUSH) == -1, goto CLEANUP,
+                  "%s: http_schedule", scenario->name);
+    server->http = &http;
+    server->scenario = scenario;
+    server->step = scenario->steps;
+    server->accepts = 0;
+    server->watched = 0;
+    HANDLE_RESULT(http_queue(&http, batches[server->step->batch], batchlen[server->step->batch]) == -1,
+                  goto CLEANUP, "%s: http_queue", scenario->name);
+    run_event_loop(ev_loop);
+    if(server->failed) goto CLEANUP;
+
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t dropped = 0;
+    for(const struct step *step = scenario->steps; step->name != NULL; ++step) {
+        if(step->status / 100 == 2) ++requests;
+        if(step->status / 100 != 2) ++failures;
+        if(step->status / 100 == 4) dropped += batchlen[step->batch];
+    }
+    HANDLE_RESULT(http.requests != requests || http.failures != failures || http.dropped != dropped,
+                  goto CLEANUP, "%s: %" PRIu64 " requests, %" PRIu64 " failures, %" PRIu64
+                  " bytes dropped, expected %" PRIu64 ", %" PRIu64 ", %" PRIu64, scenario->name,
+                  http.requests, http.failures, http.dropped, requests, failures, dropped);
+    HANDLE_RESULT(!http_healthy(&http), goto CLEANUP, "%s: not healthy after a 204", scenario->name);
+    result = 0;
+
+CLEANUP:
+    http_close(&http);
+    server->http = NULL;
+    return result;
+}
+
+int main(void) {
+    openlog("http", LOG_NDELAY | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    int result = EXIT_FAILURE;
+    make_batches();
+
+    static struct server server;
+    server.listener.fd = -1;
+    server.listener.data = &server;
+    server.listener.handler = &handle_listener;
+    server.conn.fd = -1;
+    server.conn.data = &server;
+    server.conn.handler = &handle_conn;
+    server.watch.fd = -1;
+    server.watch.data = &server;
+    server.watch.handler = &handle_watch;
+    server.watch.last = 1;
+
+    int ev_loop = -1;
+    HANDLE_POSIX_RESULT(ev_loop = create_event_loop(), return EXIT_FAILURE, "create_event_loop");
+    HANDLE_POSIX_RESULT(server.listener.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                        goto CLEANUP, "socket");
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    HANDLE_POSIX_RESULT(bind(server.listener.fd, (struct sockaddr *)&addr, sizeof(addr)), goto CLEANUP,
+                        "bind");
+    HANDLE_POSIX_RESULT(listen(server.listener.fd, 4), goto CLEANUP, "listen");
+    HANDLE_POSIX_RESULT(getsockname(server.listener.fd, (struct sockaddr *)&addr, &addrlen), goto CLEANUP,
+                        "getsockname");
+    snprintf(server.host, sizeof(server.host), "127.0.0.1:%u", ntohs(addr.sin_port));
+    HANDLE_RESULT(register_event(ev_loop, EPOLLIN, &server.listener) == -1, goto CLEANUP,
+                  "register_event");
+    struct itimerspec watch = {
+        .it_interval = { .tv_sec = 0, .tv_nsec = TEST_WATCH * 1000000L },
+        .it_value = { .tv_sec = 0, .tv_nsec = TEST_WATCH * 1000000L }
+    };
+    HANDLE_RESULT(create_timer(ev_loop, &watch, &server.watch) == -1, goto CLEANUP, "create_timer");
+
+    for(const struct scenario *scenario = scenarios; scenario->name != NULL; ++scenario) {
+        HANDLE_RESULT(run(ev_loop, &server, scenario) == -1, goto CLEANUP, NULL);
+    }
+    result = EXIT_SUCCESS;
+
+CLEANUP:
+    if(server.conn.fd != -1) close(server.conn.fd);
+    if(server.watch.fd != -1) close(server.watch.fd);
+    if(server.listener.fd != -1) close(server.listener.fd);
+    close(ev_loop);
+    return result;
+}
@@ -0,0 +1,215 @@
+/*
+ * Output of the influxdb_serialize_* functions over a /proc fixture.
+ *
+ *     lines FIXTURE
+ *
+ * Every serializer of the benchmark runs over the files of the fixture with
+ * a fixed hostname and time, plain and in rate mode (a second sample of the
+ * same files a second later), and the lines go to stdout. make test compares
+ * them byte for byte with test/expected/FIXTURE.txt, so a change of the
+ * output of a serializer shows up as a diff. The proc_stat, net_stat and
+ * softnet_stat lines of the plain mode are the output of the format()
+ * serializers the writer replaced.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "error_handling.h"
+#include "influxdb.h"
+#include "irq.h"
+#include "line_protocol.h"
+#include "netlink.h"
+#include "series.h"
+#include "state.h"
+
+#define LINES_BUFFER_SIZE (4 * 1024 * 1024)
+#define LINES_STATE_CAPACITY 65536
+#define LINES_HOSTNAME "host42"
+
+struct input {
+    char *buf;
+    size_t len;
+    struct netlink nl;
+};
+
+struct lines_case {
+    const char *name;
+    const char *path;   /* relative to the fixture directory */
+    int (*run)(struct input *input, const struct timespec *ts, struct lp_writer *w);
+};
+
+static const char *net_tags[] = {
+    "Ip", "Icmp", "IcmpMsg", "Tcp", "Udp", "TcpExt", "IpExt", NULL
+};
+
+static struct influxdb_field_map meminfo_fields;
+static struct influxdb_field_map vmstat_fields;
+static struct irq_matrix interrupts;
+static struct irq_matrix softirqs;
+
+int run_proc_stat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_proc_stat(input->buf, input->len, LINES_HOSTNAME, ts, w);
+}
+
+int run_net_stat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_net_stat(input->buf, input->len, net_tags, LINES_HOSTNAME, ts, w);
+}
+
+int run_softnet_stat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_softnet_stat(input->buf, input->len, LINES_HOSTNAME, ts, w);
+}
+
+int run_memory_stat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_memory_stat(&meminfo_fields, input->buf, input->len,
+                                          LINES_HOSTNAME, ts, w);
+}
+
+int run_vmstat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_vmstat(&vmstat_fields, input->buf, input->len, LINES_HOSTNAME, ts, w);
+}
+
+int run_nic_stat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    if(input->nl.count == 0) {
+        HANDLE_RESULT(netlink_parse_dev(&input->nl, input->buf, input->len) == -1, return -1,
+                      "run_nic_stat: netlink_parse_dev");
+    }
+    return influxdb_serialize_nic_stat(input->nl.links, input->nl.count, LINES_HOSTNAME, ts, w);
+}
+
+int run_disk_stat(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    return influxdb_serialize_disk_stat(input->buf, input->len, NULL, NULL, LINES_HOSTNAME, ts, w);
+}
+
+int run_interrupts(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    if(irq_read(&interrupts, input->buf, input->len, ts) == -1) return -1;
+    return influxdb_serialize_irq_matrix(&interrupts, "interrupts", "irq", LINES_HOSTNAME, ts, w);
+}
+
+int run_softirqs(struct input *input, const struct timespec *ts, struct lp_writer *w) {
+    if(irq_read(&softirqs, input->buf, input->len, ts) == -1) return -1;
+    return influxdb_serialize_irq_matrix(&softirqs, "softirqs", "softirq", LINES_HOSTNAME, ts, w);
+}
+
+static const struct lines_case cases[] = {
+    { "proc_stat", "stat", &run_proc_stat },
+    { "net_stat_snmp", "net/snmp", &run_net_stat },
+    { "net_stat_netstat", "net/netstat", &run_net_stat },
+    { "softnet_stat", "net/softnet_stat", &run_softnet_stat },
+    { "memory_stat", "meminfo", &run_memory_stat },
+    { "vmstat", "vmstat", &run_vmstat },
+    { "nic_stat", "net/dev", &run_nic_stat },
+    { "disk_stat", "diskstats", &run_disk_stat },
+    { "interrupts", "interrupts", &run_interrupts },
+    { "softirqs", "softirqs", &run_softirqs },
+    { NULL, NULL, NULL }
+};
+
+int read_fixture(const char *path, struct input *input) {
+    assert(path != NULL);
+    assert(input != NULL);
+
+    FILE *f = fopen(path, "r");
+    HANDLE_RESULT(f == NULL, return -1, "read_fixture: can't open %s", path);
+    HANDLE_POSIX_RESULT(fseek(f, 0, SEEK_END), goto FAIL, "read_fixture: fseek(%s)", path);
+    long size = ftell(f);
+    HANDLE_POSIX_RESULT(size, goto FAIL, "read_fixture: ftell(%s)", path);
+    rewind(f);
+    input->buf = malloc(size + 1);
+    HANDLE_RESULT(input->buf == NULL, goto FAIL, "read_fixture: can't allocate %ld bytes", size);
+    input->len = fread(input->buf, 1, size, f);
+    input->buf[input->len] = 0;
+    fclose(f);
+    return 0;
+
+FAIL:
+    fclose(f);
+    return -1;
+}
+
+/* the serializers of all cases over the fixture, the last of samples is written to out */
+int serialize(struct input *inputs, int rate, int samples, char *buf, FILE *out) {
+    assert(inputs != NULL);
+    assert(buf != NULL);
+
+    int result = -1;
+    struct state_table state = { .capacity = 0 };
+    struct series_registry series;
+    HANDLE_RESULT(series_registry_init(&series, SERIES_CAPACITY, SERIES_ARENA_SIZE, NULL) == -1,
+                  return -1, "serialize: series_registry_init");
+    if(rate) {
+        HANDLE_RESULT(state_table_init(&state, LINES_STATE_CAPACITY) == -1,
+                      goto CLEANUP, "serialize: state_table_init");
+    }
+    memset(&meminfo_fields, 0, sizeof(meminfo_fields));
+    memset(&vmstat_fields, 0, sizeof(vmstat_fields));
+    irq_close(&interrupts);
+    irq_close(&softirqs);
+
+    struct timespec ts = { .tv_sec = 1792196808, .tv_nsec = 12345 };
+    for(int sample = 0; sample < samples; ++sample) {
+        for(const struct lines_case *c = cases; c->name != NULL; ++c) {
+            struct lp_writer w;
+            lp_writer_init(&w, buf, LINES_BUFFER_SIZE);
+            lp_writer_registry(&w, &series);
+            if(rate) {
+                lp_writer_state(&w, &state, &ts);
+                w.rate = 1;
+            }
+            HANDLE_RESULT(c->run(&inputs[c - cases], &ts, &w) == -1, goto CLEANUP,
+                          "serialize: %s failed", c->name);
+            if(sample == samples - 1) fwrite(w.buf, 1, w.len, out);
+        }
+        ++ts.tv_sec;
+    }
+    result = 0;
+
+CLEANUP:
+    if(state.capacity != 0) state_table_destroy(&state);
+    series_registry_destroy(&series);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    openlog("lines", LOG_NDELAY | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_INFO));
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s FIXTURE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_FAILURE;
+    size_t count = 0;
+    struct input inputs[sizeof(cases) / sizeof(cases[0])];
+    char *buf = malloc(LINES_BUFFER_SIZE);
+    HANDLE_RESULT(buf == NULL, goto CLEANUP, "can't allocate output buffer");
+    for(size_t i = 0; cases[i].name != NULL; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", argv[1], cases[i].path);
+        inputs[i].buf = NULL;
+        HANDLE_RESULT(netlink_init(&inputs[i].nl, NULL, NULL) == -1, goto CLEANUP,
+                      "can't allocate links");
+        count = i + 1;
+        HANDLE_RESULT(read_fixture(path, &inputs[i]) == -1, goto CLEANUP,
+                      "can't read fixture %s", path);
+    }
+
+    HANDLE_RESULT(serialize(inputs, 0, 1, buf, stdout) == -1, goto CLEANUP, "plain mode failed");
+    HANDLE_RESULT(serialize(inputs, 1, 2, buf, stdout) == -1, goto CLEANUP, "rate mode failed");
+    result = EXIT_SUCCESS;
+
+CLEANUP:
+    for(size_t i = 0; i < count; ++i) {
+        free(inputs[i].buf);
+        netlink_close(&inputs[i].nl);
+    }
+    irq_close(&interrupts);
+    irq_close(&softirqs);
+    free(buf);
+    return result;
+}
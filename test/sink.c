@@ -0,0 +1,214 @@
+/*
+ * Local receiver test of the UDP sink.
+ *
+ *     sink
+ *
+ * Lines of varying length, one of them longer than most payloads, are sent
+ * with sink_send() to a UDP socket bound on the loopback, for several
+ * payload sizes and with and without GSO. Every datagram received has to
+ * end on a line boundary and fit the payload unless it holds a single
+ * longer line, and the datagrams put together, without the blank lines
+ * GSO pads with, have to be the input byte for byte. GSO cases are skipped
+ * when the kernel does not support UDP_SEGMENT.
+ *
+ * sendmmsg() is wrapped to fail a GSO send after some of its messages went
+ * out: with EIO the sink falls back to plain datagrams and sends only the
+ * ones left, so the input still arrives once; with ECONNREFUSED the send
+ * fails and GSO stays on.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "sink.h"
+
+#define TEST_INPUT_SIZE 24576
+#define TEST_LONG_LINE 3000         /* longer than all payloads but the largest */
+#define TEST_RECEIVE_BUFFER (8 * 1024 * 1024)
+
+static const size_t payloads[] = { 200, 512, SINK_DEFAULT_PAYLOAD, 8972, SINK_MAX_PAYLOAD, 0 };
+
+static int inject_error;        /* errno of a sendmmsg() after inject_after messages, 0 for none */
+static unsigned inject_after;
+
+int __real_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags);
+
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags) {
+    if(inject_error == 0) return __real_sendmmsg(fd, msgs, vlen, flags);
+    if(inject_after == 0) {
+        errno = inject_error;
+        inject_error = 0;
+        return -1;
+    }
+    int r = __real_sendmmsg(fd, msgs, vlen < inject_after ? vlen : inject_after, flags);
+    if(r > 0) inject_after -= r;
+    return r;
+}
+
+/* lines of 30 to 180 bytes and one of TEST_LONG_LINE bytes in the middle */
+size_t make_input(char *buf, size_t size) {
+    assert(buf != NULL);
+
+    size_t len = 0;
+    unsigned seed = 42;
+    for(unsigned i = 0; len + TEST_LONG_LINE + 1 < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        size_t width = i == 40 ? TEST_LONG_LINE : 30 + (seed >> 16) % 150;
+        int n = snprintf(buf + len, size - len, "test,line=%u value=", i);
+        len += n;
+        for(size_t j = n; j + 1 < width; ++j) buf[len++] = 'a' + (i + j) % 26;
+        buf[len++] = '\n';
+    }
+    return len;
+}
+
+int receive(int fd, char *out, size_t size, size_t payload, size_t *len, size_t *datagrams) {
+    assert(out != NULL);
+    assert(len != NULL);
+    assert(datagrams != NULL);
+
+    *len = 0;
+    *datagrams = 0;
+    static char datagram[SINK_MAX_PAYLOAD + 1];
+    for(;;) {
+        ssize_t r = recv(fd, datagram, sizeof(datagram), MSG_DONTWAIT);
+        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        HANDLE_POSIX_RESULT(r, return -1, "receive: recv");
+        ++*datagrams;
+        HANDLE_RESULT(r == 0 || datagram[r - 1] != '\n', return -1,
+                      "receive: datagram %zu does not end with a line", *datagrams);
+        /* GSO pads with blank lines, the input has none */
+        while(r > 1 && datagram[r - 2] == '\n') --r;
+        const char *eol = memchr(datagram, '\n', r);
+        HANDLE_RESULT((size_t)r > payload && eol != datagram + r - 1, return -1,
+                      "receive: datagram %zu of %zd bytes exceeds payload of %zu bytes",
+                      *datagrams, r, payload);
+        HANDLE_RESULT(*len + r > size, return -1, "receive: more output than input");
+        memcpy(out + *len, datagram, r);
+        *len += r;
+    }
+}
+
+int check(int fd, const char *service, size_t payload, int gso, const char *input, size_t len) {
+    assert(service != NULL);
+    assert(input != NULL);
+
+    static char output[TEST_INPUT_SIZE];
+    int result = -1;
+    struct sink sink;
+    HANDLE_RESULT(sink_open(&sink, "127.0.0.1", service, payload, gso) == -1, return -1,
+                  "check: sink_open");
+    if(gso && !sink.gso) {
+        printf("payload %5zu gso: skipped, UDP_SEGMENT not supported\n", payload);
+        result = 0;
+        goto CLEANUP;
+    }
+    HANDLE_RESULT(sink_send(&sink, input, len) == -1, goto CLEANUP, "check: sink_send");
+    size_t received = 0;
+    size_t datagrams = 0;
+    HANDLE_RESULT(receive(fd, output, sizeof(output), payload, &received, &datagrams) == -1,
+                  goto CLEANUP, "check: payload %zu%s", payload, gso ? " gso" : "");
+    HANDLE_RESULT(datagrams != sink.datagrams, goto CLEANUP,
+                  "check: %zu of %" PRIu64 " datagrams received", datagrams, sink.datagrams);
+    HANDLE_RESULT(received != len || memcmp(output, input, len) != 0, goto CLEANUP,
+                  "check: payload %zu%s: %zu bytes received differ from the %zu sent",
+                  payload, gso ? " gso" : "", received, len);
+    printf("payload %5zu%s: %zu bytes in %zu datagrams\n", payload, gso ? " gso" : "    ",
+           len, datagrams);
+    result = 0;
+
+CLEANUP:
+    sink_close(&sink);
+    return result;
+}
+
+/* a GSO send that fails with error after one message went out */
+int check_fault(int fd, const char *service, int error, const char *input, size_t len) {
+    assert(service != NULL);
+    assert(input != NULL);
+
+    static char output[TEST_INPUT_SIZE];
+    int result = -1;
+    struct sink sink;
+    HANDLE_RESULT(sink_open(&sink, "127.0.0.1", service, SINK_DEFAULT_PAYLOAD, 1) == -1, return -1,
+                  "check_fault: sink_open");
+    if(!sink.gso) {
+        printf("%s: skipped, UDP_SEGMENT not supported\n", strerror(error));
+        result = 0;
+        goto CLEANUP;
+    }
+    inject_error = error;
+    inject_after = 1;
+    int sent = sink_send(&sink, input, len);
+    inject_error = 0;
+    size_t received = 0;
+    size_t datagrams = 0;
+    HANDLE_RESULT(receive(fd, output, sizeof(output), SINK_DEFAULT_PAYLOAD, &received, &datagrams) == -1,
+                  goto CLEANUP, "check_fault: %s", strerror(error));
+    if(error == EIO) {
+        HANDLE_RESULT(sent == -1 || sink.gso, goto CLEANUP, "check_fault: EIO did not fall back");
+        HANDLE_RESULT(datagrams != sink.datagrams || received != len ||
+                      memcmp(output, input, len) != 0, goto CLEANUP,
+                      "check_fault: %zu bytes in %zu datagrams after the fallback, %zu sent in %" PRIu64,
+                      received, datagrams, len, sink.datagrams);
+    } else {
+        HANDLE_RESULT(sent != -1 || sink.errors != 1 || !sink.gso, goto CLEANUP,
+                      "check_fault: %s not reported or GSO turned off", strerror(error));
+        HANDLE_RESULT(received >= len, goto CLEANUP, "check_fault: %s sent all the same",
+                      strerror(error));
+    }
+    printf("%s: %zu bytes in %zu datagrams, gso %s\n", strerror(error), received, datagrams,
+           sink.gso ? "on" : "off");
+    result = 0;
+
+CLEANUP:
+    sink_close(&sink);
+    return result;
+}
+
+int main(void) {
+    openlog("sink", LOG_NDELAY | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    int result = EXIT_FAILURE;
+    static char input[TEST_INPUT_SIZE];
+    size_t len = make_input(input, sizeof(input));
+
+    int fd = -1;
+    HANDLE_POSIX_RESULT(fd = socket(AF_INET, SOCK_DGRAM, 0), return EXIT_FAILURE, "socket");
+    int rcvbuf = TEST_RECEIVE_BUFFER;
+    HANDLE_POSIX_RESULT(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)),
+                        goto CLEANUP, "setsockopt(SO_RCVBUF)");
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    HANDLE_POSIX_RESULT(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), goto CLEANUP, "bind");
+    HANDLE_POSIX_RESULT(getsockname(fd, (struct sockaddr *)&addr, &addrlen), goto CLEANUP,
+                        "getsockname");
+    char service[8];
+    snprintf(service, sizeof(service), "%u", ntohs(addr.sin_port));
+
+    for(const size_t *payload = payloads; *payload != 0; ++payload) {
+        for(int gso = 0; gso <= 1; ++gso) {
+            HANDLE_RESULT(check(fd, service, *payload, gso, input, len) == -1, goto CLEANUP, NULL);
+        }
+    }
+    HANDLE_RESULT(check_fault(fd, service, EIO, input, len) == -1, goto CLEANUP, NULL);
+    HANDLE_RESULT(check_fault(fd, service, ECONNREFUSED, input, len) == -1, goto CLEANUP, NULL);
+    result = EXIT_SUCCESS;
+
+CLEANUP:
+    close(fd);
+    return result;
+}
@@ -0,0 +1,140 @@
+/*
+ * Reads of sources that come back in pieces.
+ *
+ *     source FIXTURE
+ *
+ * pread() is wrapped to return at most a chunk per call, as a seq_file
+ * behind /proc returns one buffer, usually a page, per call. Every file of
+ * the fixture is read with source_read() and through source_complete() of
+ * a short batched read, for several chunk sizes, and has to come back
+ * whole. The fixture files are regular files that a real pread() returns
+ * in one piece, so the short reads only happen here.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "source.h"
+
+static const char *files[] = {
+    "stat", "interrupts", "softirqs", "diskstats", "net/dev", "net/softnet_stat", NULL
+};
+
+/* 0 passes the reads through */
+static const size_t chunks[] = { 4096, 4093, 100, 0 };
+
+static size_t chunk;
+static unsigned long preads;
+
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    ++preads;
+    return __real_pread(fd, buf, chunk != 0 && count > chunk ? chunk : count, offset);
+}
+
+/* the content of the file read with read(2), which is not wrapped */
+char *read_file(const char *path, size_t *len) {
+    assert(path != NULL);
+    assert(len != NULL);
+
+    FILE *f = fopen(path, "r");
+    HANDLE_RESULT(f == NULL, return NULL, "read_file: can't open %s", path);
+    size_t size = 4096;
+    char *buf = malloc(size);
+    *len = 0;
+    while(buf != NULL) {
+        *len += fread(buf + *len, 1, size - *len, f);
+        if(*len < size) break;
+        char *grown = realloc(buf, size *= 2);
+        if(grown == NULL) free(buf);
+        buf = grown;
+    }
+    HANDLE_RESULT(buf == NULL, (void)f, "read_file: can't allocate %zu bytes", size);
+    fclose(f);
+    return buf;
+}
+
+int same(const struct source *source, const char *how, const char *expected, size_t len) {
+    assert(source != NULL);
+    assert(how != NULL);
+    assert(expected != NULL);
+
+    HANDLE_RESULT(source->len != len || memcmp(source->buf, expected, len) != 0 ||
+                  source->buf[len] != 0, return 0,
+                  "%s, chunk %zu, %s: %zu bytes read of %zu", source->path, chunk, how,
+                  source->len, len);
+    return 1;
+}
+
+int check(const char *root, const char *name) {
+    assert(root != NULL);
+    assert(name != NULL);
+
+    int result = -1;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    size_t len = 0;
+    char *expected = read_file(path, &len);
+    HANDLE_RESULT(expected == NULL, return -1, "check: read_file(%s)", path);
+    struct source source;
+    HANDLE_RESULT(source_open(&source, root, name) == -1, goto CLEANUP, "check: source_open(%s)", path);
+
+    /* read twice: the buffer grown by the first read has to be filled again */
+    for(int i = 0; i < 2; ++i) {
+        preads = 0;
+        HANDLE_RESULT(source_read(&source) == -1, goto CLEANUP, "check: source_read(%s)", path);
+        if(!same(&source, "source_read", expected, len)) goto CLEANUP;
+        size_t pieces = chunk != 0 ? (len + chunk - 1) / chunk : 1;
+        HANDLE_RESULT(preads < pieces + 1, goto CLEANUP,
+                      "check: %s in %lu preads, not to the end of file", path, preads);
+    }
+
+    /* a batched read that came back with the first chunk only */
+    size_t first = chunk != 0 && chunk < len ? chunk : len;
+    HANDLE_RESULT(__real_pread(source.fd, source.buf, first, 0) != (ssize_t)first, goto CLEANUP,
+                  "check: pread(%s)", path);
+    source_complete(&source, first);
+    HANDLE_RESULT(!source.fresh, goto CLEANUP, "check: %s not complete", path);
+    preads = 0;
+    HANDLE_RESULT(source_read(&source) == -1, goto CLEANUP, "check: source_read(%s)", path);
+    HANDLE_RESULT(preads != 0, goto CLEANUP, "check: %s read again after its completion", path);
+    if(!same(&source, "source_complete", expected, len)) goto CLEANUP;
+
+    /* a failed one is read again */
+    source_complete(&source, -1);
+    HANDLE_RESULT(source.fresh, goto CLEANUP, "check: %s fresh after a failed read", path);
+    HANDLE_RESULT(source_read(&source) == -1, goto CLEANUP, "check: source_read(%s)", path);
+    if(!same(&source, "failed completion", expected, len)) goto CLEANUP;
+    printf("%-16s chunk %4zu: %7zu bytes\n", name, chunk, len);
+    result = 0;
+
+CLEANUP:
+    source_close(&source);
+    free(expected);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    openlog("source", LOG_NDELAY | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s FIXTURE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for(const size_t *c = chunks;; ++c) {
+        chunk = *c;
+        for(const char **name = files; *name != NULL; ++name) {
+            HANDLE_RESULT(check(argv[1], *name) == -1, return EXIT_FAILURE, NULL);
+        }
+        if(*c == 0) break;
+    }
+    return EXIT_SUCCESS;
+}
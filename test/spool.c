@@ -0,0 +1,275 @@
+/*
+ * Spool of the UDP sink, from the file to a local receiver.
+ *
+ *     spool
+ *
+ * Batches of varying length are spooled past the capacity of the ring, and
+ * the ring has to hold the newest of them, in order, with the oldest
+ * dropped. The file is opened again and has to hold the same batches, and
+ * once more after the last batch was torn, which recovery has to discard.
+ * The spool is then replayed by a sink that is down: its probe is refused
+ * and nothing leaves the spool. A sink to a receiver on the loopback sends
+ * the probe, and once it got through the rest, and the receiver has to get
+ * the batches of the spool in order, each of them once.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+#include "sink.h"
+#include "spool.h"
+
+#define TEST_CAPACITY 8192
+#define TEST_BATCHES 96             /* over 3 times the capacity */
+#define TEST_BATCH_SIZE 512
+#define TEST_RATE (1024 * 1024)     /* bytes per second, the whole spool at once */
+#define TEST_REPLAYS 8
+
+static char batches[TEST_BATCHES + 1][TEST_BATCH_SIZE];
+static size_t batchlen[TEST_BATCHES + 1];
+
+/* a line of 40 to 400 bytes per batch */
+void make_batches(void) {
+    unsigned seed = 42;
+    for(unsigned i = 0; i <= TEST_BATCHES; ++i) {
+        seed = seed * 1103515245 + 12345;
+        size_t width = 40 + (seed >> 16) % 360;
+        int n = snprintf(batches[i], sizeof(batches[i]), "spool,batch=%u value=%ui,pad=\"", i, i);
+        size_t len = n;
+        for(; len + 2 < width; ++len) batches[i][len] = 'a' + (i + len) % 26;
+        batches[i][len++] = '"';
+        batches[i][len++] = '\n';
+        batchlen[i] = len;
+    }
+}
+
+/* the spooled batches have to be first to last, in order */
+int check_batches(struct spool *spool, unsigned first, unsigned last, const char *how) {
+    assert(spool != NULL);
+    assert(how != NULL);
+
+    const char *buf = NULL;
+    size_t len = 0;
+    unsigned i = first;
+    for(; spool_peek(spool, &buf, &len); spool_advance(spool), ++i) {
+        HANDLE_RESULT(i > last, return -1, "%s: batch past %u spooled", how, last);
+        HANDLE_RESULT(len != batchlen[i] || memcmp(buf, batches[i], len) != 0, return -1,
+                      "%s: batch %u of %zu bytes is not the one spooled", how, i, len);
+    }
+    HANDLE_RESULT(i != last + 1, return -1, "%s: batches %u to %u spooled, not %u to %u",
+                  how, first, i - 1, first, last);
+    spool_rewind(spool);
+    return 0;
+}
+
+/* the first batch in the spool */
+unsigned oldest(struct spool *spool) {
+    assert(spool != NULL);
+
+    const char *buf = NULL;
+    size_t len = 0;
+    unsigned i = 0;
+    if(spool_peek(spool, &buf, &len)) sscanf(buf, "spool,batch=%u", &i);
+    return i;
+}
+
+/* past the capacity, reopened, and reopened after a torn batch; the first batch kept is returned */
+int check_spool(const char *path, unsigned *first) {
+    assert(path != NULL);
+    assert(first != NULL);
+
+    int result = -1;
+    struct spool spool;
+    HANDLE_RESULT(spool_open(&spool, path, TEST_CAPACITY) == -1, return -1, "check_spool: spool_open");
+    size_t spooled = 0;
+    for(unsigned i = 0; i < TEST_BATCHES; ++i) {
+        HANDLE_RESULT(spool_append(&spool, batches[i], batchlen[i]) == -1, goto CLEANUP,
+                      "check_spool: spool_append");
+        spooled += batchlen[i];
+    }
+    *first = oldest(&spool);
+    HANDLE_RESULT(*first == 0 || spool.dropped != *first, goto CLEANUP,
+                  "check_spool: %" PRIu64 " batches dropped, the oldest kept is %u", spool.dropped, *first);
+    HANDLE_RESULT(spool_size(&spool) > TEST_CAPACITY || spool_size(&spool) < TEST_CAPACITY / 2,
+                  goto CLEANUP, "check_spool: %" PRIu64 " bytes spooled in %u", spool_size(&spool),
+                  TEST_CAPACITY);
+    if(check_batches(&spool, *first, TEST_BATCHES - 1, "full") == -1) goto CLEANUP;
+    printf("full:     %zu bytes spooled, batches %u to %u kept\n", spooled, *first, TEST_BATCHES - 1);
+
+    spool_close(&spool);
+    HANDLE_RESULT(spool_open(&spool, path, TEST_CAPACITY) == -1, return -1, "check_spool: spool_open");
+    if(check_batches(&spool, *first, TEST_BATCHES - 1, "reopened") == -1) goto CLEANUP;
+    printf("reopened: batches %u to %u\n", *first, TEST_BATCHES - 1);
+
+    /* a batch written but torn, as by a crash before it was complete on disk */
+    HANDLE_RESULT(spool_append(&spool, batches[TEST_BATCHES], batchlen[TEST_BATCHES]) == -1,
+                  goto CLEANUP, "check_spool: spool_append");
+    unsigned kept = oldest(&spool);
+    const char *buf = NULL;
+    size_t len = 0;
+    char *torn = NULL;
+    for(; spool_peek(&spool, &buf, &len); spool_advance(&spool)) {
+        torn = len == batchlen[TEST_BATCHES] && memcmp(buf, batches[TEST_BATCHES], len) == 0 ?
+               (char *)buf + len / 2 : NULL;
+    }
+    HANDLE_RESULT(torn == NULL, goto CLEANUP, "check_spool: the last batch is not the newest");
+    *torn ^= 1;
+    spool_close(&spool);
+    HANDLE_RESULT(spool_open(&spool, path, TEST_CAPACITY) == -1, return -1, "check_spool: spool_open");
+    if(check_batches(&spool, kept, TEST_BATCHES - 1, "torn") == -1) goto CLEANUP;
+    printf("torn:     batch %u discarded, batches %u to %u\n", TEST_BATCHES, kept, TEST_BATCHES - 1);
+    *first = kept;
+    result = 0;
+
+CLEANUP:
+    spool_close(&spool);
+    return result;
+}
+
+/* a socket on the loopback, bound to a free port */
+int bind_receiver(char *service, size_t size) {
+    assert(service != NULL);
+
+    int fd = -1;
+    HANDLE_POSIX_RESULT(fd = socket(AF_INET, SOCK_DGRAM, 0), return -1, "socket");
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = 0 };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    HANDLE_POSIX_RESULT(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), goto FAIL, "bind");
+    HANDLE_POSIX_RESULT(getsockname(fd, (struct sockaddr *)&addr, &addrlen), goto FAIL, "getsockname");
+    snprintf(service, size, "%u", ntohs(addr.sin_port));
+    return fd;
+
+FAIL:
+    close(fd);
+    return -1;
+}
+
+int open_sink(struct sink *sink, const char *service, const char *path) {
+    assert(sink != NULL);
+    assert(service != NULL);
+    assert(path != NULL);
+
+    HANDLE_RESULT(sink_open(sink, "127.0.0.1", service, SINK_DEFAULT_PAYLOAD, 0) == -1, return -1,
+                  "open_sink: sink_open");
+    HANDLE_RESULT(sink_spool(sink, path, TEST_CAPACITY, TEST_RATE) == -1, sink_close(sink); return -1,
+                  "open_sink: sink_spool");
+    /* as after a failed send: replay starts with a probe */
+    sink->healthy = 0;
+    return 0;
+}
+
+/* a sink that is down refuses the probe, the spool keeps it */
+int check_refused(const char *path) {
+    assert(path != NULL);
+
+    int result = -1;
+    char service[8];
+    int fd = bind_receiver(service, sizeof(service));
+    HANDLE_RESULT(fd == -1, return -1, "check_refused: bind_receiver");
+    close(fd);
+    struct sink sink;
+    HANDLE_RESULT(open_sink(&sink, service, path) == -1, return -1, "check_refused: open_sink");
+    uint64_t size = spool_size(sink.spool);
+    HANDLE_RESULT(sink_replay(&sink) == -1 || !sink.probing || sink.datagrams != 1, goto CLEANUP,
+                  "check_refused: no probe sent");
+    usleep(20000);
+    HANDLE_RESULT(sink_replay(&sink) == -1, goto CLEANUP, "check_refused: sink_replay");
+    HANDLE_RESULT(sink.healthy || spool_size(sink.spool) != size, goto CLEANUP,
+                  "check_refused: refused probe taken, %" PRIu64 " of %" PRIu64 " bytes spooled",
+                  spool_size(sink.spool), size);
+    printf("refused:  probe of %" PRIu64 " bytes kept\n", sink.bytes);
+    result = 0;
+
+CLEANUP:
+    sink_close(&sink);
+    return result;
+}
+
+/* replays into the receiver, which has to get batches first to the last in order */
+int check_replay(const char *path, unsigned first) {
+    assert(path != NULL);
+
+    static char output[TEST_CAPACITY * 2];
+    int result = -1;
+    char service[8];
+    int fd = bind_receiver(service, sizeof(service));
+    HANDLE_RESULT(fd == -1, return -1, "check_replay: bind_receiver");
+    struct sink sink;
+    HANDLE_RESULT(open_sink(&sink, service, path) == -1, close(fd); return -1, "check_replay: open_sink");
+    HANDLE_RESULT(sink_replay(&sink) == -1 || !sink.probing, goto CLEANUP, "check_replay: no probe sent");
+    const char *buf = NULL;
+    size_t len = 0;
+    for(int i = 0; i < TEST_REPLAYS && spool_peek(sink.spool, &buf, &len); ++i) {
+        usleep(20000);
+        HANDLE_RESULT(sink_replay(&sink) == -1, goto CLEANUP, "check_replay: sink_replay");
+    }
+    HANDLE_RESULT(!sink.healthy || spool_peek(sink.spool, &buf, &len), goto CLEANUP,
+                  "check_replay: %" PRIu64 " bytes left after %d replays", spool_size(sink.spool),
+                  TEST_REPLAYS);
+    /* the next tick confirms the last batch replayed */
+    HANDLE_RESULT(sink_send(&sink, batches[TEST_BATCHES], batchlen[TEST_BATCHES]) == -1, goto CLEANUP,
+                  "check_replay: sink_send");
+    HANDLE_RESULT(spool_size(sink.spool) != 0, goto CLEANUP, "check_replay: %" PRIu64 " bytes left",
+                  spool_size(sink.spool));
+
+    size_t received = 0;
+    for(;;) {
+        ssize_t r = recv(fd, output + received, sizeof(output) - received, MSG_DONTWAIT);
+        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        HANDLE_POSIX_RESULT(r, goto CLEANUP, "check_replay: recv");
+        received += r;
+    }
+    size_t expected = 0;
+    for(unsigned i = first; i <= TEST_BATCHES; ++i) {
+        HANDLE_RESULT(received - expected < batchlen[i] ||
+                      memcmp(output + expected, batches[i], batchlen[i]) != 0, goto CLEANUP,
+                      "check_replay: batch %u not received in order", i);
+        expected += batchlen[i];
+    }
+    HANDLE_RESULT(received != expected, goto CLEANUP, "check_replay: %zu bytes received, %zu sent",
+                  received, expected);
+    printf("replayed: batches %u to %u, %zu bytes in %" PRIu64 " datagrams\n", first, TEST_BATCHES - 1,
+           received, sink.datagrams);
+    result = 0;
+
+CLEANUP:
+    sink_close(&sink);
+    close(fd);
+    return result;
+}
+
+int main(void) {
+    openlog("spool", LOG_NDELAY | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    int result = EXIT_FAILURE;
+    make_batches();
+    const char *tmp = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/spool.XXXXXX", tmp != NULL ? tmp : "/tmp");
+    int fd = -1;
+    HANDLE_POSIX_RESULT(fd = mkstemp(path), return EXIT_FAILURE, "mkstemp(%s)", path);
+    close(fd);
+
+    unsigned first = 0;
+    HANDLE_RESULT(check_spool(path, &first) == -1, goto CLEANUP, NULL);
+    HANDLE_RESULT(check_refused(path) == -1, goto CLEANUP, NULL);
+    HANDLE_RESULT(check_replay(path, first) == -1, goto CLEANUP, NULL);
+    result = EXIT_SUCCESS;
+
+CLEANUP:
+    unlink(path);
+    return result;
+}
@@ -0,0 +1,178 @@
+#include "uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+
+static inline int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static inline int uring_register(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_open(struct uring *ring, unsigned entries) {
+    assert(ring != NULL);
+    assert(entries > 0);
+
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = -1;
+    ring->sq_map = ring->cq_map = ring->sqes = MAP_FAILED;
+
+    HANDLE_POSIX_RESULT(ring->fd = uring_setup(entries, &params), goto FAIL,
+                        "uring_open: io_uring_setup");
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    HANDLE_POSIX_RESULT(ring->sq_map == MAP_FAILED ? -1 : 0, goto FAIL,
+                        "fd=%d: uring_open: mmap(sq)", ring->fd);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        HANDLE_POSIX_RESULT(ring->cq_map == MAP_FAILED ? -1 : 0, goto FAIL,
+                            "fd=%d: uring_open: mmap(cq)", ring->fd);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    HANDLE_POSIX_RESULT(ring->sqes == MAP_FAILED ? -1 : 0, goto FAIL,
+                        "fd=%d: uring_open: mmap(sqes)", ring->fd);
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    syslog(LOG_DEBUG, "fd=%d: io_uring with %u entries opened", ring->fd, ring->entries);
+    return 0;
+
+FAIL:
+    uring_close(ring);
+    return -1;
+}
+
+void uring_close(struct uring *ring) {
+    assert(ring != NULL);
+
+    if(ring->sqes != MAP_FAILED && ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map != MAP_FAILED && ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_size);
+    }
+    if(ring->sq_map != MAP_FAILED && ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_size);
+    if(ring->fd != -1) {
+        HANDLE_POSIX_RESULT(close(ring->fd), (void)ring, "fd=%d: close: io_uring", ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* the eventfd is signalled for every completion */
+int uring_register_eventfd(struct uring *ring, int fd) {
+    assert(ring != NULL);
+    assert(fd != -1);
+
+    HANDLE_POSIX_RESULT(uring_register(ring->fd, IORING_REGISTER_EVENTFD, &fd, 1), return -1,
+                        "fd=%d: uring_register_eventfd: io_uring_register", ring->fd);
+    return 0;
+}
+
+/* queues a pread(), -1 when the submission queue is full */
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset, uint64_t data) {
+    assert(ring != NULL);
+    assert(buf != NULL);
+
+    unsigned tail = *ring->sq_tail + ring->queued;
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries ||
+       ring->inflight + ring->queued >= ring->entries) {
+        return -1;  /* no more in flight than entries, the completion queue can't overflow */
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    ++ring->queued;
+    return 0;
+}
+
+int uring_submit(struct uring *ring) {
+    assert(ring != NULL);
+
+    if(ring->queued == 0) return 0;
+    /* the sqes are complete before the kernel can see the new tail */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    unsigned queued = ring->queued;
+    ring->queued = 0;
+    int r = uring_enter(ring->fd, queued, 0, 0);
+    HANDLE_POSIX_RESULT(r, return -1, "fd=%d: uring_submit: io_uring_enter", ring->fd);
+    ring->inflight += r;
+    /* the rest stays in the submission queue until a later io_uring_enter() */
+    HANDLE_RESULT((unsigned)r != queued, return -1,
+                  "fd=%d: uring_submit: %d of %u reads submitted", ring->fd, r, queued);
+    return 0;
+}
+
+/* submits what is queued and blocks until count completions are ready */
+int uring_wait(struct uring *ring, unsigned count) {
+    assert(ring != NULL);
+
+    unsigned queued = ring->queued;
+    if(queued != 0) {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE);
+        ring->queued = 0;
+    }
+    int r = uring_enter(ring->fd, queued, count, IORING_ENTER_GETEVENTS);
+    HANDLE_POSIX_RESULT(r, return -1, "fd=%d: uring_wait: io_uring_enter", ring->fd);
+    ring->inflight += r;
+    return 0;
+}
+
+/* next completion, 0 when there is none */
+int uring_reap(struct uring *ring, uint64_t *data, int32_t *res) {
+    assert(ring != NULL);
+    assert(data != NULL);
+    assert(res != NULL);
+
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    --ring->inflight;
+    return 1;
+}
@@ -0,0 +1,52 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * Minimal io_uring for batched reads, on the raw syscalls (no liburing).
+ * Reads are queued with uring_read() and go to the kernel together with one
+ * io_uring_enter() in uring_submit(). Completions are signalled on an
+ * eventfd registered with the ring, so they can be reaped from the epoll
+ * loop, or waited for with uring_wait().
+ *
+ * uring_open() fails on kernels without io_uring (or with it disabled by
+ * kernel.io_uring_disabled or seccomp); callers fall back to plain reads.
+ */
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned queued;    /* sqes written, not submitted yet */
+    unsigned inflight;  /* submitted, not reaped yet */
+
+    void *sq_map;
+    size_t sq_size;
+    void *cq_map;       /* same as sq_map with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+int uring_open(struct uring *ring, unsigned entries);
+void uring_close(struct uring *ring);
+int uring_register_eventfd(struct uring *ring, int fd);
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset, uint64_t data);
+int uring_submit(struct uring *ring);
+int uring_wait(struct uring *ring, unsigned count);
+int uring_reap(struct uring *ring, uint64_t *data, int32_t *res);
+
+#endif /* URING_H_ */
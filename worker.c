@@ -0,0 +1,167 @@
+#include "worker.h"
+
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "error_handling.h"
+
+int worker_queue_init(struct worker_queue *queue) {
+    assert(queue != NULL);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = -1;
+    for(size_t i = 0; i < WORKER_SLOTS; ++i) {
+        queue->slots[i].buf = malloc(WORKER_BUFFER_SIZE);
+        HANDLE_RESULT(queue->slots[i].buf == NULL, goto FAIL,
+                      "worker_queue_init: can't allocate %d bytes", WORKER_BUFFER_SIZE);
+        queue->slots[i].size = WORKER_BUFFER_SIZE;
+    }
+    HANDLE_POSIX_RESULT(queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                        goto FAIL, "worker_queue_init: eventfd");
+    syslog(LOG_DEBUG, "fd=%d: worker queue of %d slots", queue->fd, WORKER_SLOTS);
+    return 0;
+
+FAIL:
+    worker_queue_destroy(queue);
+    return -1;
+}
+
+void worker_queue_destroy(struct worker_queue *queue) {
+    assert(queue != NULL);
+
+    for(size_t i = 0; i < WORKER_SLOTS; ++i) {
+        free(queue->slots[i].buf);
+        queue->slots[i].buf = NULL;
+        queue->slots[i].size = 0;
+    }
+    if(queue->fd != -1) {
+        HANDLE_POSIX_RESULT(close(queue->fd), (void)queue, "fd=%d: close: worker queue", queue->fd);
+        queue->fd = -1;
+    }
+}
+
+static void worker_signal(struct worker_queue *queue) {
+    uint64_t one = 1;
+    /* EAGAIN means the counter is far from read, the consumer is awake anyway */
+    if(write(queue->fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        syslog(LOG_ERR, "fd=%d: worker_signal: write: %s", queue->fd, strerror(errno));
+    }
+}
+
+/*
+ * Producer: the tick in *buf becomes the slot at the head and *buf the
+ * buffer the slot had. -1 when the ring is full, *buf is kept then.
+ */
+int worker_push(struct worker_queue *queue, char **buf, size_t *size, size_t len,
+                void *data, int64_t woken) {
+    assert(queue != NULL);
+    assert(buf != NULL && *buf != NULL);
+    assert(size != NULL);
+
+    uint64_t head = queue->head;
+    if(head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == WORKER_SLOTS) return -1;
+    struct worker_slot *slot = &queue->slots[head % WORKER_SLOTS];
+    char *spare = slot->buf;
+    size_t sparesize = slot->size;
+    slot->buf = *buf;
+    slot->size = *size;
+    slot->len = len;
+    slot->data = data;
+    slot->woken = woken;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    *buf = spare;
+    *size = sparesize;
+    worker_signal(queue);
+    return 0;
+}
+
+/* consumer: the oldest tick not sent yet, NULL when there is none */
+struct worker_slot *worker_peek(struct worker_queue *queue) {
+    assert(queue != NULL);
+
+    uint64_t tail = queue->tail;
+    if(__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+    return &queue->slots[tail % WORKER_SLOTS];
+}
+
+/* consumer: gives the slot of worker_peek() back to the producer */
+void worker_pop(struct worker_queue *queue) {
+    assert(queue != NULL);
+    assert(queue->tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE));
+
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* producer: no more ticks come, the consumer sees it after the last one */
+void worker_stop(struct worker_queue *queue) {
+    assert(queue != NULL);
+
+    __atomic_store_n(&queue->stopped, 1, __ATOMIC_RELEASE);
+    worker_signal(queue);
+}
+
+/* a new producer takes over after worker_stop(), set before it starts */
+void worker_resume(struct worker_queue *queue) {
+    assert(queue != NULL);
+
+    __atomic_store_n(&queue->stopped, 0, __ATOMIC_RELEASE);
+}
+
+/* "0-3,8,10-11" */
+int worker_parse_cpus(const char *list, cpu_set_t *cpus) {
+    assert(list != NULL);
+    assert(cpus != NULL);
+
+    CPU_ZERO(cpus);
+    const char *p = list;
+    do {
+        char *end = NULL;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if(end == p) return -1;
+        if(*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if(end == p || last < first) return -1;
+        }
+        if(last >= CPU_SETSIZE) return -1;
+        for(unsigned long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, cpus);
+        p = end;
+    } while(*p++ == ',');
+    return p[-1] == 0 ? 0 : -1;
+}
+
+/* moves the calling thread to its CPUs and priority */
+int worker_settle(const struct worker_sched *sched) {
+    assert(sched != NULL);
+
+    int error = 0;
+    if(sched->pinned) {
+        error = pthread_setaffinity_np(pthread_self(), sizeof(sched->cpus), &sched->cpus);
+        HANDLE_RESULT(error != 0, return -1, "worker_settle: pthread_setaffinity_np: %s",
+                      strerror(error));
+    }
+    if(sched->idle) {
+        struct sched_param param = { .sched_priority = 0 };
+        error = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+        HANDLE_RESULT(error != 0, return -1, "worker_settle: pthread_setschedparam: %s",
+                      strerror(error));
+    }
+    /* the nice value of a thread is set through its id */
+    if(sched->nice != 0) {
+        HANDLE_POSIX_RESULT(setpriority(PRIO_PROCESS, syscall(SYS_gettid), sched->nice),
+                            return -1, "worker_settle: setpriority(%d)", sched->nice);
+    }
+    syslog(LOG_DEBUG, "collecting on %d CPUs%s, nice %d",
+           sched->pinned ? CPU_COUNT(&sched->cpus) : (int)sysconf(_SC_NPROCESSORS_ONLN),
+           sched->idle ? " under SCHED_IDLE" : "", sched->nice);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include <sys/types.h>
+
+#include <sched.h>
+#include <stdint.h>
+
+#define WORKER_SLOTS 16                 /* ticks in flight to the sending thread */
+#define WORKER_BUFFER_SIZE 65536        /* initial size of a slot buffer */
+
+/*
+ * Hand-off of finished ticks from the collecting thread to the sending one
+ * in worker mode: a single-producer single-consumer ring of WORKER_SLOTS
+ * buffers. The producer swaps the output buffer of its writer with the
+ * buffer of the free slot at the head, so a tick is never copied, and
+ * publishes it with a release store of the head; the consumer takes the
+ * slots up to the head (acquire), sends them and gives them back with a
+ * release store of the tail. No side takes a lock or allocates, buffers
+ * are allocated upfront and grow to the largest tick they held. The
+ * consumer is woken through an eventfd; when the ring is full the tick is
+ * dropped rather than stalling the collectors.
+ *
+ * worker_settle() applies the CPU set, SCHED_IDLE or nice value to the
+ * calling thread, the collecting one.
+ */
+struct worker_slot {
+    char *buf;
+    size_t size;
+    size_t len;
+    void *data;         /* of the producer, e.g. the collector */
+    int64_t woken;      /* monotonic ns the tick was started */
+};
+
+struct worker_queue {
+    struct worker_slot slots[WORKER_SLOTS];
+    uint64_t head;      /* written by the producer only */
+    uint64_t tail;      /* written by the consumer only */
+    int fd;             /* eventfd the consumer polls */
+    int stopped;        /* the producer is gone */
+};
+
+struct worker_sched {
+    cpu_set_t cpus;
+    int pinned;         /* cpus is set */
+    int idle;           /* SCHED_IDLE */
+    int nice;           /* 0 keeps it */
+};
+
+int worker_queue_init(struct worker_queue *queue);
+void worker_queue_destroy(struct worker_queue *queue);
+int worker_push(struct worker_queue *queue, char **buf, size_t *size, size_t len,
+                void *data, int64_t woken);
+struct worker_slot *worker_peek(struct worker_queue *queue);
+void worker_pop(struct worker_queue *queue);
+void worker_stop(struct worker_queue *queue);
+void worker_resume(struct worker_queue *queue);
+
+int worker_parse_cpus(const char *list, cpu_set_t *cpus);
+int worker_settle(const struct worker_sched *sched);
+
+#endif /* WORKER_H_ */